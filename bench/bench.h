@@ -0,0 +1,30 @@
+// Helpers shared by the benchmarks. Every result is printed as one JSON
+// object per line, so the output of two builds can be compared by a script
+// or simply diffed.
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h> // For printf
+#include <time.h>  // For clock_gettime, CLOCK_MONOTONIC
+
+static inline double bench_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Print the result of one case: 'ns' nanoseconds per operation over
+// 'iterations' operations. 'extra' is NULL or more members, already
+// formatted as "\"key\":value,...".
+static inline void bench_report(const char *bench, const char *name,
+                                long iterations, double ns,
+                                const char *extra) {
+  printf("{\"bench\":\"%s\",\"case\":\"%s\",\"iterations\":%ld,"
+         "\"ns_per_op\":%.1f,\"ops_per_sec\":%.0f%s%s}\n",
+         bench, name, iterations, ns, ns > 0 ? 1e9 / ns : 0.0,
+         extra ? "," : "", extra ? extra : "");
+  fflush(stdout);
+}
+
+#endif // BENCH_H
@@ -0,0 +1,152 @@
+// Microbenchmark for the request path without sockets.
+// Times parseRequest() on a curl and a browser request head, echoResponse(),
+// copying a canned response into a connection's output, and handle_client()
+// answering whole requests (parse, route and queue the response) for the
+// root page, the echo endpoint and a missing path. The connection's output
+// is discarded after each request the way a completed write resets it.
+
+#include "bench.h"
+#include "../include/connection.h"
+#include "../include/http_parser.h"
+#include "../include/http_response.h"
+#include "../include/server.h"
+
+#include <stdio.h>  // For fprintf
+#include <stdlib.h> // For EXIT_FAILURE, EXIT_SUCCESS, exit, strtol
+#include <string.h> // For memcpy, strlen
+#include <time.h>   // For time
+
+static const char curl_head[] = "GET /echo/hello HTTP/1.1\r\n"
+                                "Host: localhost:42069\r\n"
+                                "User-Agent: curl/8.5.0\r\n"
+                                "Accept: */*\r\n\r\n";
+
+static const char browser_head[] =
+    "GET /echo/item-42?session=00c0ffee&view=full HTTP/1.1\r\n"
+    "Host: localhost:42069\r\n"
+    "Connection: keep-alive\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+    "(KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+    "image/avif,image/webp,*/*;q=0.8\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n\r\n";
+
+// Keeps the compiler from dropping work whose result is not used
+static volatile size_t sink;
+
+static void report(const char *name, long iterations, double elapsed) {
+  bench_report("http", name, iterations, elapsed / iterations, NULL);
+}
+
+static void bench_parse(const char *name, const char *head, long iterations) {
+  size_t len = strlen(head);
+  ClientRequest C;
+  double start = bench_now_ns();
+  for (long i = 0; i < iterations; ++i) {
+    if (parseRequest(head, len, &C) != PARSE_OK) {
+      fprintf(stderr, "bench_http: %s does not parse\n", name);
+      exit(EXIT_FAILURE);
+    }
+    sink += C.header_count;
+  }
+  report(name, iterations, bench_now_ns() - start);
+}
+
+static void bench_echo(Arena *arena, long iterations) {
+  StringView message = {"hello_from_C", 12};
+  double start = bench_now_ns();
+  for (long i = 0; i < iterations; ++i) {
+    ServerResponse S = echoResponse(message, arena);
+    if (!S.response_body) {
+      fprintf(stderr, "bench_http: echoResponse failed\n");
+      exit(EXIT_FAILURE);
+    }
+    sink += (size_t)S.response_body[0];
+    arena_reset(arena);
+  }
+  report("echo_response", iterations, bench_now_ns() - start);
+}
+
+// What flush_connection() does once everything queued has been written
+static void discard_output(Connection *conn) {
+  conn->out_count = conn->out_next = 0;
+  conn->out_bytes = 0;
+  conn->send_len = 0;
+  conn->zerocopy_wanted = 0;
+  arena_reset(&conn->arena);
+}
+
+static void bench_canned(Connection *conn, long iterations) {
+  double start = bench_now_ns();
+  for (long i = 0; i < iterations; ++i) {
+    StringView r = cannedResponse(conn->responses, RESPONSE_NOT_FOUND,
+                                  CONNECTION_DEFAULT, 0);
+    if (queue_response(conn, r.ptr, r.len) < 0)
+      exit(EXIT_FAILURE);
+    sink += conn->out_bytes;
+    discard_output(conn);
+  }
+  report("assemble_canned", iterations, bench_now_ns() - start);
+}
+
+static void bench_handle(Connection *conn, const char *name,
+                         const char *request, long iterations) {
+  size_t len = strlen(request);
+  double start = bench_now_ns();
+  for (long i = 0; i < iterations; ++i) {
+    memcpy(conn->recv_buffer, request, len + 1);
+    conn->recv_len = len;
+    if (handle_client(conn) != 1 || conn->out_bytes == 0) {
+      fprintf(stderr, "bench_http: %s was not answered\n", name);
+      exit(EXIT_FAILURE);
+    }
+    sink += conn->out_bytes;
+    discard_output(conn);
+    conn->requests_served = 0;
+  }
+  report(name, iterations, bench_now_ns() - start);
+}
+
+int main(int argc, char *argv[]) {
+  long iterations = argc > 1 ? strtol(argv[1], NULL, 10) : 1000000;
+  if (iterations <= 0) {
+    fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  ServerOptions opts = {0}; // The built-in routes only, no -P
+  if (setup_routes(&opts) < 0)
+    return EXIT_FAILURE;
+  MemoryPools pools;
+  memory_pools_init(&pools);
+  CannedResponses responses;
+  initializeCannedResponses(&responses, time(NULL));
+  // Requests are copied straight into the receive buffer, so it is taken
+  // up front rather than by a read
+  Connection *conn = create_connection(-1, &pools);
+  if (!conn || reserve_input(conn, RECV_BUFFER_SIZE) < 0)
+    return EXIT_FAILURE;
+  conn->responses = &responses;
+
+  bench_parse("parse_curl", curl_head, iterations);
+  bench_parse("parse_browser", browser_head, iterations);
+  bench_echo(&conn->arena, iterations);
+  bench_canned(conn, iterations);
+  bench_handle(conn, "handle_root", "GET / HTTP/1.1\r\nHost: a\r\n\r\n",
+               iterations);
+  bench_handle(conn, "handle_echo", curl_head, iterations);
+  bench_handle(conn, "handle_not_found",
+               "GET /missing HTTP/1.1\r\nHost: a\r\n\r\n", iterations);
+
+  free_connection(conn);
+  memory_pools_destroy(&pools);
+  free_routes();
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,100 @@
+// Microbenchmark for the access log.
+// Compares what a worker pays per request for an unbuffered printf, as the
+// server used to log, with filling in a record of its access log ring while
+// the log thread formats and writes the records. Output goes to /dev/null so
+// only the cost on the worker's side is measured.
+
+#include "bench.h"
+#include "../include/access_log.h"
+#include "../include/http_types.h" // For HTTP_METHOD_GET
+
+#include <fcntl.h>  // For open, O_WRONLY
+#include <stdio.h>  // For fprintf, snprintf, setvbuf
+#include <stdlib.h> // For EXIT_FAILURE, EXIT_SUCCESS, strtol
+#include <string.h> // For memcpy
+#include <time.h>   // For nanosleep
+#include <unistd.h> // For dup, dup2, close, STDOUT_FILENO
+
+// Returns the average nanoseconds per line written with an unbuffered stream
+static double run_printf(FILE *out, long iterations) {
+  setvbuf(out, NULL, _IONBF, 0);
+  double start = bench_now_ns();
+  for (long i = 0; i < iterations; ++i)
+    fprintf(out, "Echo Response Sent.\n");
+  return (bench_now_ns() - start) / iterations;
+}
+
+// Returns the average nanoseconds per record handed to the log thread.
+// Records are pushed in batches of half a ring and the thread is given time
+// to drain each batch outside the timed part, so every record is accepted
+// and what is measured is the cost on the worker's side alone.
+static double run_ring(AccessLogRing *ring, long iterations) {
+  static const char target[] = "/echo/item-42?session=00c0ffee&view=full";
+  const struct timespec pause = {0, 1000000};
+  double elapsed = 0;
+  for (long done = 0; done < iterations;) {
+    long batch = iterations - done < ACCESS_LOG_RING_SIZE / 2
+                     ? iterations - done
+                     : ACCESS_LOG_RING_SIZE / 2;
+    double start = bench_now_ns();
+    for (long i = 0; i < batch; ++i) {
+      AccessRecord *r = access_log_reserve(ring);
+      if (!r)
+        continue;
+      r->time_ns = access_log_now();
+      r->bytes = 106;
+      r->peer_addr = 0x0100007f;
+      r->peer_port = 40000;
+      r->status = 200;
+      r->kind = ACCESS_RECORD_REQUEST;
+      r->method = HTTP_METHOD_GET;
+      r->version = 11;
+      r->target_len = sizeof(target) - 1;
+      memcpy(r->target, target, sizeof(target) - 1);
+      access_log_commit(ring);
+    }
+    elapsed += bench_now_ns() - start;
+    done += batch;
+    while (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != ring->tail)
+      nanosleep(&pause, NULL);
+  }
+  return elapsed / iterations;
+}
+
+int main(int argc, char *argv[]) {
+  long iterations = argc > 1 ? strtol(argv[1], NULL, 10) : 1000000;
+  if (iterations <= 0) {
+    fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  // The log thread writes to standard output, which is pointed at
+  // /dev/null while measuring
+  int saved_stdout = dup(STDOUT_FILENO);
+  int null_fd = open("/dev/null", O_WRONLY);
+  FILE *null_out = fdopen(dup(null_fd), "w");
+  if (saved_stdout < 0 || null_fd < 0 || !null_out) {
+    perror("Failed to open /dev/null");
+    return EXIT_FAILURE;
+  }
+
+  double printf_ns = run_printf(null_out, iterations);
+  fclose(null_out);
+
+  dup2(null_fd, STDOUT_FILENO);
+  if (access_log_start(LOG_LEVEL_INFO, LOG_FORMAT_COMMON, 1) < 0)
+    return EXIT_FAILURE;
+  AccessLogRing *ring = access_log_ring(0);
+  double ring_ns = run_ring(ring, iterations);
+  uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+  access_log_stop();
+  dup2(saved_stdout, STDOUT_FILENO);
+  close(saved_stdout);
+  close(null_fd);
+
+  char extra[64];
+  bench_report("log", "printf_unbuffered", iterations, printf_ns, NULL);
+  snprintf(extra, sizeof(extra), "\"dropped\":%llu,\"speedup\":%.1f",
+           (unsigned long long)dropped, printf_ns / ring_ns);
+  bench_report("log", "ring", iterations, ring_ns, extra);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,109 @@
+// Microbenchmark for the request parser's scanning kernels.
+// Parses a set of realistic browser request heads (500-2000 bytes) with every
+// kernel the CPU supports and reports the speedup over the scalar kernel.
+
+#include "bench.h"
+#include "../include/http_parser.h"
+#include "../include/http_scan.h"
+
+#include <stdio.h>  // For snprintf, fprintf
+#include <stdlib.h> // For EXIT_FAILURE, EXIT_SUCCESS, strtol
+#include <string.h> // For memset, strlen
+
+#define HEAD_COUNT 8
+#define HEAD_CAPACITY 4096
+
+static char heads[HEAD_COUNT][HEAD_CAPACITY];
+static size_t head_lens[HEAD_COUNT];
+
+// Build a Chrome-like request head whose cookie pads it to 'target' bytes
+static size_t build_head(char *buf, size_t target, int seed) {
+  int n = snprintf(
+      buf, HEAD_CAPACITY,
+      "GET /echo/item-%d?session=%08x&view=full HTTP/1.1\r\n"
+      "Host: localhost:42069\r\n"
+      "Connection: keep-alive\r\n"
+      "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", "
+      "\"Not-A.Brand\";v=\"99\"\r\n"
+      "sec-ch-ua-mobile: ?0\r\n"
+      "sec-ch-ua-platform: \"Linux\"\r\n"
+      "Upgrade-Insecure-Requests: 1\r\n"
+      "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+      "(KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+      "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+      "image/avif,image/webp,image/apng,*/*;q=0.8,"
+      "application/signed-exchange;v=b3;q=0.7\r\n"
+      "Sec-Fetch-Site: same-origin\r\n"
+      "Sec-Fetch-Mode: navigate\r\n"
+      "Sec-Fetch-User: ?1\r\n"
+      "Sec-Fetch-Dest: document\r\n"
+      "Referer: http://localhost:42069/echo/previous-page\r\n"
+      "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+      "Accept-Language: en-US,en;q=0.9,de;q=0.8\r\n"
+      "Cookie: ",
+      seed, (unsigned)seed * 2654435761u);
+  size_t len = (size_t)n;
+  // Cookie pairs until the head reaches the target size
+  for (int i = 0; len + 40 < target; ++i) {
+    len += snprintf(buf + len, HEAD_CAPACITY - len, "%sc%d=%016llx",
+                    i ? "; " : "", i,
+                    (unsigned long long)(seed + i) * 0x9E3779B97F4A7C15ull);
+  }
+  len += snprintf(buf + len, HEAD_CAPACITY - len, "\r\n\r\n");
+  return len;
+}
+
+// Returns the average nanoseconds per parsed head
+static double run(long iterations) {
+  ClientRequest C;
+  size_t headers = 0;
+  double start = bench_now_ns();
+  for (long i = 0; i < iterations; ++i) {
+    int h = (int)(i % HEAD_COUNT);
+    if (parseRequest(heads[h], head_lens[h], &C) != PARSE_OK) {
+      fprintf(stderr, "parse failed for head %d\n", h);
+      exit(EXIT_FAILURE);
+    }
+    headers += C.header_count;
+  }
+  double elapsed = bench_now_ns() - start;
+  if (headers == 0)
+    fprintf(stderr, "no headers parsed\n");
+  return elapsed / iterations;
+}
+
+int main(int argc, char *argv[]) {
+  long iterations = argc > 1 ? strtol(argv[1], NULL, 10) : 2000000;
+  if (iterations <= 0)
+    iterations = 2000000;
+
+  size_t total = 0;
+  for (int i = 0; i < HEAD_COUNT; ++i) {
+    size_t target = 500 + (size_t)i * 1500 / (HEAD_COUNT - 1);
+    head_lens[i] = build_head(heads[i], target, i);
+    total += head_lens[i];
+  }
+  double avg_len = (double)total / HEAD_COUNT;
+
+  const HttpScanKernel kernels[] = {HTTP_SCAN_SCALAR, HTTP_SCAN_SSE42,
+                                    HTTP_SCAN_AVX2};
+  double scalar_ns = 0;
+  for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); ++k) {
+    if (httpScanUseKernel(kernels[k]) < 0) {
+      fprintf(stderr, "bench_scan: %s is unsupported on this CPU\n",
+              httpScanKernelName(kernels[k]));
+      continue;
+    }
+    run(iterations / 10); // Warm up caches and branch predictors
+    double ns = run(iterations);
+    if (kernels[k] == HTTP_SCAN_SCALAR)
+      scalar_ns = ns;
+    char extra[128];
+    snprintf(extra, sizeof(extra),
+             "\"head_bytes\":%.0f,\"gb_per_sec\":%.2f,\"speedup\":%.2f",
+             avg_len, avg_len / ns, scalar_ns / ns);
+    bench_report("scan", httpScanKernelName(kernels[k]), iterations, ns,
+                 extra);
+  }
+  return EXIT_SUCCESS;
+}
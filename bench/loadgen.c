@@ -0,0 +1,634 @@
+// Load generator for the server.
+// Keeps a number of client connections busy for a fixed time, each sending
+// batches of pipelined requests drawn from a weighted mix of the root page,
+// the echo endpoint and a missing path, and reports the request rate and the
+// latency distribution as one JSON line. The server can be one that is
+// already running or one started for the run from the command line given
+// after "--", which is stopped with SIGINT afterwards.
+
+#include "bench.h"
+#include "../include/config.h"  // For PORT
+#include "../include/metrics.h" // For Histogram, histogram_record
+
+#include <arpa/inet.h>   // For inet_pton, htons
+#include <errno.h>       // For errno, EINTR
+#include <fcntl.h>       // For open, fcntl, O_NONBLOCK, O_WRONLY
+#include <netinet/in.h>  // For sockaddr_in, IPPROTO_TCP
+#include <netinet/tcp.h> // For TCP_NODELAY
+#include <pthread.h>     // For pthread_create, pthread_join
+#include <signal.h>      // For kill, SIGINT, signal, SIGPIPE
+#include <stdio.h>       // For fprintf, snprintf
+#include <stdlib.h>      // For EXIT_FAILURE, EXIT_SUCCESS, calloc, strtol
+#include <string.h>      // For memcpy, memmove, memchr, strchr, strlen
+#include <strings.h>     // For strncasecmp
+#include <sys/epoll.h>   // For epoll_create1, epoll_ctl, epoll_wait
+#include <sys/socket.h>  // For socket, connect, setsockopt
+#include <sys/wait.h>    // For waitpid
+#include <time.h>        // For nanosleep
+#include <unistd.h>      // For read, write, close, fork, execvp, getopt
+
+#define MAX_DEPTH 256
+#define MAX_REQUEST_SIZE 128
+#define RESPONSE_BUFFER_SIZE (64 * 1024)
+#define STARTUP_TIMEOUT_MS 5000
+
+// The requests a mix is made of, all answered without a document root
+static const struct {
+  const char *name;
+  const char *path;
+} kinds[] = {
+    {"root", "/"},
+    {"echo", "/echo/loadgen"},
+    {"missing", "/missing/loadgen"},
+};
+#define KIND_COUNT (sizeof(kinds) / sizeof(kinds[0]))
+
+typedef struct {
+  int connections;
+  int threads;
+  int depth;
+  int keep_alive;
+  double seconds;
+  unsigned weights[KIND_COUNT];
+  const char *mix;
+  const char *name;
+  struct sockaddr_in addr;
+} LoadOptions;
+
+// One client connection and where its current response stands
+typedef struct {
+  int fd;
+  int connecting;      // Waiting for a non-blocking connect() to finish
+  uint32_t rng;
+  unsigned in_flight;  // Requests sent and not answered yet
+  uint64_t sent_ns;    // When the current batch was sent
+  int closing;         // The server announced it closes after a response
+  int in_body;         // Reading a body rather than a head
+  uint64_t body_left;  // Body bytes of the current response still to come
+  int status;          // Status of the current response
+  size_t len;          // Bytes held in 'buffer'
+  char buffer[RESPONSE_BUFFER_SIZE];
+} Client;
+
+// One thread's share of the connections and what it has counted
+typedef struct {
+  const LoadOptions *opts;
+  int epoll_fd;
+  Client *clients;
+  int client_count;
+  uint64_t deadline_ns;
+  uint64_t requests, errors, reconnects;
+  uint64_t status_2xx, status_4xx, status_other;
+  uint64_t max_ns;
+  Histogram latency;
+  int failed;
+} LoadThread;
+
+static char requests[KIND_COUNT][MAX_REQUEST_SIZE];
+static size_t request_lens[KIND_COUNT];
+
+static uint64_t now_ns(void) { return (uint64_t)bench_now_ns(); }
+
+static uint32_t next_random(uint32_t *state) {
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+static unsigned pick_kind(const LoadOptions *opts, Client *c) {
+  unsigned total = 0;
+  for (size_t k = 0; k < KIND_COUNT; ++k)
+    total += opts->weights[k];
+  unsigned r = next_random(&c->rng) % total;
+  for (size_t k = 0; k < KIND_COUNT; ++k) {
+    if (r < opts->weights[k])
+      return (unsigned)k;
+    r -= opts->weights[k];
+  }
+  return 0;
+}
+
+// Connect to the server. A non-blocking socket may still be connecting
+// when this returns.
+static int open_socket(const struct sockaddr_in *addr, int nonblocking) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if (nonblocking)
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  if (connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) < 0 &&
+      !(nonblocking && errno == EINPROGRESS)) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Send the next batch of requests. The socket is blocking and a batch is
+// far smaller than its send buffer, so the write does not wait in practice.
+static int send_batch(LoadThread *T, Client *c) {
+  char batch[MAX_DEPTH * MAX_REQUEST_SIZE];
+  size_t len = 0;
+  for (int i = 0; i < T->opts->depth; ++i) {
+    unsigned k = pick_kind(T->opts, c);
+    memcpy(batch + len, requests[k], request_lens[k]);
+    len += request_lens[k];
+  }
+  if (c->sent_ns == 0)
+    c->sent_ns = now_ns();
+  for (size_t done = 0; done < len;) {
+    ssize_t n = write(c->fd, batch + done, len - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    done += (size_t)n;
+  }
+  c->in_flight = (unsigned)T->opts->depth;
+  return 0;
+}
+
+// (Re)connect; the first batch is sent once the connection is up. The
+// connect does not block: a server whose accept queue is full drops the
+// handshake and it is only retried a second later, which must not hold up
+// the other connections. Without keep-alive the latency of a request
+// includes setting up its connection.
+static int start_client(LoadThread *T, Client *c) {
+  c->sent_ns = now_ns();
+  c->fd = open_socket(&T->opts->addr, 1);
+  if (c->fd < 0)
+    return -1;
+  c->connecting = 1;
+  c->in_flight = 0;
+  c->len = 0;
+  c->in_body = 0;
+  c->closing = 0;
+  struct epoll_event ev = {.events = EPOLLOUT, .data.ptr = c};
+  if (epoll_ctl(T->epoll_fd, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+    close(c->fd);
+    c->fd = -1;
+    return -1;
+  }
+  return 0;
+}
+
+// The connection is up: switch to blocking writes and waiting for
+// responses, and send the first batch
+static int connected(LoadThread *T, Client *c) {
+  int error = 0;
+  socklen_t len = sizeof(error);
+  if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error) {
+    errno = error;
+    return -1;
+  }
+  c->connecting = 0;
+  fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) & ~O_NONBLOCK);
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+  if (epoll_ctl(T->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev) < 0)
+    return -1;
+  return send_batch(T, c);
+}
+
+// Close with a reset rather than a FIN. Neither side then keeps the
+// connection in TIME_WAIT, where a new connection that happens to get the
+// same client port would wait a second for its SYN to be retransmitted.
+static void abort_client(Client *c) {
+  struct linger abort_linger = {1, 0};
+  setsockopt(c->fd, SOL_SOCKET, SO_LINGER, &abort_linger,
+             sizeof(abort_linger));
+  close(c->fd);
+  c->fd = -1;
+}
+
+static int restart_client(LoadThread *T, Client *c) {
+  abort_client(c);
+  T->reconnects++;
+  return start_client(T, c);
+}
+
+// Value of the header field 'name' in the head 'head', or NULL
+static const char *find_header(const char *head, size_t len,
+                               const char *name) {
+  size_t name_len = strlen(name);
+  const char *end = head + len;
+  const char *line = memchr(head, '\n', len);
+  while (line && ++line + name_len < end) {
+    if (strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+      const char *value = line + name_len + 1;
+      while (value < end && *value == ' ')
+        ++value;
+      return value;
+    }
+    line = memchr(line, '\n', (size_t)(end - line));
+  }
+  return NULL;
+}
+
+static void complete_response(LoadThread *T, Client *c) {
+  uint64_t latency = now_ns() - c->sent_ns;
+  histogram_record(&T->latency, latency);
+  if (latency > T->max_ns)
+    T->max_ns = latency;
+  T->requests++;
+  if (c->status >= 200 && c->status < 300)
+    T->status_2xx++;
+  else if (c->status >= 400 && c->status < 500)
+    T->status_4xx++;
+  else
+    T->status_other++;
+  c->in_flight--;
+}
+
+// Take the next response off the front of the client's buffer; bodies
+// are skipped as they arrive. Returns 1 once a response is complete, 0 if
+// more bytes are needed, or -1 if the response is malformed.
+static int next_response(Client *c) {
+  size_t pos = 0;
+  if (!c->in_body) {
+    const char *end = NULL;
+    for (size_t i = 3; i < c->len; ++i) {
+      if (c->buffer[i] == '\n' && c->buffer[i - 1] == '\r' &&
+          c->buffer[i - 2] == '\n' && c->buffer[i - 3] == '\r') {
+        end = c->buffer + i + 1;
+        break;
+      }
+    }
+    if (!end)
+      return c->len == sizeof(c->buffer) ? -1 : 0;
+    size_t head_len = (size_t)(end - c->buffer);
+    if (head_len < 12 || strncasecmp(c->buffer, "HTTP/1.", 7) != 0)
+      return -1;
+    c->status = (int)strtol(c->buffer + 9, NULL, 10);
+    const char *length = find_header(c->buffer, head_len, "Content-Length");
+    c->body_left = length ? strtoull(length, NULL, 10) : 0;
+    const char *connection = find_header(c->buffer, head_len, "Connection");
+    if (connection && strncasecmp(connection, "close", 5) == 0)
+      c->closing = 1;
+    c->in_body = 1;
+    pos = head_len;
+  }
+  size_t take = c->len - pos;
+  if (take > c->body_left)
+    take = (size_t)c->body_left;
+  pos += take;
+  c->body_left -= take;
+  memmove(c->buffer, c->buffer + pos, c->len - pos);
+  c->len -= pos;
+  if (c->body_left > 0)
+    return 0;
+  c->in_body = 0;
+  return 1;
+}
+
+// Read what arrived on a client and move it on: a new batch once the last
+// one is answered, a new connection once the server closes.
+static void service_client(LoadThread *T, Client *c) {
+  if (c->connecting) {
+    if (connected(T, c) < 0) {
+      perror("loadgen: connect");
+      T->failed = 1;
+    }
+    return;
+  }
+  ssize_t n = read(c->fd, c->buffer + c->len, sizeof(c->buffer) - c->len);
+  if (n < 0 && errno == EINTR)
+    return;
+  int rc = 0;
+  if (n > 0) {
+    c->len += (size_t)n;
+    while (c->in_flight > 0 && (rc = next_response(c)) == 1)
+      complete_response(T, c);
+  }
+  if (n <= 0 || rc < 0) {
+    // The server went away or sent garbage. Requests after a response that
+    // announced the close are simply not answered, the rest are lost.
+    if (rc < 0)
+      fprintf(stderr, "loadgen: malformed response\n");
+    if (!c->closing || rc < 0)
+      T->errors += c->in_flight;
+    if (restart_client(T, c) < 0)
+      T->failed = 1;
+    return;
+  }
+  if (c->in_flight > 0 && !c->closing)
+    return;
+  c->sent_ns = 0;
+  if (c->closing || !T->opts->keep_alive)
+    rc = restart_client(T, c);
+  else
+    rc = send_batch(T, c);
+  if (rc < 0)
+    T->failed = 1;
+}
+
+static void *load_thread(void *arg) {
+  LoadThread *T = arg;
+  struct epoll_event events[256];
+  for (int i = 0; i < T->client_count; ++i) {
+    T->clients[i].rng = 2463534242u + (uint32_t)i * 7919u;
+    T->clients[i].fd = -1;
+    if (start_client(T, &T->clients[i]) < 0) {
+      perror("loadgen: connect");
+      T->failed = 1;
+      return NULL;
+    }
+  }
+  while (!T->failed && now_ns() < T->deadline_ns) {
+    int n = epoll_wait(T->epoll_fd, events, 256, 50);
+    for (int i = 0; i < n && !T->failed; ++i)
+      service_client(T, events[i].data.ptr);
+  }
+  for (int i = 0; i < T->client_count; ++i) {
+    if (T->clients[i].fd >= 0)
+      abort_client(&T->clients[i]);
+  }
+  return NULL;
+}
+
+static void print_usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [-c connections] [-T threads] [-d depth] [-k on|off]"
+          " [-t seconds]\n"
+          "          [-m mix] [-a address] [-p port] [-n name]"
+          " [-- server command]\n"
+          "  -c connections  Client connections (default 64)\n"
+          "  -T threads      Threads sharing the connections (default 1)\n"
+          "  -d depth        Requests pipelined per batch (default 1)\n"
+          "  -k on|off       Keep connections open (default on)\n"
+          "  -t seconds      Duration of the run (default 5)\n"
+          "  -m mix          Weights of root, echo and missing requests\n"
+          "                  (default root=8,echo=1,missing=1)\n"
+          "  -a address      IPv4 address of the server (default 127.0.0.1)\n"
+          "  -p port         Port of the server (default %d)\n"
+          "  -n name         Case name in the report (default load)\n"
+          "A server command after -- is started for the run and stopped\n"
+          "with SIGINT afterwards.\n",
+          prog, PORT);
+}
+
+// Parse "name=weight,..." into the weights of 'kinds'
+static int parse_mix(const char *text, unsigned *weights) {
+  unsigned total = 0;
+  for (size_t k = 0; k < KIND_COUNT; ++k)
+    weights[k] = 0;
+  while (*text) {
+    size_t k = 0;
+    size_t len = 0;
+    for (; k < KIND_COUNT; ++k) {
+      len = strlen(kinds[k].name);
+      if (strncmp(text, kinds[k].name, len) == 0 && text[len] == '=')
+        break;
+    }
+    if (k == KIND_COUNT)
+      return -1;
+    char *end = NULL;
+    long weight = strtol(text + len + 1, &end, 10);
+    if (end == text + len + 1 || weight < 0 || weight > 1000 ||
+        (*end != ',' && *end != '\0'))
+      return -1;
+    weights[k] = (unsigned)weight;
+    total += (unsigned)weight;
+    text = *end ? end + 1 : end;
+  }
+  return total > 0 ? 0 : -1;
+}
+
+static int parse_options(int argc, char *argv[], LoadOptions *opts) {
+  opts->connections = 64;
+  opts->threads = 1;
+  opts->depth = 1;
+  opts->keep_alive = 1;
+  opts->seconds = 5;
+  opts->mix = "root=8,echo=1,missing=1";
+  opts->name = "load";
+  opts->addr.sin_family = AF_INET;
+  opts->addr.sin_port = htons(PORT);
+  inet_pton(AF_INET, "127.0.0.1", &opts->addr.sin_addr);
+  int opt;
+  while ((opt = getopt(argc, argv, "c:T:d:k:t:m:a:p:n:h")) != -1) {
+    long value;
+    switch (opt) {
+    case 'c':
+    case 'T':
+    case 'd':
+    case 'p':
+      value = strtol(optarg, NULL, 10);
+      if (value < 1 || (opt == 'd' && value > MAX_DEPTH) || value > 65535) {
+        fprintf(stderr, "Invalid value for -%c: %s\n", opt, optarg);
+        return -1;
+      }
+      if (opt == 'c')
+        opts->connections = (int)value;
+      else if (opt == 'T')
+        opts->threads = (int)value;
+      else if (opt == 'd')
+        opts->depth = (int)value;
+      else
+        opts->addr.sin_port = htons((uint16_t)value);
+      break;
+    case 'k':
+      if (strcmp(optarg, "on") != 0 && strcmp(optarg, "off") != 0) {
+        fprintf(stderr, "Invalid value for -k: %s\n", optarg);
+        return -1;
+      }
+      opts->keep_alive = strcmp(optarg, "on") == 0;
+      break;
+    case 't':
+      opts->seconds = strtod(optarg, NULL);
+      if (opts->seconds <= 0) {
+        fprintf(stderr, "Invalid value for -t: %s\n", optarg);
+        return -1;
+      }
+      break;
+    case 'm':
+      opts->mix = optarg;
+      break;
+    case 'a':
+      if (inet_pton(AF_INET, optarg, &opts->addr.sin_addr) != 1) {
+        fprintf(stderr, "Invalid IPv4 address: %s\n", optarg);
+        return -1;
+      }
+      break;
+    case 'n':
+      opts->name = optarg;
+      break;
+    default:
+      print_usage(argv[0]);
+      return opt == 'h' ? 1 : -1;
+    }
+  }
+  if (parse_mix(opts->mix, opts->weights) < 0) {
+    fprintf(stderr, "Invalid request mix: %s\n", opts->mix);
+    return -1;
+  }
+  // Requests answered with "Connection: close" can not be pipelined
+  if (!opts->keep_alive)
+    opts->depth = 1;
+  if (opts->threads > opts->connections)
+    opts->threads = opts->connections;
+  return 0;
+}
+
+// Start the server command and wait until it accepts connections. Returns
+// its pid, or -1 if it did not come up.
+static pid_t start_server(char *argv[], const struct sockaddr_in *addr) {
+  int fd = open_socket(addr, 0);
+  if (fd >= 0) {
+    close(fd);
+    fprintf(stderr, "loadgen: something already listens on port %d\n",
+            ntohs(addr->sin_port));
+    return -1;
+  }
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("loadgen: fork");
+    return -1;
+  }
+  if (pid == 0) {
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd >= 0) {
+      dup2(null_fd, STDOUT_FILENO);
+      dup2(null_fd, STDERR_FILENO);
+    }
+    execvp(argv[0], argv);
+    _exit(127);
+  }
+  const struct timespec pause = {0, 10 * 1000000L};
+  for (int waited = 0; waited < STARTUP_TIMEOUT_MS; waited += 10) {
+    fd = open_socket(addr, 0);
+    if (fd >= 0) {
+      close(fd);
+      return pid;
+    }
+    if (waitpid(pid, NULL, WNOHANG) == pid) {
+      fprintf(stderr, "loadgen: %s exited during startup\n", argv[0]);
+      return -1;
+    }
+    nanosleep(&pause, NULL);
+  }
+  fprintf(stderr, "loadgen: %s did not start listening\n", argv[0]);
+  kill(pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+  return -1;
+}
+
+static void stop_server(pid_t pid) {
+  if (pid <= 0)
+    return;
+  kill(pid, SIGINT);
+  waitpid(pid, NULL, 0);
+}
+
+static void report(const LoadOptions *opts, LoadThread *threads,
+                   double elapsed_ns) {
+  LoadThread total = {0};
+  for (int t = 0; t < opts->threads; ++t) {
+    LoadThread *T = &threads[t];
+    total.requests += T->requests;
+    total.errors += T->errors;
+    total.reconnects += T->reconnects;
+    total.status_2xx += T->status_2xx;
+    total.status_4xx += T->status_4xx;
+    total.status_other += T->status_other;
+    if (T->max_ns > total.max_ns)
+      total.max_ns = T->max_ns;
+    for (size_t b = 0; b < METRICS_HISTOGRAM_BUCKETS; ++b)
+      total.latency.buckets[b] += T->latency.buckets[b];
+    total.latency.count += T->latency.count;
+    total.latency.sum += T->latency.sum;
+  }
+  const Histogram *h = &total.latency;
+  printf("{\"bench\":\"load\",\"case\":\"%s\",\"connections\":%d,"
+         "\"threads\":%d,\"depth\":%d,\"keep_alive\":%s,\"mix\":\"%s\","
+         "\"seconds\":%.2f,\"requests\":%llu,\"req_per_sec\":%.0f,"
+         "\"errors\":%llu,\"reconnects\":%llu,\"status_2xx\":%llu,"
+         "\"status_4xx\":%llu,\"status_other\":%llu,"
+         "\"latency_us\":{\"mean\":%.1f,\"p50\":%.1f,\"p99\":%.1f,"
+         "\"p999\":%.1f,\"max\":%.1f}}\n",
+         opts->name, opts->connections, opts->threads, opts->depth,
+         opts->keep_alive ? "true" : "false", opts->mix, elapsed_ns / 1e9,
+         (unsigned long long)total.requests,
+         total.requests / (elapsed_ns / 1e9),
+         (unsigned long long)total.errors,
+         (unsigned long long)total.reconnects,
+         (unsigned long long)total.status_2xx,
+         (unsigned long long)total.status_4xx,
+         (unsigned long long)total.status_other,
+         h->count ? (double)h->sum / h->count / 1e3 : 0.0,
+         histogram_quantile(h, 0.5) / 1e3, histogram_quantile(h, 0.99) / 1e3,
+         histogram_quantile(h, 0.999) / 1e3, total.max_ns / 1e3);
+}
+
+int main(int argc, char *argv[]) {
+  LoadOptions opts;
+  int parsed = parse_options(argc, argv, &opts);
+  if (parsed != 0)
+    return parsed > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+  signal(SIGPIPE, SIG_IGN);
+  for (size_t k = 0; k < KIND_COUNT; ++k) {
+    request_lens[k] = (size_t)snprintf(
+        requests[k], MAX_REQUEST_SIZE,
+        "GET %s HTTP/1.1\r\nHost: loadgen\r\n%s\r\n", kinds[k].path,
+        opts.keep_alive ? "" : "Connection: close\r\n");
+  }
+
+  pid_t server = 0;
+  if (optind < argc) {
+    server = start_server(argv + optind, &opts.addr);
+    if (server < 0)
+      return EXIT_FAILURE;
+  }
+
+  LoadThread *threads = calloc((size_t)opts.threads, sizeof(LoadThread));
+  Client *clients = calloc((size_t)opts.connections, sizeof(Client));
+  pthread_t *ids = calloc((size_t)opts.threads, sizeof(pthread_t));
+  int rc = EXIT_SUCCESS;
+  if (!threads || !clients || !ids) {
+    fprintf(stderr, "loadgen: out of memory\n");
+    rc = EXIT_FAILURE;
+    goto done;
+  }
+  double start = bench_now_ns();
+  uint64_t deadline = (uint64_t)(start + opts.seconds * 1e9);
+  int started = 0;
+  for (int t = 0; t < opts.threads; ++t) {
+    LoadThread *T = &threads[t];
+    int first = (int)((long)opts.connections * t / opts.threads);
+    int last = (int)((long)opts.connections * (t + 1) / opts.threads);
+    T->opts = &opts;
+    T->clients = clients + first;
+    T->client_count = last - first;
+    T->deadline_ns = deadline;
+    T->epoll_fd = epoll_create1(0);
+    if (T->epoll_fd < 0 || pthread_create(&ids[t], NULL, load_thread, T)) {
+      fprintf(stderr, "loadgen: failed to start thread %d\n", t);
+      rc = EXIT_FAILURE;
+      break;
+    }
+    started++;
+  }
+  for (int t = 0; t < started; ++t) {
+    pthread_join(ids[t], NULL);
+    if (threads[t].failed)
+      rc = EXIT_FAILURE;
+  }
+  for (int t = 0; t < opts.threads; ++t) {
+    if (threads[t].epoll_fd > 0)
+      close(threads[t].epoll_fd);
+  }
+  if (rc == EXIT_SUCCESS)
+    report(&opts, threads, bench_now_ns() - start);
+  else
+    fprintf(stderr, "loadgen: the run failed\n");
+
+done:
+  stop_server(server);
+  free(ids);
+  free(clients);
+  free(threads);
+  return rc;
+}
@@ -0,0 +1,111 @@
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include "config.h" // For ACCESS_LOG_*, CACHE_LINE_SIZE
+#include <stddef.h> // For NULL
+#include <stdint.h> // For uint8_t, uint16_t, uint32_t, uint64_t
+
+typedef struct AccessRecordStruct AccessRecord;
+typedef struct AccessLogRingStruct AccessLogRing;
+
+// How much is logged. Every level includes the ones before it.
+typedef enum {
+  LOG_LEVEL_OFF,   // Nothing
+  LOG_LEVEL_ERROR, // Requests answered with a 4xx or 5xx status, or reset
+  LOG_LEVEL_INFO,  // Every request
+  LOG_LEVEL_DEBUG, // Every request, plus connections opening and closing
+} LogLevel;
+
+// How records are written out
+typedef enum {
+  LOG_FORMAT_COMMON, // NCSA common log format, one line per request
+  LOG_FORMAT_JSON,   // One JSON object per line
+} LogFormat;
+
+// What a record stands for
+enum {
+  ACCESS_RECORD_REQUEST,
+  ACCESS_RECORD_RESET, // An HTTP/2 request reset instead of answered
+  ACCESS_RECORD_CONNECT,
+  ACCESS_RECORD_DISCONNECT,
+};
+
+// One log entry as a worker leaves it behind: plain binary fields, so that
+// producing it is a handful of stores. Formatting is left to the log thread.
+struct AccessRecordStruct {
+  uint64_t time_ns;      // Wall clock, nanoseconds since the epoch
+  uint64_t bytes;        // Response bytes queued, or requests served
+  uint32_t peer_addr;    // IPv4 address in network byte order
+  uint16_t peer_port;    // In host byte order
+  uint16_t status;       // Response status, 0 if none was sent, or the
+                         // RST_STREAM error code of a reset
+  uint8_t kind;          // ACCESS_RECORD_*
+  uint8_t method;        // HttpMethod
+  uint8_t version;       // Major * 10 + minor, 255 if the request was bad
+  uint8_t target_len;    // Bytes used in 'target'
+  char target[ACCESS_LOG_TARGET_MAX]; // Path and query, truncated
+};
+
+_Static_assert(sizeof(AccessRecord) == 128, "AccessRecord is two lines");
+
+// A single-producer, single-consumer ring of records. The worker owning it
+// is the only writer of 'tail' and the log thread the only writer of 'head',
+// and each index sits on its own cache line, so neither side ever waits for
+// the other or takes a lock. When the ring is full the record is dropped and
+// counted rather than blocking the worker.
+struct AccessLogRingStruct {
+  // Producer side
+  _Alignas(CACHE_LINE_SIZE) uint32_t tail;
+  uint32_t cached_head; // Last head seen, re-read when the ring looks full
+  uint64_t dropped;     // Records lost to a full ring
+  // Consumer side
+  _Alignas(CACHE_LINE_SIZE) uint32_t head;
+  uint64_t dropped_reported;
+  // Shared, read-only after setup
+  _Alignas(CACHE_LINE_SIZE) AccessRecord *records;
+  uint32_t mask; // ACCESS_LOG_RING_SIZE - 1
+};
+
+// The configured level. Set by access_log_start() and only read afterwards.
+extern LogLevel access_log_level;
+
+// A function to set up one ring per worker and start the log thread, which
+// formats records in 'format' and writes them to standard output in
+// batches. With LOG_LEVEL_OFF no thread is started. Returns 0 on success or
+// -1 on failure.
+int access_log_start(LogLevel level, LogFormat format, int ring_count);
+
+// A function to return the ring of worker 'index', or NULL if logging is off
+AccessLogRing *access_log_ring(int index);
+
+// A function to stop the log thread once every queued record is written and
+// to report the records that were dropped. The workers must have stopped.
+void access_log_stop(void);
+
+// A function to return the wall clock in nanoseconds, for AccessRecord
+uint64_t access_log_now(void);
+
+// A function to check whether records of 'level' are wanted
+static inline int access_log_wants(LogLevel level) {
+  return access_log_level >= level;
+}
+
+// A function to return the next free record of 'ring' to fill in, or NULL
+// (counted as dropped) if the log thread has fallen a full ring behind
+static inline AccessRecord *access_log_reserve(AccessLogRing *ring) {
+  if (ring->tail - ring->cached_head > ring->mask) {
+    ring->cached_head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (ring->tail - ring->cached_head > ring->mask) {
+      __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+      return NULL;
+    }
+  }
+  return &ring->records[ring->tail & ring->mask];
+}
+
+// A function to publish the record returned by access_log_reserve()
+static inline void access_log_commit(AccessLogRing *ring) {
+  __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+#endif // ACCESS_LOG_H
@@ -0,0 +1,44 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include "options.h" // For ServerOptions
+#include <stdint.h>  // For uint32_t, uint64_t
+
+// What admission_check() decided about a new connection
+typedef enum {
+  ADMIT_OK,           // Admitted, with a token taken from its bucket
+  ADMIT_UNTRACKED,    // Admitted without a bucket: the table had no room,
+                      // or the client has no IPv4 address
+  ADMIT_RATE_LIMITED, // The client's bucket is empty: 429
+  ADMIT_OVERLOADED,   // Too many connections are open: 503
+  ADMIT_SHEDDING,     // The memory budget is nearly used up: 503
+} AdmissionResult;
+
+// A function to set up admission control from opts->client_rate,
+// opts->client_burst, opts->max_connections and opts->memory_budget_mb.
+// Called once before the workers start; with all of them 0 every client is
+// admitted.
+void admission_init(const ServerOptions *opts);
+
+// A function to return whether a check needs the client's address
+int admission_by_address(void);
+
+// A function to decide whether the client at IPv4 address 'addr' (network
+// byte order) may open a connection at monotonic time 'now_ms'. Each address
+// has a token bucket refilled at opts->client_rate tokens per second, up to
+// opts->client_burst, and a connection costs a token. The buckets live in a
+// fixed-size, open-addressed table that every worker updates with
+// compare-and-swap, without a lock. An admitted connection also counts
+// against opts->max_connections until admission_release(). A client
+// without an IPv4 address (addr 0: IPv6 and unix socket peers) has no
+// bucket of its own and is admitted untracked, rather than sharing one
+// bucket with every other such client. Once ADMISSION_SHED_PERCENT of the
+// memory budget is in use every new connection is turned away, leaving the
+// rest to the open ones.
+AdmissionResult admission_check(uint32_t addr, uint64_t now_ms);
+
+// A function to give back the connection an ADMIT_OK or ADMIT_UNTRACKED
+// check counted, once it is closed
+void admission_release(void);
+
+#endif // ADMISSION_H
@@ -0,0 +1,32 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "buffer_pool.h" // For BufferPool
+#include <stddef.h>      // For size_t
+
+typedef struct ArenaStruct Arena;
+
+// A bump-pointer allocator for memory that lives exactly as long as one
+// request. Blocks come from a BufferPool and go back to it on reset, so a
+// request that fits the pooled blocks never reaches malloc.
+struct ArenaStruct {
+  BufferPool *pool; // Source of the blocks
+  char *block;      // Block allocations are currently served from
+  size_t used;      // Bytes used in 'block', including its header
+};
+
+// A function to attach an empty arena to a block pool
+void arena_init(Arena *arena, BufferPool *pool);
+
+// A function to allocate 'size' bytes, aligned for any object.
+// Returns NULL if the size exceeds a block or no block is available.
+void *arena_alloc(Arena *arena, size_t size);
+
+// A function to copy 'len' bytes into the arena as a NUL terminated string
+char *arena_strndup(Arena *arena, const char *s, size_t len);
+
+// A function to release every allocation at once, returning the blocks to
+// the pool
+void arena_reset(Arena *arena);
+
+#endif // ARENA_H
@@ -0,0 +1,35 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stddef.h> // For size_t
+#include <stdint.h> // For uint64_t
+
+typedef struct BufferPoolStruct BufferPool;
+
+// A free list of fixed-size buffers. Each worker owns its pools, so no
+// locking is needed. Released buffers are kept for reuse (up to max_free,
+// and none while the memory budget is running out); only a miss on an
+// empty free list reaches malloc.
+struct BufferPoolStruct {
+  size_t buffer_size;
+  void *free_list; // Linked through the first word of each free buffer
+  size_t free_count;
+  size_t max_free;      // Free buffers kept before releases go to free()
+  uint64_t heap_allocs; // Buffers that had to come from malloc
+  uint64_t reuses;      // Buffers served from the free list
+};
+
+// A function to set up an empty pool of 'buffer_size' byte buffers
+void buffer_pool_init(BufferPool *pool, size_t buffer_size, size_t max_free);
+
+// A function to take a buffer from the pool. Returns NULL if the pool is
+// empty and a new buffer would exceed the memory budget or malloc fails.
+void *buffer_pool_acquire(BufferPool *pool);
+
+// A function to hand a buffer back to the pool
+void buffer_pool_release(BufferPool *pool, void *buffer);
+
+// A function to free every buffer held by the pool
+void buffer_pool_destroy(BufferPool *pool);
+
+#endif // BUFFER_POOL_H
@@ -0,0 +1,49 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include "http_types.h" // For ClientRequest
+#include <stddef.h>     // For size_t
+#include <sys/types.h>  // For ssize_t
+#include <zlib.h>       // For z_stream
+
+typedef struct CompressorStruct Compressor;
+
+// Content codings a response body can be sent in
+typedef enum {
+  CODING_IDENTITY, // As is
+  CODING_GZIP,     // "gzip": deflate data in a gzip wrapper
+  CODING_DEFLATE,  // "deflate": deflate data in a zlib wrapper
+  CONTENT_CODINGS
+} ContentCoding;
+
+// A worker's deflate state. Setting up a stream allocates a few hundred
+// kilobytes, so each coding gets one stream, set up on first use and reset
+// for every body after that.
+struct CompressorStruct {
+  z_stream streams[CONTENT_CODINGS]; // Unused for CODING_IDENTITY
+  int ready[CONTENT_CODINGS];        // Stream has been set up
+  int level[CONTENT_CODINGS];        // Compression level it is set to
+};
+
+// A function to set up a compressor without any stream
+void compressor_init(Compressor *z);
+
+// A function to free the streams of a compressor
+void compressor_destroy(Compressor *z);
+
+// A function to pick the coding for a response to 'C' from its
+// Accept-Encoding header: gzip, else deflate, else identity. Codings with
+// q=0 are refused, and "*" stands for every coding not listed.
+ContentCoding compress_negotiate(const ClientRequest *C);
+
+// A function to return the token naming 'coding' in Content-Encoding
+const char *content_coding_name(ContentCoding coding);
+
+// A function to compress 'len' bytes at 'src' in one pass into 'dst',
+// which holds 'cap' bytes, at zlib level 'level'. Passing less room than
+// the input makes sure compressing gains something.
+// Returns the compressed length, or -1 if it does not fit or zlib fails.
+ssize_t compress_buffer(Compressor *z, ContentCoding coding, int level,
+                        const char *src, size_t len, char *dst, size_t cap);
+
+#endif // COMPRESS_H
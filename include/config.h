@@ -1,11 +1,137 @@
 #ifndef CONFIG_H
 #define CONFIG_H
 
-#define RESPONSE_CODES 600
 #define PORT 42069
-#define BACKLOG 5
+#define BACKLOG 511 // Pending connections the kernel queues per listener
 #define BUFFER_SIZE 256
-#define ARGS_BUFFER_SIZE 256  // For C.args
-#define ROUTE_BUFFER_SIZE 128 // For C.route
+#define MAX_HEADERS 64 // Header fields kept per request
+#define CACHE_LINE_SIZE 64 // Padding between data written by different threads
+
+#define ROUTER_MAX_PARAMS 8 // {param} segments and '*' captured per route
+
+// Request size limits, keeping per-connection memory bounded
+#define MAX_HEAD_SIZE (RECV_BUFFER_SIZE - 1) // Request line plus headers
+#define MAX_BODY_SIZE (8 * 1024 * 1024)      // Content-Length or chunked
+#define MAX_CHUNK_LINE 1024 // Chunk-size line including extensions
+
+// Event loop settings
+#define MAX_EVENTS 256          // Events fetched per epoll_wait() call
+#define EPOLL_TIMEOUT_MS 1000   // Longest wait, even with no timer due
+#define RECV_BUFFER_SIZE 16384  // Per-connection receive buffer, at most
+#define RECV_SMALL_BUFFER_SIZE 4096 // ... and the one a connection starts
+                                    // with once data arrives
+#define SEND_BUFFER_SIZE 20480  // Per-connection buffer for copied output
+
+// Response output, queued as iovec segments and written with sendmsg()
+#define OUTPUT_MAX_SEGMENTS 128 // Segments queued per connection (< IOV_MAX)
+#define RESPONSE_SEGMENTS 8     // Most segments a single response queues
+#define OUTPUT_HIGH_WATER SEND_BUFFER_SIZE // Unsent bytes before pausing
+#define ZEROCOPY_MIN_SIZE (64 * 1024) // Segments sent with MSG_ZEROCOPY
+#define CANNED_RESPONSE_MAX 256 // Longest rendered canned response
+// Send buffer space needed to handle a request: the copied parts of a
+// response are a canned response or a Date line
+#define RESPONSE_COPY_HEADROOM (CANNED_RESPONSE_MAX + 64)
+
+// io_uring backend (-b uring), one ring per worker
+#define URING_ENTRIES 1024      // Submission queue slots
+#define URING_BUFFER_COUNT 1024 // Provided receive buffers, a power of two
+#define URING_BUFFER_SIZE 4096  // Bytes per provided receive buffer
+#define URING_MAX_HELD 8 // Received buffers a connection holds before its
+                         // receive is paused
+
+// Memory pools, one set per worker
+#define ARENA_BLOCK_SIZE (RECV_BUFFER_SIZE + 1024) // Fits an echo of any head
+#define POOL_MAX_FREE 1024 // Free buffers kept per pool
+#define CONNECTION_SLAB_SIZE 256 // Connection structs per slab allocation
+
+// Static files, served from the -d document root
+#define FILE_CACHE_ENTRIES 256 // Open files kept per worker
+#define FILE_CACHE_BUCKETS 512 // Hash buckets, a power of two
+#define FILE_PATH_MAX 1024     // Longest decoded path below the root
+#define FILE_MMAP_MAX_SIZE (256 * 1024) // Largest file served from a mapping
+#define FILE_MMAP_MIN_HITS 4   // Requests before a file is mapped
+
+// Response compression, negotiated with Accept-Encoding
+#define COMPRESS_MIN_SIZE 1024         // Smaller bodies are sent as they are
+#define COMPRESS_LEVEL_DYNAMIC 1       // zlib level for per-request bodies
+#define COMPRESS_LEVEL_STATIC 9        // zlib level for cached file variants
+#define COMPRESS_FILE_MAX (1024 * 1024) // Largest file compressed
+#define COMPRESS_CACHE_BYTES (8 * 1024 * 1024) // Compressed file variants
+                                               // kept per worker
+
+// Handler response micro-cache, one per worker
+#define RESPONSE_CACHE_ENTRIES 1024 // Responses kept per worker
+#define RESPONSE_CACHE_BUCKETS 2048 // Hash buckets, a power of two
+#define RESPONSE_CACHE_BYTES (4 * 1024 * 1024) // Memory for them per worker
+#define RESPONSE_CACHE_MAX_SIZE (64 * 1024)    // Largest response cached
+#define RESPONSE_CACHE_KEY_MAX 4096 // Longest request target cached, plus 2
+#define ECHO_CACHE_TTL_MS 1000      // How long an echo is served again
+
+// Persistent connection limits
+#define MAX_KEEPALIVE_REQUESTS 1000  // Requests served before closing
+
+// Connection timeouts, kept on a timer wheel per worker
+#define TIMER_TICK_MS 100         // Resolution of every timeout
+#define TIMER_WHEEL_SLOTS 1024    // Ticks the wheel spans, a power of two
+#define HEADER_TIMEOUT_MS 10000   // To receive a whole request head
+#define BODY_TIMEOUT_MS 30000     // Between reads of a request body
+#define WRITE_TIMEOUT_MS 30000    // Between writes of queued output
+#define KEEPALIVE_TIMEOUT_MS 5000 // Idle time before a connection is closed
+#define LINGER_TIMEOUT_MS 2000    // For the client to close after the last
+                                  // response before the socket is dropped
+
+// Graceful drain (SIGTERM, SIGQUIT) and binary upgrade (SIGHUP, SIGUSR2)
+#define DRAIN_TIMEOUT_MS 10000  // For requests in flight before cutting off
+#define UPGRADE_TIMEOUT_MS 5000 // For the new binary to start serving
+
+// Reverse proxy (-P), each worker with its own upstream connection pools
+#define PROXY_MAX_ROUTES 8     // -P options
+#define PROXY_MAX_UPSTREAMS 32 // Upstream servers over every route
+#define PROXY_NAME_MAX 128     // Longest upstream address as written
+#define PROXY_IDLE_MAX 64      // Idle connections pooled per upstream
+#define PROXY_IDLE_TIMEOUT_MS 4000 // Pooled connection lifetime, below the
+                                   // usual 5 s keep-alive of backends
+#define PROXY_CONNECT_TIMEOUT_MS 3000 // For connect() to an upstream
+#define PROXY_TIMEOUT_MS 30000 // Between reads of the upstream's response
+#define PROXY_MAX_TRIES 3      // Connections a request is sent on at most
+#define PROXY_MAX_FAILS 3      // Failures in a row before an upstream is
+#define PROXY_EJECT_MS 10000   // ejected from balancing for this long
+#define PROXY_SPLICE_SIZE (64 * 1024) // Bytes moved per splice() call
+
+// Admission control (-r, -C), one table of client buckets for every worker
+#define ADMISSION_TABLE_SIZE 4096 // Client token buckets, a power of two
+#define ADMISSION_MAX_PROBES 8    // Slots searched for a client's bucket
+#define ADMISSION_MAX_RATE 10000  // Largest -r rate and burst
+#define ADMISSION_MAX_CONNECTIONS 1000000 // Largest -C
+#define ADMISSION_MAX_MEMORY_MB (1024 * 1024) // Largest -M
+#define ADMISSION_SHED_PERCENT 90 // Share of -M in use from which new
+                                  // connections get 503
+
+// HTTP/2 over cleartext TCP (h2c), by prior knowledge or Upgrade
+#define HTTP2_MAX_STREAMS 100 // Streams a client may have open at once
+#define HTTP2_STREAM_WINDOW (RECV_BUFFER_SIZE - 1) // Request body bytes in
+                              // flight per stream, what its buffer holds
+#define HTTP2_CONNECTION_WINDOW (1024 * 1024) // ... and over all streams
+#define HTTP2_MAX_FRAME 16384 // Largest frame payload accepted or sent
+#define HTTP2_MAX_FIELDS (MAX_HEADERS + 4) // Fields of a request, the
+                                           // pseudo-headers included
+#define HTTP2_RESPONSE_HEAD_MAX 4096 // Longest response head translated
+#define HPACK_TABLE_SIZE 4096 // Decoder dynamic table, the protocol default
+
+// Access log (-l, -F): one ring of records per worker, drained by a thread
+#define ACCESS_LOG_RING_SIZE 4096 // Records per worker ring, a power of two
+#define ACCESS_LOG_TARGET_MAX 100 // Request target bytes kept per record
+#define ACCESS_LOG_BATCH_SIZE (64 * 1024) // Formatted bytes per write()
+#define ACCESS_LOG_IDLE_MS 10 // Log thread sleep when every ring is empty
+
+// Metrics, served as Prometheus text at GET /metrics
+#define METRICS_MAX_ROUTES 24         // Routes counted separately, the
+                                      // built-in ones and two per -P
+#define METRICS_HISTOGRAM_SUB_BITS 3  // 8 buckets per power of two
+#define METRICS_HISTOGRAM_MAX_BITS 40 // Largest value about 18 minutes (ns)
+#define METRICS_PAGE_SIZE (16 * 1024) // Room for the rendered page
+
+// Worker settings
+#define MAX_WORKERS 256 // Upper bound for the -w option
 
 #endif // CONFIG_H
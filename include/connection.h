@@ -0,0 +1,285 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include "access_log.h"    // For AccessLogRing
+#include "arena.h"         // For Arena
+#include "buffer_pool.h"   // For BufferPool
+#include "compress.h"      // For Compressor
+#include "config.h"        // For RECV_BUFFER_SIZE, SEND_BUFFER_SIZE
+#include "file_cache.h"    // For FileCache, FileEntry
+#include "http_parser.h"   // For HttpParser, HttpBodySink
+#include "http_response.h" // For CannedResponses
+#include "metrics.h"       // For WorkerMetrics
+#include "response_cache.h" // For ResponseCache
+#include "timer_wheel.h"   // For Timer
+#include <stdint.h>        // For uint64_t
+#include <stddef.h>        // For size_t
+#include <sys/socket.h>    // For struct msghdr
+#include <sys/types.h>     // For ssize_t
+#include <sys/uio.h>       // For struct iovec
+#include <time.h>          // For time_t
+
+typedef struct ConnectionStruct Connection;
+typedef struct MemoryPoolsStruct MemoryPools;
+typedef struct UpstreamStruct Upstream;
+typedef struct ProxyStruct Proxy;
+typedef struct Http2SessionStruct Http2Session;
+typedef struct Http2StreamStruct Http2Stream;
+
+// Returned by flush_connection() while a proxied response waits for its
+// upstream rather than for the client
+#define FLUSH_WAITING 2
+
+// What a connection is waiting for, which decides its timeout
+typedef enum {
+  TIMEOUT_HEAD,   // The rest of a request head, or the first request
+  TIMEOUT_BODY,   // More of a request body
+  TIMEOUT_WRITE,  // The client to take queued output
+  TIMEOUT_IDLE,   // The next request on a kept-alive connection
+  TIMEOUT_LINGER, // The client to close after the last response
+  TIMEOUT_CONNECT,  // A proxy upstream to accept the connection
+  TIMEOUT_UPSTREAM, // A proxy upstream to send more of its response
+  TIMEOUT_KINDS
+} TimeoutKind;
+
+// A slab of CONNECTION_SLAB_SIZE Connection structs, one allocation. Its
+// free structs are chained by index, the last freed first.
+typedef struct {
+  Connection *structs; // NULL once the slab has been given back
+  uint32_t free_head;  // Index of the first free struct, or
+                       // CONNECTION_NO_SLOT if none
+  uint32_t used;       // Structs handed out
+} ConnectionSlab;
+
+// The memory a worker recycles between connections and requests: receive
+// buffers in two size classes, output blocks, send buffers for proxied
+// requests, arena blocks, and the Connection structs themselves. Those
+// are carved from slabs, so a worker's connections sit side by side in a
+// few large allocations, and are known by their slot: slab *
+// CONNECTION_SLAB_SIZE + index. A new connection takes the first slab with
+// a free struct, packing the connections into the low slabs, and a slab
+// left empty is freed once another slab's worth of structs is free.
+struct MemoryPoolsStruct {
+  BufferPool recv_small;    // RECV_SMALL_BUFFER_SIZE receive buffers
+  BufferPool recv_buffers;  // RECV_BUFFER_SIZE receive buffers
+  BufferPool output_blocks; // A connection's segments and copied output
+  BufferPool send_buffers;  // SEND_BUFFER_SIZE, for proxied requests
+  BufferPool arena_blocks;
+  ConnectionSlab *slabs;
+  size_t slab_count;          // Entries in 'slabs', freed ones included
+  size_t first_free;          // No slab before this one has a free struct
+  size_t free_structs;        // Free structs over every slab
+  uint64_t connection_allocs; // Slabs that came from calloc
+};
+
+// Ends a chain of free connection structs
+#define CONNECTION_NO_SLOT UINT32_MAX
+
+// Per-client state owned by the event loop. Every client socket is
+// non-blocking, so bytes received and bytes still waiting to be written are
+// kept here between readiness notifications.
+struct ConnectionStruct {
+  int fd;
+  uint32_t slot;            // Where the struct sits in the worker's slabs
+  MemoryPools *pools;       // Where the buffers below came from
+  // Memory is only held while it is used: an idle kept-alive connection
+  // has neither a receive buffer nor an output block.
+  char *recv_buffer;        // recv_size bytes from pools->recv_small or
+                            // pools->recv_buffers, NULL while empty
+  size_t recv_size;         // 0, RECV_SMALL_BUFFER_SIZE or RECV_BUFFER_SIZE
+  size_t recv_len;          // Bytes currently held in recv_buffer
+  // Output waiting to be written: segments pointing into send_buffer, the
+  // arena or static strings. out[out_next] is the first unsent one; it is
+  // advanced in place after a partial write. Both arrays share a block
+  // from pools->output_blocks, taken with the first segment queued and
+  // given back once everything has been written.
+  struct iovec *out;        // OUTPUT_MAX_SEGMENTS entries, or NULL
+  char *send_buffer;        // SEND_BUFFER_SIZE bytes after 'out'
+  size_t send_len;          // Bytes copied into send_buffer
+  size_t out_count;         // Segments queued
+  size_t out_next;          // Segments fully written
+  size_t out_bytes;         // Bytes not yet written
+  int zerocopy_wanted;      // A queued segment is worth MSG_ZEROCOPY
+  int zerocopy_state;       // 0 untried, 1 SO_ZEROCOPY enabled, -1 unusable
+  uint32_t zerocopy_sends;  // sendmsg() calls made with MSG_ZEROCOPY
+  uint32_t zerocopy_done;   // Of those, completions reported by the kernel
+  // A file response holds its cache entry until it has been written. Its
+  // body range goes out with sendfile() once the segments are written.
+  FileEntry *file;
+  off_t file_offset;        // Next byte of 'file' to send
+  size_t file_remaining;    // Bytes of 'file' still to send
+  FileCache *files;         // The worker's file cache, NULL without a root
+  Compressor *compressor;   // The worker's deflate streams, NULL to send
+                            // every body as it is
+  const CannedResponses *responses; // The worker's rendered responses
+  ResponseCache *cache;     // The worker's cache of handler responses
+  unsigned cache_ttl_ms;    // Set by a handler whose response may be served
+                            // again to the same request for that long
+  AccessLogRing *log;       // The worker's access log ring, NULL if off
+  uint32_t peer_addr;       // Client IPv4 address, network byte order, for
+  uint16_t peer_port;       // the access log; 0 if logging is off
+  uint16_t status;          // Status code of the response being queued
+  WorkerMetrics *metrics;   // The worker's counters
+  uint64_t received_ns;     // Monotonic time of the last read that brought
+                            // data, where a request's latency starts
+  int recv_pending;         // recv_buffer filled up before the socket drained
+  int peer_closed;          // Set once read() has returned 0
+  int close_after_send;     // Close the socket once send_buffer is drained
+  int lingering;            // Write side shut down, discarding input
+  unsigned requests_served; // Requests answered on this connection
+  // The timeout the connection is under. A head has to arrive whole, and
+  // a lingering client has to close, by a deadline fixed when the wait
+  // began; the other timeouts restart with every bit of activity.
+  Timer timer;              // Linked into the event loop's timer wheel
+  TimeoutKind timeout_kind;
+  uint64_t fixed_deadline;  // Tick a head or linger wait ends at
+  unsigned timed_request;   // requests_served when it was fixed
+  HttpParser parser;        // Where the current request stands
+  Arena arena;              // Memory for queued responses, reset once flushed
+  // Receives the body of the current request with the Connection as 'ctx',
+  // then one call with data == NULL once the body is complete.
+  HttpBodySink on_body;
+  int stream_chunked; // Streamed response body uses chunked coding
+  // A proxied request holds its upstream connection until the response has
+  // been relayed; the response follows whatever was queued before it
+  Proxy *proxy;             // The worker's proxy state
+  Upstream *upstream;       // NULL unless a request is being proxied
+  TimeoutKind relay_wait;   // What the relay waits for meanwhile
+  // HTTP/2: the session of a connection that switched, or for a connection
+  // without a socket standing in for a stream, that stream
+  Http2Session *h2;
+  Http2Stream *stream;
+  // io_uring backend only. The kernel refers to the connection until every
+  // submitted operation has completed, and received data waits in provided
+  // buffers, chained by buffer id, until recv_buffer has room for it.
+  unsigned uring_ops;       // Operations submitted and not yet completed
+  int recv_armed;           // A multishot receive is active
+  int recv_cancelling;      // ... and has been asked to stop
+  int recv_starved;         // The receive stopped for lack of buffers
+  int send_busy;            // A sendmsg or POLLOUT poll is in flight
+  int closing;              // Closed, freed with the last completion
+  size_t out_locked;        // Segments the in-flight sendmsg may read
+  struct msghdr send_msg;   // Message of the in-flight sendmsg
+  uint16_t held_head, held_tail; // Oldest and newest held buffer
+  unsigned held_count;      // Buffers held
+  size_t held_offset;       // Bytes of the oldest one already copied
+  Connection *prev, *next;  // Links in the event loop's connection list
+  uint32_t next_free;       // Next free struct of the slab while unused
+};
+
+// A function to set up a worker's empty memory pools
+void memory_pools_init(MemoryPools *pools);
+
+// A function to free everything cached in a worker's memory pools
+void memory_pools_destroy(MemoryPools *pools);
+
+// A function to return how many times the pools had to call malloc
+uint64_t memory_pools_heap_allocs(const MemoryPools *pools);
+
+// A function to set up the state for a freshly accepted client socket in
+// a free slot of the worker's slabs. No buffer is taken until there is
+// something to put in it.
+Connection *create_connection(int client_fd, MemoryPools *pools);
+
+// A function to close the socket and hand the connection's memory and its
+// slot back to its pools
+void free_connection(Connection *conn);
+
+// A function to read everything currently available on the socket.
+// Returns the number of bytes read, 0 if nothing was available, or -1 on a
+// fatal socket error. Sets peer_closed when the client shut its side down and
+// recv_pending when the buffer filled up before the socket was drained.
+ssize_t fill_connection(Connection *conn);
+
+// A function to drop the first 'len' bytes of the receive buffer
+void consume_connection(Connection *conn, size_t len);
+
+// A function to make sure the receive buffer has room to read into: a
+// connection without one gets a small buffer, and a full small one is
+// moved to a RECV_BUFFER_SIZE one, since its handler could not take a
+// request or frame from it. Returns 0 on success or -1 if no buffer could
+// be had.
+int make_input_room(Connection *conn);
+
+// A function to give a connection a receive buffer of at least 'size'
+// bytes, moving what it holds. Returns 0 on success or -1 if no buffer
+// could be had.
+int reserve_input(Connection *conn, size_t size);
+
+// A function to hand the receive buffer back to its pool if it holds
+// nothing, so a connection waiting for its next request holds none.
+// HTTP/2 connections keep theirs for the session's lifetime.
+void release_input(Connection *conn);
+
+// A function to copy bytes into the send buffer and queue them for output.
+// Returns 0 on success or -1 if the data does not fit.
+int queue_response(Connection *conn, const char *data, size_t len);
+
+// A function to queue bytes for output without copying them. The data must
+// stay untouched until flush_connection() returns 1: static strings and the
+// connection's arena qualify. Segments of ZEROCOPY_MIN_SIZE bytes or more
+// are sent with MSG_ZEROCOPY. Returns 0 on success or -1 if no segment is
+// left.
+int queue_reference(Connection *conn, const char *data, size_t len);
+
+// A function to queue 'len' bytes of 'file' from 'offset', sent with
+// sendfile() after the segments queued so far. The connection takes over
+// the caller's reference to 'file' and drops it once everything is written;
+// 'len' may be 0 when only the entry's headers or mapping are referenced.
+// Returns 0 on success or -1 if a file is already queued.
+int queue_file(Connection *conn, FileEntry *file, off_t offset, size_t len);
+
+// A function to copy up to 'len' bytes from the start of the queued
+// segments, leaving them queued. Returns the number of bytes copied.
+size_t peek_output(const Connection *conn, char *dst, size_t len);
+
+// A function to copy the last 'len' bytes of the queued segments, which
+// have to hold that many, leaving them queued
+void peek_output_tail(const Connection *conn, char *dst, size_t len);
+
+// A function to take up to 'len' bytes of queued output, segments then
+// file range, instead of writing them to the socket. Once everything is
+// taken the output memory is recycled as after a write. Returns the number
+// of bytes taken, or -1 if the file could not be read.
+ssize_t take_output(Connection *conn, char *dst, size_t len);
+
+// A function to check whether another response can be queued, or whether
+// the pending output has to drain first
+int connection_has_room(const Connection *conn);
+
+// A function to check whether the kernel still holds pages of a
+// MSG_ZEROCOPY send. Their completions arrive on the socket's error queue
+// and are reported as EPOLLERR.
+int connection_zerocopy_pending(const Connection *conn);
+
+// A function to account for 'n' bytes added to the receive buffer, by
+// fill_connection() or by someone else such as the io_uring loop. Stamps
+// the arrival time used for request latency.
+void connection_received(Connection *conn, size_t n);
+
+// A function to account for 'n' bytes of the queued segments written by
+// someone else, such as an io_uring sendmsg. A partially written segment
+// is resumed from the right offset.
+void connection_sent(Connection *conn, size_t n);
+
+// A function to write as much of the queued output as the socket accepts,
+// with a single sendmsg() per attempt, followed by the queued file range.
+// Once everything is written (and every zero-copy send has completed) the
+// output block and the arena are recycled and the file reference dropped,
+// and a proxied response is relayed further. Returns 1 once everything is
+// written, 0 if the socket would block, FLUSH_WAITING if a proxied response
+// waits for its upstream, or -1 on a fatal socket error.
+int flush_connection(Connection *conn);
+
+// A function to start a lingering close: the write side is shut down so the
+// client sees the end of the last response, and input is discarded until the
+// client closes too. Closing straight away while request bytes are still
+// unread would make the kernel reset the connection and could destroy the
+// response before the client has read it.
+void linger_connection(Connection *conn);
+
+// A function to discard input on a lingering connection.
+// Returns -1 once the client has closed (or on error), 0 otherwise.
+int drain_connection(Connection *conn);
+
+#endif // CONNECTION_H
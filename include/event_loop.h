@@ -0,0 +1,105 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include "access_log.h"    // For AccessLogRing
+#include "compress.h"      // For Compressor
+#include "connection.h"    // For Connection
+#include "file_cache.h"    // For FileCache
+#include "http_response.h" // For CannedResponses
+#include "metrics.h"       // For WorkerMetrics
+#include "options.h"       // For ServerOptions
+#include "proxy.h"         // For Proxy, Upstream
+#include "response_cache.h" // For ResponseCache
+#include "timer_wheel.h"   // For TimerWheel
+#include <netinet/in.h>    // For sockaddr_in
+#include <stdint.h>        // For uint64_t
+
+typedef struct EventLoopStruct EventLoop;
+typedef struct UringLoopStruct UringLoop;
+
+// State of one worker's reactor. The loop owns the non-blocking listening
+// socket and every client connection accepted from it. The epoll and the
+// io_uring backends share everything but the way they wait for I/O.
+struct EventLoopStruct {
+  int epoll_fd;      // -1 under the io_uring backend
+  UringLoop *uring;  // io_uring backend state, NULL under epoll
+  int server_fd;
+  int wake_fd; // eventfd signalled when the loop has to re-check keep_running
+  Connection *connections; // Every open connection
+  size_t connection_count;
+  uint64_t now_ms;   // Monotonic milliseconds, refreshed after every wait
+  TimerWheel timers; // The timeout of every open connection
+  MemoryPools pools; // Buffers, arena blocks and connections for reuse
+  FileCache files;   // Open files below the document root
+  CannedResponses responses; // Fixed responses with the current Date
+  Compressor compressor; // Deflate streams for compressed responses
+  ResponseCache cache; // Responses handlers allowed to be served again
+  int serve_files;   // Set when a document root is configured
+  AccessLogRing *log; // This worker's access log ring, NULL if logging is off
+  WorkerMetrics *metrics; // This worker's counters
+  Proxy proxy;       // Upstream connection pools of the -P routes
+  uint64_t requests; // Requests answered on connections closed so far
+  int draining;      // Not accepting any more, ends once every connection
+                     // is gone or at drain_deadline_ms
+  uint64_t drain_deadline_ms;
+};
+
+// A function to run the reactor on server_fd until keep_running is cleared.
+// A write to wake_fd (if not -1) interrupts the wait so shutdown is noticed
+// immediately. 'worker_index' selects the worker's access log ring and
+// metrics. opts->backend picks epoll or io_uring; a kernel without the
+// io_uring features needed falls back to epoll. Returns 0 on a clean
+// shutdown or -1 if the loop could not be set up.
+int run_event_loop(int server_fd, int wake_fd, int worker_index,
+                   const ServerOptions *opts);
+
+// A function to set up the connection for a freshly accepted socket and
+// link it into the loop, once admission control lets the client in; a
+// client it turns away is answered with 429 or 503 right here. 'addr' is
+// the client's address, or NULL to look it up when it is needed. Returns
+// NULL (with the socket closed) if the client was turned away or on failure.
+Connection *adopt_connection(EventLoop *loop, int client_fd,
+                             const struct sockaddr_in *addr);
+
+// A function to re-arm a connection's timeout after it was serviced,
+// according to what it waits for now
+void touch_connection(EventLoop *loop, Connection *conn);
+
+// A function to unlink a connection from the loop and release it
+void close_connection(EventLoop *loop, Connection *conn);
+
+// A function to close every connection whose timeout has expired. Cheap
+// enough to call after every wake-up.
+void close_expired_connections(EventLoop *loop);
+
+// A function to watch a proxy upstream socket for readiness in both
+// directions. Returns 0 on success or -1 on failure.
+int loop_watch_upstream(EventLoop *loop, Upstream *up);
+
+// A function to stop watching an upstream socket that is about to be closed
+void loop_forget_upstream(EventLoop *loop, Upstream *up);
+
+// A function to drive a connection outside of its own readiness, when its
+// upstream moved or its timeout was handled; it is closed if it failed
+void resume_connection(EventLoop *loop, Connection *conn);
+
+// A function to return how long the next wait may last: until the next
+// timer is due, at most EPOLL_TIMEOUT_MS
+int loop_wait_ms(const EventLoop *loop);
+
+// A function to start draining once the main thread has set 'draining':
+// idle connections are closed now and after every later wake-up, and the
+// loop ends once the last connection is gone or DRAIN_TIMEOUT_MS have
+// passed. Returns 1 the first time, when the caller has to stop accepting,
+// 0 otherwise.
+int loop_start_drain(EventLoop *loop);
+
+// A function to check whether the loop goes on: until keep_running is
+// cleared or a drain has finished
+int loop_running(const EventLoop *loop);
+
+// A function to refresh the loop's clocks after a wait: the monotonic time
+// for timeouts and the Date header of the canned responses
+void update_loop_time(EventLoop *loop);
+
+#endif // EVENT_LOOP_H
@@ -0,0 +1,103 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include "compress.h"  // For Compressor, ContentCoding
+#include "config.h"    // For FILE_CACHE_BUCKETS
+#include <stddef.h>    // For size_t
+#include <stdint.h>    // For uint64_t
+#include <sys/types.h> // For off_t
+#include <time.h>      // For time_t
+
+typedef struct FileEntryStruct FileEntry;
+typedef struct FileCacheStruct FileCache;
+typedef struct FileVariantStruct FileVariant;
+
+// The whole file in a content coding other than identity, compressed once
+// and kept with its entry so repeat requests never compress it again
+struct FileVariantStruct {
+  const char *headers; // Header lines of a 200, Content-Length included
+  size_t headers_len;
+  const char *body;
+  size_t body_len;
+  char data[]; // The body, then the headers
+};
+
+// An open file below the document root with everything needed to answer a
+// request for it. Entries are reference counted: the cache holds one
+// reference while the entry is listed, and every response in flight holds
+// another, so an evicted or invalidated file stays usable until the last
+// response using it has been written.
+struct FileEntryStruct {
+  char *path;   // Relative to the document root, the cache key
+  int fd;       // Open for the lifetime of the entry, used with sendfile()
+  off_t size;
+  time_t mtime;
+  char *map;    // Whole file mapped once it turned out to be hot, or NULL
+  int map_failed;
+  // Precomputed header lines, in this order: ETag and Last-Modified (the
+  // validators sent with a 304), Content-Type, Accept-Ranges and for a
+  // compressible file Vary, then Content-Length.
+  char *headers;
+  size_t validators_len; // Length of the ETag and Last-Modified lines
+  size_t common_len;     // Length of everything before Content-Length
+  size_t headers_len;
+  const char *etag;          // The quoted ETag, inside 'headers'
+  size_t etag_len;
+  const char *last_modified; // The HTTP date, inside 'headers'
+  size_t last_modified_len;
+  const char *content_type;
+  int compressible;    // Text worth sending compressed
+  FileVariant *variants[CONTENT_CODINGS]; // Compressed so far, or NULL
+  unsigned variants_refused; // Bit per coding that did not shrink the file
+  size_t variant_bytes;      // Held by 'variants'
+  unsigned hits;       // Requests served from this entry
+  unsigned refs;       // Cache listing plus responses in flight
+  int cached;          // Listed in the cache's table and LRU list
+  int wd;              // inotify watch descriptor of the file
+  uint32_t hash;
+  FileEntry *hash_next;
+  FileEntry *lru_prev, *lru_next;
+};
+
+// A bounded cache of open files, one per worker so it needs no locking. The
+// least recently used entry is dropped once FILE_CACHE_ENTRIES are listed,
+// and inotify drops entries whose file changes, is replaced or removed.
+struct FileCacheStruct {
+  int root_fd;    // The document root directory
+  int inotify_fd; // Registered with the worker's epoll instance
+  FileEntry *buckets[FILE_CACHE_BUCKETS];
+  FileEntry *lru_head, *lru_tail; // Most and least recently used
+  size_t count;
+  size_t variant_bytes; // Held by the variants of listed entries
+  uint64_t hits, misses;
+};
+
+// A function to open the document root and the inotify instance.
+// Returns 0 on success or -1 on failure.
+int file_cache_init(FileCache *cache, const char *doc_root);
+
+// A function to drop every entry and close the cache's descriptors
+void file_cache_destroy(FileCache *cache);
+
+// A function to look up the regular file at 'path' (relative to the document
+// root, no "." or ".." segments) and take a reference to it. Paths that would
+// resolve outside the root are refused. Returns NULL with errno set if the
+// file can not be served; EISDIR means 'path' is a directory.
+FileEntry *file_cache_open(FileCache *cache, const char *path);
+
+// A function to drop a reference taken by file_cache_open()
+void file_cache_release(FileEntry *entry);
+
+// A function to return the body of 'entry' in 'coding', compressed with
+// 'z' on first use. Variants of every listed entry share a budget of
+// COMPRESS_CACHE_BYTES; the least recently used entries holding variants
+// are dropped to make room. Returns NULL if the file is not worth
+// compressing or can not be compressed, and the identity body should go.
+const FileVariant *file_cache_variant(FileCache *cache, FileEntry *entry,
+                                      ContentCoding coding, Compressor *z);
+
+// A function to read pending inotify events and drop the entries they
+// concern. Called when the inotify descriptor becomes readable.
+void file_cache_process_events(FileCache *cache);
+
+#endif // FILE_CACHE_H
@@ -0,0 +1,65 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include "config.h"     // For HPACK_TABLE_SIZE
+#include "http_types.h" // For StringView
+#include <stddef.h>     // For size_t
+#include <stdint.h>     // For uint8_t, uint32_t
+#include <sys/types.h>  // For ssize_t
+
+// Entries the dynamic table can hold: each costs 32 bytes beyond its name
+// and value
+#define HPACK_MAX_ENTRIES (HPACK_TABLE_SIZE / 32)
+
+typedef struct HpackDecoderStruct HpackDecoder;
+
+// Receives each decoded header field. The views stay valid until
+// hpack_decode() returns.
+typedef void (*HpackFieldSink)(void *ctx, StringView name, StringView value);
+
+// One dynamic table entry: its name and value are stored back to back in
+// the decoder's ring
+typedef struct {
+  uint32_t offset; // Where the name starts in 'ring'
+  uint32_t name_len;
+  uint32_t value_len;
+} HpackEntry;
+
+// The decoding side of an HTTP/2 connection's header compression. The
+// dynamic table is a ring of entries over a ring of bytes: new entries go
+// in at the head, evictions take the oldest from the tail, and nothing is
+// ever moved.
+struct HpackDecoderStruct {
+  char ring[HPACK_TABLE_SIZE];
+  HpackEntry entries[HPACK_MAX_ENTRIES];
+  size_t first;    // Oldest entry in 'entries'
+  size_t count;    // Entries held
+  size_t head;     // Next free byte in 'ring'
+  size_t size;     // Table size as HPACK counts it
+  size_t max_size; // Current limit, lowered by the encoder's size updates
+};
+
+// A function to set up an empty decoder with the HPACK_TABLE_SIZE limit
+// announced in our SETTINGS
+void hpack_decoder_init(HpackDecoder *D);
+
+// A function to decode a complete header block, passing every field to
+// 'sink' in order. Strings that are Huffman coded or held by the dynamic
+// table are written to 'scratch' first. Returns 0 on success or -1 on a
+// compression error, after which the connection can not continue.
+int hpack_decode(HpackDecoder *D, const uint8_t *block, size_t len,
+                 char *scratch, size_t scratch_size, HpackFieldSink sink,
+                 void *ctx);
+
+// A function to encode a response's :status. Returns the bytes written to
+// 'out', which needs room for 5.
+size_t hpack_encode_status(uint8_t *out, unsigned status);
+
+// A function to encode a header field as a literal without indexing. The
+// name is lowercased and found in the static table where possible, and
+// strings are Huffman coded when that is shorter. Returns the bytes
+// written, or -1 if 'room' is too small.
+ssize_t hpack_encode_field(uint8_t *out, size_t room, StringView name,
+                           StringView value);
+
+#endif // HPACK_H
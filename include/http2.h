@@ -0,0 +1,141 @@
+#ifndef HTTP2_H
+#define HTTP2_H
+
+#include "config.h"      // For HTTP2_*, RECV_BUFFER_SIZE
+#include "connection.h"  // For Connection, TimeoutKind
+#include "hpack.h"       // For HpackDecoder
+#include "http_parser.h" // For HttpParser
+#include "http_types.h"  // For ClientRequest, HttpHeader
+#include "proxy.h"       // For BodyFraming
+#include <stddef.h>      // For size_t
+#include <stdint.h>      // For uint8_t, uint32_t, int64_t, uint64_t
+
+// Error codes of RST_STREAM and GOAWAY frames (RFC 9113, 7)
+typedef enum {
+  HTTP2_NO_ERROR = 0x0,
+  HTTP2_PROTOCOL_ERROR = 0x1,
+  HTTP2_INTERNAL_ERROR = 0x2,
+  HTTP2_FLOW_CONTROL_ERROR = 0x3,
+  HTTP2_STREAM_CLOSED = 0x5,
+  HTTP2_FRAME_SIZE_ERROR = 0x6,
+  HTTP2_REFUSED_STREAM = 0x7,
+  HTTP2_CANCEL = 0x8,
+  HTTP2_COMPRESSION_ERROR = 0x9,
+  HTTP2_ENHANCE_YOUR_CALM = 0xb,
+  HTTP2_HTTP_1_1_REQUIRED = 0xd,
+} Http2Error;
+
+// One request and its response. The handlers never see the stream: they
+// are given 'conn', a connection without a socket whose receive buffer
+// holds the request rewritten as HTTP/1.1 and then the request body, and
+// whose queued output is the HTTP/1.1 response, turned into HEADERS and
+// DATA frames as flow control allows.
+struct Http2StreamStruct {
+  uint32_t id;
+  Connection *conn;       // Stands in for the client connection
+  int64_t send_window;    // DATA the client lets us send
+  int64_t recv_window;    // DATA the client may still send
+  uint32_t recv_consumed; // Taken by the body sink, not granted back yet
+  uint64_t body_bytes;    // Request body received
+  int64_t body_length;    // Its Content-Length, -1 if none was sent
+  int remote_closed;      // END_STREAM received: the request is complete
+  int body_done;          // ... and its body went to the sink entirely
+  int head_only;          // A HEAD request, answered without a body
+  int head_sent;          // The response HEADERS went out
+  int local_closed;       // END_STREAM sent: the response is complete
+  int reset;              // To be reset with 'reset_code'
+  uint32_t reset_code;
+  BodyFraming framing;    // How the end of the response body is found
+  uint64_t remaining;     // BODY_LENGTH bytes still to send
+  HttpParser chunks;      // Strips the framing of a BODY_CHUNKED body
+  Http2Stream *next;
+};
+
+// The HTTP/2 side of a client connection. Frames are read from the
+// connection's receive buffer and written to its output like any other
+// response, so both event loop backends drive it through handle_client().
+struct Http2SessionStruct {
+  Connection *conn;
+  int preface_pending;   // Upgraded: the client's preface is still due
+  int settings_received; // The client's first SETTINGS arrived
+  int settings_acked;    // ... and it acknowledged ours
+  // The frame being read. Its payload is taken as it arrives, except for
+  // the small control frames, which are handled whole.
+  int in_frame;
+  uint32_t frame_length;
+  uint8_t frame_type;
+  uint8_t frame_flags;
+  uint32_t frame_stream;
+  uint32_t frame_left;   // Payload bytes not taken yet
+  uint32_t content_left; // ... of which are not padding
+  int prefix_done;       // The padding length and priority were read
+  size_t offset;         // Receive buffer bytes taken in this pass
+  int blocked;           // A stream's body buffer is full
+  // The header block being assembled from HEADERS and CONTINUATION frames
+  uint32_t block_stream;
+  int block_end_stream;  // The HEADERS frame carried END_STREAM
+  int block_new;         // ... and opened the stream
+  int continuation;      // A CONTINUATION frame has to follow
+  char *block;           // RECV_BUFFER_SIZE bytes while needed, else NULL
+  size_t block_len;
+  // The fields of the last decoded block, viewing 'scratch' or the block
+  HpackDecoder decoder;
+  char *scratch;         // RECV_BUFFER_SIZE bytes for decoded strings
+  HttpHeader fields[HTTP2_MAX_FIELDS];
+  size_t field_count;
+  int fields_dropped;    // More than HTTP2_MAX_FIELDS arrived
+  // Connection flow control and the client's settings
+  int64_t send_window;
+  int64_t recv_window;
+  uint32_t recv_consumed;      // Taken from the buffer, not granted back
+  uint32_t peer_initial_window;
+  uint32_t peer_max_frame;
+  // Streams
+  uint32_t last_stream;  // Highest stream id the client has used
+  unsigned stream_count;
+  Http2Stream *streams;
+  Http2Stream *turn;     // Where the next round of output starts
+  Http2Stream *free_streams;
+  int goaway_sent;
+  int goaway_received;
+  Http2Error error; // Why reading the last frame failed
+};
+
+// A function to check the start of a fresh connection's input for the
+// HTTP/2 connection preface. Returns 1 if it is there, 0 if the input so
+// far is too short to tell, or -1 if it is not.
+int http2_preface(const Connection *conn);
+
+// A function to switch a connection to HTTP/2 once http2_preface() found
+// the preface: it is consumed and our SETTINGS are queued.
+// Returns 0 on success or -1 on failure.
+int http2_start(Connection *conn);
+
+// A function to take up a request's "Upgrade: h2c": 101 Switching
+// Protocols and our SETTINGS are queued, and the request itself is served
+// as stream 1. Only requests without a body, carrying HTTP2-Settings, are
+// upgraded. 'parse_start' is when parsing the request began. Returns 1 if
+// the connection was switched, 0 if the request is to be served as
+// HTTP/1.1, or -1 on failure.
+int http2_upgrade(Connection *conn, const ClientRequest *C,
+                  uint64_t parse_start);
+
+// A function to read the frames buffered on an HTTP/2 connection and queue
+// the frames of every stream with output ready. Returns 1 if anything
+// moved, 0 if it waits for the client, or -1 if the connection has to be
+// dropped. A protocol error queues GOAWAY and marks the connection for
+// closing.
+int http2_handle(Connection *conn);
+
+// A function to reset the stream a handler was given 'conn' for with
+// 'code' instead of answering it
+int http2_reset_stream(Connection *conn, Http2Error code);
+
+// A function to tell what an HTTP/2 connection without queued output waits
+// for, which decides its timeout
+TimeoutKind http2_waiting_for(const Connection *conn);
+
+// A function to free the HTTP/2 state of a connection that is closing
+void http2_close(Connection *conn);
+
+#endif // HTTP2_H
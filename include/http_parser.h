@@ -2,8 +2,76 @@
 #define HTTP_PARSER_H
 
 #include "http_types.h" // For ClientRequest struct
+#include <stdint.h>     // For uint64_t
 #include <sys/types.h>  // For ssize_t
 
-// A function to parse the client request into a structured field
-ClientRequest parseRequest(const char *client_req_str, ssize_t req_size);
+// Return codes of the parser functions
+#define PARSE_OK 0                    // Head parsed / body complete
+#define PARSE_NEED_MORE 1             // All input used, feed more bytes
+#define PARSE_PAUSED 2                // The body sink did not take everything
+#define PARSE_MALFORMED -1            // Syntax error, answer 400
+#define PARSE_TOO_MANY_HEADERS -2     // More than MAX_HEADERS fields, 431
+#define PARSE_HEAD_TOO_LARGE -3       // Head longer than MAX_HEAD_SIZE, 431
+#define PARSE_BODY_TOO_LARGE -4       // Body longer than MAX_BODY_SIZE, 413
+#define PARSE_UNSUPPORTED_ENCODING -5 // Transfer coding other than chunked, 501
+
+typedef enum {
+  HTTP_PARSER_HEAD = 0,        // Waiting for a complete request head
+  HTTP_PARSER_BODY,            // Inside a Content-Length body
+  HTTP_PARSER_CHUNK_SIZE,      // Hex digits of a chunk-size line
+  HTTP_PARSER_CHUNK_EXT,       // Chunk extensions up to the line end
+  HTTP_PARSER_CHUNK_SIZE_LF,   // LF ending a chunk-size line
+  HTTP_PARSER_CHUNK_DATA,      // Inside chunk data
+  HTTP_PARSER_CHUNK_DATA_CR,   // CR after chunk data
+  HTTP_PARSER_CHUNK_DATA_LF,   // LF after chunk data
+  HTTP_PARSER_TRAILER_START,   // Start of a trailer line or the final CRLF
+  HTTP_PARSER_TRAILER_LINE,    // Inside a trailer field
+  HTTP_PARSER_TRAILER_END_LF,  // LF of the final CRLF
+} HttpParserState;
+
+typedef struct HttpParserStruct HttpParser;
+
+// Resumable parser state kept per connection. The head has to be contiguous
+// (the ClientRequest views point into it) but is searched incrementally; the
+// body is decoded byte by byte, so it can arrive in chunks of any size.
+struct HttpParserStruct {
+  HttpParserState state;
+  size_t scan_offset;  // Head bytes already searched for the blank line
+  uint64_t remaining;  // Bytes left in the Content-Length body or chunk
+  uint64_t body_bytes; // Body bytes delivered for the current request
+  size_t line_bytes;   // Length of the current chunk-size or trailer line
+  int size_digits;     // Hex digits seen on the current chunk-size line
+};
+
+// Receives decoded body bytes. Returns how many of the 'len' bytes were
+// taken (fewer pauses the parser) or -1 to abort.
+typedef ssize_t (*HttpBodySink)(void *ctx, const char *data, size_t len);
+
+// A function to parse a complete request head into views of the method,
+// target, version and headers, and to validate the body framing headers.
+// Nothing is copied or allocated: the views point into 'head'.
+int parseRequest(const char *head, size_t head_len, ClientRequest *C);
+
+// A function to prepare the parser for the next request
+void httpParserReset(HttpParser *P);
+
+// A function to feed the buffered start of a request. 'buffer' holds all
+// bytes received so far for this request; the search for the end of the head
+// resumes where the previous call stopped. Returns PARSE_NEED_MORE until the
+// head is complete, then parses it into C, stores its length in head_len,
+// switches to the body states if the request has a body, and returns
+// PARSE_OK. Anything else is an error code.
+int httpParserHead(HttpParser *P, const char *buffer, size_t len,
+                   ClientRequest *C, size_t *head_len);
+
+// A function to check whether the parser is waiting for body bytes
+int httpParserInBody(const HttpParser *P);
+
+// A function to feed body bytes. Decoded bytes are passed to 'sink' without
+// being buffered; 'consumed' reports how much input was used. Returns
+// PARSE_OK once the body is complete (the parser is then ready for the next
+// head), PARSE_NEED_MORE, PARSE_PAUSED, or an error code.
+int httpParserBody(HttpParser *P, const char *data, size_t len,
+                   size_t *consumed, HttpBodySink sink, void *ctx);
+
 #endif // HTTP_PARSER_H
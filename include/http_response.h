@@ -1,17 +1,75 @@
 #ifndef HTTP_RESPONSE_H
 #define HTTP_RESPONSE_H
-#include "http_types.h" // For ClientRequest, ServerResponse
+#include "arena.h"      // For Arena
+#include "config.h"     // For CANNED_RESPONSE_MAX
+#include "http_types.h" // For ServerResponse, StringView
 #include <string.h>     // For size_t
+#include <time.h>       // For time_t
 
-// A function to initialize the server response messages
-int initializeServerResponses(char *serverResponse[], int response_code,
-                              const char *response_text,
-                              size_t response_length);
+// Responses whose content never changes, apart from the Date header
+typedef enum {
+  RESPONSE_ROOT_OK,            // 200 for "/"
+  RESPONSE_BAD_REQUEST,        // 400
+  RESPONSE_NOT_FOUND,          // 404
+  RESPONSE_CONTENT_TOO_LARGE,  // 413
+  RESPONSE_TOO_MANY_REQUESTS,  // 429, the client opens connections too fast
+  RESPONSE_HEADERS_TOO_LARGE,  // 431
+  RESPONSE_INTERNAL_ERROR,     // 500
+  RESPONSE_NOT_IMPLEMENTED,    // 501
+  RESPONSE_BAD_GATEWAY,        // 502, no upstream could answer
+  RESPONSE_SERVICE_UNAVAILABLE, // 503, too many connections are open
+  RESPONSE_GATEWAY_TIMEOUT,    // 504, the upstream did not answer in time
+  CANNED_RESPONSE_COUNT
+} CannedResponseId;
 
-// A function to free the server responses
-void freeServerResponses(char *serverResponse[], size_t count);
+// How the connection header of a response reads
+typedef enum {
+  CONNECTION_DEFAULT,    // No header: HTTP/1.1 keeps the connection open
+  CONNECTION_CLOSE,      // "Connection: close"
+  CONNECTION_KEEP_ALIVE, // "Connection: keep-alive", for HTTP/1.0 clients
+  CONNECTION_MODES
+} ConnectionMode;
 
-// A function to return an appropriate response
-ServerResponse echoResponse(ClientRequest C, char **serverResponse);
+typedef struct CannedResponsesStruct CannedResponses;
+
+// A worker's rendering of the canned responses: every response in every
+// connection mode, complete with the current Date header and ready to be
+// written as is. Rendered again once per second, when the Date changes.
+struct CannedResponsesStruct {
+  time_t date_second; // Wall-clock second the Date header shows
+  char date_line[HTTP_DATE_SIZE + 8]; // "Date: ...\r\n"
+  size_t date_line_len;
+  size_t head_len[CANNED_RESPONSE_COUNT][CONNECTION_MODES]; // Without body
+  size_t total_len[CANNED_RESPONSE_COUNT][CONNECTION_MODES];
+  char rendered[CANNED_RESPONSE_COUNT][CONNECTION_MODES][CANNED_RESPONSE_MAX];
+};
+
+// A function to render every canned response for wall-clock time 'now'
+void initializeCannedResponses(CannedResponses *R, time_t now);
+
+// A function to render the canned responses again if 'now' is a different
+// second than the one they show. Cheap enough to call after every wake-up.
+void refreshCannedResponses(CannedResponses *R, time_t now);
+
+// A function to return a complete canned response. 'head_only' leaves the
+// body out, for HEAD requests. The bytes change when the responses are
+// refreshed, so they have to be copied, not referenced.
+StringView cannedResponse(const CannedResponses *R, CannedResponseId id,
+                          ConnectionMode mode, int head_only);
+
+// A function to return the current "Date: ...\r\n" line for responses that
+// are put together per request
+StringView dateHeader(const CannedResponses *R);
+
+// A function to return the status code of a status line such as
+// "HTTP/1.1 404 Not Found\r\n", or 0 if there is none
+int responseStatus(const char *status_line);
+
+// A function to return the header line for a connection mode
+const char *connectionHeader(ConnectionMode mode);
+
+// A function to return a 200 response with 'message' as its plain text
+// body. The parts live in 'arena' and stay valid until it is reset.
+ServerResponse echoResponse(StringView message, Arena *arena);
 
 #endif // HTTP_RESPONSE_H
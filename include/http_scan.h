@@ -0,0 +1,41 @@
+#ifndef HTTP_SCAN_H
+#define HTTP_SCAN_H
+
+// Byte scanning kernels used by the request parser. Each scanner returns a
+// pointer to the first byte in [p, end) that stops the scan, or 'end' if
+// there is none. The SIMD kernels look at 16 (SSE4.2) or 32 (AVX2) bytes per
+// step and are picked at runtime from what the CPU supports.
+
+typedef enum {
+  HTTP_SCAN_SCALAR = 0, // Portable byte-at-a-time loops
+  HTTP_SCAN_SSE42,      // PCMPESTRI ranges plus PSHUFB token classification
+  HTTP_SCAN_AVX2,       // 32-byte compares plus VPSHUFB token classification
+} HttpScanKernel;
+
+// Stops at the first byte that is not a token character, e.g. the ' ' after
+// the method or the ':' after a header field name.
+extern const char *(*scanToken)(const char *p, const char *end);
+
+// Stops at the first space or control character, i.e. the end of the
+// request-target or of the version.
+extern const char *(*scanTarget)(const char *p, const char *end);
+
+// Stops at the first control character other than HTAB. In a header field
+// value that is the line end ('\r' or '\n'); anything else is invalid, so
+// line ends are found and values validated in the same pass.
+extern const char *(*scanFieldValue)(const char *p, const char *end);
+
+// A function to select the fastest kernel the CPU supports
+void httpScanInit(void);
+
+// A function to select a specific kernel.
+// Returns 0 on success or -1 if the CPU does not support it.
+int httpScanUseKernel(HttpScanKernel kernel);
+
+// A function to return the kernel currently in use
+HttpScanKernel httpScanActiveKernel(void);
+
+// A function to return a printable name for a kernel
+const char *httpScanKernelName(HttpScanKernel kernel);
+
+#endif // HTTP_SCAN_H
@@ -1,28 +1,100 @@
 #ifndef HTTP_TYPES_H
 #define HTTP_TYPES_H
 
+#include "config.h" // For MAX_HEADERS
+#include <stddef.h> // For size_t
+#include <stdint.h> // For uint64_t
 #include <stdlib.h>
+#include <time.h>   // For time_t
 
+// Bytes needed for an HTTP date, including the terminating NUL
+#define HTTP_DATE_SIZE 30
+
+typedef struct StringViewStruct StringView;
+typedef struct HttpHeaderStruct HttpHeader;
 typedef struct RequestStruct ClientRequest;
 typedef struct ResponseStruct ServerResponse;
 
+// A non-owning, not NUL terminated slice of a buffer
+struct StringViewStruct {
+  const char *ptr;
+  size_t len;
+};
+
+typedef enum {
+  HTTP_METHOD_UNKNOWN = 0, // A syntactically valid but unrecognised method
+  HTTP_METHOD_GET,
+  HTTP_METHOD_HEAD,
+  HTTP_METHOD_POST,
+  HTTP_METHOD_PUT,
+  HTTP_METHOD_DELETE,
+  HTTP_METHOD_CONNECT,
+  HTTP_METHOD_OPTIONS,
+  HTTP_METHOD_TRACE,
+  HTTP_METHOD_PATCH,
+  HTTP_METHOD_COUNT
+} HttpMethod;
+
+struct HttpHeaderStruct {
+  StringView name;
+  StringView value; // Leading and trailing whitespace removed
+};
+
+// A parsed request. Every view points into the connection's receive buffer,
+// so a ClientRequest is only valid until that buffer is consumed.
 struct RequestStruct {
-  char *http_method;
-  char *route;
-  char *http_version;
-  char *args;
+  HttpMethod http_method;
+  StringView method_name;  // The method token as sent
+  StringView target;       // The full request-target
+  StringView route;        // The path part of the target
+  StringView query;        // The text after '?', empty if there is none
+  StringView http_version; // e.g. "HTTP/1.1"
+  int version_minor;       // 0 for HTTP/1.0, 1 for HTTP/1.1
+  HttpHeader headers[MAX_HEADERS];
+  size_t header_count;
+  uint64_t content_length; // Declared body length, 0 when absent
+  int chunked;             // Body uses Transfer-Encoding: chunked
+  int expect_continue;     // Client waits for "100 Continue" before the body
+  int keep_alive;          // Connection may be reused after the response
 };
 
+// A response assembled by a handler. The parts are allocated from the
+// connection's per-request arena, so there is nothing to free.
 struct ResponseStruct {
-  char *status_line;
+  const char *status_line;
   char *headers;
   char *response_body;
+  unsigned cache_ttl_ms; // How long the response may be served again from
+                         // the response cache, 0 if it may not
 };
 
-// A function to free the server response
-void freeServerResponse(ServerResponse *S);
+// A function to compare a view with a NUL terminated string
+int viewEquals(StringView v, const char *s);
+
+// A function to compare a view with a NUL terminated string, ignoring case
+int viewEqualsIgnoreCase(StringView v, const char *s);
+
+// A function to check whether a view starts with a NUL terminated prefix
+int viewStartsWith(StringView v, const char *prefix);
+
+// A function to look up a request header by name (case insensitive).
+// Returns NULL if the header is not present.
+const HttpHeader *findHeader(const ClientRequest *C, const char *name);
+
+// A function to check whether a comma separated header value lists
+// 'token' (case insensitive), e.g. "keep-alive, Upgrade" lists "upgrade"
+int headerHasToken(StringView value, const char *token);
+
+// A function to format 't' as an HTTP date ("Sun, 06 Nov 1994 08:49:37
+// GMT"). 'size' must be at least HTTP_DATE_SIZE. Returns the length written,
+// or 0 on failure.
+size_t formatHttpDate(time_t t, char *buf, size_t size);
+
+// A function to parse an HTTP date in IMF-fixdate form.
+// Returns 0 on success or -1 if the value is not such a date.
+int parseHttpDate(StringView v, time_t *out);
 
-// A function to free the client request
-void freeClientRequest(ClientRequest *C);
+// A function to return the canonical name of a method
+const char *httpMethodName(HttpMethod method);
 
 #endif // HTTP_TYPES_H
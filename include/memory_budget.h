@@ -0,0 +1,33 @@
+#ifndef MEMORY_BUDGET_H
+#define MEMORY_BUDGET_H
+
+#include <stddef.h> // For size_t
+
+// The memory the workers' pools hold from the heap, counted against one
+// budget shared by all of them: receive and output buffers, arena blocks,
+// connection slabs and HTTP/2 sessions, which is what grows with the
+// number of connections. Free buffers a pool keeps count as well, since
+// they are still held. Past ADMISSION_SHED_PERCENT of the budget new
+// connections are turned away, and past the budget itself allocations
+// fail, so the server sheds load before the kernel runs out of memory.
+
+// A function to set the budget to 'bytes', 0 for none. Called once before
+// the workers start.
+void memory_budget_init(size_t bytes);
+
+// A function to count 'bytes' about to come from the heap. Returns 1 if
+// they fit the budget, else 0, counting nothing.
+int memory_budget_reserve(size_t bytes);
+
+// A function to give back 'bytes' counted by memory_budget_reserve() once
+// they are freed
+void memory_budget_release(size_t bytes);
+
+// A function to return the bytes counted now, over every worker
+size_t memory_budget_used(void);
+
+// A function to return whether ADMISSION_SHED_PERCENT of the budget is in
+// use, so new connections are to be turned away
+int memory_budget_shedding(void);
+
+#endif // MEMORY_BUDGET_H
@@ -0,0 +1,136 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "config.h" // For CACHE_LINE_SIZE, METRICS_*
+#include <stddef.h> // For size_t
+#include <stdint.h> // For uint64_t
+#include <time.h>   // For clock_gettime, CLOCK_MONOTONIC
+
+typedef struct HistogramStruct Histogram;
+typedef struct WorkerMetricsStruct WorkerMetrics;
+
+// Log-linear buckets: every power of two is split into
+// 2^METRICS_HISTOGRAM_SUB_BITS equal parts, so a bucket is never wider than
+// 1/8 of its values (HdrHistogram with one significant octal digit).
+// Values are nanoseconds, clamped to 2^METRICS_HISTOGRAM_MAX_BITS - 1.
+#define METRICS_HISTOGRAM_SUB (1u << METRICS_HISTOGRAM_SUB_BITS)
+#define METRICS_HISTOGRAM_BUCKETS                                             \
+  ((METRICS_HISTOGRAM_MAX_BITS - METRICS_HISTOGRAM_SUB_BITS + 1) *             \
+   METRICS_HISTOGRAM_SUB)
+
+// Status classes counted per route: index 0 for a request that got no
+// response, then 1xx to 5xx
+#define METRICS_STATUS_CLASSES 6
+
+// Connections closed by each kind of timeout (TimeoutKind)
+#define METRICS_TIMEOUT_KINDS 7
+
+struct HistogramStruct {
+  uint64_t count;
+  uint64_t sum; // Nanoseconds
+  uint64_t buckets[METRICS_HISTOGRAM_BUCKETS];
+};
+
+// One worker's counters. Only the owning worker writes them, with plain
+// (relaxed atomic) stores, and each worker's block starts on its own cache
+// line, so counting costs an add and never bounces a line between CPUs.
+// Readers sum the blocks of every worker while they keep changing; every
+// single value is read whole, the set as a whole is only approximately
+// simultaneous, which is what a scrape needs.
+struct WorkerMetricsStruct {
+  _Alignas(CACHE_LINE_SIZE) uint64_t accepts;
+  uint64_t connections; // Open right now
+  // Admission control: connections turned away, and ones admitted without
+  // a bucket because the client table had no room
+  uint64_t rate_limited;
+  uint64_t overloaded;
+  uint64_t shed;        // ... by the memory budget
+  uint64_t untracked;
+  uint64_t parse_errors;
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  // Reverse proxy: connections opened to upstreams and pooled ones reused,
+  // upstream failures and the ejections they caused
+  uint64_t upstream_connects;
+  uint64_t upstream_reuses;
+  uint64_t upstream_failures;
+  uint64_t upstream_ejections;
+  // HTTP/2: connections switched to it, the streams they opened and the
+  // streams reset by RST_STREAM instead of answered
+  uint64_t http2_connections;
+  uint64_t http2_streams;
+  uint64_t http2_resets;
+  // Response cache: requests answered from it, and responses put in it
+  uint64_t cache_hits;
+  uint64_t cache_fills;
+  uint64_t timeouts[METRICS_TIMEOUT_KINDS];
+  // By route index (METRICS_MAX_ROUTES for requests matching no route) and
+  // status class
+  uint64_t requests[METRICS_MAX_ROUTES + 1][METRICS_STATUS_CLASSES];
+  Histogram parse_time;   // Parsing the request head
+  Histogram handler_time; // Routing and queueing the response
+  // From the read that completed the request head to its response being
+  // queued, including time spent behind earlier pipelined requests
+  Histogram request_time;
+};
+
+// A function to set up zeroed counters for 'worker_count' workers.
+// Returns 0 on success or -1 if there is no memory.
+int metrics_init(int worker_count);
+
+// A function to free the counters once the workers have stopped
+void metrics_destroy(void);
+
+// A function to return the counters of worker 'index', or NULL before
+// metrics_init()
+WorkerMetrics *metrics_worker(int index);
+
+// A function to render the sum over every worker in the Prometheus text
+// format. 'route_names' labels the route indexes of 'requests'. Returns the
+// length written, or 0 if 'size' bytes are not enough.
+size_t metrics_render(char *out, size_t size, const char *const *route_names,
+                      size_t route_count);
+
+// A function to return the value at quantile 'q' (0 to 1) of 'h', as the
+// upper bound of the bucket it falls into, or 0 if 'h' is empty
+uint64_t histogram_quantile(const Histogram *h, double q);
+
+// A function to return the monotonic clock in nanoseconds
+static inline uint64_t metrics_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// A function to add 'n' to a counter of the calling worker. The store is
+// atomic so that a concurrent reader never sees a torn value, but it is not
+// a read-modify-write: the worker is the only writer.
+static inline void metrics_add(uint64_t *counter, uint64_t n) {
+  __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+// A function to set a gauge of the calling worker
+static inline void metrics_set(uint64_t *gauge, uint64_t value) {
+  __atomic_store_n(gauge, value, __ATOMIC_RELAXED);
+}
+
+// A function to return the bucket of value 'ns'
+static inline size_t histogram_bucket(uint64_t ns) {
+  if (ns < METRICS_HISTOGRAM_SUB)
+    return (size_t)ns;
+  if (ns >> METRICS_HISTOGRAM_MAX_BITS)
+    ns = (1ull << METRICS_HISTOGRAM_MAX_BITS) - 1;
+  unsigned msb = 63u - (unsigned)__builtin_clzll(ns);
+  unsigned shift = msb - METRICS_HISTOGRAM_SUB_BITS;
+  return (size_t)(shift + 1) * METRICS_HISTOGRAM_SUB +
+         (size_t)((ns >> shift) & (METRICS_HISTOGRAM_SUB - 1));
+}
+
+// A function to record one value of 'ns' nanoseconds
+static inline void histogram_record(Histogram *h, uint64_t ns) {
+  metrics_add(&h->buckets[histogram_bucket(ns)], 1);
+  metrics_add(&h->count, 1);
+  metrics_add(&h->sum, ns);
+}
+
+#endif // METRICS_H
@@ -0,0 +1,40 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include "access_log.h" // For LogLevel, LogFormat
+#include "config.h"     // For PROXY_MAX_ROUTES
+
+typedef struct ServerOptionsStruct ServerOptions;
+
+// How the workers wait for and perform socket I/O
+typedef enum {
+  BACKEND_EPOLL, // Readiness notifications, then read()/sendmsg()
+  BACKEND_URING, // io_uring completions, falling back to epoll if missing
+} IoBackend;
+
+// Runtime settings taken from the command line
+struct ServerOptionsStruct {
+  int port;
+  int worker_count;     // Number of worker threads, 0 means one per online CPU
+  int pin_workers;      // Pin each worker thread to its own CPU
+  const char *doc_root; // Directory served as static files, or NULL
+  IoBackend backend;    // I/O backend of the workers
+  int sqpoll;           // io_uring: let a kernel thread poll submissions
+  LogLevel log_level;   // What goes into the access log
+  LogFormat log_format; // How access log lines are written
+  // "prefix=upstream[,upstream...]" of each -P, as given
+  const char *proxy_routes[PROXY_MAX_ROUTES];
+  int proxy_route_count;
+  // Admission control, every limit 0 when off
+  int client_rate;      // New connections per second from one address
+  int client_burst;     // ... allowed in a burst
+  int max_connections;  // Open at once over every worker
+  int memory_budget_mb; // Pooled memory over every worker, in megabytes
+};
+
+// A function to fill 'opts' from argv, starting from the config.h defaults.
+// Returns 0 on success, 1 if usage was printed on request, or -1 on invalid
+// arguments.
+int parse_options(int argc, char *argv[], ServerOptions *opts);
+
+#endif // OPTIONS_H
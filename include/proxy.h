@@ -0,0 +1,177 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include "access_log.h"    // For AccessRecord
+#include "config.h"        // For PROXY_MAX_ROUTES, PROXY_MAX_UPSTREAMS
+#include "connection.h"    // For Connection, Upstream, Proxy
+#include "http_parser.h"   // For HttpParser
+#include "http_response.h" // For ConnectionMode
+#include "router.h"        // For Router
+#include <stddef.h>        // For size_t
+#include <stdint.h>        // For uint64_t
+
+typedef struct EventLoopStruct EventLoop;
+typedef struct UpstreamServerStruct UpstreamServer;
+typedef struct RelayRequestStruct RelayRequest;
+typedef struct DeferredRequestStruct DeferredRequest;
+
+// Results of proxy_relay() other than -1
+#define RELAY_BLOCKED 0 // The client socket is full
+#define RELAY_DONE 1    // The whole response has been relayed
+#define RELAY_WAITING 2 // Nothing to do until the upstream moves
+#define RELAY_QUEUED 3  // Output was queued on the client connection
+
+// Where a connection to an upstream stands
+typedef enum {
+  UPSTREAM_FREE,       // Unused, on the free or retired list
+  UPSTREAM_IDLE,       // Kept open in its server's pool
+  UPSTREAM_CONNECTING, // connect() has not completed
+  UPSTREAM_HEAD,       // Waiting for the response head
+  UPSTREAM_BODY,       // Relaying the response body
+} UpstreamState;
+
+// How the end of a response body is found
+typedef enum {
+  BODY_NONE,    // No body: HEAD requests, 204 and 304 responses
+  BODY_LENGTH,  // Content-Length bytes
+  BODY_CHUNKED, // Transfer-Encoding: chunked
+  BODY_CLOSE,   // Everything until the upstream closes
+} BodyFraming;
+
+// A proxied request is counted and logged once its response has been
+// relayed, so the status and size are the ones the client got. Until then
+// this holds what handle_client() knew.
+struct DeferredRequestStruct {
+  int pending;         // Not counted and logged yet
+  int logged;          // 'record' was filled in for the access log
+  AccessRecord record; // Complete but for time, status and bytes
+  size_t route;        // Index of the route it matched
+  uint64_t received;   // metrics_now() when its head arrived
+};
+
+// The client's request as forwarded. It moves to another connection when
+// the one it was sent on fails before any of it was written, or when a
+// pooled connection turns out to have been closed by its server and the
+// request can safely be repeated.
+struct RelayRequestStruct {
+  char *send_buffer;  // SEND_BUFFER_SIZE bytes from the worker's pools:
+                      // the head, then body bytes with any chunk framing
+  size_t send_len;    // Bytes held
+  size_t send_sent;   // Bytes of those written
+  int has_body;       // The request has a body, whose bytes are dropped
+  int chunked;        // once written; forwarded with chunked coding
+  int idempotent;     // The method may be repeated without harm
+  int done;           // Every request byte has been queued
+  int head_only;      // The request was a HEAD
+  int client_minor;   // HTTP minor version of the client
+  ConnectionMode mode; // Connection header for the client
+  int route;          // Index of the -P route
+  int tries;          // Connections it has been sent on
+  int status;         // Error to answer with ourselves, if not 0
+  uint64_t relayed;   // Response bytes written or queued for the client
+  DeferredRequest deferred;
+};
+
+// One connection to an upstream server. While a request is relayed it
+// belongs to the client connection ('client'); between requests it waits
+// in its server's pool. Both sockets are non-blocking, and the event loop
+// reports upstream readiness by resuming the client, so every byte moves
+// from the client's handlers: the request body sink and proxy_relay().
+struct UpstreamStruct {
+  int fd;
+  UpstreamState state;
+  int server;         // Index into the configured servers
+  Proxy *proxy;       // The worker's proxy state
+  Connection *client; // The connection being served, NULL when idle
+  int reused;         // Served a request before this one
+  int wrote;          // Request bytes were written on this connection
+  RelayRequest request;
+  // Response side
+  char *recv_buffer;  // RECV_BUFFER_SIZE bytes from the worker's pools
+  size_t recv_len;    // Bytes held
+  size_t recv_queued; // Bytes at the front queued on the client
+  BodyFraming framing;
+  uint64_t remaining; // BODY_LENGTH bytes still to come
+  HttpParser chunks;  // Finds the end of a BODY_CHUNKED body
+  int decode_chunks;  // Strip the chunk framing for an HTTP/1.0 client
+  int body_complete;  // The last body byte has been queued
+  int keep_alive;     // The upstream keeps the connection open
+  // Bodies move socket to pipe to socket with splice(); they are copied
+  // through recv_buffer instead if there is no pipe or splice() refuses
+  int pipe_fds[2];
+  size_t piped;       // Bytes in the pipe
+  int copy_only;      // splice() is not usable on this connection
+  uint64_t idle_since_ms;
+  // io_uring backend only
+  int polling;        // A multishot poll is armed
+  int retired;        // Closed while polling, freed with the last completion
+  Upstream *prev, *next; // Links in the pool, free or retired list
+};
+
+// A worker's view of one upstream server
+struct UpstreamServerStruct {
+  Upstream *idle;       // Open connections, most recently used first
+  Upstream *idle_tail;  // ... and the oldest
+  unsigned idle_count;
+  unsigned outstanding; // Requests relayed right now
+  unsigned failures;    // Consecutive failures
+  uint64_t ejected_until_ms; // Skipped by the balancer until then
+};
+
+// A worker's proxy state: its pools of upstream connections and what it
+// has learned about each server's health. Nothing is shared with the
+// other workers.
+struct ProxyStruct {
+  EventLoop *loop;
+  UpstreamServer servers[PROXY_MAX_UPSTREAMS];
+  unsigned cursors[PROXY_MAX_ROUTES]; // Where each route's tie-break starts
+  Upstream *free;    // Unused structs
+  size_t free_count;
+  Upstream *retired; // Closed, waiting for the io_uring backend to let go
+};
+
+// A function to parse "prefix=upstream[,upstream...]" (the -P option) and
+// register the proxy on 'prefix' and every path below it, for every method
+// but CONNECT and TRACE. An upstream is "host:port", "[v6 address]:port"
+// or "unix:/path"; names are resolved now. Returns 0 on success or -1 with
+// a message printed.
+int proxy_add_route(Router *router, const char *spec);
+
+// A function to set up a worker's empty proxy state
+void proxy_init(Proxy *proxy, EventLoop *loop);
+
+// A function to close every pooled connection and free the proxy state.
+// Every client connection must be closed already.
+void proxy_destroy(Proxy *proxy);
+
+// A function to close pooled connections that have idled for longer than
+// PROXY_IDLE_TIMEOUT_MS and free unused structs beyond POOL_MAX_FREE. Call
+// between batches of events, which may still name closed upstreams; cheap
+// enough for every wake-up.
+void proxy_expire_idle(Proxy *proxy);
+
+// A function to handle readiness of an upstream socket. Returns the client
+// connection to resume, or NULL if there is none (a pooled connection was
+// closed by its server, or the event is stale).
+Connection *proxy_upstream_ready(Upstream *up);
+
+// A function to move a proxied response forward once the client's queued
+// output has been written: the upstream's head is turned into the client's,
+// and the body is spliced or copied across. Returns one of the RELAY_*
+// codes, or -1 if the client connection has to be dropped.
+int proxy_relay(Connection *conn);
+
+// A function to let go of the upstream of a client connection that is
+// closing. An upstream in the middle of a response is closed.
+void proxy_detach(Connection *conn);
+
+// A function to handle the timeout of a client waiting for its upstream.
+// Returns 1 if the request was sent elsewhere or a 504 is to be answered,
+// so the client should be resumed, or 0 if it has to be closed.
+int proxy_expire(Connection *conn);
+
+// A function to free an upstream the io_uring backend held on to after it
+// was closed
+void proxy_release_retired(Upstream *up);
+
+#endif // PROXY_H
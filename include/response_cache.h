@@ -0,0 +1,75 @@
+#ifndef RESPONSE_CACHE_H
+#define RESPONSE_CACHE_H
+
+#include "config.h"     // For RESPONSE_CACHE_*
+#include "http_types.h" // For StringView
+#include <stddef.h>     // For size_t
+#include <stdint.h>     // For uint8_t, uint16_t, uint32_t, uint64_t
+
+typedef struct CachedResponseStruct CachedResponse;
+typedef struct ResponseCacheStruct ResponseCache;
+
+// What a cached response is found by: the request's method and target,
+// and the content coding negotiated from Accept-Encoding, the one request
+// header the cacheable handlers vary on
+typedef struct {
+  uint8_t method;    // HttpMethod
+  uint8_t coding;    // ContentCoding
+  StringView target;
+} ResponseKey;
+
+// A response exactly as its handler queued it, status line, headers and
+// body back to back, so a hit goes out as a single segment. Only its Date
+// line is brought up to date when it is served.
+struct CachedResponseStruct {
+  uint32_t hash;
+  uint64_t expires_ms; // Loop time it stops being served at
+  uint16_t status;
+  int referenced;      // Served since the clock hand last came by
+  size_t slot;         // Its place on the clock
+  char *response;      // Inside 'data', after the key
+  size_t len;          // Bytes of 'response'
+  size_t date_offset;  // Where its "Date: " line starts, 'len' if none
+  size_t key_len;      // Bytes of the key at the start of 'data'
+  size_t capacity;     // Bytes 'data' has room for
+  CachedResponse *hash_next;
+  char data[];         // Method, coding and target, then the response
+};
+
+// A bounded cache of handler responses, one per worker so it needs no
+// locking. Entries expire after the time to live their handler chose.
+// Once RESPONSE_CACHE_ENTRIES or RESPONSE_CACHE_BYTES is reached, the
+// CLOCK hand drops the first entry that has expired or was not served
+// since the hand last passed it.
+struct ResponseCacheStruct {
+  CachedResponse *buckets[RESPONSE_CACHE_BUCKETS];
+  CachedResponse *clock[RESPONSE_CACHE_ENTRIES];
+  size_t free_slots[RESPONSE_CACHE_ENTRIES]; // Empty places on the clock
+  size_t free_count;
+  size_t hand;
+  size_t count;
+  size_t bytes;    // Held by the entries, structs included
+  uint64_t now_ms; // The worker loop's clock, set by update_loop_time()
+};
+
+// A function to set up an empty cache
+void response_cache_init(ResponseCache *cache);
+
+// A function to drop every entry
+void response_cache_destroy(ResponseCache *cache);
+
+// A function to find the response cached for 'key'. Returns it if it has
+// not expired, else NULL.
+CachedResponse *response_cache_lookup(ResponseCache *cache,
+                                      const ResponseKey *key);
+
+// A function to make room for a 'len' byte response to 'key', replacing
+// the expired one if there is, for 'ttl_ms' from now. The caller copies
+// the response to 'response' and sets 'date_offset'. An expired entry
+// with room for the new response keeps its memory. Returns NULL if the
+// response is too large to cache or on failure.
+CachedResponse *response_cache_insert(ResponseCache *cache,
+                                      const ResponseKey *key, size_t len,
+                                      uint16_t status, unsigned ttl_ms);
+
+#endif // RESPONSE_CACHE_H
@@ -0,0 +1,108 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include "config.h"        // For ROUTER_MAX_PARAMS
+#include "connection.h"    // For Connection
+#include "http_response.h" // For ConnectionMode
+#include "http_types.h"    // For ClientRequest, HttpMethod, StringView
+#include <stddef.h>        // For size_t
+#include <stdint.h>        // For uint32_t
+
+typedef struct RouterStruct Router;
+typedef struct RouteStruct Route;
+typedef struct RouteNodeStruct RouteNode;
+typedef struct RouteMatchStruct RouteMatch;
+
+// A function to answer a routed request. Returns 0 once a response is
+// queued, or -1 if the connection has to be dropped.
+typedef int (*RouteHandler)(Connection *conn, const ClientRequest *C,
+                            const RouteMatch *match, ConnectionMode mode);
+
+// Method masks for router_add()
+#define ROUTE_METHOD(method) (1u << (method))
+#define ROUTE_GET ROUTE_METHOD(HTTP_METHOD_GET)
+#define ROUTE_HEAD ROUTE_METHOD(HTTP_METHOD_HEAD)
+#define ROUTE_POST ROUTE_METHOD(HTTP_METHOD_POST)
+
+// Handler flags for router_add()
+#define ROUTE_BODY 1u // The handler reads the request body
+
+// Everything registered for one path pattern
+struct RouteStruct {
+  char *pattern;
+  uint32_t methods; // ROUTE_METHOD() bits with a handler
+  RouteHandler handlers[HTTP_METHOD_COUNT];
+  unsigned flags[HTTP_METHOD_COUNT];
+  // "Allow: ...\r\nContent-Length: 0\r\n", the header lines of this path's
+  // 405 response
+  char *allow_headers;
+};
+
+// A node of the compiled radix trie. Literal children of a node are stored
+// next to each other, sorted by their first byte.
+struct RouteNodeStruct {
+  uint32_t label;       // Offset of the edge label in Router.labels
+  uint32_t label_len;
+  uint32_t first_child; // Index of the first literal child
+  uint32_t child_count;
+  int32_t param_child;  // Child matching one {param} segment, or -1
+  int32_t route;        // Route ending at this node, or -1
+  int32_t wildcard;     // Route of a trailing '*' at this node, or -1
+};
+
+// A route table. Patterns are registered with router_add() and compiled
+// once with router_compile(); after that the table is read-only, so every
+// worker matches against the same copy without locks. Exact paths are found
+// with a single probe of a perfect hash table, patterns by walking a radix
+// trie laid out in one array, so the cost of a match depends on the length
+// of the path, not on the number of routes.
+struct RouterStruct {
+  Route *routes;
+  size_t route_count, route_capacity;
+  // Perfect hash of the exact paths: slot -> route index + 1, 0 if empty
+  uint32_t *exact_slots;
+  uint32_t exact_mask;
+  uint32_t exact_seed;
+  RouteNode *nodes; // nodes[0] is the root
+  size_t node_count;
+  char *labels;
+};
+
+// The result of router_match()
+struct RouteMatchStruct {
+  const Route *route;   // NULL if no pattern matches the path
+  RouteHandler handler; // NULL if the path matches but not the method
+  unsigned flags;       // ROUTE_* flags of the handler
+  size_t param_count;
+  // Captured {param} segments in pattern order, followed by the rest of the
+  // path for a trailing '*'. Views into the request.
+  StringView params[ROUTER_MAX_PARAMS];
+};
+
+// A function to set up an empty router
+void router_init(Router *router);
+
+// A function to free the routes and the compiled tables
+void router_destroy(Router *router);
+
+// A function to register 'handler' for the methods in 'methods' on
+// 'pattern'. A pattern is an exact path ("/echo"), may contain whole
+// {name} segments ("/users/{id}/posts") and may end in '*' to match any
+// rest of the path ("/echo/*"). A GET handler also answers HEAD unless HEAD
+// has its own. Returns 0 on success or -1 for an invalid pattern, a
+// duplicate method or no memory.
+int router_add(Router *router, uint32_t methods, const char *pattern,
+               RouteHandler handler, unsigned flags);
+
+// A function to build the lookup tables from the registered routes.
+// Returns 0 on success or -1 if there is no memory.
+int router_compile(Router *router);
+
+// A function to find the route for a request path and method. Exact paths
+// win over patterns, literal segments over {param} segments and those over
+// a trailing '*'. Returns 1 if a handler was found, 0 otherwise; on 0
+// match->route still tells a 405 (path known) from a 404.
+int router_match(const Router *router, StringView path, HttpMethod method,
+                 RouteMatch *match);
+
+#endif // ROUTER_H
@@ -1,19 +1,59 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+#include "connection.h" // For Connection
 #include "http_types.h" // For ClientRequest, ServerResponse
-// #include <netinet/in.h> // For sockaddr_in (if not included elsewhere)
-#include <sys/types.h> // For socklen_t
+#include "options.h"    // For ServerOptions
+#include "proxy.h"      // For DeferredRequest
+#include <netinet/in.h> // For sockaddr_in
+#include <stdint.h>     // For uint64_t
+#include <sys/types.h>  // For socklen_t
 
-// A function to setup the server socket
-int setup_server_socket(int port);
+// Return codes of handle_accept() other than a valid client fd
+#define ACCEPT_SHUTDOWN -1    // keep_running was cleared
+#define ACCEPT_INTERRUPTED -2 // accept() was interrupted by a signal
+#define ACCEPT_FAILED -3      // Any other accept() error
+#define ACCEPT_WOULD_BLOCK -4 // No more pending connections
 
-// New function to handle accepting a client connection
-// Returns client_fd on success, -1 on signal interrupt, or other negative on
-// error
-int handle_accept(int server_fd);
+// A function to setup the server socket. With reuse_port set, the socket is
+// bound with SO_REUSEPORT so several listeners can share the port.
+int setup_server_socket(int port, int reuse_port);
 
-// A function to handle the client
-void handle_client(int client_fd, char *serverResponse[]);
+// A function to apply the per-client socket options to an accepted socket
+void configure_client_socket(int client_fd);
+
+// New function to handle accepting a client connection, whose address is
+// stored in 'client_addr' for admission control and the access log.
+// Returns a non-blocking client_fd on success or one of the ACCEPT_* codes
+int handle_accept(int server_fd, struct sockaddr_in *client_addr);
+
+// A function to register and compile the request routes, the proxied
+// prefixes of opts->proxy_routes included. Called once before the workers
+// start. Returns 0 on success or -1 on failure.
+int setup_routes(const ServerOptions *opts);
+
+// A function to free the route table after the workers have stopped
+void free_routes(void);
+
+// A function to handle the next request buffered on a client connection.
+// The response is queued on the connection's output.
+// Returns 1 if a request was handled, 0 if the buffered request is still
+// incomplete, or -1 if the connection has to be dropped.
+int handle_client(Connection *conn);
+
+// A function to serve a request that arrived on an HTTP/2 stream, given
+// the connection standing in for the stream. The request was parsed with
+// status 'parse_status' (an error is answered the way handle_client()
+// would), and with 'has_body' its body follows through conn->on_body.
+// Counted and logged like any other. Returns 0 on success or -1 if the
+// stream has to be reset.
+int handle_stream_request(Connection *conn, const ClientRequest *C,
+                          int parse_status, int has_body,
+                          uint64_t parse_start);
+
+// A function to count and log a proxied request once its response has been
+// relayed, 'bytes' of it. Does nothing if it was done already.
+void finish_deferred_request(Connection *conn, DeferredRequest *d,
+                             uint64_t bytes);
 
 #endif // SERVER_H
@@ -1,16 +1,41 @@
 #ifndef SIGNAL_HANDLER_H
 #define SIGNAL_HANDLER_H
 
-#include <signal.h> // For sig_atomic_t
+#include <signal.h> // For sig_atomic_t, sigset_t
 
 // Global atomic flag to control server loop
 // 'extern' because it's defined in sigal_handler.c
 extern volatile sig_atomic_t keep_running;
 
+// Set by the main thread to make the workers drain: stop accepting, finish
+// the requests in flight, close idle connections and end their loops
+extern volatile sig_atomic_t draining;
+
+// What the main thread was woken up for
+typedef enum {
+  SIGNAL_STOP,    // SIGINT: stop now, cutting off connections
+  SIGNAL_DRAIN,   // SIGTERM or SIGQUIT: drain, then stop
+  SIGNAL_UPGRADE, // SIGHUP or SIGUSR2: hand over to a new binary
+} ServerSignal;
+
 // Signal handler function
 void signal_handler(int signum);
 
 // Function to set up the signal handler
 int setup_signal_handler();
 
+// Function to block the shutdown signals in the calling thread. Threads
+// created afterwards inherit the mask, so only the thread that later calls
+// wait_for_signal() ever runs the handler. The previous mask is stored in
+// 'old_mask'.
+int block_shutdown_signals(sigset_t *old_mask);
+
+// Function to sleep until one of the signals above arrives and return it
+ServerSignal wait_for_signal(const sigset_t *old_mask);
+
+// Function to sleep at most 'timeout_ms' while the workers drain. A SIGINT
+// meanwhile clears keep_running, cutting the drain short; other signals
+// are ignored.
+void wait_for_stop(int timeout_ms);
+
 #endif // SIGNAL_HANDLER_H
@@ -0,0 +1,22 @@
+#ifndef STATIC_FILES_H
+#define STATIC_FILES_H
+
+#include "connection.h"    // For Connection
+#include "http_response.h" // For ConnectionMode
+#include "http_types.h"    // For ClientRequest
+
+// Results of serve_static_file()
+#define STATIC_NOT_FOUND 0 // No file for this route, try the other routes
+#define STATIC_SERVED 1    // A response has been queued
+
+// A function to answer a GET or HEAD request from the connection's file
+// cache. Handles If-None-Match / If-Modified-Since (304) and a single byte
+// Range (206, or 416 if it can not be satisfied). The body is sent with
+// sendfile(), or from a mapping for small hot files. Text files are sent
+// gzip or deflate compressed to clients that accept it, from a variant
+// compressed once and cached with the file.
+// Returns STATIC_SERVED, STATIC_NOT_FOUND, or -1 on failure.
+int serve_static_file(Connection *conn, const ClientRequest *C,
+                      ConnectionMode mode);
+
+#endif // STATIC_FILES_H
@@ -0,0 +1,51 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include "config.h" // For TIMER_WHEEL_SLOTS
+#include <stdint.h> // For uint64_t
+#include <stddef.h> // For size_t
+
+typedef struct TimerStruct Timer;
+typedef struct TimerWheelStruct TimerWheel;
+
+// A timer embedded in whatever it times. Times are in wheel ticks.
+struct TimerStruct {
+  uint64_t deadline;  // Tick the timer is due at
+  uint64_t slot_tick; // Tick of the slot it is linked into, 0 if unlinked
+  Timer *prev, *next;
+};
+
+// A hashed timing wheel: one slot per tick for the next TIMER_WHEEL_SLOTS
+// ticks, each a list of the timers due at that tick. Arming, re-arming and
+// cancelling are O(1). Re-arming to a later deadline, which is what
+// activity on a connection does, leaves the timer where it is and only
+// stores the new deadline; when its slot comes up the timer is moved on
+// instead of expiring. A deadline beyond the wheel's span waits in the
+// farthest slot and is moved on the same way. A bitmap of the non-empty
+// slots finds the next due tick without walking empty slots.
+struct TimerWheelStruct {
+  uint64_t now;  // Every slot up to this tick has been processed
+  size_t count;  // Timers linked
+  Timer *slots[TIMER_WHEEL_SLOTS];
+  uint64_t occupied[TIMER_WHEEL_SLOTS / 64]; // Bit per non-empty slot
+};
+
+// A function to set up an empty wheel whose clock reads 'now'
+void timer_wheel_init(TimerWheel *wheel, uint64_t now);
+
+// A function to (re)arm 't' to expire at tick 'deadline'
+void timer_wheel_arm(TimerWheel *wheel, Timer *t, uint64_t deadline);
+
+// A function to disarm 't' if it is armed
+void timer_wheel_cancel(TimerWheel *wheel, Timer *t);
+
+// A function to move the wheel's clock to 'now' and return every timer that
+// expired on the way, disarmed and chained through 'next', oldest first.
+// Returns NULL if none did.
+Timer *timer_wheel_advance(TimerWheel *wheel, uint64_t now);
+
+// A function to return the tick of the earliest non-empty slot, or 0 if no
+// timer is armed. The timers there may turn out to have been re-armed.
+uint64_t timer_wheel_next(const TimerWheel *wheel);
+
+#endif // TIMER_WHEEL_H
@@ -0,0 +1,35 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include "worker.h" // For Worker
+
+// A binary upgrade starts the binary found at this process's path again,
+// with the same arguments. The new process inherits every worker's
+// listening socket (their numbers are passed in UPGRADE_LISTEN_FDS_ENV, one
+// per worker index and -1 for a worker without one), so connections keep
+// being queued and accepted by one process or the other and none is
+// refused. Once its workers are running it writes to the pipe named in
+// UPGRADE_READY_FD_ENV, and the old process drains and exits.
+#define UPGRADE_LISTEN_FDS_ENV "HTTPC_LISTEN_FDS"
+#define UPGRADE_READY_FD_ENV "HTTPC_READY_FD"
+
+// A function to remember how this process was started and take over the
+// listening sockets a parent handed down, if any. Call before the workers
+// start. Returns 0 on success or -1 if the path can not be resolved.
+int upgrade_init(char *argv[]);
+
+// A function to return the inherited listening socket for worker 'index',
+// or -1 if there is none and the worker binds its own
+int upgrade_listener(int index);
+
+// A function to tell the parent, if there is one, that this process is
+// serving now. Inherited sockets no worker took are closed.
+void upgrade_ready(void);
+
+// A function to start the new binary with the workers' listening sockets
+// and wait up to UPGRADE_TIMEOUT_MS until it is serving. Returns 0 once it
+// is, after which this process should drain, or -1 if it could not be
+// started or gave up, in which case this process simply keeps serving.
+int upgrade_binary(const Worker *workers, int count);
+
+#endif // UPGRADE_H
@@ -0,0 +1,92 @@
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h> // For io_uring_sqe, io_uring_cqe, IORING_*
+#include <stddef.h>         // For size_t
+#include <stdint.h>         // For uint8_t, uint16_t
+
+typedef struct UringStruct Uring;
+typedef struct UringBuffersStruct UringBuffers;
+
+// An io_uring instance driven through the raw system calls. The submission
+// and completion rings are mapped into the process and shared with the
+// kernel; SQEs are filled in place and handed over in batches.
+struct UringStruct {
+  int fd;
+  unsigned flags;    // IORING_SETUP_* the ring was created with
+  unsigned features; // IORING_FEAT_* the kernel reported
+  // Submission queue
+  unsigned *sq_head, *sq_tail, *sq_flags;
+  unsigned sq_mask, sq_entries;
+  unsigned sqe_tail;      // Next SQE to hand out
+  unsigned sqe_published; // SQEs made visible to the kernel so far
+  struct io_uring_sqe *sqes;
+  // Completion queue
+  unsigned *cq_head, *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+  void *sq_map, *cq_map;
+  size_t sq_map_size, cq_map_size, sqes_size;
+};
+
+// A ring of provided buffers. The kernel picks one for every completed
+// receive, so idle connections pin no receive memory.
+struct UringBuffersStruct {
+  struct io_uring_buf_ring *ring; // Shared with the kernel
+  size_t ring_size;
+  char *memory;   // 'count' buffers of 'size' bytes
+  unsigned count; // A power of two
+  unsigned size;
+  uint16_t group; // Buffer group id used by IOSQE_BUFFER_SELECT
+  uint16_t tail;  // Local tail, published by uring_buffers_commit()
+};
+
+// A function to create a ring with 'entries' submission slots. With
+// 'sqpoll' a kernel thread polls the submission queue; otherwise the ring
+// runs its completion work only when the owning thread waits for it.
+// Returns 0 on success or a negative errno.
+int uring_init(Uring *ring, unsigned entries, int sqpoll);
+
+// A function to tear the ring down
+void uring_destroy(Uring *ring);
+
+// A function to check that the kernel implements every IORING_OP_* in 'ops'.
+// Returns 1 if it does, 0 otherwise.
+int uring_supports(const Uring *ring, const uint8_t *ops, size_t count);
+
+// A function to return a cleared SQE to fill in. A full submission queue is
+// submitted first. Returns NULL if no slot could be freed.
+struct io_uring_sqe *uring_get_sqe(Uring *ring);
+
+// A function to submit every filled SQE with one system call and wait until
+// at least 'wait_nr' completions are ready or 'timeout_ms' passed.
+// Returns 0 on success (including a timeout) or a negative errno.
+int uring_submit_and_wait(Uring *ring, unsigned wait_nr, int timeout_ms);
+
+// A function to return the next unread completion, or NULL
+struct io_uring_cqe *uring_peek_cqe(Uring *ring);
+
+// A function to mark the completion returned by uring_peek_cqe() as read
+void uring_cqe_seen(Uring *ring);
+
+// A function to register 'count' buffers of 'size' bytes as buffer group
+// 'group'. Returns 0 on success or a negative errno.
+int uring_buffers_init(Uring *ring, UringBuffers *buffers, uint16_t group,
+                       unsigned count, unsigned size);
+
+// A function to unregister and free the buffers
+void uring_buffers_destroy(Uring *ring, UringBuffers *buffers);
+
+// A function to return the start of buffer 'id'
+static inline char *uring_buffer(const UringBuffers *buffers, uint16_t id) {
+  return buffers->memory + (size_t)id * buffers->size;
+}
+
+// A function to hand buffer 'id' back; the kernel sees it after the next
+// uring_buffers_commit()
+void uring_buffers_recycle(UringBuffers *buffers, uint16_t id);
+
+// A function to publish the recycled buffers to the kernel
+void uring_buffers_commit(UringBuffers *buffers);
+
+#endif // URING_H
@@ -0,0 +1,36 @@
+#ifndef URING_LOOP_H
+#define URING_LOOP_H
+
+#include "connection.h" // For Connection
+#include "event_loop.h" // For EventLoop, UringLoop
+#include "proxy.h"      // For Upstream
+
+// Returned by run_uring_loop() when the kernel lacks what the backend needs
+#define URING_UNSUPPORTED 1
+
+// A function to serve the loop's connections with io_uring: a multishot
+// accept on the listener, a multishot receive per connection into a ring of
+// provided buffers, and sendmsg for the output. Every operation for one
+// wake-up is submitted with a single io_uring_enter(). With 'sqpoll' a
+// kernel thread picks submissions up without any system call.
+// Returns 0 on a clean shutdown, -1 on failure, or URING_UNSUPPORTED before
+// anything was accepted, so the caller can fall back to epoll.
+int run_uring_loop(EventLoop *loop, int sqpoll);
+
+// A function to release a connection closed by the loop. Its operations
+// are cancelled and the memory is freed with the last completion.
+void uring_close_connection(UringLoop *uring, Connection *conn);
+
+// A function to drive a connection outside of its own completions, the
+// way one of them would. Returns -1 if it has to be closed, 0 otherwise.
+int uring_resume_connection(UringLoop *uring, Connection *conn);
+
+// A function to poll a proxy upstream socket for readiness in both
+// directions with one multishot poll. Returns 0 on success or -1.
+int uring_watch_upstream(UringLoop *uring, Upstream *up);
+
+// A function to cancel the poll of an upstream socket about to be closed.
+// The Upstream stays retired until the poll's last completion.
+void uring_forget_upstream(UringLoop *uring, Upstream *up);
+
+#endif // URING_LOOP_H
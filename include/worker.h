@@ -0,0 +1,43 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include "options.h" // For ServerOptions
+#include <pthread.h> // For pthread_t
+
+typedef struct WorkerStruct Worker;
+
+// One event loop thread. Every worker binds its own SO_REUSEPORT listener,
+// so the kernel spreads incoming connections across workers and the accept
+// path shares no lock.
+struct WorkerStruct {
+  int id;
+  int cpu;       // CPU the thread is pinned to, or -1 if not pinned
+  int server_fd; // This worker's own listening socket
+  int wake_fd;   // eventfd written to interrupt the event loop on shutdown
+  int started;   // Set once the thread has been created
+  int finished;  // Set by the thread once its loop has ended
+  pthread_t thread;
+  const ServerOptions *opts;
+};
+
+// A function to return the worker count to use when none was configured:
+// one per online CPU.
+int default_worker_count(void);
+
+// A function to bind a listener per worker and start the worker threads.
+// Returns 0 on success or -1 on failure, in which case any workers already
+// started have been stopped again.
+int start_workers(Worker *workers, int count, const ServerOptions *opts);
+
+// A function to drain every worker: set 'draining', wake the workers and
+// wait until each has answered the requests in flight and ended its loop,
+// at most DRAIN_TIMEOUT_MS. A SIGINT meanwhile stops them at once. The
+// workers still have to be stopped afterwards.
+void drain_workers(Worker *workers, int count);
+
+// A function to wake every worker, wait for it to finish and release its
+// sockets. keep_running must already be cleared, or every worker have
+// finished draining.
+void stop_workers(Worker *workers, int count);
+
+#endif // WORKER_H
@@ -0,0 +1,263 @@
+#include "../include/access_log.h"
+#include "../include/http_types.h" // For HttpMethod, httpMethodName
+
+#include <arpa/inet.h> // For inet_ntop, INET_ADDRSTRLEN
+#include <errno.h>     // For errno, EINTR
+#include <pthread.h>   // For pthread_create, pthread_join
+#include <stdio.h>     // For fprintf, snprintf
+#include <stdlib.h>    // For aligned_alloc, free
+#include <string.h>    // For memset, strerror
+#include <time.h>      // For clock_gettime, nanosleep, gmtime_r, strftime
+#include <unistd.h>    // For write, STDOUT_FILENO
+
+// Longest line a record formats to, the target escaped at 6 bytes per byte
+#define LINE_MAX_SIZE (ACCESS_LOG_TARGET_MAX * 6 + 256)
+
+LogLevel access_log_level = LOG_LEVEL_OFF;
+
+// The log thread and everything only it touches
+static struct {
+  LogFormat format;
+  AccessLogRing *rings;
+  int ring_count;
+  int started;
+  int stopping; // Set by access_log_stop(), read by the thread
+  pthread_t thread;
+  char out[ACCESS_LOG_BATCH_SIZE];
+  size_t out_len;
+  // The time text only changes once a second, so it is formatted once per
+  // second rather than per record
+  time_t second;
+  char time_text[32];
+} logger;
+
+// The coarse clock is read from the vDSO without touching the hardware
+// timer, a fifth of the cost of CLOCK_REALTIME. It advances once per
+// scheduler tick, which is finer than a log line needs.
+uint64_t access_log_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void write_out(void) {
+  size_t done = 0;
+  while (done < logger.out_len) {
+    ssize_t n = write(STDOUT_FILENO, logger.out + done, logger.out_len - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break; // Nowhere to log to, the batch is lost
+    done += (size_t)n;
+  }
+  logger.out_len = 0;
+}
+
+static const char *time_text(uint64_t time_ns) {
+  time_t second = (time_t)(time_ns / 1000000000u);
+  if (second != logger.second || logger.time_text[0] == '\0') {
+    struct tm tm;
+    gmtime_r(&second, &tm);
+    strftime(logger.time_text, sizeof(logger.time_text),
+             logger.format == LOG_FORMAT_JSON ? "%Y-%m-%dT%H:%M:%S"
+                                              : "%d/%b/%Y:%H:%M:%S +0000",
+             &tm);
+    logger.second = second;
+  }
+  return logger.time_text;
+}
+
+// Copy the request target, escaping whatever could break the line: '"',
+// '\' and bytes outside printable ASCII
+static size_t escape_target(const AccessRecord *r, char *dst) {
+  static const char hex[] = "0123456789abcdef";
+  size_t len = 0;
+  for (size_t i = 0; i < r->target_len; ++i) {
+    unsigned char c = (unsigned char)r->target[i];
+    if (c >= 0x20 && c < 0x7f && c != '"' && c != '\\') {
+      dst[len++] = (char)c;
+    } else if (logger.format == LOG_FORMAT_JSON) {
+      memcpy(dst + len, "\\u00", 4);
+      dst[len + 4] = hex[c >> 4];
+      dst[len + 5] = hex[c & 15];
+      len += 6;
+    } else {
+      dst[len++] = '\\';
+      dst[len++] = 'x';
+      dst[len++] = hex[c >> 4];
+      dst[len++] = hex[c & 15];
+    }
+  }
+  dst[len] = '\0';
+  return len;
+}
+
+static void format_record(const AccessRecord *r) {
+  char *line = logger.out + logger.out_len;
+  char peer[INET_ADDRSTRLEN] = "-";
+  inet_ntop(AF_INET, &r->peer_addr, peer, sizeof(peer));
+  const char *when = time_text(r->time_ns);
+  char target[ACCESS_LOG_TARGET_MAX * 6 + 1];
+  escape_target(r, target);
+  const char *method = httpMethodName((HttpMethod)r->method);
+  int bad = r->version == 255;
+  int n;
+
+  if (logger.format == LOG_FORMAT_JSON) {
+    unsigned ms = (unsigned)(r->time_ns / 1000000u % 1000u);
+    if (r->kind == ACCESS_RECORD_REQUEST && bad) {
+      n = snprintf(line, LINE_MAX_SIZE,
+                   "{\"time\":\"%s.%03uZ\",\"remote\":\"%s:%u\","
+                   "\"event\":\"request\",\"status\":%u,\"bytes\":%llu}\n",
+                   when, ms, peer, r->peer_port, r->status,
+                   (unsigned long long)r->bytes);
+    } else if (r->kind == ACCESS_RECORD_REQUEST) {
+      n = snprintf(line, LINE_MAX_SIZE,
+                   "{\"time\":\"%s.%03uZ\",\"remote\":\"%s:%u\","
+                   "\"event\":\"request\",\"method\":\"%s\","
+                   "\"target\":\"%s\",\"version\":\"HTTP/%u.%u\","
+                   "\"status\":%u,\"bytes\":%llu}\n",
+                   when, ms, peer, r->peer_port, method, target,
+                   r->version / 10, r->version % 10, r->status,
+                   (unsigned long long)r->bytes);
+    } else if (r->kind == ACCESS_RECORD_RESET) {
+      n = snprintf(line, LINE_MAX_SIZE,
+                   "{\"time\":\"%s.%03uZ\",\"remote\":\"%s:%u\","
+                   "\"event\":\"reset\",\"method\":\"%s\","
+                   "\"target\":\"%s\",\"version\":\"HTTP/%u.%u\","
+                   "\"error_code\":%u,\"bytes\":%llu}\n",
+                   when, ms, peer, r->peer_port, method, target,
+                   r->version / 10, r->version % 10, r->status,
+                   (unsigned long long)r->bytes);
+    } else {
+      n = snprintf(line, LINE_MAX_SIZE,
+                   "{\"time\":\"%s.%03uZ\",\"remote\":\"%s:%u\","
+                   "\"event\":\"%s\",\"requests\":%llu}\n",
+                   when, ms, peer, r->peer_port,
+                   r->kind == ACCESS_RECORD_CONNECT ? "connect"
+                                                    : "disconnect",
+                   (unsigned long long)r->bytes);
+    }
+  } else if (r->kind == ACCESS_RECORD_REQUEST && bad) {
+    n = snprintf(line, LINE_MAX_SIZE, "%s - - [%s] \"-\" %u %llu\n", peer,
+                 when, r->status, (unsigned long long)r->bytes);
+  } else if (r->kind == ACCESS_RECORD_REQUEST) {
+    n = snprintf(line, LINE_MAX_SIZE,
+                 "%s - - [%s] \"%s %s HTTP/%u.%u\" %u %llu\n", peer, when,
+                 method, target, r->version / 10, r->version % 10,
+                 r->status, (unsigned long long)r->bytes);
+  } else if (r->kind == ACCESS_RECORD_RESET) {
+    // No status was sent: '-' in its place, then the RST_STREAM error code
+    n = snprintf(line, LINE_MAX_SIZE,
+                 "%s - - [%s] \"%s %s HTTP/%u.%u\" - %llu reset %u\n", peer,
+                 when, method, target, r->version / 10, r->version % 10,
+                 (unsigned long long)r->bytes, r->status);
+  } else if (r->kind == ACCESS_RECORD_CONNECT) {
+    n = snprintf(line, LINE_MAX_SIZE, "%s:%u - - [%s] connected\n", peer,
+                 r->peer_port, when);
+  } else {
+    n = snprintf(line, LINE_MAX_SIZE,
+                 "%s:%u - - [%s] disconnected after %llu requests\n", peer,
+                 r->peer_port, when, (unsigned long long)r->bytes);
+  }
+  if (n > 0)
+    logger.out_len += (size_t)n < LINE_MAX_SIZE ? (size_t)n : LINE_MAX_SIZE - 1;
+}
+
+// Format every record published so far. Returns the number of records.
+static size_t drain_rings(void) {
+  size_t drained = 0;
+  for (int i = 0; i < logger.ring_count; ++i) {
+    AccessLogRing *ring = &logger.rings[i];
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    for (uint32_t head = ring->head; head != tail; ++head) {
+      if (sizeof(logger.out) - logger.out_len < LINE_MAX_SIZE)
+        write_out();
+      format_record(&ring->records[head & ring->mask]);
+      // Hand the slot back straight away, so a worker that filled its ring
+      // can go on while the rest is formatted
+      __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+      drained++;
+    }
+    uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    if (dropped != ring->dropped_reported) {
+      fprintf(stderr, "Access log of worker %d dropped %llu records.\n", i,
+              (unsigned long long)(dropped - ring->dropped_reported));
+      ring->dropped_reported = dropped;
+    }
+  }
+  return drained;
+}
+
+// Records are picked up by polling: waking the thread would cost every
+// worker a system call per record, the very thing the rings avoid. An idle
+// thread sleeps ACCESS_LOG_IDLE_MS between looks, which also bounds how long
+// a line waits before it is written.
+static void *log_thread(void *arg) {
+  (void)arg;
+  const struct timespec idle = {0, ACCESS_LOG_IDLE_MS * 1000000L};
+  for (;;) {
+    // Read before draining: once the workers are gone and a drain finds
+    // nothing, nothing can follow
+    int stopping = __atomic_load_n(&logger.stopping, __ATOMIC_ACQUIRE);
+    if (drain_rings() > 0)
+      continue;
+    write_out();
+    if (stopping)
+      break;
+    nanosleep(&idle, NULL);
+  }
+  return NULL;
+}
+
+int access_log_start(LogLevel level, LogFormat format, int ring_count) {
+  access_log_level = level;
+  if (level == LOG_LEVEL_OFF)
+    return 0;
+  logger.format = format;
+  logger.ring_count = ring_count;
+  size_t rings_size = (size_t)ring_count * sizeof(AccessLogRing);
+  logger.rings = aligned_alloc(CACHE_LINE_SIZE, rings_size);
+  if (!logger.rings) {
+    fprintf(stderr, "Failed to allocate the access log rings.\n");
+    access_log_level = LOG_LEVEL_OFF;
+    return -1;
+  }
+  memset(logger.rings, 0, rings_size);
+  for (int i = 0; i < ring_count; ++i) {
+    AccessLogRing *ring = &logger.rings[i];
+    ring->records = aligned_alloc(CACHE_LINE_SIZE,
+                                  ACCESS_LOG_RING_SIZE * sizeof(AccessRecord));
+    ring->mask = ACCESS_LOG_RING_SIZE - 1;
+    if (!ring->records) {
+      fprintf(stderr, "Failed to allocate the access log rings.\n");
+      access_log_stop();
+      return -1;
+    }
+  }
+  int rc = pthread_create(&logger.thread, NULL, log_thread, NULL);
+  if (rc != 0) {
+    fprintf(stderr, "pthread_create failed for the access log: %s\n",
+            strerror(rc));
+    access_log_stop();
+    return -1;
+  }
+  logger.started = 1;
+  return 0;
+}
+
+AccessLogRing *access_log_ring(int index) {
+  return logger.rings ? &logger.rings[index] : NULL;
+}
+
+void access_log_stop(void) {
+  if (logger.started) {
+    __atomic_store_n(&logger.stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(logger.thread, NULL);
+  }
+  for (int i = 0; logger.rings && i < logger.ring_count; ++i)
+    free(logger.rings[i].records);
+  free(logger.rings);
+  memset(&logger, 0, sizeof(logger));
+  access_log_level = LOG_LEVEL_OFF;
+}
@@ -0,0 +1,151 @@
+#include "../include/admission.h"
+#include "../include/config.h"        // For ADMISSION_*, CACHE_LINE_SIZE
+#include "../include/memory_budget.h" // For memory_budget_shedding
+
+#include <stddef.h> // For size_t, NULL
+
+// A bucket's state word packs the milli-tokens it held at its last update
+// above the millisecond of that update. State 0 is a full bucket, which is
+// what a slot nobody has used yet holds.
+#define STAMP_BITS 40 // Monotonic milliseconds, wrapping after 34 years
+#define STAMP_MASK ((1ull << STAMP_BITS) - 1)
+#define TOKEN 1000u   // Milli-tokens a connection costs
+
+// Keys are the IPv4 address with a bit above it set, so 0 marks a slot
+// that was never claimed
+#define KEY_USED (1ull << 32)
+
+_Static_assert((ADMISSION_TABLE_SIZE & (ADMISSION_TABLE_SIZE - 1)) == 0,
+               "ADMISSION_TABLE_SIZE is a power of two");
+_Static_assert((uint64_t)ADMISSION_MAX_RATE * TOKEN < (1ull << (64 -
+                                                               STAMP_BITS)),
+               "a full bucket fits next to its stamp");
+
+typedef struct {
+  uint64_t key;   // Client address | KEY_USED, 0 while unclaimed
+  uint64_t state; // Milli-tokens << STAMP_BITS | stamp
+} AdmissionSlot;
+
+// Shared by every worker and only ever updated with atomic operations. A
+// slot, once claimed, is never emptied again: a client whose bucket has
+// refilled completely is no different from one never seen, so its slot is
+// handed to the next client that needs one. A search can therefore stop at
+// the first unclaimed slot.
+static _Alignas(CACHE_LINE_SIZE) AdmissionSlot table[ADMISSION_TABLE_SIZE];
+
+static uint64_t refill_rate;     // Milli-tokens per millisecond, 0 if off
+static uint64_t capacity;        // Milli-tokens of a full bucket
+static uint64_t max_connections; // 0 if unlimited
+
+// Connections admitted and not yet released, over every worker
+static struct {
+  _Alignas(CACHE_LINE_SIZE) uint64_t count;
+} open_connections;
+
+void admission_init(const ServerOptions *opts) {
+  refill_rate = (uint64_t)opts->client_rate;
+  capacity = (uint64_t)opts->client_burst * TOKEN;
+  max_connections = (uint64_t)opts->max_connections;
+  memory_budget_init((size_t)opts->memory_budget_mb * 1024 * 1024);
+}
+
+int admission_by_address(void) { return refill_rate != 0; }
+
+// The milli-tokens in a bucket at 'now'. Workers read the clock at
+// different moments, so a stamp may lie slightly ahead of 'now'.
+static uint64_t bucket_level(uint64_t state, uint64_t now) {
+  if (state == 0)
+    return capacity;
+  uint64_t stamp = state & STAMP_MASK;
+  uint64_t elapsed = now > stamp ? now - stamp : 0;
+  uint64_t level = (state >> STAMP_BITS) + elapsed * refill_rate;
+  return level < capacity ? level : capacity;
+}
+
+// Find the slot of 'addr', claiming one if it has none: the first unclaimed
+// slot on its probe sequence or, failing that, the first whose bucket is
+// full again. Returns NULL if there is neither, or another worker took the
+// slot first for another address.
+static AdmissionSlot *find_bucket(uint32_t addr, uint64_t now) {
+  uint64_t key = (uint64_t)addr | KEY_USED;
+  uint32_t hash = addr * 2654435761u; // Knuth's multiplicative hash
+  size_t index = (hash ^ (hash >> 16)) & (ADMISSION_TABLE_SIZE - 1);
+  AdmissionSlot *spare = NULL;
+  uint64_t spare_key = 0;
+  for (int probe = 0; probe < ADMISSION_MAX_PROBES; ++probe) {
+    AdmissionSlot *slot = &table[(index + probe) & (ADMISSION_TABLE_SIZE - 1)];
+    uint64_t seen = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+    if (seen == key)
+      return slot;
+    if (seen == 0) {
+      if (!spare) {
+        spare = slot;
+        spare_key = 0;
+      }
+      break;
+    }
+    if (!spare &&
+        bucket_level(__atomic_load_n(&slot->state, __ATOMIC_RELAXED), now) ==
+            capacity) {
+      spare = slot;
+      spare_key = seen;
+    }
+  }
+  if (!spare)
+    return NULL;
+  // The state is left as it is: a full bucket, whoever it belonged to. A
+  // worker still taking a token for the previous owner costs the new one
+  // that token at most.
+  uint64_t expected = spare_key;
+  if (__atomic_compare_exchange_n(&spare->key, &expected, key, 0,
+                                  __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ||
+      expected == key)
+    return spare;
+  return NULL;
+}
+
+// Take a token from the bucket, unless it has none left
+static int take_token(AdmissionSlot *slot, uint64_t now) {
+  uint64_t state = __atomic_load_n(&slot->state, __ATOMIC_RELAXED);
+  for (;;) {
+    uint64_t level = bucket_level(state, now);
+    if (level < TOKEN)
+      return 0;
+    uint64_t next = (level - TOKEN) << STAMP_BITS | (now & STAMP_MASK);
+    if (__atomic_compare_exchange_n(&slot->state, &state, next, 1,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      return 1;
+  }
+}
+
+AdmissionResult admission_check(uint32_t addr, uint64_t now_ms) {
+  if (memory_budget_shedding())
+    return ADMIT_SHEDDING;
+  // A connection is counted before its bucket is looked at, so an
+  // overloaded server does not use up the tokens of the clients it turns
+  // away
+  if (max_connections &&
+      __atomic_add_fetch(&open_connections.count, 1, __ATOMIC_RELAXED) >
+          max_connections) {
+    __atomic_sub_fetch(&open_connections.count, 1, __ATOMIC_RELAXED);
+    return ADMIT_OVERLOADED;
+  }
+  if (!refill_rate)
+    return ADMIT_OK;
+  // Peers without an IPv4 address would all share the bucket of address 0
+  if (addr == 0)
+    return ADMIT_UNTRACKED;
+  uint64_t now = now_ms & STAMP_MASK;
+  AdmissionSlot *slot = find_bucket(addr, now);
+  if (!slot)
+    return ADMIT_UNTRACKED; // Better to admit than to turn away at random
+  if (take_token(slot, now))
+    return ADMIT_OK;
+  admission_release();
+  return ADMIT_RATE_LIMITED;
+}
+
+void admission_release(void) {
+  if (max_connections)
+    __atomic_sub_fetch(&open_connections.count, 1, __ATOMIC_RELAXED);
+}
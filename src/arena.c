@@ -0,0 +1,53 @@
+#include "../include/arena.h"
+
+#include <stddef.h> // For max_align_t
+#include <string.h> // For memcpy
+
+// Every block starts with a link to the block used before it, so a reset can
+// walk back through all of them.
+#define ARENA_ALIGN _Alignof(max_align_t)
+#define ARENA_HEADER                                                           \
+  ((sizeof(void *) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+void arena_init(Arena *arena, BufferPool *pool) {
+  arena->pool = pool;
+  arena->block = NULL;
+  arena->used = 0;
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+  size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  size_t capacity = arena->pool->buffer_size;
+  if (size > capacity - ARENA_HEADER)
+    return NULL;
+
+  if (!arena->block || arena->used + size > capacity) {
+    char *block = buffer_pool_acquire(arena->pool);
+    if (!block)
+      return NULL;
+    *(char **)block = arena->block;
+    arena->block = block;
+    arena->used = ARENA_HEADER;
+  }
+  void *ptr = arena->block + arena->used;
+  arena->used += size;
+  return ptr;
+}
+
+char *arena_strndup(Arena *arena, const char *s, size_t len) {
+  char *copy = arena_alloc(arena, len + 1);
+  if (!copy)
+    return NULL;
+  memcpy(copy, s, len);
+  copy[len] = '\0';
+  return copy;
+}
+
+void arena_reset(Arena *arena) {
+  while (arena->block) {
+    char *previous = *(char **)arena->block;
+    buffer_pool_release(arena->pool, arena->block);
+    arena->block = previous;
+  }
+  arena->used = 0;
+}
@@ -0,0 +1,62 @@
+#include "../include/buffer_pool.h"
+#include "../include/memory_budget.h" // For memory_budget_*
+
+#include <stdio.h>  // For fprintf, perror
+#include <stdlib.h> // For malloc, free
+
+void buffer_pool_init(BufferPool *pool, size_t buffer_size, size_t max_free) {
+  pool->buffer_size = buffer_size;
+  pool->free_list = NULL;
+  pool->free_count = 0;
+  pool->max_free = max_free;
+  pool->heap_allocs = 0;
+  pool->reuses = 0;
+}
+
+void *buffer_pool_acquire(BufferPool *pool) {
+  void *buffer = pool->free_list;
+  if (buffer) {
+    pool->free_list = *(void **)buffer;
+    pool->free_count--;
+    pool->reuses++;
+    return buffer;
+  }
+  if (!memory_budget_reserve(pool->buffer_size)) {
+    fprintf(stderr, "Memory budget exhausted, no %zu byte buffer.\n",
+            pool->buffer_size);
+    return NULL;
+  }
+  buffer = malloc(pool->buffer_size);
+  if (!buffer) {
+    perror("malloc failed in buffer_pool_acquire");
+    memory_budget_release(pool->buffer_size);
+    return NULL;
+  }
+  pool->heap_allocs++;
+  return buffer;
+}
+
+void buffer_pool_release(BufferPool *pool, void *buffer) {
+  if (!buffer)
+    return;
+  // Keep idle memory bounded after a load spike, and give it all back
+  // while the memory budget is running out
+  if (pool->free_count >= pool->max_free || memory_budget_shedding()) {
+    free(buffer);
+    memory_budget_release(pool->buffer_size);
+    return;
+  }
+  *(void **)buffer = pool->free_list;
+  pool->free_list = buffer;
+  pool->free_count++;
+}
+
+void buffer_pool_destroy(BufferPool *pool) {
+  while (pool->free_list) {
+    void *next = *(void **)pool->free_list;
+    free(pool->free_list);
+    memory_budget_release(pool->buffer_size);
+    pool->free_list = next;
+  }
+  pool->free_count = 0;
+}
@@ -0,0 +1,130 @@
+#include "../include/compress.h"
+
+#include <limits.h> // For UINT_MAX
+#include <stdint.h> // For uintptr_t
+#include <string.h> // For memset
+
+// windowBits selecting the wrapper: 15 plus 16 asks zlib for gzip
+static const int window_bits[CONTENT_CODINGS] = {
+    [CODING_GZIP] = 15 + 16,
+    [CODING_DEFLATE] = 15,
+};
+
+static const char *const coding_names[CONTENT_CODINGS] = {
+    [CODING_IDENTITY] = "identity",
+    [CODING_GZIP] = "gzip",
+    [CODING_DEFLATE] = "deflate",
+};
+
+void compressor_init(Compressor *z) { memset(z, 0, sizeof(*z)); }
+
+void compressor_destroy(Compressor *z) {
+  for (int c = 0; c < CONTENT_CODINGS; ++c) {
+    if (z->ready[c])
+      deflateEnd(&z->streams[c]);
+    z->ready[c] = 0;
+  }
+}
+
+const char *content_coding_name(ContentCoding coding) {
+  return coding_names[coding];
+}
+
+// Quality of one Accept-Encoding element in thousandths: 1000 without a
+// q parameter, 0 for "q=0" however many zeros follow
+static int element_quality(StringView params) {
+  for (size_t i = 0; i + 1 < params.len; ++i) {
+    if ((params.ptr[i] != 'q' && params.ptr[i] != 'Q') ||
+        params.ptr[i + 1] != '=' ||
+        (i > 0 && params.ptr[i - 1] != ';' && params.ptr[i - 1] != ' ' &&
+         params.ptr[i - 1] != '\t'))
+      continue;
+    const char *p = params.ptr + i + 2;
+    const char *end = params.ptr + params.len;
+    if (p < end && *p == '1')
+      return 1000;
+    int q = 0, scale = 100;
+    if (p < end && *p == '0')
+      p++;
+    if (p < end && *p == '.') {
+      for (p++; p < end && *p >= '0' && *p <= '9' && scale > 0; ++p) {
+        q += (*p - '0') * scale;
+        scale /= 10;
+      }
+    }
+    return q;
+  }
+  return 1000;
+}
+
+ContentCoding compress_negotiate(const ClientRequest *C) {
+  // -1 while a coding is not listed
+  int gzip = -1, deflate = -1, any = -1;
+  for (size_t h = 0; h < C->header_count; ++h) {
+    if (!viewEqualsIgnoreCase(C->headers[h].name, "Accept-Encoding"))
+      continue;
+    StringView list = C->headers[h].value;
+    size_t i = 0;
+    while (i < list.len) {
+      while (i < list.len && (list.ptr[i] == ' ' || list.ptr[i] == '\t' ||
+                              list.ptr[i] == ','))
+        i++;
+      size_t start = i;
+      while (i < list.len && list.ptr[i] != ',' && list.ptr[i] != ';' &&
+             list.ptr[i] != ' ' && list.ptr[i] != '\t')
+        i++;
+      StringView token = {list.ptr + start, i - start};
+      size_t params = i;
+      while (i < list.len && list.ptr[i] != ',')
+        i++;
+      int q = element_quality((StringView){list.ptr + params, i - params});
+      if (viewEqualsIgnoreCase(token, "gzip") ||
+          viewEqualsIgnoreCase(token, "x-gzip"))
+        gzip = q;
+      else if (viewEqualsIgnoreCase(token, "deflate"))
+        deflate = q;
+      else if (viewEqualsIgnoreCase(token, "*"))
+        any = q;
+    }
+  }
+  if (gzip < 0)
+    gzip = any;
+  if (deflate < 0)
+    deflate = any;
+  if (gzip > 0 && gzip >= deflate)
+    return CODING_GZIP;
+  if (deflate > 0)
+    return CODING_DEFLATE;
+  return CODING_IDENTITY;
+}
+
+ssize_t compress_buffer(Compressor *z, ContentCoding coding, int level,
+                        const char *src, size_t len, char *dst, size_t cap) {
+  if (coding == CODING_IDENTITY || len > UINT_MAX || cap > UINT_MAX)
+    return -1;
+  z_stream *s = &z->streams[coding];
+  if (!z->ready[coding]) {
+    memset(s, 0, sizeof(*s));
+    if (deflateInit2(s, level, Z_DEFLATED, window_bits[coding], 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+      return -1;
+    z->ready[coding] = 1;
+    z->level[coding] = level;
+  } else {
+    deflateReset(s);
+    if (z->level[coding] != level) {
+      // Nothing has been fed since the reset, so this takes effect at once
+      if (deflateParams(s, level, Z_DEFAULT_STRATEGY) != Z_OK)
+        return -1;
+      z->level[coding] = level;
+    }
+  }
+  s->next_in = (Bytef *)(uintptr_t)src; // zlib never writes the input
+  s->avail_in = (uInt)len;
+  s->next_out = (Bytef *)dst;
+  s->avail_out = (uInt)cap;
+  // Z_STREAM_END only comes once everything, trailer included, fitted
+  if (deflate(s, Z_FINISH) != Z_STREAM_END)
+    return -1;
+  return (ssize_t)(cap - s->avail_out);
+}
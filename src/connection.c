@@ -0,0 +1,585 @@
+// MSG_ZEROCOPY and the IP_RECVERR control messages are Linux extensions
+#define _GNU_SOURCE
+#include "../include/connection.h"
+#include "../include/memory_budget.h" // For memory_budget_reserve
+#include "../include/proxy.h"         // For proxy_relay, RELAY_*
+
+#include <errno.h>           // For errno, EAGAIN, EWOULDBLOCK, EINTR
+#include <linux/errqueue.h>  // For sock_extended_err, SO_EE_ORIGIN_ZEROCOPY
+#include <netinet/in.h>      // For SOL_IP, IP_RECVERR, SOL_IPV6
+#include <stdio.h>           // For fprintf, perror
+#include <stdlib.h>          // For calloc, realloc, free
+#include <string.h>          // For memcpy, memmove, memset, strerror
+#include <sys/sendfile.h>    // For sendfile
+#include <sys/socket.h>      // For sendmsg, recvmsg, shutdown, MSG_ZEROCOPY
+#include <unistd.h>          // For read, close, pread
+
+// An output block holds the segment array, then the send buffer
+#define OUTPUT_BLOCK_SIZE                                                      \
+  (OUTPUT_MAX_SEGMENTS * sizeof(struct iovec) + SEND_BUFFER_SIZE)
+#define SLAB_BYTES (CONNECTION_SLAB_SIZE * sizeof(Connection))
+
+void memory_pools_init(MemoryPools *pools) {
+  buffer_pool_init(&pools->recv_small, RECV_SMALL_BUFFER_SIZE, POOL_MAX_FREE);
+  buffer_pool_init(&pools->recv_buffers, RECV_BUFFER_SIZE, POOL_MAX_FREE);
+  buffer_pool_init(&pools->output_blocks, OUTPUT_BLOCK_SIZE, POOL_MAX_FREE);
+  buffer_pool_init(&pools->send_buffers, SEND_BUFFER_SIZE, POOL_MAX_FREE);
+  buffer_pool_init(&pools->arena_blocks, ARENA_BLOCK_SIZE, POOL_MAX_FREE);
+  pools->slabs = NULL;
+  pools->slab_count = 0;
+  pools->first_free = 0;
+  pools->free_structs = 0;
+  pools->connection_allocs = 0;
+}
+
+static void free_slab(MemoryPools *pools, ConnectionSlab *slab) {
+  free(slab->structs);
+  memory_budget_release(SLAB_BYTES);
+  slab->structs = NULL;
+  slab->free_head = CONNECTION_NO_SLOT;
+  pools->free_structs -= CONNECTION_SLAB_SIZE - slab->used;
+}
+
+void memory_pools_destroy(MemoryPools *pools) {
+  buffer_pool_destroy(&pools->recv_small);
+  buffer_pool_destroy(&pools->recv_buffers);
+  buffer_pool_destroy(&pools->output_blocks);
+  buffer_pool_destroy(&pools->send_buffers);
+  buffer_pool_destroy(&pools->arena_blocks);
+  for (size_t i = 0; i < pools->slab_count; ++i) {
+    if (pools->slabs[i].structs)
+      free_slab(pools, &pools->slabs[i]);
+  }
+  free(pools->slabs);
+  pools->slabs = NULL;
+  pools->slab_count = 0;
+}
+
+uint64_t memory_pools_heap_allocs(const MemoryPools *pools) {
+  return pools->recv_small.heap_allocs + pools->recv_buffers.heap_allocs +
+         pools->output_blocks.heap_allocs + pools->send_buffers.heap_allocs +
+         pools->arena_blocks.heap_allocs + pools->connection_allocs;
+}
+
+// Allocate the structs of a slab, in the first entry that has none.
+// Returns the entry, or NULL on failure.
+static ConnectionSlab *add_slab(MemoryPools *pools) {
+  size_t n = 0;
+  while (n < pools->slab_count && pools->slabs[n].structs)
+    n++;
+  if (n == pools->slab_count) {
+    if ((n + 1) * CONNECTION_SLAB_SIZE > CONNECTION_NO_SLOT) {
+      fprintf(stderr, "Too many connections for one worker.\n");
+      return NULL;
+    }
+    ConnectionSlab *slabs =
+        realloc(pools->slabs, (n + 1) * sizeof(*pools->slabs));
+    if (!slabs) {
+      perror("realloc failed for ConnectionSlab");
+      return NULL;
+    }
+    pools->slabs = slabs;
+    pools->slabs[n].structs = NULL;
+    pools->slabs[n].free_head = CONNECTION_NO_SLOT;
+    pools->slabs[n].used = 0;
+    pools->slab_count++;
+  }
+  if (!memory_budget_reserve(SLAB_BYTES)) {
+    fprintf(stderr, "Memory budget exhausted, no connection slab.\n");
+    return NULL;
+  }
+  ConnectionSlab *slab = &pools->slabs[n];
+  slab->structs = calloc(CONNECTION_SLAB_SIZE, sizeof(Connection));
+  if (!slab->structs) {
+    perror("calloc failed for connection slab");
+    memory_budget_release(SLAB_BYTES);
+    return NULL;
+  }
+  for (uint32_t i = 0; i < CONNECTION_SLAB_SIZE; ++i)
+    slab->structs[i].next_free = i + 1 < CONNECTION_SLAB_SIZE
+                                     ? i + 1
+                                     : CONNECTION_NO_SLOT;
+  slab->free_head = 0;
+  slab->used = 0;
+  pools->free_structs += CONNECTION_SLAB_SIZE;
+  pools->connection_allocs++;
+  return slab;
+}
+
+Connection *create_connection(int client_fd, MemoryPools *pools) {
+  ConnectionSlab *slab = NULL;
+  while (pools->first_free < pools->slab_count) {
+    slab = &pools->slabs[pools->first_free];
+    if (slab->free_head != CONNECTION_NO_SLOT)
+      break;
+    slab = NULL;
+    pools->first_free++;
+  }
+  if (!slab && !(slab = add_slab(pools)))
+    return NULL;
+  size_t n = (size_t)(slab - pools->slabs);
+  if (n < pools->first_free)
+    pools->first_free = n;
+  uint32_t index = slab->free_head;
+  Connection *conn = &slab->structs[index];
+  slab->free_head = conn->next_free;
+  slab->used++;
+  pools->free_structs--;
+  memset(conn, 0, sizeof(*conn));
+  conn->fd = client_fd;
+  conn->slot = (uint32_t)(n * CONNECTION_SLAB_SIZE) + index;
+  conn->pools = pools;
+  arena_init(&conn->arena, &pools->arena_blocks);
+  httpParserReset(&conn->parser);
+  return conn;
+}
+
+static BufferPool *input_pool(Connection *conn) {
+  return conn->recv_size == RECV_BUFFER_SIZE ? &conn->pools->recv_buffers
+                                             : &conn->pools->recv_small;
+}
+
+int reserve_input(Connection *conn, size_t size) {
+  if (conn->recv_buffer && conn->recv_size >= size)
+    return 0;
+  BufferPool *pool = size <= RECV_SMALL_BUFFER_SIZE
+                         ? &conn->pools->recv_small
+                         : &conn->pools->recv_buffers;
+  char *buffer = buffer_pool_acquire(pool);
+  if (!buffer)
+    return -1;
+  if (conn->recv_buffer) {
+    memcpy(buffer, conn->recv_buffer, conn->recv_len);
+    buffer_pool_release(input_pool(conn), conn->recv_buffer);
+  }
+  buffer[conn->recv_len] = '\0';
+  conn->recv_buffer = buffer;
+  conn->recv_size = pool->buffer_size;
+  return 0;
+}
+
+int make_input_room(Connection *conn) {
+  if (!conn->recv_buffer)
+    return reserve_input(conn, RECV_SMALL_BUFFER_SIZE);
+  if (conn->recv_len + 1 < conn->recv_size)
+    return 0;
+  return reserve_input(conn, RECV_BUFFER_SIZE);
+}
+
+void release_input(Connection *conn) {
+  if (conn->recv_len > 0 || conn->h2 || !conn->recv_buffer)
+    return;
+  buffer_pool_release(input_pool(conn), conn->recv_buffer);
+  conn->recv_buffer = NULL;
+  conn->recv_size = 0;
+}
+
+// Take an output block for the first segment queued
+static int reserve_output(Connection *conn) {
+  if (conn->out)
+    return 0;
+  conn->out = buffer_pool_acquire(&conn->pools->output_blocks);
+  if (!conn->out)
+    return -1;
+  conn->send_buffer = (char *)(conn->out + OUTPUT_MAX_SEGMENTS);
+  return 0;
+}
+
+static void release_output(Connection *conn) {
+  buffer_pool_release(&conn->pools->output_blocks, conn->out);
+  conn->out = NULL;
+  conn->send_buffer = NULL;
+}
+
+void free_connection(Connection *conn) {
+  if (!conn)
+    return;
+  if (conn->fd >= 0)
+    close(conn->fd);
+  MemoryPools *pools = conn->pools;
+  file_cache_release(conn->file);
+  arena_reset(&conn->arena);
+  if (conn->recv_buffer)
+    buffer_pool_release(input_pool(conn), conn->recv_buffer);
+  release_output(conn);
+  size_t n = conn->slot / CONNECTION_SLAB_SIZE;
+  ConnectionSlab *slab = &pools->slabs[n];
+  conn->next_free = slab->free_head;
+  slab->free_head = conn->slot % CONNECTION_SLAB_SIZE;
+  slab->used--;
+  pools->free_structs++;
+  if (n < pools->first_free)
+    pools->first_free = n;
+  // An empty slab is kept while it is the only room for new connections,
+  // so a count going up and down around a slab's size does not allocate
+  if (slab->used == 0 && pools->free_structs >= 2 * CONNECTION_SLAB_SIZE)
+    free_slab(pools, slab);
+}
+
+ssize_t fill_connection(Connection *conn) {
+  ssize_t total = 0;
+  if (make_input_room(conn) < 0)
+    return -1;
+  conn->recv_pending = 1;
+  // Edge-triggered readiness only fires once per batch of incoming data, so
+  // keep reading until the kernel reports that nothing is left (or until the
+  // buffer is full and the request has to be handled first).
+  while (conn->recv_len < conn->recv_size - 1) {
+    ssize_t n = read(conn->fd, conn->recv_buffer + conn->recv_len,
+                     conn->recv_size - 1 - conn->recv_len);
+    if (n > 0) {
+      conn->recv_len += (size_t)n;
+      total += n;
+      continue;
+    }
+    if (n == 0) {
+      conn->peer_closed = 1;
+      conn->recv_pending = 0;
+      break;
+    }
+    if (errno == EINTR)
+      continue;
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      conn->recv_pending = 0;
+      break;
+    }
+    fprintf(stderr, "Failed to read from client: %s\n", strerror(errno));
+    return -1;
+  }
+  // Keep the buffer NUL terminated for the string based parser
+  conn->recv_buffer[conn->recv_len] = '\0';
+  if (total > 0)
+    connection_received(conn, (size_t)total);
+  return total;
+}
+
+void consume_connection(Connection *conn, size_t len) {
+  if (len >= conn->recv_len) {
+    conn->recv_len = 0;
+  } else {
+    memmove(conn->recv_buffer, conn->recv_buffer + len, conn->recv_len - len);
+    conn->recv_len -= len;
+  }
+  if (conn->recv_buffer)
+    conn->recv_buffer[conn->recv_len] = '\0';
+}
+
+// Append a segment to the output queue, extending the last one when the
+// new bytes directly follow it in memory. Segments an in-flight io_uring
+// send may still be reading are left alone.
+static int push_segment(Connection *conn, const char *data, size_t len) {
+  if (conn->out_count > conn->out_next && conn->out_count > conn->out_locked) {
+    struct iovec *last = &conn->out[conn->out_count - 1];
+    if ((const char *)last->iov_base + last->iov_len == data) {
+      last->iov_len += len;
+      conn->out_bytes += len;
+      return 0;
+    }
+  }
+  if (conn->out_count == OUTPUT_MAX_SEGMENTS) {
+    fprintf(stderr, "Response needs more than %d output segments.\n",
+            OUTPUT_MAX_SEGMENTS);
+    return -1;
+  }
+  conn->out[conn->out_count].iov_base = (void *)data;
+  conn->out[conn->out_count].iov_len = len;
+  conn->out_count++;
+  conn->out_bytes += len;
+  return 0;
+}
+
+int queue_response(Connection *conn, const char *data, size_t len) {
+  if (len > SEND_BUFFER_SIZE - conn->send_len) {
+    fprintf(stderr, "Response of %zu bytes does not fit the send buffer.\n",
+            len);
+    return -1;
+  }
+  if (len == 0)
+    return 0;
+  if (reserve_output(conn) < 0)
+    return -1;
+  char *dst = conn->send_buffer + conn->send_len;
+  memcpy(dst, data, len);
+  if (push_segment(conn, dst, len) < 0)
+    return -1;
+  conn->send_len += len;
+  return 0;
+}
+
+int queue_reference(Connection *conn, const char *data, size_t len) {
+  if (len == 0)
+    return 0;
+  if (reserve_output(conn) < 0)
+    return -1;
+  if (push_segment(conn, data, len) < 0)
+    return -1;
+  if (len >= ZEROCOPY_MIN_SIZE)
+    conn->zerocopy_wanted = 1;
+  return 0;
+}
+
+int queue_file(Connection *conn, FileEntry *file, off_t offset, size_t len) {
+  if (conn->file) {
+    fprintf(stderr, "A file response is already queued.\n");
+    return -1;
+  }
+  conn->file = file;
+  conn->file_offset = offset;
+  conn->file_remaining = len;
+  return 0;
+}
+
+// Recycle the output memory once everything queued has gone
+static void recycle_output(Connection *conn) {
+  conn->out_count = conn->out_next = 0;
+  conn->send_len = 0;
+  conn->zerocopy_wanted = 0;
+  release_output(conn);
+  arena_reset(&conn->arena);
+  file_cache_release(conn->file);
+  conn->file = NULL;
+}
+
+size_t peek_output(const Connection *conn, char *dst, size_t len) {
+  size_t n = 0;
+  for (size_t i = conn->out_next; i < conn->out_count && n < len; ++i) {
+    size_t part = conn->out[i].iov_len < len - n ? conn->out[i].iov_len
+                                                 : len - n;
+    memcpy(dst + n, conn->out[i].iov_base, part);
+    n += part;
+  }
+  return n;
+}
+
+void peek_output_tail(const Connection *conn, char *dst, size_t len) {
+  for (size_t i = conn->out_count; len > 0 && i > conn->out_next; --i) {
+    const struct iovec *seg = &conn->out[i - 1];
+    size_t part = seg->iov_len < len ? seg->iov_len : len;
+    len -= part;
+    memcpy(dst + len, (const char *)seg->iov_base + seg->iov_len - part,
+           part);
+  }
+}
+
+ssize_t take_output(Connection *conn, char *dst, size_t len) {
+  size_t n = 0;
+  while (n < len && conn->out_bytes > 0) {
+    struct iovec *iov = &conn->out[conn->out_next];
+    size_t part = iov->iov_len < len - n ? iov->iov_len : len - n;
+    memcpy(dst + n, iov->iov_base, part);
+    n += part;
+    iov->iov_base = (char *)iov->iov_base + part;
+    iov->iov_len -= part;
+    conn->out_bytes -= part;
+    if (iov->iov_len == 0)
+      conn->out_next++;
+  }
+  while (n < len && conn->out_bytes == 0 && conn->file_remaining > 0) {
+    size_t part = conn->file_remaining < len - n ? conn->file_remaining
+                                                 : len - n;
+    ssize_t got = (ssize_t)part;
+    if (conn->file->map)
+      memcpy(dst + n, conn->file->map + conn->file_offset, part);
+    else
+      got = pread(conn->file->fd, dst + n, part, conn->file_offset);
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got <= 0) {
+      fprintf(stderr, "Failed Reading File: %s\n",
+              got == 0 ? "file was truncated" : strerror(errno));
+      return -1;
+    }
+    n += (size_t)got;
+    conn->file_offset += got;
+    conn->file_remaining -= (size_t)got;
+  }
+  if (conn->out_bytes == 0 && conn->file_remaining == 0)
+    recycle_output(conn);
+  return (ssize_t)n;
+}
+
+int connection_has_room(const Connection *conn) {
+  // The body of a queued file goes out after every queued segment, so the
+  // next response has to wait for it
+  // Nor is anything queued behind a proxied response, though its request
+  // body still has to be read
+  return conn->file == NULL &&
+         (conn->upstream == NULL || httpParserInBody(&conn->parser)) &&
+         conn->out_count + RESPONSE_SEGMENTS <= OUTPUT_MAX_SEGMENTS &&
+         conn->out_bytes < OUTPUT_HIGH_WATER &&
+         SEND_BUFFER_SIZE - conn->send_len >= RESPONSE_COPY_HEADROOM;
+}
+
+int connection_zerocopy_pending(const Connection *conn) {
+  return conn->zerocopy_done != conn->zerocopy_sends;
+}
+
+// Turn on SO_ZEROCOPY the first time a connection wants it. Kernels or
+// sockets without support simply keep copying.
+static int enable_zerocopy(Connection *conn) {
+  if (conn->zerocopy_state == 0) {
+    int one = 1;
+    conn->zerocopy_state =
+        setsockopt(conn->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0
+            ? 1
+            : -1;
+  }
+  return conn->zerocopy_state > 0;
+}
+
+// Read zero-copy completions from the socket's error queue. Each one covers
+// a range of sendmsg() calls, numbered from 0 in the order they were made.
+// Returns -1 on a socket error, 0 otherwise.
+static int reap_zerocopy(Connection *conn) {
+  while (connection_zerocopy_pending(conn)) {
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err) +
+                            sizeof(struct sockaddr_in6))];
+    struct msghdr msg = {.msg_control = control,
+                         .msg_controllen = sizeof(control)};
+    if (recvmsg(conn->fd, &msg, MSG_ERRQUEUE) < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 0; // The rest arrive with a later EPOLLERR
+      fprintf(stderr, "Failed to read zero-copy completions: %s\n",
+              strerror(errno));
+      return -1;
+    }
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm;
+         cm = CMSG_NXTHDR(&msg, cm)) {
+      if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+            (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+        continue;
+      struct sock_extended_err err;
+      memcpy(&err, CMSG_DATA(cm), sizeof(err));
+      if (err.ee_origin != SO_EE_ORIGIN_ZEROCOPY || err.ee_errno != 0)
+        continue;
+      conn->zerocopy_done += err.ee_data - err.ee_info + 1;
+      // The kernel fell back to copying (loopback always does), so pinning
+      // pages only adds the completion round trip.
+      if (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+        conn->zerocopy_state = -1;
+    }
+  }
+  return 0;
+}
+
+void connection_received(Connection *conn, size_t n) {
+  conn->received_ns = metrics_now();
+  if (conn->metrics)
+    metrics_add(&conn->metrics->bytes_in, n);
+}
+
+void connection_sent(Connection *conn, size_t n) {
+  if (conn->metrics)
+    metrics_add(&conn->metrics->bytes_out, n);
+  conn->out_bytes -= n;
+  while (n > 0) {
+    struct iovec *iov = &conn->out[conn->out_next];
+    if (n < iov->iov_len) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+      return;
+    }
+    n -= iov->iov_len;
+    conn->out_next++;
+  }
+}
+
+// Write the queued segments and file range. Returns 1 once everything is
+// written and the output memory recycled, 0 if the socket would block, or
+// -1 on a fatal socket error.
+static int write_output(Connection *conn) {
+  while (conn->out_bytes > 0) {
+    struct msghdr msg = {.msg_iov = conn->out + conn->out_next,
+                         .msg_iovlen = conn->out_count - conn->out_next};
+    // MSG_NOSIGNAL keeps a client that hung up from raising SIGPIPE
+    int flags = MSG_NOSIGNAL;
+    if (conn->zerocopy_wanted && enable_zerocopy(conn))
+      flags |= MSG_ZEROCOPY;
+    ssize_t n = sendmsg(conn->fd, &msg, flags);
+    if (n >= 0) {
+      if (flags & MSG_ZEROCOPY)
+        conn->zerocopy_sends++;
+      connection_sent(conn, (size_t)n);
+      continue;
+    }
+    if (errno == EINTR)
+      continue;
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return 0; // EPOLLOUT will tell us when there is room again
+    if (errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+      conn->zerocopy_wanted = 0; // Out of pinnable memory, copy instead
+      continue;
+    }
+    fprintf(stderr, "Failed Sending Response: %s\n", strerror(errno));
+    return -1;
+  }
+  // The file body follows the head, copied from the page cache by the
+  // kernel
+  while (conn->file_remaining > 0) {
+    ssize_t n = sendfile(conn->fd, conn->file->fd, &conn->file_offset,
+                         conn->file_remaining);
+    if (n > 0) {
+      conn->file_remaining -= (size_t)n;
+      if (conn->metrics)
+        metrics_add(&conn->metrics->bytes_out, (uint64_t)n);
+      continue;
+    }
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return 0;
+    // A file that shrank can not fill the promised Content-Length
+    fprintf(stderr, "Failed Sending File: %s\n",
+            n == 0 ? "file was truncated" : strerror(errno));
+    return -1;
+  }
+  // Zero-copy sends still read from the queued memory until they complete
+  if (reap_zerocopy(conn) < 0)
+    return -1;
+  if (connection_zerocopy_pending(conn))
+    return 0;
+  recycle_output(conn);
+  return 1;
+}
+
+int flush_connection(Connection *conn) {
+  for (;;) {
+    int written = write_output(conn);
+    if (written <= 0)
+      return written;
+    if (!conn->upstream)
+      return 1;
+    // Relaying queues the next part of the response behind what was just
+    // written, or splices it straight to the socket
+    int relayed = proxy_relay(conn);
+    if (relayed == RELAY_BLOCKED)
+      return 0;
+    if (relayed == RELAY_WAITING)
+      return FLUSH_WAITING;
+    if (relayed < 0)
+      return -1;
+  }
+}
+
+void linger_connection(Connection *conn) {
+  conn->lingering = 1;
+  conn->recv_len = 0;
+  release_input(conn);
+  shutdown(conn->fd, SHUT_WR);
+}
+
+int drain_connection(Connection *conn) {
+  char discard[4096];
+  for (;;) {
+    ssize_t n = read(conn->fd, discard, sizeof(discard));
+    if (n > 0)
+      continue;
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return 0;
+    return -1; // EOF or error
+  }
+}
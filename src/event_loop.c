@@ -0,0 +1,584 @@
+#include "../include/event_loop.h"
+#include "../include/admission.h"      // For admission_check
+#include "../include/config.h"         // For MAX_EVENTS, *_TIMEOUT_MS
+#include "../include/http2.h"          // For http2_waiting_for, http2_close
+#include "../include/proxy.h"          // For proxy_init, proxy_detach
+#include "../include/server.h"         // For handle_accept, handle_client
+#include "../include/signal_handler.h" // For keep_running, draining
+#include "../include/uring_loop.h"     // For run_uring_loop
+
+#include <errno.h>      // For errno, EAGAIN, EWOULDBLOCK, EINTR
+#include <fcntl.h>      // For fcntl, O_NONBLOCK
+#include <netinet/in.h> // For sockaddr_in, ntohs
+#include <stddef.h>     // For offsetof
+#include <stdint.h>     // For uintptr_t
+#include <stdio.h>      // For fprintf, printf
+#include <string.h>     // For strerror
+#include <sys/epoll.h>  // For epoll_create1, epoll_ctl, epoll_wait
+#include <sys/socket.h> // For getpeername, send, recv, shutdown
+#include <time.h>       // For clock_gettime, CLOCK_MONOTONIC
+#include <unistd.h>     // For close, read
+
+// Tags stored in epoll_event.data.ptr for the non-client descriptors.
+// Upstream sockets of the proxy carry their Upstream's address with the
+// lowest bit set, which no Connection has.
+static char listener_tag, wake_tag, inotify_tag;
+#define UPSTREAM_TAG 1u
+
+_Static_assert(METRICS_TIMEOUT_KINDS == TIMEOUT_KINDS,
+               "a timeout counter per TimeoutKind");
+
+// Timeouts by TimeoutKind, in timer wheel ticks
+#define TICKS(ms) (((ms) + TIMER_TICK_MS - 1) / TIMER_TICK_MS)
+static const uint64_t timeout_ticks[TIMEOUT_KINDS] = {
+    [TIMEOUT_HEAD] = TICKS(HEADER_TIMEOUT_MS),
+    [TIMEOUT_BODY] = TICKS(BODY_TIMEOUT_MS),
+    [TIMEOUT_WRITE] = TICKS(WRITE_TIMEOUT_MS),
+    [TIMEOUT_IDLE] = TICKS(KEEPALIVE_TIMEOUT_MS),
+    [TIMEOUT_LINGER] = TICKS(LINGER_TIMEOUT_MS),
+    [TIMEOUT_CONNECT] = TICKS(PROXY_CONNECT_TIMEOUT_MS),
+    [TIMEOUT_UPSTREAM] = TICKS(PROXY_TIMEOUT_MS),
+};
+
+static uint64_t monotonic_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u;
+}
+
+static uint64_t loop_tick(const EventLoop *loop) {
+  return loop->now_ms / TIMER_TICK_MS;
+}
+
+static void unlink_connection(EventLoop *loop, Connection *conn) {
+  if (conn->prev)
+    conn->prev->next = conn->next;
+  else
+    loop->connections = conn->next;
+  if (conn->next)
+    conn->next->prev = conn->prev;
+}
+
+static void push_connection(EventLoop *loop, Connection *conn) {
+  conn->prev = NULL;
+  conn->next = loop->connections;
+  if (loop->connections)
+    loop->connections->prev = conn;
+  loop->connections = conn;
+}
+
+// Leave a debug record for a connection opening or closing
+static void log_connection(const Connection *conn, uint8_t kind) {
+  if (!conn->log || !access_log_wants(LOG_LEVEL_DEBUG))
+    return;
+  AccessRecord *r = access_log_reserve(conn->log);
+  if (!r)
+    return;
+  r->time_ns = access_log_now();
+  r->bytes = conn->requests_served;
+  r->peer_addr = conn->peer_addr;
+  r->peer_port = conn->peer_port;
+  r->status = 0;
+  r->kind = kind;
+  r->target_len = 0;
+  access_log_commit(conn->log);
+}
+
+// Answer a client that admission control turned away and close its socket.
+// The response goes straight into the empty send buffer of the fresh
+// socket and the write side is shut down behind it. Whatever the client has
+// sent already is read and dropped, so that closing does not reset the
+// connection and destroy the response before the client reads it.
+static void reject_client(EventLoop *loop, int client_fd,
+                          CannedResponseId id) {
+  StringView response =
+      cannedResponse(&loop->responses, id, CONNECTION_CLOSE, 0);
+  if (send(client_fd, response.ptr, response.len, MSG_NOSIGNAL) > 0) {
+    shutdown(client_fd, SHUT_WR);
+    char discard[4096];
+    while (recv(client_fd, discard, sizeof(discard), 0) ==
+           (ssize_t)sizeof(discard))
+      ;
+  }
+  close(client_fd);
+}
+
+Connection *adopt_connection(EventLoop *loop, int client_fd,
+                             const struct sockaddr_in *addr) {
+  // Neither the io_uring accept nor a loop without admission control and
+  // access log needs the address, so it is only looked up on demand
+  struct sockaddr_in peer;
+  if (!addr && (loop->log || admission_by_address())) {
+    socklen_t addr_len = sizeof(peer);
+    if (getpeername(client_fd, (struct sockaddr *)&peer, &addr_len) == 0)
+      addr = &peer;
+  }
+  uint32_t peer_addr =
+      addr && addr->sin_family == AF_INET ? addr->sin_addr.s_addr : 0;
+
+  switch (admission_check(peer_addr, loop->now_ms)) {
+  case ADMIT_OK:
+    break;
+  case ADMIT_UNTRACKED:
+    metrics_add(&loop->metrics->untracked, 1);
+    break;
+  case ADMIT_RATE_LIMITED:
+    metrics_add(&loop->metrics->rate_limited, 1);
+    reject_client(loop, client_fd, RESPONSE_TOO_MANY_REQUESTS);
+    return NULL;
+  case ADMIT_OVERLOADED:
+    metrics_add(&loop->metrics->overloaded, 1);
+    reject_client(loop, client_fd, RESPONSE_SERVICE_UNAVAILABLE);
+    return NULL;
+  case ADMIT_SHEDDING:
+    metrics_add(&loop->metrics->shed, 1);
+    reject_client(loop, client_fd, RESPONSE_SERVICE_UNAVAILABLE);
+    return NULL;
+  }
+
+  Connection *conn = create_connection(client_fd, &loop->pools);
+  if (!conn) {
+    admission_release();
+    close(client_fd);
+    return NULL;
+  }
+  conn->files = loop->serve_files ? &loop->files : NULL;
+  conn->responses = &loop->responses;
+  conn->compressor = &loop->compressor;
+  conn->cache = &loop->cache;
+  conn->timeout_kind = TIMEOUT_KINDS; // Nothing fixed yet
+  conn->log = loop->log;
+  conn->metrics = loop->metrics;
+  conn->proxy = &loop->proxy;
+  conn->peer_addr = 0;
+  conn->peer_port = 0;
+  if (loop->log && peer_addr) {
+    conn->peer_addr = peer_addr;
+    conn->peer_port = ntohs(addr->sin_port);
+  }
+  push_connection(loop, conn);
+  loop->connection_count++;
+  metrics_add(&loop->metrics->accepts, 1);
+  metrics_set(&loop->metrics->connections, loop->connection_count);
+  log_connection(conn, ACCESS_RECORD_CONNECT);
+  touch_connection(loop, conn);
+  return conn;
+}
+
+static TimeoutKind waiting_for(const Connection *conn) {
+  if (conn->lingering)
+    return TIMEOUT_LINGER;
+  if (conn->out_bytes > 0 || conn->file_remaining > 0)
+    return TIMEOUT_WRITE;
+  if (conn->h2)
+    return http2_waiting_for(conn);
+  if (httpParserInBody(&conn->parser))
+    return TIMEOUT_BODY;
+  if (conn->upstream)
+    return conn->relay_wait;
+  if (conn->recv_len > 0 || conn->recv_pending || conn->requests_served == 0)
+    return TIMEOUT_HEAD;
+  return TIMEOUT_IDLE;
+}
+
+// Runs after every bit of activity, so it only stores a deadline and leaves
+// moving the timer to the wheel when its slot comes up
+void touch_connection(EventLoop *loop, Connection *conn) {
+  // An emptied receive buffer goes back to its pool here as well
+  release_input(conn);
+  TimeoutKind kind = waiting_for(conn);
+  uint64_t deadline = loop_tick(loop) + timeout_ticks[kind] + 1;
+  if (kind == TIMEOUT_HEAD || kind == TIMEOUT_LINGER) {
+    // A client trickling in a head byte by byte must not extend its time,
+    // so the deadline is only set when the wait for a new head begins
+    if (conn->timeout_kind != kind ||
+        conn->timed_request != conn->requests_served) {
+      conn->fixed_deadline = deadline;
+      conn->timed_request = conn->requests_served;
+    }
+    deadline = conn->fixed_deadline;
+  }
+  conn->timeout_kind = kind;
+  timer_wheel_arm(&loop->timers, &conn->timer, deadline);
+}
+
+// Closing the fd also removes it from the epoll interest list. io_uring
+// operations hold their own reference, so that backend frees the
+// connection once they have completed.
+void close_connection(EventLoop *loop, Connection *conn) {
+  proxy_detach(conn);
+  admission_release();
+  timer_wheel_cancel(&loop->timers, &conn->timer);
+  unlink_connection(loop, conn);
+  loop->connection_count--;
+  loop->requests += conn->requests_served;
+  metrics_set(&loop->metrics->connections, loop->connection_count);
+  log_connection(conn, ACCESS_RECORD_DISCONNECT);
+  http2_close(conn);
+  if (loop->uring)
+    uring_close_connection(loop->uring, conn);
+  else
+    free_connection(conn);
+}
+
+// A connection accepted whose client has not sent a byte, not even one
+// still waiting in the socket to be read
+static int silent_since_accept(const Connection *conn) {
+  if (conn->timeout_kind != TIMEOUT_HEAD || conn->requests_served > 0 ||
+      conn->recv_len > 0 || conn->recv_pending || conn->h2)
+    return 0;
+  char byte;
+  ssize_t n = recv(conn->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+  return n == 0 || (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+}
+
+// Keep-alive connections are closed as soon as they are idle while
+// draining, and so are connections whose client has sent nothing yet, so
+// that they do not hold up an upgrade until DRAIN_TIMEOUT_MS; their clients
+// retry on a fresh connection elsewhere
+static void close_idle_connections(EventLoop *loop) {
+  Connection *conn = loop->connections;
+  while (conn) {
+    Connection *next = conn->next;
+    if (conn->timeout_kind == TIMEOUT_IDLE || silent_since_accept(conn))
+      close_connection(loop, conn);
+    conn = next;
+  }
+}
+
+// The wheel hands over every expired timer at once, so a burst of
+// timeouts is closed in one batch without visiting anything else
+void close_expired_connections(EventLoop *loop) {
+  Timer *t = timer_wheel_advance(&loop->timers, loop_tick(loop));
+  while (t) {
+    Timer *next = t->next;
+    Connection *conn =
+        (Connection *)((char *)t - offsetof(Connection, timer));
+    metrics_add(&loop->metrics->timeouts[conn->timeout_kind], 1);
+    // A client that waited too long for its upstream is answered with 504
+    // or its request goes to another server
+    if (conn->upstream && proxy_expire(conn))
+      resume_connection(loop, conn);
+    else
+      close_connection(loop, conn);
+    t = next;
+  }
+  proxy_expire_idle(&loop->proxy);
+  if (loop->draining)
+    close_idle_connections(loop);
+}
+
+int loop_start_drain(EventLoop *loop) {
+  if (!draining || loop->draining)
+    return 0;
+  loop->draining = 1;
+  loop->drain_deadline_ms = loop->now_ms + DRAIN_TIMEOUT_MS;
+  close_idle_connections(loop);
+  return 1;
+}
+
+int loop_running(const EventLoop *loop) {
+  if (!keep_running)
+    return 0;
+  return !loop->draining || (loop->connections &&
+                             loop->now_ms < loop->drain_deadline_ms);
+}
+
+int loop_wait_ms(const EventLoop *loop) {
+  if (loop->draining)
+    return TIMER_TICK_MS; // The drain deadline is not on the wheel
+  uint64_t next = timer_wheel_next(&loop->timers);
+  if (next == 0)
+    return EPOLL_TIMEOUT_MS;
+  uint64_t due_ms = next * TIMER_TICK_MS;
+  if (due_ms <= loop->now_ms)
+    return 0;
+  return due_ms - loop->now_ms < EPOLL_TIMEOUT_MS
+             ? (int)(due_ms - loop->now_ms)
+             : EPOLL_TIMEOUT_MS;
+}
+
+// Accept every pending connection. With an edge-triggered listener a single
+// notification may stand for many queued clients.
+static void accept_connections(EventLoop *loop) {
+  for (;;) {
+    struct sockaddr_in addr;
+    int client_fd = handle_accept(loop->server_fd, &addr);
+    if (client_fd == ACCEPT_WOULD_BLOCK || client_fd == ACCEPT_SHUTDOWN)
+      return;
+    if (client_fd == ACCEPT_INTERRUPTED)
+      continue;
+    if (client_fd < 0)
+      return; // Error message already printed by handle_accept
+
+    Connection *conn = adopt_connection(loop, client_fd, &addr);
+    if (!conn)
+      continue;
+    // Register for both directions once; with EPOLLET there is no need to
+    // toggle EPOLLOUT as the send buffer fills and drains.
+    struct epoll_event ev = {
+        .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+        .data.ptr = conn,
+    };
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+      fprintf(stderr, "epoll_ctl ADD failed: %s\n", strerror(errno));
+      close_connection(loop, conn);
+    }
+  }
+}
+
+// Drive one connection forward after a readiness notification.
+// Returns -1 when the connection should be closed, 0 otherwise.
+static int service_connection(Connection *conn, uint32_t events) {
+  // EPOLLERR also announces zero-copy completions; flush_connection() reads
+  // them. Real socket errors then surface from read() or sendmsg().
+  if ((events & EPOLLERR) && !connection_zerocopy_pending(conn))
+    return -1;
+  if (conn->lingering)
+    return drain_connection(conn);
+
+  int readable = (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) != 0;
+  for (;;) {
+    if ((readable || conn->recv_pending) && !conn->peer_closed &&
+        fill_connection(conn) < 0)
+      return -1;
+    readable = 0;
+
+    // Answer every pipelined request that is complete in the receive buffer.
+    // The responses pile up as output segments and leave in a single
+    // sendmsg(). Once enough output is pending the rest wait until it has
+    // drained. A connection marked for closing still finishes the body it is
+    // streaming.
+    int handled_any = 0;
+    while ((!conn->close_after_send || httpParserInBody(&conn->parser)) &&
+           connection_has_room(conn)) {
+      int handled = handle_client(conn);
+      if (handled < 0)
+        return -1;
+      if (handled == 0)
+        break;
+      handled_any = 1;
+    }
+
+    size_t queued = conn->out_bytes + conn->file_remaining;
+    int relaying = conn->upstream != NULL;
+    int flushed = flush_connection(conn);
+    if (flushed < 0)
+      return -1;
+    if (flushed == FLUSH_WAITING) {
+      // The upstream's readiness resumes the relay. Only more of a request
+      // body may still be fed to it.
+      if (!handled_any)
+        return 0;
+      continue;
+    }
+    if (flushed == 1 && conn->close_after_send &&
+        !httpParserInBody(&conn->parser)) {
+      // Last response fully written
+      if (conn->peer_closed)
+        return -1;
+      linger_connection(conn);
+      return drain_connection(conn);
+    }
+    if (flushed == 0)
+      return 0; // Socket is full, EPOLLOUT resumes the work
+    // Go round again while anything moved: new requests may have become
+    // complete, or a paused body can continue now that the buffer drained.
+    if (!handled_any && !conn->recv_pending && queued == 0 && !relaying)
+      break;
+  }
+
+  if (conn->peer_closed)
+    return -1; // Client went away and every complete request was answered
+  return 0;
+}
+
+int loop_watch_upstream(EventLoop *loop, Upstream *up) {
+  if (loop->uring)
+    return uring_watch_upstream(loop->uring, up);
+  // Both directions once, edge-triggered like the client sockets
+  struct epoll_event ev = {
+      .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+      .data.ptr = (void *)((uintptr_t)up | UPSTREAM_TAG),
+  };
+  if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, up->fd, &ev) < 0) {
+    fprintf(stderr, "epoll_ctl ADD for upstream failed: %s\n",
+            strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+void loop_forget_upstream(EventLoop *loop, Upstream *up) {
+  // Closing the socket takes it off the epoll interest list
+  if (loop->uring)
+    uring_forget_upstream(loop->uring, up);
+}
+
+void resume_connection(EventLoop *loop, Connection *conn) {
+  int rc = loop->uring ? uring_resume_connection(loop->uring, conn)
+                       : service_connection(conn, 0);
+  if (rc < 0)
+    close_connection(loop, conn);
+  else
+    touch_connection(loop, conn);
+}
+
+void update_loop_time(EventLoop *loop) {
+  loop->now_ms = monotonic_ms();
+  loop->cache.now_ms = loop->now_ms;
+  // The Date header is wall-clock time, rendered at most once a second
+  refreshCannedResponses(&loop->responses, time(NULL));
+}
+
+// Wait for readiness with epoll_wait() and serve until keep_running is
+// cleared. Returns 0 on a clean shutdown or -1 if epoll could not be set up.
+static int run_epoll_loop(EventLoop *loop) {
+  loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (loop->epoll_fd < 0) {
+    fprintf(stderr, "epoll_create1 failed: %s\n", strerror(errno));
+    return -1;
+  }
+
+  struct epoll_event listen_ev = {.events = EPOLLIN | EPOLLET,
+                                  .data.ptr = &listener_tag};
+  if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->server_fd, &listen_ev) <
+      0) {
+    fprintf(stderr, "epoll_ctl ADD for server socket failed: %s\n",
+            strerror(errno));
+    return -1;
+  }
+  // The wake eventfd is read when it fires, so the loop can be woken again
+  // after a drain started
+  struct epoll_event wake_ev = {.events = EPOLLIN, .data.ptr = &wake_tag};
+  if (loop->wake_fd >= 0 &&
+      epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &wake_ev) < 0) {
+    fprintf(stderr, "epoll_ctl ADD for wake fd failed: %s\n",
+            strerror(errno));
+    return -1;
+  }
+  struct epoll_event inotify_ev = {.events = EPOLLIN | EPOLLET,
+                                   .data.ptr = &inotify_tag};
+  if (loop->serve_files &&
+      epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->files.inotify_fd,
+                &inotify_ev) < 0) {
+    fprintf(stderr, "epoll_ctl ADD for inotify fd failed: %s\n",
+            strerror(errno));
+    return -1;
+  }
+
+  struct epoll_event events[MAX_EVENTS];
+  while (loop_running(loop)) {
+    int n = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, loop_wait_ms(loop));
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "epoll_wait failed: %s\n", strerror(errno));
+      break;
+    }
+    update_loop_time(loop);
+    int upstream_events = 0;
+    for (int i = 0; i < n; ++i) {
+      void *tag = events[i].data.ptr;
+      if (tag == &listener_tag) {
+        accept_connections(loop);
+        continue;
+      }
+      if (tag == &wake_tag) {
+        // keep_running and draining are checked after the batch
+        uint64_t count;
+        if (read(loop->wake_fd, &count, sizeof(count)) < 0 &&
+            errno != EAGAIN)
+          fprintf(stderr, "Failed to read the wake fd: %s\n",
+                  strerror(errno));
+        continue;
+      }
+      if (tag == &inotify_tag) {
+        file_cache_process_events(&loop->files);
+        continue;
+      }
+      if ((uintptr_t)tag & UPSTREAM_TAG) {
+        events[upstream_events++] = events[i];
+        continue;
+      }
+      Connection *conn = tag;
+      if (service_connection(conn, events[i].events) < 0)
+        close_connection(loop, conn);
+      else
+        touch_connection(loop, conn);
+    }
+    // Upstream readiness resumes a client, which may be closed as a result.
+    // That happens once the clients' own events are done with, so none of
+    // them names a freed connection.
+    for (int i = 0; i < upstream_events; ++i) {
+      Upstream *up = (Upstream *)((uintptr_t)events[i].data.ptr &
+                                  ~(uintptr_t)UPSTREAM_TAG);
+      Connection *client = proxy_upstream_ready(up);
+      if (client)
+        resume_connection(loop, client);
+    }
+    if (loop_start_drain(loop))
+      epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, loop->server_fd, NULL);
+    close_expired_connections(loop);
+  }
+  return 0;
+}
+
+int run_event_loop(int server_fd, int wake_fd, int worker_index,
+                   const ServerOptions *opts) {
+  EventLoop loop = {.epoll_fd = -1,
+                    .server_fd = server_fd,
+                    .wake_fd = wake_fd,
+                    .log = access_log_ring(worker_index),
+                    .metrics = metrics_worker(worker_index)};
+  loop.now_ms = monotonic_ms();
+  timer_wheel_init(&loop.timers, loop_tick(&loop));
+
+  int flags = fcntl(server_fd, F_GETFL, 0);
+  if (flags < 0 || fcntl(server_fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+    fprintf(stderr, "Failed to make server socket non-blocking: %s\n",
+            strerror(errno));
+    return -1;
+  }
+  // Every worker keeps its own file cache, watched by its own inotify
+  // instance, so serving files takes no locks
+  if (opts->doc_root) {
+    if (file_cache_init(&loop.files, opts->doc_root) < 0)
+      return -1;
+    loop.serve_files = 1;
+  }
+  memory_pools_init(&loop.pools);
+  initializeCannedResponses(&loop.responses, time(NULL));
+  compressor_init(&loop.compressor);
+  response_cache_init(&loop.cache);
+  loop.cache.now_ms = loop.now_ms;
+  proxy_init(&loop.proxy, &loop);
+
+  int rc = URING_UNSUPPORTED;
+  if (opts->backend == BACKEND_URING) {
+    rc = run_uring_loop(&loop, opts->sqpoll);
+    if (rc == URING_UNSUPPORTED)
+      fprintf(stderr, "io_uring is not usable here, using epoll.\n");
+  }
+  if (rc == URING_UNSUPPORTED)
+    rc = run_epoll_loop(&loop);
+
+  while (loop.connections)
+    close_connection(&loop, loop.connections);
+  proxy_destroy(&loop.proxy);
+  if (loop.serve_files)
+    file_cache_destroy(&loop.files);
+  compressor_destroy(&loop.compressor);
+  response_cache_destroy(&loop.cache);
+  if (loop.epoll_fd >= 0)
+    close(loop.epoll_fd);
+
+  // Every buffer is recycled, so heap allocations should stay at the number
+  // of connections that were open at the same time, independent of the
+  // number of requests.
+  printf("Served %llu requests with %llu heap allocations.\n",
+         (unsigned long long)loop.requests,
+         (unsigned long long)memory_pools_heap_allocs(&loop.pools));
+  memory_pools_destroy(&loop.pools);
+  return rc;
+}
@@ -0,0 +1,451 @@
+// openat2(), O_PATH and the inotify API are Linux extensions
+#define _GNU_SOURCE
+#include "../include/file_cache.h"
+#include "../include/http_types.h" // For formatHttpDate, HTTP_DATE_SIZE
+
+#include <errno.h>         // For errno, ENOENT, EISDIR, ENOSYS
+#include <fcntl.h>         // For open, openat, O_* flags
+#include <linux/openat2.h> // For struct open_how, RESOLVE_BENEATH
+#include <stdio.h>         // For fprintf, snprintf
+#include <stdlib.h>        // For calloc, malloc, realloc, free
+#include <string.h>        // For strcmp, strdup, strerror, strrchr
+#include <strings.h>       // For strcasecmp
+#include <sys/inotify.h>   // For inotify_init1, inotify_add_watch
+#include <sys/mman.h>      // For mmap, munmap
+#include <sys/stat.h>      // For fstat, S_ISREG, S_ISDIR
+#include <sys/syscall.h>   // For SYS_openat2
+#include <unistd.h>        // For close, pread, read, syscall
+
+// Changes that make a cached entry stale: the content was written, the
+// metadata or link count changed (unlink, or a rename over the path), or the
+// file itself was moved or deleted.
+#define WATCH_EVENTS                                                         \
+  (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF)
+
+typedef struct {
+  const char *extension;
+  const char *type;
+  int compressible; // Text-like; images, fonts and video already are
+} ContentType;
+
+static const ContentType content_types[] = {
+    {"html", "text/html; charset=utf-8", 1},
+    {"htm", "text/html; charset=utf-8", 1},
+    {"css", "text/css; charset=utf-8", 1},
+    {"js", "text/javascript; charset=utf-8", 1},
+    {"mjs", "text/javascript; charset=utf-8", 1},
+    {"json", "application/json", 1},
+    {"txt", "text/plain; charset=utf-8", 1},
+    {"xml", "application/xml", 1},
+    {"svg", "image/svg+xml", 1},
+    {"png", "image/png", 0},
+    {"jpg", "image/jpeg", 0},
+    {"jpeg", "image/jpeg", 0},
+    {"gif", "image/gif", 0},
+    {"webp", "image/webp", 0},
+    {"ico", "image/x-icon", 0},
+    {"wasm", "application/wasm", 1},
+    {"pdf", "application/pdf", 0},
+    {"woff", "font/woff", 0},
+    {"woff2", "font/woff2", 0},
+    {"mp4", "video/mp4", 0},
+};
+
+static const ContentType unknown_type = {"", "application/octet-stream", 0};
+
+static const ContentType *content_type_for(const char *path) {
+  const char *dot = strrchr(path, '.');
+  if (dot && !strchr(dot, '/')) {
+    for (size_t i = 0; i < sizeof(content_types) / sizeof(content_types[0]);
+         ++i) {
+      if (strcasecmp(dot + 1, content_types[i].extension) == 0)
+        return &content_types[i];
+    }
+  }
+  return &unknown_type;
+}
+
+// FNV-1a over the path
+static uint32_t hash_path(const char *path) {
+  uint32_t h = 2166136261u;
+  for (; *path; ++path) {
+    h ^= (unsigned char)*path;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+int file_cache_init(FileCache *cache, const char *doc_root) {
+  memset(cache, 0, sizeof(*cache));
+  cache->inotify_fd = -1;
+  cache->root_fd = open(doc_root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (cache->root_fd < 0) {
+    fprintf(stderr, "Failed to open document root %s: %s\n", doc_root,
+            strerror(errno));
+    return -1;
+  }
+  cache->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (cache->inotify_fd < 0) {
+    fprintf(stderr, "inotify_init1 failed: %s\n", strerror(errno));
+    close(cache->root_fd);
+    cache->root_fd = -1;
+    return -1;
+  }
+  return 0;
+}
+
+static void destroy_entry(FileEntry *entry) {
+  if (entry->map)
+    munmap(entry->map, (size_t)entry->size);
+  if (entry->fd >= 0)
+    close(entry->fd);
+  for (int c = 0; c < CONTENT_CODINGS; ++c)
+    free(entry->variants[c]);
+  free(entry->headers);
+  free(entry->path);
+  free(entry);
+}
+
+void file_cache_release(FileEntry *entry) {
+  if (entry && --entry->refs == 0)
+    destroy_entry(entry);
+}
+
+static void lru_unlink(FileCache *cache, FileEntry *entry) {
+  if (entry->lru_prev)
+    entry->lru_prev->lru_next = entry->lru_next;
+  else
+    cache->lru_head = entry->lru_next;
+  if (entry->lru_next)
+    entry->lru_next->lru_prev = entry->lru_prev;
+  else
+    cache->lru_tail = entry->lru_prev;
+}
+
+static void lru_push(FileCache *cache, FileEntry *entry) {
+  entry->lru_prev = NULL;
+  entry->lru_next = cache->lru_head;
+  if (cache->lru_head)
+    cache->lru_head->lru_prev = entry;
+  else
+    cache->lru_tail = entry;
+  cache->lru_head = entry;
+}
+
+// Take an entry out of the cache. Responses still holding it keep it alive.
+static void evict_entry(FileCache *cache, FileEntry *entry) {
+  FileEntry **link = &cache->buckets[entry->hash & (FILE_CACHE_BUCKETS - 1)];
+  while (*link != entry)
+    link = &(*link)->hash_next;
+  *link = entry->hash_next;
+  lru_unlink(cache, entry);
+  cache->count--;
+  cache->variant_bytes -= entry->variant_bytes;
+  entry->cached = 0;
+
+  // Hard links to one inode share a watch, so it is only removed with the
+  // last entry using it
+  int shared = 0;
+  for (FileEntry *e = cache->lru_head; e && !shared; e = e->lru_next)
+    shared = e->wd == entry->wd;
+  if (!shared)
+    inotify_rm_watch(cache->inotify_fd, entry->wd);
+  file_cache_release(entry);
+}
+
+void file_cache_destroy(FileCache *cache) {
+  while (cache->lru_head)
+    evict_entry(cache, cache->lru_head);
+  if (cache->inotify_fd >= 0)
+    close(cache->inotify_fd);
+  if (cache->root_fd >= 0)
+    close(cache->root_fd);
+  cache->inotify_fd = cache->root_fd = -1;
+}
+
+// Open 'path' below the root. openat2() with RESOLVE_BENEATH also refuses
+// symlinks that lead outside the root; kernels without it fall back to a
+// plain openat().
+static int open_beneath(int root_fd, const char *path) {
+#ifdef SYS_openat2
+  struct open_how how = {.flags = O_RDONLY | O_CLOEXEC | O_NOCTTY,
+                         .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS};
+  int fd = (int)syscall(SYS_openat2, root_fd, path, &how, sizeof(how));
+  if (fd >= 0 || errno != ENOSYS)
+    return fd;
+#endif
+  return openat(root_fd, path, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+}
+
+// Format the header lines sent with every response for this file
+static int build_headers(FileEntry *entry, const struct stat *st) {
+  char date[HTTP_DATE_SIZE];
+  if (formatHttpDate(st->st_mtime, date, sizeof(date)) == 0)
+    return -1;
+  // Size, modification time and inode change whenever the file does
+  unsigned long long mtime_ns =
+      (unsigned long long)st->st_mtim.tv_sec * 1000000000ull +
+      (unsigned long long)st->st_mtim.tv_nsec;
+  char etag[64];
+  int etag_len = snprintf(etag, sizeof(etag), "\"%llx-%llx-%llx\"",
+                          (unsigned long long)st->st_ino,
+                          (unsigned long long)st->st_size, mtime_ns);
+
+  size_t size = 320 + (size_t)etag_len;
+  entry->headers = malloc(size);
+  if (!entry->headers)
+    return -1;
+  int validators = snprintf(entry->headers, size,
+                            "ETag: %s\r\nLast-Modified: %s\r\n", etag, date);
+  const ContentType *type = content_type_for(entry->path);
+  entry->content_type = type->type;
+  entry->compressible = type->compressible &&
+                        st->st_size >= COMPRESS_MIN_SIZE &&
+                        st->st_size <= COMPRESS_FILE_MAX;
+  int common = snprintf(entry->headers + validators, size - validators,
+                        "Content-Type: %s\r\nAccept-Ranges: bytes\r\n%s",
+                        type->type,
+                        entry->compressible ? "Vary: Accept-Encoding\r\n"
+                                            : "");
+  int length = snprintf(entry->headers + validators + common,
+                        size - validators - common,
+                        "Content-Length: %llu\r\n",
+                        (unsigned long long)st->st_size);
+  entry->validators_len = (size_t)validators;
+  entry->common_len = (size_t)(validators + common);
+  entry->headers_len = (size_t)(validators + common + length);
+  entry->etag = entry->headers + strlen("ETag: ");
+  entry->etag_len = (size_t)etag_len;
+  entry->last_modified =
+      entry->headers + strlen("ETag: ") + etag_len + strlen("\r\n") +
+      strlen("Last-Modified: ");
+  entry->last_modified_len = strlen(date);
+  return 0;
+}
+
+// Open a file that is not cached yet and list it
+static FileEntry *load_entry(FileCache *cache, const char *path,
+                             uint32_t hash) {
+  int fd = open_beneath(cache->root_fd, path);
+  if (fd < 0)
+    return NULL;
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return NULL;
+  }
+  if (!S_ISREG(st.st_mode)) {
+    close(fd);
+    errno = S_ISDIR(st.st_mode) ? EISDIR : ENOENT;
+    return NULL;
+  }
+
+  FileEntry *entry = calloc(1, sizeof(*entry));
+  if (!entry) {
+    close(fd);
+    return NULL;
+  }
+  entry->fd = fd;
+  entry->size = st.st_size;
+  entry->mtime = st.st_mtime;
+  entry->hash = hash;
+  entry->refs = 1; // The caller's reference
+  entry->path = strdup(path);
+  if (!entry->path || build_headers(entry, &st) < 0) {
+    destroy_entry(entry);
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  // Watch the inode through the descriptor, so the watch is on exactly the
+  // file that was opened. Without a watch the entry can not be trusted to
+  // stay fresh, so it only serves this one request.
+  char proc_path[64];
+  snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+  entry->wd = inotify_add_watch(cache->inotify_fd, proc_path, WATCH_EVENTS);
+  if (entry->wd < 0)
+    return entry;
+
+  if (cache->count >= FILE_CACHE_ENTRIES)
+    evict_entry(cache, cache->lru_tail);
+  FileEntry **bucket = &cache->buckets[hash & (FILE_CACHE_BUCKETS - 1)];
+  entry->hash_next = *bucket;
+  *bucket = entry;
+  lru_push(cache, entry);
+  cache->count++;
+  entry->cached = 1;
+  entry->refs++; // The cache's reference
+  return entry;
+}
+
+FileEntry *file_cache_open(FileCache *cache, const char *path) {
+  uint32_t hash = hash_path(path);
+  FileEntry *entry = cache->buckets[hash & (FILE_CACHE_BUCKETS - 1)];
+  while (entry && (entry->hash != hash || strcmp(entry->path, path) != 0))
+    entry = entry->hash_next;
+
+  if (!entry) {
+    cache->misses++;
+    return load_entry(cache, path, hash);
+  }
+  cache->hits++;
+  if (cache->lru_head != entry) {
+    lru_unlink(cache, entry);
+    lru_push(cache, entry);
+  }
+  entry->hits++;
+  entry->refs++;
+
+  // Small files that keep being requested are mapped, so their body leaves
+  // in the same sendmsg() as the head instead of a separate sendfile().
+  // The mapping is only ever read by the kernel, so a file truncated under
+  // it makes the send fail with EFAULT rather than raise SIGBUS.
+  if (!entry->map && !entry->map_failed && entry->size > 0 &&
+      entry->size <= FILE_MMAP_MAX_SIZE &&
+      entry->hits >= FILE_MMAP_MIN_HITS) {
+    void *map =
+        mmap(NULL, (size_t)entry->size, PROT_READ, MAP_SHARED, entry->fd, 0);
+    if (map == MAP_FAILED)
+      entry->map_failed = 1;
+    else
+      entry->map = map;
+  }
+  return entry;
+}
+
+// Read the whole file, from its mapping if it has one. Returns a buffer
+// to free (NULL when the mapping is used) or NULL with *data unset.
+static char *read_whole(const FileEntry *entry, const char **data) {
+  if (entry->map) {
+    *data = entry->map;
+    return NULL;
+  }
+  char *copy = malloc((size_t)entry->size);
+  if (!copy)
+    return NULL;
+  size_t done = 0;
+  while (done < (size_t)entry->size) {
+    ssize_t n = pread(entry->fd, copy + done, (size_t)entry->size - done,
+                      (off_t)done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      free(copy); // Truncated under us; inotify drops the entry
+      return NULL;
+    }
+    done += (size_t)n;
+  }
+  *data = copy;
+  return copy;
+}
+
+// Make room for 'bytes' more variant bytes by dropping the least recently
+// used entries that hold variants, never 'keep'
+static int make_variant_room(FileCache *cache, const FileEntry *keep,
+                             size_t bytes) {
+  FileEntry *entry = cache->lru_tail;
+  while (cache->variant_bytes + bytes > COMPRESS_CACHE_BYTES && entry) {
+    FileEntry *prev = entry->lru_prev;
+    if (entry != keep && entry->variant_bytes > 0)
+      evict_entry(cache, entry);
+    entry = prev;
+  }
+  return cache->variant_bytes + bytes <= COMPRESS_CACHE_BYTES ? 0 : -1;
+}
+
+static FileVariant *compress_entry(const FileEntry *entry,
+                                   ContentCoding coding, Compressor *z) {
+  const char *data = NULL;
+  char *copy = read_whole(entry, &data);
+  if (!data)
+    return NULL;
+  // Room for a body smaller than the file, then the header lines
+  size_t head_room = 256 + entry->etag_len + entry->last_modified_len +
+                     strlen(entry->content_type);
+  size_t cap = (size_t)entry->size - 1;
+  FileVariant *v = malloc(sizeof(*v) + cap + head_room);
+  if (!v) {
+    free(copy);
+    return NULL;
+  }
+  ssize_t len = compress_buffer(z, coding, COMPRESS_LEVEL_STATIC, data,
+                                (size_t)entry->size, v->data, cap);
+  free(copy);
+  if (len < 0) {
+    free(v);
+    return NULL;
+  }
+  // A compressed body is a different representation: its ETag is made
+  // weak, so validation still matches while ranges never mix the two
+  int head_len = snprintf(
+      v->data + len, head_room,
+      "ETag: W/%.*s\r\nLast-Modified: %.*s\r\nContent-Type: %s\r\n"
+      "Content-Encoding: %s\r\nVary: Accept-Encoding\r\n"
+      "Content-Length: %zd\r\n",
+      (int)entry->etag_len, entry->etag, (int)entry->last_modified_len,
+      entry->last_modified, entry->content_type,
+      content_coding_name(coding), len);
+  if (head_len < 0 || (size_t)head_len >= head_room) {
+    free(v);
+    return NULL;
+  }
+  FileVariant *shrunk =
+      realloc(v, sizeof(*v) + (size_t)len + (size_t)head_len);
+  if (shrunk)
+    v = shrunk;
+  v->body = v->data;
+  v->body_len = (size_t)len;
+  v->headers = v->data + len;
+  v->headers_len = (size_t)head_len;
+  return v;
+}
+
+const FileVariant *file_cache_variant(FileCache *cache, FileEntry *entry,
+                                      ContentCoding coding, Compressor *z) {
+  if (coding == CODING_IDENTITY || !entry->compressible)
+    return NULL;
+  if (entry->variants[coding])
+    return entry->variants[coding];
+  // An entry that is not listed only serves one request, and a file that
+  // did not shrink once will not shrink the next time either
+  if (!entry->cached || (entry->variants_refused & (1u << coding)))
+    return NULL;
+
+  FileVariant *v = compress_entry(entry, coding, z);
+  size_t bytes = v ? sizeof(*v) + v->body_len + v->headers_len : 0;
+  if (!v || make_variant_room(cache, entry, bytes) < 0) {
+    free(v);
+    entry->variants_refused |= 1u << coding;
+    return NULL;
+  }
+  entry->variants[coding] = v;
+  entry->variant_bytes += bytes;
+  cache->variant_bytes += bytes;
+  return v;
+}
+
+void file_cache_process_events(FileCache *cache) {
+  // Aligned for struct inotify_event, with room for the longest name
+  char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  for (;;) {
+    ssize_t n = read(cache->inotify_fd, buffer, sizeof(buffer));
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR)
+        continue;
+      return; // EAGAIN once the queue is empty
+    }
+    for (char *p = buffer; p < buffer + n;) {
+      const struct inotify_event *event = (const struct inotify_event *)p;
+      p += sizeof(*event) + event->len;
+      if (event->mask & IN_IGNORED)
+        continue; // The watch is gone already
+      FileEntry *entry = cache->lru_head;
+      while (entry) {
+        FileEntry *next = entry->lru_next;
+        if (entry->wd == event->wd)
+          evict_entry(cache, entry);
+        entry = next;
+      }
+    }
+  }
+}
@@ -0,0 +1,533 @@
+#include "../include/hpack.h"
+
+#include <string.h> // For memcpy
+
+// Representations, told apart by their leading bits (RFC 7541, 6)
+#define INDEXED 0x80           // 1xxxxxxx: a field from the tables
+#define LITERAL_INDEXED 0x40   // 01xxxxxx: literal, added to the table
+#define SIZE_UPDATE 0x20       // 001xxxxx: dynamic table size update
+                               // 000xxxxx: literal, not added
+#define HUFFMAN 0x80           // First byte of a Huffman coded string
+#define ENTRY_OVERHEAD 32      // Bytes an entry counts beyond its strings
+#define STATIC_ENTRIES 61
+
+#define FIELD(name, value)                                                     \
+  {{name, sizeof(name) - 1}, {value, sizeof(value) - 1}}
+
+// The static table (RFC 7541, Appendix A), index 1 first
+static const struct {
+  StringView name, value;
+} static_table[STATIC_ENTRIES] = {
+    FIELD(":authority", ""),
+    FIELD(":method", "GET"),
+    FIELD(":method", "POST"),
+    FIELD(":path", "/"),
+    FIELD(":path", "/index.html"),
+    FIELD(":scheme", "http"),
+    FIELD(":scheme", "https"),
+    FIELD(":status", "200"),
+    FIELD(":status", "204"),
+    FIELD(":status", "206"),
+    FIELD(":status", "304"),
+    FIELD(":status", "400"),
+    FIELD(":status", "404"),
+    FIELD(":status", "500"),
+    FIELD("accept-charset", ""),
+    FIELD("accept-encoding", "gzip, deflate"),
+    FIELD("accept-language", ""),
+    FIELD("accept-ranges", ""),
+    FIELD("accept", ""),
+    FIELD("access-control-allow-origin", ""),
+    FIELD("age", ""),
+    FIELD("allow", ""),
+    FIELD("authorization", ""),
+    FIELD("cache-control", ""),
+    FIELD("content-disposition", ""),
+    FIELD("content-encoding", ""),
+    FIELD("content-language", ""),
+    FIELD("content-length", ""),
+    FIELD("content-location", ""),
+    FIELD("content-range", ""),
+    FIELD("content-type", ""),
+    FIELD("cookie", ""),
+    FIELD("date", ""),
+    FIELD("etag", ""),
+    FIELD("expect", ""),
+    FIELD("expires", ""),
+    FIELD("from", ""),
+    FIELD("host", ""),
+    FIELD("if-match", ""),
+    FIELD("if-modified-since", ""),
+    FIELD("if-none-match", ""),
+    FIELD("if-range", ""),
+    FIELD("if-unmodified-since", ""),
+    FIELD("last-modified", ""),
+    FIELD("link", ""),
+    FIELD("location", ""),
+    FIELD("max-forwards", ""),
+    FIELD("proxy-authenticate", ""),
+    FIELD("proxy-authorization", ""),
+    FIELD("range", ""),
+    FIELD("referer", ""),
+    FIELD("refresh", ""),
+    FIELD("retry-after", ""),
+    FIELD("server", ""),
+    FIELD("set-cookie", ""),
+    FIELD("strict-transport-security", ""),
+    FIELD("transfer-encoding", ""),
+    FIELD("user-agent", ""),
+    FIELD("vary", ""),
+    FIELD("via", ""),
+    FIELD("www-authenticate", ""),
+};
+
+// The Huffman code (RFC 7541, Appendix B) is canonical: sorted by length,
+// then by symbol, the codes count upwards. Encoding looks a symbol's code
+// up directly. Decoding tries one length after the other: the codes of
+// length L are huffman_first[L] onwards, huffman_count[L] of them, and
+// stand for the symbols from huffman_offset[L] on in huffman_symbols.
+static const uint32_t huffman_codes[257] = {
+    0x00001ff8, 0x007fffd8, 0x0fffffe2, 0x0fffffe3, 0x0fffffe4, 0x0fffffe5,
+    0x0fffffe6, 0x0fffffe7, 0x0fffffe8, 0x00ffffea, 0x3ffffffc, 0x0fffffe9,
+    0x0fffffea, 0x3ffffffd, 0x0fffffeb, 0x0fffffec, 0x0fffffed, 0x0fffffee,
+    0x0fffffef, 0x0ffffff0, 0x0ffffff1, 0x0ffffff2, 0x3ffffffe, 0x0ffffff3,
+    0x0ffffff4, 0x0ffffff5, 0x0ffffff6, 0x0ffffff7, 0x0ffffff8, 0x0ffffff9,
+    0x0ffffffa, 0x0ffffffb, 0x00000014, 0x000003f8, 0x000003f9, 0x00000ffa,
+    0x00001ff9, 0x00000015, 0x000000f8, 0x000007fa, 0x000003fa, 0x000003fb,
+    0x000000f9, 0x000007fb, 0x000000fa, 0x00000016, 0x00000017, 0x00000018,
+    0x00000000, 0x00000001, 0x00000002, 0x00000019, 0x0000001a, 0x0000001b,
+    0x0000001c, 0x0000001d, 0x0000001e, 0x0000001f, 0x0000005c, 0x000000fb,
+    0x00007ffc, 0x00000020, 0x00000ffb, 0x000003fc, 0x00001ffa, 0x00000021,
+    0x0000005d, 0x0000005e, 0x0000005f, 0x00000060, 0x00000061, 0x00000062,
+    0x00000063, 0x00000064, 0x00000065, 0x00000066, 0x00000067, 0x00000068,
+    0x00000069, 0x0000006a, 0x0000006b, 0x0000006c, 0x0000006d, 0x0000006e,
+    0x0000006f, 0x00000070, 0x00000071, 0x00000072, 0x000000fc, 0x00000073,
+    0x000000fd, 0x00001ffb, 0x0007fff0, 0x00001ffc, 0x00003ffc, 0x00000022,
+    0x00007ffd, 0x00000003, 0x00000023, 0x00000004, 0x00000024, 0x00000005,
+    0x00000025, 0x00000026, 0x00000027, 0x00000006, 0x00000074, 0x00000075,
+    0x00000028, 0x00000029, 0x0000002a, 0x00000007, 0x0000002b, 0x00000076,
+    0x0000002c, 0x00000008, 0x00000009, 0x0000002d, 0x00000077, 0x00000078,
+    0x00000079, 0x0000007a, 0x0000007b, 0x00007ffe, 0x000007fc, 0x00003ffd,
+    0x00001ffd, 0x0ffffffc, 0x000fffe6, 0x003fffd2, 0x000fffe7, 0x000fffe8,
+    0x003fffd3, 0x003fffd4, 0x003fffd5, 0x007fffd9, 0x003fffd6, 0x007fffda,
+    0x007fffdb, 0x007fffdc, 0x007fffdd, 0x007fffde, 0x00ffffeb, 0x007fffdf,
+    0x00ffffec, 0x00ffffed, 0x003fffd7, 0x007fffe0, 0x00ffffee, 0x007fffe1,
+    0x007fffe2, 0x007fffe3, 0x007fffe4, 0x001fffdc, 0x003fffd8, 0x007fffe5,
+    0x003fffd9, 0x007fffe6, 0x007fffe7, 0x00ffffef, 0x003fffda, 0x001fffdd,
+    0x000fffe9, 0x003fffdb, 0x003fffdc, 0x007fffe8, 0x007fffe9, 0x001fffde,
+    0x007fffea, 0x003fffdd, 0x003fffde, 0x00fffff0, 0x001fffdf, 0x003fffdf,
+    0x007fffeb, 0x007fffec, 0x001fffe0, 0x001fffe1, 0x003fffe0, 0x001fffe2,
+    0x007fffed, 0x003fffe1, 0x007fffee, 0x007fffef, 0x000fffea, 0x003fffe2,
+    0x003fffe3, 0x003fffe4, 0x007ffff0, 0x003fffe5, 0x003fffe6, 0x007ffff1,
+    0x03ffffe0, 0x03ffffe1, 0x000fffeb, 0x0007fff1, 0x003fffe7, 0x007ffff2,
+    0x003fffe8, 0x01ffffec, 0x03ffffe2, 0x03ffffe3, 0x03ffffe4, 0x07ffffde,
+    0x07ffffdf, 0x03ffffe5, 0x00fffff1, 0x01ffffed, 0x0007fff2, 0x001fffe3,
+    0x03ffffe6, 0x07ffffe0, 0x07ffffe1, 0x03ffffe7, 0x07ffffe2, 0x00fffff2,
+    0x001fffe4, 0x001fffe5, 0x03ffffe8, 0x03ffffe9, 0x0ffffffd, 0x07ffffe3,
+    0x07ffffe4, 0x07ffffe5, 0x000fffec, 0x00fffff3, 0x000fffed, 0x001fffe6,
+    0x003fffe9, 0x001fffe7, 0x001fffe8, 0x007ffff3, 0x003fffea, 0x003fffeb,
+    0x01ffffee, 0x01ffffef, 0x00fffff4, 0x00fffff5, 0x03ffffea, 0x007ffff4,
+    0x03ffffeb, 0x07ffffe6, 0x03ffffec, 0x03ffffed, 0x07ffffe7, 0x07ffffe8,
+    0x07ffffe9, 0x07ffffea, 0x07ffffeb, 0x0ffffffe, 0x07ffffec, 0x07ffffed,
+    0x07ffffee, 0x07ffffef, 0x07fffff0, 0x03ffffee, 0x3fffffff,
+};
+
+static const uint8_t huffman_lengths[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+static const uint16_t huffman_symbols[257] = {
+    48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37,
+    45, 46, 47, 51, 52, 53, 54, 55, 56, 57, 61, 65,
+    95, 98, 100, 102, 103, 104, 108, 109, 110, 112, 114, 117,
+    58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+    77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89,
+    106, 107, 113, 118, 119, 120, 121, 122, 38, 42, 44, 59,
+    88, 90, 33, 34, 40, 41, 63, 39, 43, 124, 35, 62,
+    0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+    195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161,
+    167, 172, 176, 177, 179, 209, 216, 217, 227, 229, 230, 129,
+    132, 133, 134, 136, 146, 154, 156, 160, 163, 164, 169, 170,
+    173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+    233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150,
+    151, 152, 155, 157, 158, 165, 166, 168, 174, 175, 180, 182,
+    183, 188, 191, 197, 231, 239, 9, 142, 144, 145, 148, 159,
+    171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+    200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243,
+    255, 203, 204, 211, 212, 214, 221, 222, 223, 241, 244, 245,
+    246, 247, 248, 250, 251, 252, 253, 254, 2, 3, 4, 5,
+    6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+    21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220,
+    249, 10, 13, 22, 256,
+};
+
+static const uint32_t huffman_first[31] = {
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000014, 0x0000005c, 0x000000f8, 0x000001fc, 0x000003f8, 0x000007fa,
+    0x00000ffa, 0x00001ff8, 0x00003ffc, 0x00007ffc, 0x0000fffe, 0x0001fffc,
+    0x0003fff8, 0x0007fff0, 0x000fffe6, 0x001fffdc, 0x003fffd2, 0x007fffd8,
+    0x00ffffea, 0x01ffffec, 0x03ffffe0, 0x07ffffde, 0x0fffffe2, 0x1ffffffe,
+    0x3ffffffc,
+};
+
+static const uint16_t huffman_count[31] = {
+    0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3,
+    0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4,
+};
+
+static const uint16_t huffman_offset[31] = {
+    0, 0, 0, 0, 0, 0, 10, 36, 68, 74, 74, 79, 82, 84, 90, 92,
+    95, 95, 95, 95, 98, 106, 119, 145, 174, 186, 190, 205, 224, 253, 253,
+};
+
+// Decoded strings that can not be viewed in place
+typedef struct {
+  char *buf;
+  size_t used;
+  size_t size;
+} Scratch;
+
+static unsigned char to_lower(unsigned char c) {
+  return c >= 'A' && c <= 'Z' ? (unsigned char)(c + ('a' - 'A')) : c;
+}
+
+// Decode an integer whose first byte keeps 'prefix_bits' bits for it.
+// Returns 0 on success or -1 if it is truncated or implausibly large.
+static int decode_integer(const uint8_t **p, const uint8_t *end,
+                          unsigned prefix_bits, uint32_t *out) {
+  uint32_t mask = (1u << prefix_bits) - 1;
+  uint32_t value = *(*p)++ & mask;
+  if (value < mask) {
+    *out = value;
+    return 0;
+  }
+  // Four continuation bytes reach 2^28, more than any length or index
+  for (unsigned shift = 0; *p < end && shift <= 21; shift += 7) {
+    uint8_t b = *(*p)++;
+    value += (uint32_t)(b & 0x7f) << shift;
+    if (!(b & 0x80)) {
+      *out = value;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// Decode 'len' Huffman coded bytes into the scratch buffer. The padding at
+// the end has to be a prefix of EOS, shorter than a byte.
+static int huffman_decode(const uint8_t *in, size_t len, Scratch *s,
+                          StringView *out) {
+  char *dst = s->buf + s->used;
+  size_t room = s->size - s->used, n = 0, i = 0;
+  uint64_t acc = 0; // Undecoded bits, left aligned
+  unsigned bits = 0;
+  for (;;) {
+    while (bits <= 56 && i < len) {
+      acc |= (uint64_t)in[i++] << (56 - bits);
+      bits += 8;
+    }
+    if (bits == 0)
+      break;
+    int symbol = -1;
+    unsigned l;
+    for (l = 5; l <= 30 && l <= bits; ++l) {
+      uint32_t code = (uint32_t)(acc >> (64 - l));
+      if (code - huffman_first[l] < huffman_count[l]) {
+        symbol = huffman_symbols[huffman_offset[l] + code - huffman_first[l]];
+        break;
+      }
+    }
+    if (symbol < 0) {
+      // Out of input in the middle of a code: only padding may be left
+      if (bits > 7 || acc >> (64 - bits) != (1u << bits) - 1)
+        return -1;
+      break;
+    }
+    if (symbol == 256 || n == room)
+      return -1; // EOS must not appear in a string
+    dst[n++] = (char)symbol;
+    acc <<= l;
+    bits -= l;
+  }
+  s->used += n;
+  *out = (StringView){dst, n};
+  return 0;
+}
+
+// Decode a string literal: plain ones are viewed where they are, Huffman
+// coded ones are decoded into the scratch buffer
+static int decode_string(const uint8_t **p, const uint8_t *end, Scratch *s,
+                         StringView *out) {
+  if (*p == end)
+    return -1;
+  int huffman = (**p & HUFFMAN) != 0;
+  uint32_t len;
+  if (decode_integer(p, end, 7, &len) < 0 || len > (size_t)(end - *p))
+    return -1;
+  const uint8_t *data = *p;
+  *p += len;
+  if (huffman)
+    return huffman_decode(data, len, s, out);
+  *out = (StringView){(const char *)data, len};
+  return 0;
+}
+
+// Copy 'len' bytes of the ring from 'offset' on, which may wrap around its
+// end, into the scratch buffer
+static int copy_from_ring(const HpackDecoder *D, size_t offset, size_t len,
+                          Scratch *s, StringView *out) {
+  if (len > s->size - s->used)
+    return -1;
+  char *dst = s->buf + s->used;
+  size_t first = HPACK_TABLE_SIZE - offset < len ? HPACK_TABLE_SIZE - offset
+                                                 : len;
+  memcpy(dst, D->ring + offset, first);
+  memcpy(dst + first, D->ring, len - first);
+  s->used += len;
+  *out = (StringView){dst, len};
+  return 0;
+}
+
+// Look up a field of the static or dynamic table. 'value' may be NULL when
+// only the name is needed.
+static int table_field(const HpackDecoder *D, uint32_t index, Scratch *s,
+                       StringView *name, StringView *value) {
+  if (index == 0)
+    return -1;
+  if (index <= STATIC_ENTRIES) {
+    *name = static_table[index - 1].name;
+    if (value)
+      *value = static_table[index - 1].value;
+    return 0;
+  }
+  // The newest entry comes right after the static table
+  size_t age = index - STATIC_ENTRIES - 1;
+  if (age >= D->count)
+    return -1;
+  const HpackEntry *e =
+      &D->entries[(D->first + D->count - 1 - age) % HPACK_MAX_ENTRIES];
+  if (copy_from_ring(D, e->offset, e->name_len, s, name) < 0)
+    return -1;
+  if (value && copy_from_ring(D, (e->offset + e->name_len) % HPACK_TABLE_SIZE,
+                              e->value_len, s, value) < 0)
+    return -1;
+  return 0;
+}
+
+static void evict_oldest(HpackDecoder *D) {
+  const HpackEntry *e = &D->entries[D->first];
+  D->size -= e->name_len + e->value_len + ENTRY_OVERHEAD;
+  D->first = (D->first + 1) % HPACK_MAX_ENTRIES;
+  D->count--;
+}
+
+static void evict_to(HpackDecoder *D, size_t max_size) {
+  while (D->count > 0 && D->size > max_size)
+    evict_oldest(D);
+}
+
+// Write bytes at the ring's head, wrapping around its end
+static void ring_write(HpackDecoder *D, StringView v) {
+  size_t first = HPACK_TABLE_SIZE - D->head < v.len ? HPACK_TABLE_SIZE - D->head
+                                                    : v.len;
+  memcpy(D->ring + D->head, v.ptr, first);
+  memcpy(D->ring, v.ptr + first, v.len - first);
+  D->head = (D->head + v.len) % HPACK_TABLE_SIZE;
+}
+
+// Add a field to the dynamic table. The strings are never in the ring
+// themselves, so evicting first is safe. The bytes of the live entries
+// never exceed the table size, so the ring can not overrun its tail.
+static void table_insert(HpackDecoder *D, StringView name, StringView value) {
+  size_t size = name.len + value.len + ENTRY_OVERHEAD;
+  if (size > D->max_size) {
+    evict_to(D, 0); // Too large for the table: it only empties it
+    return;
+  }
+  evict_to(D, D->max_size - size);
+  HpackEntry *e = &D->entries[(D->first + D->count) % HPACK_MAX_ENTRIES];
+  e->offset = (uint32_t)D->head;
+  e->name_len = (uint32_t)name.len;
+  e->value_len = (uint32_t)value.len;
+  ring_write(D, name);
+  ring_write(D, value);
+  D->count++;
+  D->size += size;
+}
+
+void hpack_decoder_init(HpackDecoder *D) {
+  D->first = D->count = D->head = D->size = 0;
+  D->max_size = HPACK_TABLE_SIZE;
+}
+
+int hpack_decode(HpackDecoder *D, const uint8_t *block, size_t len,
+                 char *scratch, size_t scratch_size, HpackFieldSink sink,
+                 void *ctx) {
+  const uint8_t *p = block, *end = block + len;
+  Scratch s = {scratch, 0, scratch_size};
+  int fields = 0;
+  while (p < end) {
+    uint8_t b = *p;
+    uint32_t index;
+    StringView name, value;
+    if (b & INDEXED) {
+      if (decode_integer(&p, end, 7, &index) < 0 ||
+          table_field(D, index, &s, &name, &value) < 0)
+        return -1;
+    } else if ((b & 0xe0) == SIZE_UPDATE) {
+      // Only at the start of a block, and within what we announced
+      if (fields > 0 || decode_integer(&p, end, 5, &index) < 0 ||
+          index > HPACK_TABLE_SIZE)
+        return -1;
+      D->max_size = index;
+      evict_to(D, D->max_size);
+      continue;
+    } else {
+      // A literal: indexed, without indexing or never indexed, with either
+      // a name from the tables or a literal one
+      int indexed = (b & 0xc0) == LITERAL_INDEXED;
+      if (decode_integer(&p, end, indexed ? 6 : 4, &index) < 0)
+        return -1;
+      if (index > 0 ? table_field(D, index, &s, &name, NULL) < 0
+                    : decode_string(&p, end, &s, &name) < 0)
+        return -1;
+      if (decode_string(&p, end, &s, &value) < 0)
+        return -1;
+      if (indexed)
+        table_insert(D, name, value);
+    }
+    fields++;
+    sink(ctx, name, value);
+  }
+  return 0;
+}
+
+// Encode an integer into a first byte holding 'first_bits' above a
+// 'prefix_bits' prefix, followed by continuation bytes as needed
+static size_t encode_integer(uint8_t *out, uint8_t first_bits,
+                             unsigned prefix_bits, size_t value) {
+  size_t mask = ((size_t)1 << prefix_bits) - 1;
+  if (value < mask) {
+    out[0] = (uint8_t)(first_bits | value);
+    return 1;
+  }
+  out[0] = (uint8_t)(first_bits | mask);
+  value -= mask;
+  size_t n = 1;
+  for (; value >= 0x80; value >>= 7)
+    out[n++] = (uint8_t)(0x80 | (value & 0x7f));
+  out[n++] = (uint8_t)value;
+  return n;
+}
+
+// Bytes the Huffman code of a string takes, padding included
+static size_t huffman_length(StringView v, int lower) {
+  size_t bits = 0;
+  for (size_t i = 0; i < v.len; ++i) {
+    unsigned char c = (unsigned char)v.ptr[i];
+    bits += huffman_lengths[lower ? to_lower(c) : c];
+  }
+  return (bits + 7) / 8;
+}
+
+static size_t huffman_encode(uint8_t *out, StringView v, int lower) {
+  uint64_t acc = 0; // Pending bits, right aligned
+  unsigned bits = 0;
+  size_t n = 0;
+  for (size_t i = 0; i < v.len; ++i) {
+    unsigned char c = (unsigned char)v.ptr[i];
+    if (lower)
+      c = to_lower(c);
+    acc = acc << huffman_lengths[c] | huffman_codes[c];
+    bits += huffman_lengths[c];
+    while (bits >= 8) {
+      bits -= 8;
+      out[n++] = (uint8_t)(acc >> bits);
+    }
+    acc &= ((uint64_t)1 << bits) - 1;
+  }
+  // Pad with the most significant bits of EOS, which are all ones
+  if (bits > 0)
+    out[n++] = (uint8_t)(acc << (8 - bits) | (0xffu >> bits));
+  return n;
+}
+
+// Encode a string literal, Huffman coded if that is shorter
+static size_t encode_string(uint8_t *out, StringView v, int lower) {
+  size_t coded = huffman_length(v, lower);
+  if (coded < v.len) {
+    size_t n = encode_integer(out, HUFFMAN, 7, coded);
+    return n + huffman_encode(out + n, v, lower);
+  }
+  size_t n = encode_integer(out, 0, 7, v.len);
+  for (size_t i = 0; i < v.len; ++i) {
+    unsigned char c = (unsigned char)v.ptr[i];
+    out[n + i] = lower ? to_lower(c) : c;
+  }
+  return n + v.len;
+}
+
+size_t hpack_encode_status(uint8_t *out, unsigned status) {
+  // Static table entries 8 to 14
+  static const unsigned indexed[] = {200, 204, 206, 304, 400, 404, 500};
+  for (size_t i = 0; i < sizeof(indexed) / sizeof(indexed[0]); ++i) {
+    if (indexed[i] == status) {
+      out[0] = (uint8_t)(INDEXED | (8 + i));
+      return 1;
+    }
+  }
+  // A literal with the name of entry 8, ":status"
+  out[0] = 8;
+  out[1] = 3;
+  out[2] = (uint8_t)('0' + status / 100 % 10);
+  out[3] = (uint8_t)('0' + status / 10 % 10);
+  out[4] = (uint8_t)('0' + status % 10);
+  return 5;
+}
+
+// Find a header name in the static table, ignoring case. Returns its
+// index, or 0 if it is not there.
+static uint32_t static_name_index(StringView name) {
+  for (uint32_t i = 15; i <= STATIC_ENTRIES; ++i) {
+    const StringView *n = &static_table[i - 1].name;
+    if (n->len != name.len)
+      continue;
+    size_t j = 0;
+    while (j < name.len && to_lower((unsigned char)name.ptr[j]) ==
+                               (unsigned char)n->ptr[j])
+      ++j;
+    if (j == name.len)
+      return i;
+  }
+  return 0;
+}
+
+ssize_t hpack_encode_field(uint8_t *out, size_t room, StringView name,
+                           StringView value) {
+  // Integers take at most 6 bytes here, and Huffman coding never grows a
+  // string
+  if (room < name.len + value.len + 18)
+    return -1;
+  uint32_t index = static_name_index(name);
+  size_t n = encode_integer(out, 0, 4, index);
+  if (index == 0)
+    n += encode_string(out + n, name, 1);
+  n += encode_string(out + n, value, 0);
+  return (ssize_t)n;
+}
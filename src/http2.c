@@ -0,0 +1,1243 @@
+// memmem() is a GNU extension
+#define _GNU_SOURCE
+#include "../include/http2.h"
+#include "../include/http_scan.h"      // For scanToken
+#include "../include/memory_budget.h"  // For memory_budget_reserve
+#include "../include/metrics.h"        // For metrics_add, metrics_now
+#include "../include/server.h"         // For handle_stream_request
+#include "../include/signal_handler.h" // For draining
+
+#include <stdio.h>  // For fprintf, perror
+#include <stdlib.h> // For malloc, calloc, free
+#include <string.h> // For memcmp, memcpy, memmove, memchr, memmem
+
+// The client's connection preface (RFC 9113, 3.4)
+static const char preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+#define PREFACE_LEN (sizeof(preface) - 1)
+
+#define FRAME_HEADER_SIZE 9
+#define MAX_WINDOW 0x7fffffff
+#define DEFAULT_WINDOW 65535    // Every window until SETTINGS change it
+#define DEFAULT_MAX_FRAME 16384 // Also the smallest maximum allowed
+
+// Frame types (RFC 9113, 6)
+enum {
+  FRAME_DATA = 0x0,
+  FRAME_HEADERS = 0x1,
+  FRAME_PRIORITY = 0x2,
+  FRAME_RST_STREAM = 0x3,
+  FRAME_SETTINGS = 0x4,
+  FRAME_PUSH_PROMISE = 0x5,
+  FRAME_PING = 0x6,
+  FRAME_GOAWAY = 0x7,
+  FRAME_WINDOW_UPDATE = 0x8,
+  FRAME_CONTINUATION = 0x9,
+};
+
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED 0x8
+#define FLAG_PRIORITY 0x20
+
+#define SETTINGS_ENABLE_PUSH 0x2
+#define SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define SETTINGS_MAX_FRAME_SIZE 0x5
+#define SETTINGS_MAX_HEADER_LIST_SIZE 0x6
+#define SETTINGS_MAX_COUNT 16 // Settings taken from an HTTP2-Settings header
+
+static uint32_t read32(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+         p[3];
+}
+
+static void write32(uint8_t *p, uint32_t v) {
+  p[0] = (uint8_t)(v >> 24);
+  p[1] = (uint8_t)(v >> 16);
+  p[2] = (uint8_t)(v >> 8);
+  p[3] = (uint8_t)v;
+}
+
+static void frame_header(uint8_t *p, size_t len, uint8_t type,
+                         uint8_t flags, uint32_t stream) {
+  p[0] = (uint8_t)(len >> 16);
+  p[1] = (uint8_t)(len >> 8);
+  p[2] = (uint8_t)len;
+  p[3] = type;
+  p[4] = flags;
+  write32(p + 5, stream);
+}
+
+// Queue a small frame, copied into the send buffer
+static int queue_frame(Http2Session *S, uint8_t type, uint8_t flags,
+                       uint32_t stream, const uint8_t *payload, size_t len) {
+  uint8_t frame[FRAME_HEADER_SIZE + 24];
+  frame_header(frame, len, type, flags, stream);
+  if (len > 0)
+    memcpy(frame + FRAME_HEADER_SIZE, payload, len);
+  return queue_response(S->conn, (const char *)frame, FRAME_HEADER_SIZE + len);
+}
+
+static int queue_window_update(Http2Session *S, uint32_t stream,
+                               uint32_t increment) {
+  uint8_t payload[4];
+  write32(payload, increment);
+  return queue_frame(S, FRAME_WINDOW_UPDATE, 0, stream, payload, 4);
+}
+
+static int queue_rst_stream(Http2Session *S, uint32_t stream,
+                            Http2Error code) {
+  uint8_t payload[4];
+  write32(payload, code);
+  if (S->conn->metrics)
+    metrics_add(&S->conn->metrics->http2_resets, 1);
+  return queue_frame(S, FRAME_RST_STREAM, 0, stream, payload, 4);
+}
+
+// Tell the client no stream above the last one it opened will be served
+static int queue_goaway(Http2Session *S, Http2Error code) {
+  uint8_t payload[8];
+  write32(payload, S->last_stream);
+  write32(payload + 4, code);
+  S->goaway_sent = 1;
+  return queue_frame(S, FRAME_GOAWAY, 0, 0, payload, 8);
+}
+
+static void put_setting(uint8_t *p, uint16_t id, uint32_t value) {
+  p[0] = (uint8_t)(id >> 8);
+  p[1] = (uint8_t)id;
+  write32(p + 2, value);
+}
+
+// The error a frame just read amounts to. Returns -1 for read_frame().
+static int fail(Http2Session *S, Http2Error code) {
+  S->error = code;
+  return -1;
+}
+
+// Give up on the connection: GOAWAY with the error, then close once it
+// has been written. Returns 1, or -1 if not even that can be queued.
+static int connection_error(Http2Session *S) {
+  if (queue_goaway(S, S->error) < 0)
+    return -1;
+  S->conn->close_after_send = 1;
+  return 1;
+}
+
+static Http2Stream *find_stream(const Http2Session *S, uint32_t id) {
+  for (Http2Stream *s = S->streams; s; s = s->next) {
+    if (s->id == id)
+      return s;
+  }
+  return NULL;
+}
+
+// Mark a stream to be reset by the next round of output. The first reason
+// given is the one sent.
+static void reset_stream(Http2Stream *s, Http2Error code) {
+  if (s->reset)
+    return;
+  s->reset = 1;
+  s->reset_code = code;
+}
+
+// Open a stream and the connection standing in for it, which shares the
+// worker's state with the client connection but has no socket
+static Http2Stream *open_stream(Http2Session *S, uint32_t id) {
+  Connection *conn = S->conn;
+  Http2Stream *s = S->free_streams;
+  if (s) {
+    S->free_streams = s->next;
+  } else if (!(s = malloc(sizeof(*s)))) {
+    perror("malloc failed for Http2Stream");
+    return NULL;
+  }
+  // The request head is rewritten into its receive buffer, so that is
+  // taken at full size straight away
+  Connection *vc = create_connection(-1, conn->pools);
+  if (vc && reserve_input(vc, RECV_BUFFER_SIZE) < 0) {
+    free_connection(vc);
+    vc = NULL;
+  }
+  if (!vc) {
+    s->next = S->free_streams;
+    S->free_streams = s;
+    return NULL;
+  }
+  memset(s, 0, sizeof(*s));
+  s->id = id;
+  s->conn = vc;
+  s->send_window = S->peer_initial_window;
+  s->recv_window = HTTP2_STREAM_WINDOW;
+  s->body_length = -1;
+  vc->files = conn->files;
+  vc->compressor = conn->compressor;
+  vc->cache = conn->cache;
+  vc->responses = conn->responses;
+  vc->log = conn->log;
+  vc->peer_addr = conn->peer_addr;
+  vc->peer_port = conn->peer_port;
+  vc->metrics = conn->metrics;
+  vc->received_ns = conn->received_ns;
+  vc->stream = s;
+  // Appended, so output goes round in the order the streams were opened
+  Http2Stream **link = &S->streams;
+  while (*link)
+    link = &(*link)->next;
+  *link = s;
+  S->stream_count++;
+  if (conn->metrics)
+    metrics_add(&conn->metrics->http2_streams, 1);
+  return s;
+}
+
+// Forget a stream. Its struct is kept for the next one.
+static void close_stream(Http2Session *S, Http2Stream *s) {
+  Http2Stream **link = &S->streams;
+  while (*link != s)
+    link = &(*link)->next;
+  *link = s->next;
+  if (S->turn == s)
+    S->turn = s->next;
+  S->stream_count--;
+  free_connection(s->conn);
+  s->next = S->free_streams;
+  S->free_streams = s;
+}
+
+static Http2Session *create_session(Connection *conn) {
+  if (!memory_budget_reserve(sizeof(Http2Session))) {
+    fprintf(stderr, "Memory budget exhausted, no HTTP/2 session.\n");
+    return NULL;
+  }
+  Http2Session *S = calloc(1, sizeof(*S));
+  if (!S) {
+    perror("calloc failed for Http2Session");
+    memory_budget_release(sizeof(Http2Session));
+    return NULL;
+  }
+  S->scratch = buffer_pool_acquire(&conn->pools->recv_buffers);
+  if (!S->scratch) {
+    free(S);
+    memory_budget_release(sizeof(Http2Session));
+    return NULL;
+  }
+  S->conn = conn;
+  hpack_decoder_init(&S->decoder);
+  S->send_window = DEFAULT_WINDOW;
+  S->recv_window = HTTP2_CONNECTION_WINDOW;
+  S->peer_initial_window = DEFAULT_WINDOW;
+  S->peer_max_frame = DEFAULT_MAX_FRAME;
+  conn->h2 = S;
+  if (conn->metrics)
+    metrics_add(&conn->metrics->http2_connections, 1);
+
+  // Our SETTINGS, then the rest of the connection window
+  uint8_t settings[18];
+  put_setting(settings, SETTINGS_MAX_CONCURRENT_STREAMS, HTTP2_MAX_STREAMS);
+  put_setting(settings + 6, SETTINGS_INITIAL_WINDOW_SIZE,
+              HTTP2_STREAM_WINDOW);
+  put_setting(settings + 12, SETTINGS_MAX_HEADER_LIST_SIZE, MAX_HEAD_SIZE);
+  if (queue_frame(S, FRAME_SETTINGS, 0, 0, settings, sizeof(settings)) < 0 ||
+      queue_window_update(S, 0, HTTP2_CONNECTION_WINDOW - DEFAULT_WINDOW) <
+          0) {
+    http2_close(conn);
+    return NULL;
+  }
+  return S;
+}
+
+// Apply the client's settings. Returns HTTP2_NO_ERROR or the error they
+// amount to.
+static Http2Error apply_settings(Http2Session *S, const uint8_t *p,
+                                 size_t len) {
+  for (size_t i = 0; i + 6 <= len; i += 6) {
+    uint16_t id = (uint16_t)(p[i] << 8 | p[i + 1]);
+    uint32_t value = read32(p + i + 2);
+    switch (id) {
+    case SETTINGS_ENABLE_PUSH:
+      if (value > 1)
+        return HTTP2_PROTOCOL_ERROR;
+      break;
+    case SETTINGS_INITIAL_WINDOW_SIZE:
+      if (value > MAX_WINDOW)
+        return HTTP2_FLOW_CONTROL_ERROR;
+      // The change applies to every open stream, and may leave one with a
+      // negative window
+      for (Http2Stream *s = S->streams; s; s = s->next) {
+        s->send_window += (int64_t)value - S->peer_initial_window;
+        if (s->send_window > MAX_WINDOW)
+          return HTTP2_FLOW_CONTROL_ERROR;
+      }
+      S->peer_initial_window = value;
+      break;
+    case SETTINGS_MAX_FRAME_SIZE:
+      if (value < DEFAULT_MAX_FRAME || value > 0xffffff)
+        return HTTP2_PROTOCOL_ERROR;
+      S->peer_max_frame = value;
+      break;
+    default:
+      // Our encoder never adds to the dynamic table, so its size does not
+      // matter, and unknown settings are to be ignored
+      break;
+    }
+  }
+  return HTTP2_NO_ERROR;
+}
+
+int http2_preface(const Connection *conn) {
+  size_t n = conn->recv_len < PREFACE_LEN ? conn->recv_len : PREFACE_LEN;
+  if (memcmp(conn->recv_buffer, preface, n) != 0)
+    return -1;
+  return n == PREFACE_LEN ? 1 : 0;
+}
+
+int http2_start(Connection *conn) {
+  consume_connection(conn, PREFACE_LEN);
+  return create_session(conn) ? 0 : -1;
+}
+
+// Decode the base64url value of HTTP2-Settings. Returns the payload length,
+// or -1 if it is not valid or too long.
+static int decode_settings_header(StringView v, uint8_t *out, size_t size) {
+  uint32_t acc = 0;
+  unsigned bits = 0;
+  size_t n = 0;
+  for (size_t i = 0; i < v.len && v.ptr[i] != '='; ++i) {
+    char c = v.ptr[i];
+    uint32_t value;
+    if (c >= 'A' && c <= 'Z')
+      value = (uint32_t)(c - 'A');
+    else if (c >= 'a' && c <= 'z')
+      value = (uint32_t)(c - 'a' + 26);
+    else if (c >= '0' && c <= '9')
+      value = (uint32_t)(c - '0' + 52);
+    else if (c == '-' || c == '+')
+      value = 62;
+    else if (c == '_' || c == '/')
+      value = 63;
+    else
+      return -1;
+    acc = acc << 6 | value;
+    bits += 6;
+    if (bits >= 8) {
+      bits -= 8;
+      if (n == size)
+        return -1;
+      out[n++] = (uint8_t)(acc >> bits);
+      acc &= (1u << bits) - 1;
+    }
+  }
+  return (int)n;
+}
+
+// The stream a request is served on from start to end
+static void start_request(Http2Session *S, Http2Stream *s, int end_stream);
+
+int http2_upgrade(Connection *conn, const ClientRequest *C,
+                  uint64_t parse_start) {
+  static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\n"
+                                  "Connection: Upgrade\r\n"
+                                  "Upgrade: h2c\r\n\r\n";
+  const HttpHeader *upgrade = findHeader(C, "Upgrade");
+  const HttpHeader *connection = findHeader(C, "Connection");
+  const HttpHeader *settings_header = findHeader(C, "HTTP2-Settings");
+  if (C->version_minor < 1 || !upgrade || !connection || !settings_header ||
+      !headerHasToken(upgrade->value, "h2c") ||
+      !headerHasToken(connection->value, "Upgrade"))
+    return 0;
+  // A value we can not read leaves the request to HTTP/1.1
+  uint8_t settings[SETTINGS_MAX_COUNT * 6];
+  int settings_len =
+      decode_settings_header(settings_header->value, settings,
+                             sizeof(settings));
+  if (settings_len < 0 || settings_len % 6 != 0)
+    return 0;
+
+  if (queue_reference(conn, switching, sizeof(switching) - 1) < 0)
+    return -1;
+  Http2Session *S = create_session(conn);
+  if (!S)
+    return -1;
+  S->preface_pending = 1;
+  S->error = apply_settings(S, settings, (size_t)settings_len);
+  if (S->error != HTTP2_NO_ERROR)
+    return connection_error(S);
+  // The request becomes stream 1, complete already
+  Http2Stream *s = open_stream(S, 1);
+  if (!s)
+    return -1;
+  S->last_stream = 1;
+  s->remote_closed = s->body_done = 1;
+  s->head_only = C->http_method == HTTP_METHOD_HEAD;
+  if (handle_stream_request(s->conn, C, PARSE_OK, 0, parse_start) < 0)
+    reset_stream(s, HTTP2_INTERNAL_ERROR);
+  s->conn->on_body = NULL;
+  return 1;
+}
+
+// Field sink of the HPACK decoder
+static void collect_field(void *ctx, StringView name, StringView value) {
+  Http2Session *S = ctx;
+  if (S->field_count == HTTP2_MAX_FIELDS) {
+    S->fields_dropped = 1;
+    return;
+  }
+  S->fields[S->field_count].name = name;
+  S->fields[S->field_count].value = value;
+  S->field_count++;
+}
+
+// Header fields that only mean something to HTTP/1.1 connections have no
+// place in HTTP/2 (RFC 9113, 8.2.2)
+static int connection_specific(StringView name) {
+  return viewEquals(name, "connection") || viewEquals(name, "keep-alive") ||
+         viewEquals(name, "proxy-connection") ||
+         viewEquals(name, "transfer-encoding") || viewEquals(name, "upgrade");
+}
+
+// A value must not hold line breaks or NULs, which would let it pass for
+// more than one field once the request is rewritten as HTTP/1.1
+static int valid_value(StringView value) {
+  for (size_t i = 0; i < value.len; ++i) {
+    char c = value.ptr[i];
+    if (c == '\r' || c == '\n' || c == '\0')
+      return 0;
+  }
+  return 1;
+}
+
+// Names have to be lowercase tokens
+static int valid_name(StringView name) {
+  if (name.len == 0 || scanToken(name.ptr, name.ptr + name.len) !=
+                           name.ptr + name.len)
+    return 0;
+  for (size_t i = 0; i < name.len; ++i) {
+    if (name.ptr[i] >= 'A' && name.ptr[i] <= 'Z')
+      return 0;
+  }
+  return 1;
+}
+
+// Appends to a head that is being rewritten, noting when it overflows
+typedef struct {
+  char *out;
+  size_t len;
+  size_t size;
+  int overflow;
+} HeadWriter;
+
+static void put(HeadWriter *w, const char *data, size_t len) {
+  if (len > w->size - w->len) {
+    w->overflow = 1;
+    return;
+  }
+  memcpy(w->out + w->len, data, len);
+  w->len += len;
+}
+
+static void put_view(HeadWriter *w, StringView v) { put(w, v.ptr, v.len); }
+
+// Rewrite the decoded fields of a request as an HTTP/1.1 head in the
+// stream's receive buffer and parse it there, so the handlers get the same
+// ClientRequest as from any other client. Returns a PARSE_* status.
+static int build_request(Http2Session *S, Http2Stream *s, ClientRequest *C) {
+  if (S->fields_dropped)
+    return PARSE_TOO_MANY_HEADERS;
+  StringView method = {0}, path = {0}, scheme = {0}, authority = {0};
+  int regular = 0, has_host = 0;
+  for (size_t i = 0; i < S->field_count; ++i) {
+    const HttpHeader *f = &S->fields[i];
+    if (f->name.len > 0 && f->name.ptr[0] == ':') {
+      StringView *slot = viewEquals(f->name, ":method")      ? &method
+                         : viewEquals(f->name, ":path")      ? &path
+                         : viewEquals(f->name, ":scheme")    ? &scheme
+                         : viewEquals(f->name, ":authority") ? &authority
+                                                             : NULL;
+      // Pseudo-headers come first, each of them once
+      if (!slot || slot->ptr || regular || !valid_value(f->value))
+        return PARSE_MALFORMED;
+      *slot = f->value;
+      continue;
+    }
+    regular = 1;
+    if (!valid_name(f->name) || !valid_value(f->value) ||
+        connection_specific(f->name) ||
+        (viewEquals(f->name, "te") && !viewEquals(f->value, "trailers")))
+      return PARSE_MALFORMED;
+    has_host |= viewEquals(f->name, "host");
+  }
+  if (!method.ptr || !scheme.ptr || path.len == 0 ||
+      memchr(method.ptr, ' ', method.len) || memchr(path.ptr, ' ', path.len))
+    return PARSE_MALFORMED;
+
+  HeadWriter w = {s->conn->recv_buffer, 0, MAX_HEAD_SIZE, 0};
+  put_view(&w, method);
+  put(&w, " ", 1);
+  put_view(&w, path);
+  put(&w, " HTTP/1.1\r\n", 11);
+  if (authority.ptr && !has_host) {
+    put(&w, "host: ", 6);
+    put_view(&w, authority);
+    put(&w, "\r\n", 2);
+  }
+  for (size_t i = 0; i < S->field_count; ++i) {
+    const HttpHeader *f = &S->fields[i];
+    if (f->name.ptr[0] == ':')
+      continue;
+    put_view(&w, f->name);
+    put(&w, ": ", 2);
+    put_view(&w, f->value);
+    put(&w, "\r\n", 2);
+  }
+  put(&w, "\r\n", 2);
+  if (w.overflow)
+    return PARSE_HEAD_TOO_LARGE;
+  w.out[w.len] = '\0';
+  return parseRequest(w.out, w.len, C);
+}
+
+static void start_request(Http2Session *S, Http2Stream *s, int end_stream) {
+  Connection *vc = s->conn;
+  uint64_t parse_start = vc->metrics ? metrics_now() : 0;
+  ClientRequest C;
+  int status = build_request(S, s, &C);
+  if (status == PARSE_OK) {
+    if (findHeader(&C, "content-length"))
+      s->body_length = (int64_t)C.content_length;
+    if (end_stream && C.content_length > 0)
+      status = PARSE_MALFORMED;
+    // Without a Content-Length the body is as long as its DATA frames,
+    // which to the handlers looks like a chunked body
+    C.chunked = !end_stream && s->body_length < 0;
+    s->head_only = C.http_method == HTTP_METHOD_HEAD;
+  }
+  s->remote_closed = end_stream;
+  S->conn->requests_served++;
+  if (handle_stream_request(vc, &C, status, !end_stream, parse_start) < 0)
+    reset_stream(s, HTTP2_INTERNAL_ERROR);
+  // The head is done with: the buffer holds the request body from now on
+  vc->recv_len = 0;
+  if (end_stream) {
+    s->body_done = 1;
+    vc->on_body = NULL;
+  }
+}
+
+// Act on a complete header block: a new request, or the trailers ending
+// one, whose fields are not passed on
+static int end_header_block(Http2Session *S, const uint8_t *block,
+                            size_t len) {
+  S->field_count = 0;
+  S->fields_dropped = 0;
+  int decoded = hpack_decode(&S->decoder, block, len, S->scratch,
+                             RECV_BUFFER_SIZE, collect_field, S);
+  if (S->block) {
+    buffer_pool_release(&S->conn->pools->recv_buffers, S->block);
+    S->block = NULL;
+    S->block_len = 0;
+  }
+  if (decoded < 0)
+    return fail(S, HTTP2_COMPRESSION_ERROR);
+
+  Http2Stream *s = find_stream(S, S->block_stream);
+  if (!S->block_new) {
+    if (s) {
+      if (!s->reset)
+        s->remote_closed = 1;
+      return 1;
+    }
+    // The stream is closed, or its id was skipped. A request there can not
+    // open a stream (RFC 9113, 5.1.1); trailers for a stream that is gone
+    // are a stream error (5.1)
+    if (!S->block_end_stream ||
+        (S->field_count > 0 && S->fields[0].name.len > 0 &&
+         S->fields[0].name.ptr[0] == ':'))
+      return fail(S, HTTP2_PROTOCOL_ERROR);
+    if (queue_rst_stream(S, S->block_stream, HTTP2_STREAM_CLOSED) < 0)
+      return fail(S, HTTP2_INTERNAL_ERROR);
+    return 1;
+  }
+  // Streams opened after our GOAWAY are ignored
+  if (S->goaway_sent)
+    return 1;
+  if (S->stream_count >= HTTP2_MAX_STREAMS ||
+      !(s = open_stream(S, S->block_stream))) {
+    if (queue_rst_stream(S, S->block_stream, HTTP2_REFUSED_STREAM) < 0)
+      return fail(S, HTTP2_INTERNAL_ERROR);
+    return 1;
+  }
+  start_request(S, s, S->block_end_stream);
+  return 1;
+}
+
+// Check a frame header just read, and set up what its payload needs.
+// Returns 1, or -1 on a connection error.
+static int begin_frame(Http2Session *S) {
+  uint32_t id = S->frame_stream, len = S->frame_length;
+  uint8_t type = S->frame_type, flags = S->frame_flags;
+  if (len > HTTP2_MAX_FRAME)
+    return fail(S, HTTP2_FRAME_SIZE_ERROR);
+  // A header block is not interrupted by any other frame, and the client
+  // starts with its SETTINGS
+  if (S->continuation != (type == FRAME_CONTINUATION) ||
+      (S->continuation && id != S->block_stream))
+    return fail(S, HTTP2_PROTOCOL_ERROR);
+  if (!S->settings_received &&
+      (type != FRAME_SETTINGS || (flags & FLAG_ACK)))
+    return fail(S, HTTP2_PROTOCOL_ERROR);
+
+  Http2Stream *s = NULL;
+  switch (type) {
+  case FRAME_DATA:
+    if (id == 0 || id > S->last_stream)
+      return fail(S, HTTP2_PROTOCOL_ERROR);
+    if (len > S->recv_window)
+      return fail(S, HTTP2_FLOW_CONTROL_ERROR);
+    S->recv_window -= len;
+    s = find_stream(S, id);
+    if (s && !s->reset) {
+      // Until the client acknowledged our SETTINGS it may still go by the
+      // default window, so overruns only count from then on
+      if (s->remote_closed)
+        reset_stream(s, HTTP2_STREAM_CLOSED);
+      else if (S->settings_acked && len > s->recv_window)
+        reset_stream(s, HTTP2_FLOW_CONTROL_ERROR);
+      s->recv_window -= len;
+    }
+    return 1;
+  case FRAME_HEADERS:
+    if (id == 0 || (id & 1) == 0)
+      return fail(S, HTTP2_PROTOCOL_ERROR);
+    S->block_stream = id;
+    S->block_end_stream = (flags & FLAG_END_STREAM) != 0;
+    S->block_new = id > S->last_stream;
+    S->continuation = !(flags & FLAG_END_HEADERS);
+    if (S->block_new) {
+      S->last_stream = id;
+    } else if ((s = find_stream(S, id)) &&
+               (!S->block_end_stream || s->remote_closed)) {
+      // Trailers have to end the request, and come once
+      reset_stream(s, s->remote_closed ? HTTP2_STREAM_CLOSED
+                                       : HTTP2_PROTOCOL_ERROR);
+    }
+    return 1;
+  case FRAME_CONTINUATION:
+    S->continuation = !(flags & FLAG_END_HEADERS);
+    return 1;
+  case FRAME_PRIORITY:
+    if (id == 0)
+      return fail(S, HTTP2_PROTOCOL_ERROR);
+    if (len != 5)
+      return fail(S, HTTP2_FRAME_SIZE_ERROR);
+    return 1;
+  case FRAME_RST_STREAM:
+    if (id == 0 || id > S->last_stream)
+      return fail(S, HTTP2_PROTOCOL_ERROR);
+    if (len != 4)
+      return fail(S, HTTP2_FRAME_SIZE_ERROR);
+    return 1;
+  case FRAME_SETTINGS:
+    if (id != 0)
+      return fail(S, HTTP2_PROTOCOL_ERROR);
+    if ((flags & FLAG_ACK) ? len != 0 : len % 6 != 0)
+      return fail(S, HTTP2_FRAME_SIZE_ERROR);
+    break;
+  case FRAME_PUSH_PROMISE:
+    return fail(S, HTTP2_PROTOCOL_ERROR); // Only servers push
+  case FRAME_PING:
+    if (id != 0)
+      return fail(S, HTTP2_PROTOCOL_ERROR);
+    if (len != 8)
+      return fail(S, HTTP2_FRAME_SIZE_ERROR);
+    return 1;
+  case FRAME_GOAWAY:
+    if (id != 0)
+      return fail(S, HTTP2_PROTOCOL_ERROR);
+    if (len < 8)
+      return fail(S, HTTP2_FRAME_SIZE_ERROR);
+    break;
+  case FRAME_WINDOW_UPDATE:
+    if (len != 4)
+      return fail(S, HTTP2_FRAME_SIZE_ERROR);
+    return 1;
+  default:
+    return 1; // Unknown types are skipped
+  }
+  // SETTINGS and GOAWAY are handled whole, so they have to fit the buffer
+  if (len > RECV_BUFFER_SIZE - 1)
+    return fail(S, HTTP2_ENHANCE_YOUR_CALM);
+  return 1;
+}
+
+// Act on a control frame whose payload is complete in the buffer
+static int handle_control(Http2Session *S, const uint8_t *p) {
+  uint32_t id = S->frame_stream;
+  Http2Stream *s = id ? find_stream(S, id) : NULL;
+  switch (S->frame_type) {
+  case FRAME_SETTINGS: {
+    if (S->frame_flags & FLAG_ACK) {
+      S->settings_acked = 1;
+      return 1;
+    }
+    Http2Error error = apply_settings(S, p, S->frame_length);
+    if (error != HTTP2_NO_ERROR)
+      return fail(S, error);
+    S->settings_received = 1;
+    if (queue_frame(S, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0) < 0)
+      return fail(S, HTTP2_INTERNAL_ERROR);
+    return 1;
+  }
+  case FRAME_PING:
+    if (!(S->frame_flags & FLAG_ACK) &&
+        queue_frame(S, FRAME_PING, FLAG_ACK, 0, p, 8) < 0)
+      return fail(S, HTTP2_INTERNAL_ERROR);
+    return 1;
+  case FRAME_GOAWAY:
+    S->goaway_received = 1;
+    return 1;
+  case FRAME_RST_STREAM:
+    if (s)
+      close_stream(S, s);
+    return 1;
+  case FRAME_WINDOW_UPDATE: {
+    uint32_t increment = read32(p) & MAX_WINDOW;
+    if (id == 0) {
+      if (increment == 0)
+        return fail(S, HTTP2_PROTOCOL_ERROR);
+      if (S->send_window + increment > MAX_WINDOW)
+        return fail(S, HTTP2_FLOW_CONTROL_ERROR);
+      S->send_window += increment;
+    } else if (id > S->last_stream) {
+      return fail(S, HTTP2_PROTOCOL_ERROR);
+    } else if (s && increment == 0) {
+      reset_stream(s, HTTP2_PROTOCOL_ERROR);
+    } else if (s && s->send_window + increment > MAX_WINDOW) {
+      reset_stream(s, HTTP2_FLOW_CONTROL_ERROR);
+    } else if (s) {
+      s->send_window += increment;
+    }
+    return 1;
+  }
+  default:
+    return 1; // PRIORITY is advice we do not take
+  }
+}
+
+// Take 'n' bytes of the frame's payload from the buffer
+static void take(Http2Session *S, size_t n) {
+  S->offset += n;
+  S->frame_left -= (uint32_t)n;
+  // Everything in a DATA frame counts against the connection window, and
+  // is granted back once it has left the buffer
+  if (S->frame_type == FRAME_DATA)
+    S->recv_consumed += (uint32_t)n;
+}
+
+// Move DATA payload into the stream's buffer, where the body sink takes
+// it from. Returns the bytes taken from 'in'.
+static size_t read_data(Http2Session *S, const uint8_t *in, size_t n) {
+  Http2Stream *s = find_stream(S, S->frame_stream);
+  if (!s || s->reset)
+    return n; // Dropped
+  Connection *vc = s->conn;
+  size_t room = RECV_BUFFER_SIZE - 1 - vc->recv_len;
+  if (n > room) {
+    n = room;
+    S->blocked = 1;
+  }
+  memcpy(vc->recv_buffer + vc->recv_len, in, n);
+  vc->recv_len += n;
+  vc->recv_buffer[vc->recv_len] = '\0';
+  s->body_bytes += n;
+  if (s->body_length >= 0 ? s->body_bytes > (uint64_t)s->body_length
+                          : s->body_bytes > MAX_BODY_SIZE)
+    reset_stream(s, s->body_length >= 0 ? HTTP2_PROTOCOL_ERROR
+                                        : HTTP2_CANCEL);
+  return n;
+}
+
+// Read the payload of a DATA, HEADERS or CONTINUATION frame as far as it
+// has arrived: the padding length and priority first, then the content,
+// then the padding. Returns 1 if anything was taken, 0 if it has to wait,
+// or -1 on a connection error.
+static int read_content(Http2Session *S, const uint8_t *in, size_t avail) {
+  uint8_t flags = S->frame_flags;
+  int moved = 0;
+  if (!S->prefix_done) {
+    size_t prefix = (flags & FLAG_PADDED) ? 1 : 0;
+    if (S->frame_type == FRAME_HEADERS && (flags & FLAG_PRIORITY))
+      prefix += 5;
+    if (S->frame_type == FRAME_CONTINUATION)
+      prefix = 0;
+    if (S->frame_left < prefix)
+      return fail(S, HTTP2_FRAME_SIZE_ERROR);
+    if (avail < prefix)
+      return 0;
+    uint32_t pad = prefix > 0 && (flags & FLAG_PADDED) ? in[0] : 0;
+    if (pad > S->frame_left - prefix)
+      return fail(S, HTTP2_PROTOCOL_ERROR);
+    take(S, prefix);
+    in += prefix;
+    avail -= prefix;
+    S->content_left = S->frame_left - pad;
+    S->prefix_done = 1;
+    moved = 1;
+  }
+
+  if (S->content_left > 0) {
+    size_t n = avail < S->content_left ? avail : S->content_left;
+    if (S->frame_type == FRAME_DATA) {
+      n = read_data(S, in, n);
+    } else if (S->block_len == 0 && n == S->content_left &&
+               (flags & FLAG_END_HEADERS)) {
+      // The whole block is in the buffer: decoded where it is, below
+    } else {
+      if (!S->block &&
+          !(S->block = buffer_pool_acquire(&S->conn->pools->recv_buffers)))
+        return fail(S, HTTP2_INTERNAL_ERROR);
+      if (n > RECV_BUFFER_SIZE - S->block_len)
+        return fail(S, HTTP2_ENHANCE_YOUR_CALM);
+      memcpy(S->block + S->block_len, in, n);
+      S->block_len += n;
+    }
+    if (n == 0)
+      return moved;
+    take(S, n);
+    S->content_left -= (uint32_t)n;
+    moved = 1;
+    if (S->content_left == 0 && S->frame_type != FRAME_DATA &&
+        (flags & FLAG_END_HEADERS)) {
+      int r = S->block_len > 0
+                  ? end_header_block(S, (const uint8_t *)S->block,
+                                     S->block_len)
+                  : end_header_block(S, in, n);
+      if (r < 0)
+        return -1;
+    }
+    in += n;
+    avail -= n;
+    if (S->content_left > 0)
+      return 1;
+  }
+
+  size_t pad = avail < S->frame_left ? avail : S->frame_left;
+  if (pad > 0) {
+    take(S, pad);
+    moved = 1;
+  }
+  if (S->frame_left > 0)
+    return moved;
+  S->in_frame = 0;
+  if (S->frame_type == FRAME_DATA && (flags & FLAG_END_STREAM)) {
+    Http2Stream *s = find_stream(S, S->frame_stream);
+    if (s)
+      s->remote_closed = 1;
+  }
+  return 1;
+}
+
+// Read the next frame, or more of the current one, from the buffer.
+// Returns 1 if anything was taken, 0 if more has to arrive first (or a
+// stream's buffer is full), or -1 on a connection error.
+static int read_frame(Http2Session *S) {
+  Connection *conn = S->conn;
+  const uint8_t *in = (const uint8_t *)conn->recv_buffer + S->offset;
+  size_t avail = conn->recv_len - S->offset;
+  if (S->preface_pending) {
+    // After an Upgrade the client sends its preface too
+    size_t n = avail < PREFACE_LEN ? avail : PREFACE_LEN;
+    if (memcmp(in, preface, n) != 0)
+      return fail(S, HTTP2_PROTOCOL_ERROR);
+    if (n < PREFACE_LEN)
+      return 0;
+    S->offset += PREFACE_LEN;
+    S->preface_pending = 0;
+    return 1;
+  }
+  if (!S->in_frame) {
+    if (avail < FRAME_HEADER_SIZE)
+      return 0;
+    S->frame_length = (uint32_t)in[0] << 16 | (uint32_t)in[1] << 8 | in[2];
+    S->frame_type = in[3];
+    S->frame_flags = in[4];
+    S->frame_stream = read32(in + 5) & MAX_WINDOW;
+    S->offset += FRAME_HEADER_SIZE;
+    S->in_frame = 1;
+    S->frame_left = S->content_left = S->frame_length;
+    S->prefix_done = 0;
+    return begin_frame(S);
+  }
+  switch (S->frame_type) {
+  case FRAME_DATA:
+  case FRAME_HEADERS:
+  case FRAME_CONTINUATION:
+    return read_content(S, in, avail);
+  case FRAME_PRIORITY:
+  case FRAME_RST_STREAM:
+  case FRAME_SETTINGS:
+  case FRAME_PING:
+  case FRAME_GOAWAY:
+  case FRAME_WINDOW_UPDATE: {
+    if (avail < S->frame_left)
+      return 0;
+    int r = handle_control(S, in);
+    take(S, S->frame_left);
+    S->in_frame = 0;
+    return r;
+  }
+  default: {
+    size_t n = avail < S->frame_left ? avail : S->frame_left;
+    take(S, n);
+    if (S->frame_left == 0)
+      S->in_frame = 0;
+    return n > 0 || S->frame_left == 0;
+  }
+  }
+}
+
+// Hand buffered request body bytes to the stream's sink, and signal the
+// end of the body once the request is complete. Returns 1 if any of it
+// was taken.
+static int feed_body(Http2Stream *s) {
+  Connection *vc = s->conn;
+  int moved = 0;
+  while (vc->recv_len > 0) {
+    // A request answered without a sink has its body dropped
+    ssize_t taken = vc->on_body ? vc->on_body(vc, vc->recv_buffer,
+                                              vc->recv_len)
+                                : (ssize_t)vc->recv_len;
+    if (taken < 0) {
+      reset_stream(s, HTTP2_INTERNAL_ERROR);
+      return 1;
+    }
+    if (taken == 0)
+      break; // The sink waits for its output to drain
+    consume_connection(vc, (size_t)taken);
+    s->recv_consumed += (uint32_t)taken;
+    moved = 1;
+  }
+  if (s->remote_closed && vc->recv_len == 0 && !s->body_done) {
+    s->body_done = 1;
+    moved = 1;
+    if (s->body_length >= 0 && s->body_bytes != (uint64_t)s->body_length)
+      reset_stream(s, HTTP2_PROTOCOL_ERROR);
+    else if (vc->on_body && vc->on_body(vc, NULL, 0) < 0)
+      reset_stream(s, HTTP2_INTERNAL_ERROR);
+    vc->on_body = NULL;
+  }
+  return moved;
+}
+
+// Body sink that strips the chunk framing of a response in place
+typedef struct {
+  char *out;
+  size_t len;
+} ChunkOutput;
+
+static ssize_t collect_chunk_data(void *ctx, const char *data, size_t len) {
+  ChunkOutput *o = ctx;
+  memmove(o->out + o->len, data, len);
+  o->len += len;
+  return (ssize_t)len;
+}
+
+// Turn the head of the stream's HTTP/1.1 response into a HEADERS frame.
+// Returns 1 if it was queued, 0 if it is not complete yet, or -1 on
+// failure.
+static int send_head(Http2Session *S, Http2Stream *s) {
+  Connection *vc = s->conn;
+  char head[HTTP2_RESPONSE_HEAD_MAX];
+  size_t len = peek_output(vc, head, sizeof(head));
+  const char *end = memmem(head, len, "\r\n\r\n", 4);
+  if (!end) {
+    if (len < sizeof(head))
+      return 0;
+    fprintf(stderr, "Response head longer than %d bytes.\n",
+            HTTP2_RESPONSE_HEAD_MAX);
+    return -1;
+  }
+  size_t head_len = (size_t)(end - head) + 4;
+  if (head_len < 16 || memcmp(head, "HTTP/1.", 7) != 0)
+    return -1;
+  unsigned status = (unsigned)((head[9] - '0') * 100 + (head[10] - '0') * 10 +
+                               (head[11] - '0'));
+
+  // The header lines, less those about the HTTP/1.1 connection
+  uint8_t block[2 * HTTP2_RESPONSE_HEAD_MAX];
+  size_t n = hpack_encode_status(block, status);
+  int chunked = 0, has_length = 0;
+  uint64_t length = 0;
+  const char *line = (const char *)memchr(head, '\n', head_len) + 1;
+  while (line < end + 2) {
+    const char *eol = memchr(line, '\r', (size_t)(end + 2 - line));
+    const char *colon = memchr(line, ':', (size_t)(eol - line));
+    if (!colon)
+      return -1;
+    StringView name = {line, (size_t)(colon - line)};
+    const char *v = colon + 1;
+    while (v < eol && (*v == ' ' || *v == '\t'))
+      ++v;
+    StringView value = {v, (size_t)(eol - v)};
+    line = eol + 2;
+    if (viewEqualsIgnoreCase(name, "Transfer-Encoding")) {
+      chunked = headerHasToken(value, "chunked");
+      continue;
+    }
+    if (viewEqualsIgnoreCase(name, "Connection") ||
+        viewEqualsIgnoreCase(name, "Keep-Alive") ||
+        viewEqualsIgnoreCase(name, "Upgrade"))
+      continue;
+    if (viewEqualsIgnoreCase(name, "Content-Length")) {
+      has_length = 1;
+      for (size_t i = 0; i < value.len; ++i)
+        length = length * 10 + (uint64_t)(value.ptr[i] - '0');
+    }
+    ssize_t field = hpack_encode_field(block + n, sizeof(block) - n, name,
+                                       value);
+    if (field < 0)
+      return -1;
+    n += (size_t)field;
+  }
+  if (take_output(vc, head, head_len) < 0)
+    return -1;
+
+  int end_stream = 0;
+  if (status >= 200) {
+    // What follows the final head
+    s->head_sent = 1;
+    if (s->head_only || status == 204 || status == 304) {
+      s->framing = BODY_NONE;
+    } else if (chunked) {
+      s->framing = BODY_CHUNKED;
+      httpParserReset(&s->chunks);
+      s->chunks.state = HTTP_PARSER_CHUNK_SIZE;
+    } else if (has_length) {
+      s->framing = BODY_LENGTH;
+      s->remaining = length;
+    } else {
+      s->framing = BODY_CLOSE;
+    }
+    end_stream = s->framing == BODY_NONE ||
+                 (s->framing == BODY_LENGTH && s->remaining == 0);
+  }
+  // An interim head, such as 100 Continue, leaves the final one to come
+  uint8_t *frame = arena_alloc(&S->conn->arena, FRAME_HEADER_SIZE + n);
+  if (!frame)
+    return -1;
+  frame_header(frame, n, FRAME_HEADERS,
+               FLAG_END_HEADERS | (end_stream ? FLAG_END_STREAM : 0), s->id);
+  memcpy(frame + FRAME_HEADER_SIZE, block, n);
+  if (queue_reference(S->conn, (const char *)frame, FRAME_HEADER_SIZE + n) <
+      0)
+    return -1;
+  s->local_closed = end_stream;
+  return 1;
+}
+
+// Queue the next DATA frame of the stream's response body, as large as
+// the windows, the client's frame size and the output buffered allow.
+// Returns 1 if anything moved, 0 if it has to wait, or -1 on failure.
+static int send_data(Http2Session *S, Http2Stream *s) {
+  Connection *vc = s->conn;
+  int64_t window = S->send_window < s->send_window ? S->send_window
+                                                   : s->send_window;
+  size_t max = S->peer_max_frame < HTTP2_MAX_FRAME ? S->peer_max_frame
+                                                   : HTTP2_MAX_FRAME;
+  if (window < (int64_t)max)
+    max = window > 0 ? (size_t)window : 0;
+  size_t want = vc->out_bytes + vc->file_remaining;
+  if (want > max)
+    want = max;
+  if (s->framing == BODY_LENGTH && want > s->remaining)
+    want = (size_t)s->remaining;
+  // A body without a length ends when the request does and everything
+  // queued has gone
+  int end = s->framing == BODY_CLOSE && s->body_done && !vc->on_body &&
+            vc->out_bytes + vc->file_remaining == want;
+  if (want == 0 && !end)
+    return 0;
+
+  uint8_t *frame = arena_alloc(&S->conn->arena, FRAME_HEADER_SIZE + want);
+  if (!frame)
+    return -1;
+  char *payload = (char *)frame + FRAME_HEADER_SIZE;
+  ssize_t taken = take_output(vc, payload, want);
+  if (taken < 0)
+    return -1;
+  size_t len = (size_t)taken;
+  if (s->framing == BODY_LENGTH) {
+    s->remaining -= len;
+    end = s->remaining == 0;
+  } else if (s->framing == BODY_CHUNKED) {
+    ChunkOutput o = {payload, 0};
+    size_t consumed = 0;
+    int status = httpParserBody(&s->chunks, payload, len, &consumed,
+                                collect_chunk_data, &o);
+    s->chunks.body_bytes = 0; // MAX_BODY_SIZE is for requests
+    if (status < 0)
+      return -1;
+    end = status == PARSE_OK;
+    len = o.len;
+    if (len == 0 && !end)
+      return 1; // Only chunk framing this time
+  }
+  S->send_window -= (int64_t)len;
+  s->send_window -= (int64_t)len;
+  frame_header(frame, len, FRAME_DATA, end ? FLAG_END_STREAM : 0, s->id);
+  if (queue_reference(S->conn, (const char *)frame, FRAME_HEADER_SIZE + len) <
+      0)
+    return -1;
+  s->local_closed = end;
+  return 1;
+}
+
+// Move one stream forward: feed its request body, grant window back, and
+// queue at most one frame of its response. Returns 1 if anything moved, 0
+// if it waits, or -1 if the connection has to be dropped.
+static int pump_stream(Http2Session *S, Http2Stream *s) {
+  int moved = s->reset ? 0 : feed_body(s);
+  if (!s->reset && !s->local_closed) {
+    int sent = s->head_sent ? send_data(S, s) : send_head(S, s);
+    if (sent < 0)
+      reset_stream(s, HTTP2_INTERNAL_ERROR);
+    moved |= sent != 0;
+  }
+  if (s->reset) {
+    if (queue_rst_stream(S, s->id, s->reset_code) < 0)
+      return -1;
+    close_stream(S, s);
+    return 1;
+  }
+  if (s->local_closed && s->body_done) {
+    close_stream(S, s);
+    return 1;
+  }
+  // The client may send more once the sink has taken half the window
+  if (!s->remote_closed && s->recv_consumed >= HTTP2_STREAM_WINDOW / 2) {
+    if (queue_window_update(S, s->id, s->recv_consumed) < 0)
+      return -1;
+    s->recv_window += s->recv_consumed;
+    s->recv_consumed = 0;
+    moved = 1;
+  }
+  return moved;
+}
+
+// Give every stream a turn at the output, one frame each per round, until
+// nothing moves or the connection's output is full. Where a round stopped
+// the next one starts, so a long response can not starve the others.
+static int pump(Http2Session *S) {
+  int progress = 0, moved = 1;
+  while (moved) {
+    moved = 0;
+    Http2Stream *s = S->turn ? S->turn : S->streams;
+    for (unsigned n = S->stream_count; n > 0; --n) {
+      if (!connection_has_room(S->conn)) {
+        S->turn = s;
+        return progress;
+      }
+      Http2Stream *next = s->next ? s->next : S->streams;
+      int r = pump_stream(S, s);
+      if (r < 0)
+        return -1;
+      if (r > 0)
+        moved = progress = 1;
+      s = next;
+    }
+    S->turn = S->stream_count > 0 ? s : NULL;
+  }
+  return progress;
+}
+
+int http2_handle(Connection *conn) {
+  Http2Session *S = conn->h2;
+  int progress = 0, rc = 0;
+  S->blocked = 0;
+  while (connection_has_room(conn) && (rc = read_frame(S)) > 0)
+    progress = 1;
+  if (S->offset > 0)
+    consume_connection(conn, S->offset);
+  S->offset = 0;
+  if (rc < 0)
+    return connection_error(S);
+
+  // Grant back what left the buffer once it adds up
+  if (S->recv_consumed >= HTTP2_CONNECTION_WINDOW / 2 &&
+      connection_has_room(conn)) {
+    if (queue_window_update(S, 0, S->recv_consumed) < 0)
+      return -1;
+    S->recv_window += S->recv_consumed;
+    S->recv_consumed = 0;
+  }
+  int pumped = pump(S);
+  if (pumped < 0)
+    return -1;
+  progress |= pumped;
+
+  if (draining && !S->goaway_sent) {
+    if (queue_goaway(S, HTTP2_NO_ERROR) < 0)
+      return -1;
+    progress = 1;
+  }
+  if ((S->goaway_sent || S->goaway_received) && S->stream_count == 0 &&
+      !conn->close_after_send) {
+    conn->close_after_send = 1;
+    progress = 1;
+  }
+  if (!progress && S->blocked && conn->recv_len >= RECV_BUFFER_SIZE - 1) {
+    // A stream's buffer is full, and so is ours behind it: the client sent
+    // more than the stream's window
+    S->error = HTTP2_FLOW_CONTROL_ERROR;
+    return connection_error(S);
+  }
+  return progress;
+}
+
+int http2_reset_stream(Connection *conn, Http2Error code) {
+  reset_stream(conn->stream, code);
+  return 0;
+}
+
+TimeoutKind http2_waiting_for(const Connection *conn) {
+  const Http2Session *S = conn->h2;
+  // Only an unfinished preface or header block runs against the fixed head
+  // deadline; a DATA frame arriving in pieces is a body still flowing
+  if (S->preface_pending || S->continuation ||
+      (S->in_frame && (S->frame_type == FRAME_HEADERS ||
+                       S->frame_type == FRAME_CONTINUATION)))
+    return TIMEOUT_HEAD;
+  TimeoutKind kind = S->in_frame && S->frame_type == FRAME_DATA
+                         ? TIMEOUT_BODY
+                         : TIMEOUT_IDLE;
+  for (const Http2Stream *s = S->streams; s; s = s->next) {
+    // Output held back by the client's windows
+    if (s->conn->out_bytes > 0 || s->conn->file_remaining > 0)
+      return TIMEOUT_WRITE;
+    if (!s->remote_closed)
+      kind = TIMEOUT_BODY;
+  }
+  // The rest of a control frame or a frame header, with no stream open
+  if (kind == TIMEOUT_IDLE && (S->in_frame || conn->recv_len > 0))
+    return TIMEOUT_HEAD;
+  return kind;
+}
+
+void http2_close(Connection *conn) {
+  Http2Session *S = conn->h2;
+  if (!S)
+    return;
+  while (S->streams)
+    close_stream(S, S->streams);
+  while (S->free_streams) {
+    Http2Stream *next = S->free_streams->next;
+    free(S->free_streams);
+    S->free_streams = next;
+  }
+  buffer_pool_release(&conn->pools->recv_buffers, S->scratch);
+  buffer_pool_release(&conn->pools->recv_buffers, S->block);
+  free(S);
+  memory_budget_release(sizeof(Http2Session));
+  conn->h2 = NULL;
+}
@@ -1,75 +1,406 @@
 #include "../include/http_parser.h"
-#include "../include/config.h" // For BUFFER_SIZE, ARGS_BUFFER_SIZE, ROUTE_BUFFER_SIZE
-#include <stdio.h>             // For fprintf, perror, sscanf
-#include <stdlib.h>            // For malloc
-#include <string.h> // For memchr, memcpy, strncpy, strcmp, strncmp, strchr
-
-ClientRequest parseRequest(const char *client_req_str, ssize_t req_size) {
-  ClientRequest C = {NULL, NULL, NULL, NULL}; // Initialize all members to NULL
-  if (req_size <= 0 || client_req_str == NULL)
-    return C;
-
-  const char *line_end = memchr(client_req_str, '\n', req_size);
-  if (!line_end) {
-    fprintf(stderr, "Request line too long or no newline found.\n");
-    return C;
+#include "../include/http_scan.h" // For scanToken, scanTarget, scanFieldValue
+#include <string.h>  // For memchr, memcmp
+
+// Map a method token to its enum value without copying it
+static HttpMethod lookupMethod(const char *m, size_t len) {
+  switch (len) {
+  case 3:
+    if (memcmp(m, "GET", 3) == 0)
+      return HTTP_METHOD_GET;
+    if (memcmp(m, "PUT", 3) == 0)
+      return HTTP_METHOD_PUT;
+    break;
+  case 4:
+    if (memcmp(m, "HEAD", 4) == 0)
+      return HTTP_METHOD_HEAD;
+    if (memcmp(m, "POST", 4) == 0)
+      return HTTP_METHOD_POST;
+    break;
+  case 5:
+    if (memcmp(m, "TRACE", 5) == 0)
+      return HTTP_METHOD_TRACE;
+    if (memcmp(m, "PATCH", 5) == 0)
+      return HTTP_METHOD_PATCH;
+    break;
+  case 6:
+    if (memcmp(m, "DELETE", 6) == 0)
+      return HTTP_METHOD_DELETE;
+    break;
+  case 7:
+    if (memcmp(m, "CONNECT", 7) == 0)
+      return HTTP_METHOD_CONNECT;
+    if (memcmp(m, "OPTIONS", 7) == 0)
+      return HTTP_METHOD_OPTIONS;
+    break;
+  }
+  return HTTP_METHOD_UNKNOWN;
+}
+
+// Decide whether the connection stays open after this request.
+// HTTP/1.1 defaults to persistent connections unless "Connection: close" is
+// sent, HTTP/1.0 only keeps the connection with "Connection: keep-alive".
+static int requestKeepAlive(const ClientRequest *C) {
+  int keep_alive = C->version_minor >= 1;
+  const HttpHeader *connection = findHeader(C, "Connection");
+  if (connection) {
+    if (headerHasToken(connection->value, "close"))
+      keep_alive = 0;
+    else if (headerHasToken(connection->value, "keep-alive"))
+      keep_alive = 1;
+  }
+  return keep_alive;
+}
+
+// Work out how the body is framed. Exactly one of Content-Length or
+// Transfer-Encoding: chunked may be present; anything ambiguous is rejected
+// so a body can never be mistaken for the next request.
+static int parseBodyFraming(ClientRequest *C) {
+  const HttpHeader *encoding = NULL;
+  const HttpHeader *length = NULL;
+  for (size_t i = 0; i < C->header_count; ++i) {
+    const HttpHeader *h = &C->headers[i];
+    if (viewEqualsIgnoreCase(h->name, "Transfer-Encoding")) {
+      if (encoding)
+        return PARSE_MALFORMED;
+      encoding = h;
+    } else if (viewEqualsIgnoreCase(h->name, "Content-Length")) {
+      if (length)
+        return PARSE_MALFORMED;
+      length = h;
+    } else if (viewEqualsIgnoreCase(h->name, "Expect")) {
+      C->expect_continue = viewEqualsIgnoreCase(h->value, "100-continue");
+    }
   }
 
-  // Calculate length of the first line, ensuring it's not too long for buffer
-  size_t line_len = line_end - client_req_str;
-  if (line_len >= BUFFER_SIZE) {
-    fprintf(stderr, "Request line exceeds internal buffer: %zu vs %d\n",
-            line_len, BUFFER_SIZE);
-    line_len = BUFFER_SIZE - 1; // Truncate to fit
+  if (encoding) {
+    if (length)
+      return PARSE_MALFORMED;
+    if (!viewEqualsIgnoreCase(encoding->value, "chunked"))
+      return PARSE_UNSUPPORTED_ENCODING;
+    C->chunked = 1;
+  } else if (length) {
+    if (length->value.len == 0)
+      return PARSE_MALFORMED;
+    uint64_t value = 0;
+    for (size_t i = 0; i < length->value.len; ++i) {
+      char c = length->value.ptr[i];
+      if (c < '0' || c > '9')
+        return PARSE_MALFORMED;
+      value = value * 10 + (uint64_t)(c - '0');
+      if (value > MAX_BODY_SIZE)
+        return PARSE_BODY_TOO_LARGE;
+    }
+    C->content_length = value;
+  }
+  return PARSE_OK;
+}
+
+int parseRequest(const char *head, size_t head_len, ClientRequest *C) {
+  const char *p = head;
+  const char *end = head + head_len;
+  // The header array is left untouched, only header_count entries are valid
+  C->http_method = HTTP_METHOD_UNKNOWN;
+  C->header_count = 0;
+  C->content_length = 0;
+  C->chunked = 0;
+  C->expect_continue = 0;
+  C->keep_alive = 0;
+
+  // Method: a token followed by a single space
+  const char *start = p;
+  p = scanToken(p, end);
+  if (p == start || p >= end || *p != ' ')
+    return PARSE_MALFORMED;
+  C->method_name = (StringView){start, p - start};
+  C->http_method = lookupMethod(start, p - start);
+  ++p;
+
+  // Request-target: visible ASCII (or obs-text) up to the next space
+  start = p;
+  p = scanTarget(p, end);
+  if (p == start || p >= end || *p != ' ')
+    return PARSE_MALFORMED;
+  C->target = (StringView){start, p - start};
+  const char *question = memchr(start, '?', p - start);
+  if (question) {
+    C->route = (StringView){start, question - start};
+    C->query = (StringView){question + 1, p - question - 1};
+  } else {
+    C->route = C->target;
+    C->query = (StringView){p, 0};
+  }
+  ++p;
+
+  // Version: "HTTP/1.x" followed by the end of the line
+  if (end - p < 9 || memcmp(p, "HTTP/1.", 7) != 0 || p[7] < '0' ||
+      p[7] > '9')
+    return PARSE_MALFORMED;
+  C->http_version = (StringView){p, 8};
+  C->version_minor = p[7] - '0';
+  p += 8;
+  if (*p == '\r')
+    ++p;
+  if (p >= end || *p != '\n')
+    return PARSE_MALFORMED;
+  ++p;
+
+  // Header fields until the empty line
+  for (;;) {
+    if (p >= end)
+      return PARSE_MALFORMED; // Callers pass a head ending in a blank line
+    if (*p == '\n' || (*p == '\r' && p + 1 < end && p[1] == '\n'))
+      break;
+
+    // Field name: a token immediately followed by ':'
+    start = p;
+    p = scanToken(p, end);
+    if (p == start || p >= end || *p != ':')
+      return PARSE_MALFORMED;
+    StringView name = {start, p - start};
+    ++p;
+
+    // Field value: optional whitespace, then everything up to the line end.
+    // The scan stops at the first control character, which has to be the
+    // CRLF (or bare LF) ending the line.
+    while (p < end && (*p == ' ' || *p == '\t'))
+      ++p;
+    start = p;
+    p = scanFieldValue(p, end);
+    const char *value_end = p;
+    if (p < end && *p == '\r')
+      ++p;
+    if (p >= end || *p != '\n')
+      return PARSE_MALFORMED; // Control character inside the value
+    ++p;
+    while (value_end > start &&
+           (value_end[-1] == ' ' || value_end[-1] == '\t'))
+      --value_end;
+
+    if (C->header_count == MAX_HEADERS)
+      return PARSE_TOO_MANY_HEADERS;
+    C->headers[C->header_count].name = name;
+    C->headers[C->header_count].value =
+        (StringView){start, value_end - start};
+    C->header_count++;
   }
 
-  char line[BUFFER_SIZE]; // Stack buffer for the request line
-  memcpy(line, client_req_str, line_len);
-  line[line_len] = '\0';
+  C->keep_alive = requestKeepAlive(C);
+  return parseBodyFraming(C);
+}
+
+// Find the blank line ending the head, starting the search at 'from'.
+// Returns the length of the head or -1 if it is not complete yet.
+static ssize_t findHeadEnd(const char *buffer, size_t len, size_t from) {
+  const char *p = buffer + from;
+  const char *end = buffer + len;
+  // Every line of the head ends in '\n', so jump from one newline to the next
+  // and look for an empty line ("\n\n" or "\n\r\n").
+  while ((p = memchr(p, '\n', end - p)) != NULL) {
+    ++p;
+    if (p < end && *p == '\n')
+      return p + 1 - buffer;
+    if (p + 1 < end && p[0] == '\r' && p[1] == '\n')
+      return p + 2 - buffer;
+  }
+  return -1;
+}
 
-  C.http_method = malloc(16);
-  C.route = malloc(ROUTE_BUFFER_SIZE); // Use defined size
-  C.http_version = malloc(16);
-  C.args = NULL; // Will be allocated only if /echo/ route
+void httpParserReset(HttpParser *P) {
+  P->state = HTTP_PARSER_HEAD;
+  P->scan_offset = 0;
+  P->remaining = 0;
+  P->body_bytes = 0;
+  P->line_bytes = 0;
+  P->size_digits = 0;
+}
 
-  if (!C.http_method || !C.route || !C.http_version) {
-    perror("malloc failed in parseRequest");
-    freeClientRequest(&C); // Free what was allocated
-    return C;              // Return the partially (or fully) NULLed struct
+int httpParserHead(HttpParser *P, const char *buffer, size_t len,
+                   ClientRequest *C, size_t *head_len) {
+  // The blank line is at most three bytes long ("\n\r\n"), so only the last
+  // bytes of the previous search have to be looked at again.
+  size_t from = P->scan_offset > 2 ? P->scan_offset - 2 : 0;
+  ssize_t end = findHeadEnd(buffer, len, from);
+  if (end < 0) {
+    P->scan_offset = len;
+    return len >= MAX_HEAD_SIZE ? PARSE_HEAD_TOO_LARGE : PARSE_NEED_MORE;
   }
+  if ((size_t)end > MAX_HEAD_SIZE)
+    return PARSE_HEAD_TOO_LARGE;
+
+  *head_len = (size_t)end;
+  int status = parseRequest(buffer, (size_t)end, C);
+  if (status != PARSE_OK)
+    return status;
 
-  // Use ROUTE_BUFFER_SIZE - 1 for sscanf field width
-  int n =
-      sscanf(line, "%15s %127s %15s", C.http_method, C.route, C.http_version);
-  if (n != 3) {
-    fprintf(stderr,
-            "sscanf failed to parse request line."
-            "Items matched: %d. Line: '%s'\n",
-            n, line);
-    freeClientRequest(&C);
-    return C;
+  httpParserReset(P);
+  if (C->chunked) {
+    P->state = HTTP_PARSER_CHUNK_SIZE;
+  } else if (C->content_length > 0) {
+    P->state = HTTP_PARSER_BODY;
+    P->remaining = C->content_length;
   }
+  return PARSE_OK;
+}
+
+int httpParserInBody(const HttpParser *P) {
+  return P->state != HTTP_PARSER_HEAD;
+}
 
-  const char *echo_prefix = "/echo/";
-  size_t echo_prefix_len = strlen(echo_prefix);
-  if (strncmp(C.route, echo_prefix, echo_prefix_len) == 0) {
-    C.args = malloc(ARGS_BUFFER_SIZE);
-    if (!C.args) {
-      perror("malloc failed for C.args in parseRequest");
-      freeClientRequest(&C); // free method, route, version
-      return C;
+// Hand up to 'avail' bytes of body data to the sink.
+// Returns the number of bytes taken or -1 if the sink aborted.
+static ssize_t deliverBody(HttpParser *P, const char *data, size_t avail,
+                           HttpBodySink sink, void *ctx) {
+  size_t n = avail < P->remaining ? avail : (size_t)P->remaining;
+  ssize_t taken = sink(ctx, data, n);
+  if (taken < 0)
+    return -1;
+  P->remaining -= (uint64_t)taken;
+  P->body_bytes += (uint64_t)taken;
+  return taken;
+}
+
+static int hexValue(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+int httpParserBody(HttpParser *P, const char *data, size_t len,
+                   size_t *consumed, HttpBodySink sink, void *ctx) {
+  const char *p = data;
+  const char *end = data + len;
+  int status = PARSE_NEED_MORE;
+
+  while (p < end || P->state == HTTP_PARSER_BODY) {
+    if (P->state == HTTP_PARSER_BODY || P->state == HTTP_PARSER_CHUNK_DATA) {
+      if (P->remaining > 0) {
+        if (p == end)
+          break;
+        ssize_t taken = deliverBody(P, p, end - p, sink, ctx);
+        if (taken < 0) {
+          status = PARSE_MALFORMED;
+          break;
+        }
+        p += taken;
+        if (P->remaining > 0) {
+          if (p < end)
+            status = PARSE_PAUSED; // The sink is full, resume later
+          break;
+        }
+      }
+      if (P->state == HTTP_PARSER_BODY) {
+        httpParserReset(P);
+        status = PARSE_OK;
+        break;
+      }
+      P->state = HTTP_PARSER_CHUNK_DATA_CR;
+      continue;
     }
-    C.args[0] = '\0'; // Initialize args
-    const char *arg_start = C.route + echo_prefix_len;
-    strncpy(C.args, arg_start, ARGS_BUFFER_SIZE - 1);
-    C.args[ARGS_BUFFER_SIZE - 1] = '\0';
-
-    // Stop at the first space if present in the echoed argument
-    char *space_in_arg = strchr(C.args, ' ');
-    if (space_in_arg) {
-      *space_in_arg = '\0';
+
+    char c = *p++;
+    switch (P->state) {
+    case HTTP_PARSER_CHUNK_SIZE: {
+      int digit = hexValue(c);
+      if (digit >= 0) {
+        if (P->remaining > (MAX_BODY_SIZE >> 4)) {
+          status = PARSE_BODY_TOO_LARGE;
+          goto out;
+        }
+        P->remaining = (P->remaining << 4) | (uint64_t)digit;
+        P->size_digits++;
+      } else if (P->size_digits == 0) {
+        status = PARSE_MALFORMED;
+        goto out;
+      } else if (c == ';' || c == ' ' || c == '\t') {
+        P->state = HTTP_PARSER_CHUNK_EXT;
+      } else if (c == '\r') {
+        P->state = HTTP_PARSER_CHUNK_SIZE_LF;
+      } else if (c == '\n') {
+        goto size_line_done;
+      } else {
+        status = PARSE_MALFORMED;
+        goto out;
+      }
+      break;
+    }
+    case HTTP_PARSER_CHUNK_EXT:
+      // Extensions are allowed but ignored
+      if (c == '\r')
+        P->state = HTTP_PARSER_CHUNK_SIZE_LF;
+      else if (c == '\n')
+        goto size_line_done;
+      break;
+    case HTTP_PARSER_CHUNK_SIZE_LF:
+      if (c != '\n') {
+        status = PARSE_MALFORMED;
+        goto out;
+      }
+    size_line_done:
+      if (P->body_bytes + P->remaining > MAX_BODY_SIZE) {
+        status = PARSE_BODY_TOO_LARGE;
+        goto out;
+      }
+      P->line_bytes = 0;
+      P->size_digits = 0;
+      P->state = P->remaining == 0 ? HTTP_PARSER_TRAILER_START
+                                   : HTTP_PARSER_CHUNK_DATA;
+      continue;
+    case HTTP_PARSER_CHUNK_DATA_CR:
+      if (c == '\r') {
+        P->state = HTTP_PARSER_CHUNK_DATA_LF;
+        break;
+      }
+      // A bare LF after the chunk data is tolerated.
+      // Fall through.
+    case HTTP_PARSER_CHUNK_DATA_LF:
+      if (c != '\n') {
+        status = PARSE_MALFORMED;
+        goto out;
+      }
+      P->state = HTTP_PARSER_CHUNK_SIZE;
+      continue;
+    case HTTP_PARSER_TRAILER_START:
+      if (c == '\r') {
+        P->state = HTTP_PARSER_TRAILER_END_LF;
+      } else if (c == '\n') {
+        httpParserReset(P);
+        status = PARSE_OK;
+        goto out;
+      } else {
+        P->state = HTTP_PARSER_TRAILER_LINE; // Trailer fields are skipped
+      }
+      break;
+    case HTTP_PARSER_TRAILER_LINE:
+      if (c == '\n')
+        P->state = HTTP_PARSER_TRAILER_START;
+      break;
+    case HTTP_PARSER_TRAILER_END_LF:
+      if (c != '\n') {
+        status = PARSE_MALFORMED;
+        goto out;
+      }
+      httpParserReset(P);
+      status = PARSE_OK;
+      goto out;
+    default:
+      status = PARSE_MALFORMED;
+      goto out;
+    }
+
+    // Chunk-size and trailer lines are buffered nowhere, but they still
+    // count towards a limit so a peer can not stream them forever.
+    if (++P->line_bytes > MAX_CHUNK_LINE) {
+      status = PARSE_MALFORMED;
+      goto out;
     }
   }
 
-  return C;
+out:
+  *consumed = (size_t)(p - data);
+  return status;
 }
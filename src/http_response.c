@@ -1,75 +1,161 @@
 #include "../include/http_response.h"
-#include "../include/config.h" // For RESPONSE_CODES, BUFFER_SIZE
-#include <stdio.h>             // For fprintf, perror, snprintf
-#include <stdlib.h>            // For malloc, free
-#include <string.h>            // For size_t
-#include <string.h>            // For strlen, memcpy
-
-// A function to initialize the server responses
-int initializeServerResponses(char *serverResponse[], int response_code,
-                              const char *response_text,
-                              size_t response_length) {
-  if (response_code >= RESPONSE_CODES || response_code < 0) {
-    fprintf(stderr, "Invalid response_code: %d\n", response_code);
-    return -1;
-  }
-  if (serverResponse[response_code] != NULL) {
-    free(serverResponse[response_code]);
-  }
-  serverResponse[response_code] = malloc(response_length + 1);
-  if (!serverResponse[response_code]) {
-    perror("malloc failed for serverResponse");
-    return -1;
-  }
-  memcpy(serverResponse[response_code], response_text, response_length);
-  serverResponse[response_code][response_length] = '\0';
-  return 0;
+#include "../include/config.h" // For BUFFER_SIZE, ECHO_CACHE_TTL_MS
+#include <stdio.h>             // For fprintf, snprintf
+#include <string.h>            // For strlen, strncmp, memcpy
+
+// Status line, fixed header lines and body of a canned response. The
+// Content-Length, Date and connection header are added when rendering.
+typedef struct {
+  const char *status_line;
+  size_t status_len;
+  const char *headers;
+  size_t headers_len;
+  const char *body;
+  size_t body_len;
+} CannedTemplate;
+
+#define CANNED(status, headers, body)                                         \
+  {status, sizeof(status) - 1, headers, sizeof(headers) - 1, body,            \
+   sizeof(body) - 1}
+
+static const CannedTemplate canned_templates[CANNED_RESPONSE_COUNT] = {
+    [RESPONSE_ROOT_OK] = CANNED("HTTP/1.1 200 OK\r\n", "", ""),
+    [RESPONSE_BAD_REQUEST] = CANNED("HTTP/1.1 400 Bad Request\r\n", "", ""),
+    [RESPONSE_NOT_FOUND] = CANNED("HTTP/1.1 404 Not Found\r\n", "", ""),
+    [RESPONSE_CONTENT_TOO_LARGE] =
+        CANNED("HTTP/1.1 413 Content Too Large\r\n", "", ""),
+    [RESPONSE_TOO_MANY_REQUESTS] =
+        CANNED("HTTP/1.1 429 Too Many Requests\r\n", "Retry-After: 1\r\n",
+               ""),
+    [RESPONSE_HEADERS_TOO_LARGE] =
+        CANNED("HTTP/1.1 431 Request Header Fields Too Large\r\n", "", ""),
+    [RESPONSE_INTERNAL_ERROR] =
+        CANNED("HTTP/1.1 500 Internal Server Error\r\n", "", ""),
+    [RESPONSE_NOT_IMPLEMENTED] =
+        CANNED("HTTP/1.1 501 Not Implemented\r\n", "", ""),
+    [RESPONSE_BAD_GATEWAY] = CANNED("HTTP/1.1 502 Bad Gateway\r\n", "", ""),
+    [RESPONSE_SERVICE_UNAVAILABLE] =
+        CANNED("HTTP/1.1 503 Service Unavailable\r\n", "Retry-After: 1\r\n",
+               ""),
+    [RESPONSE_GATEWAY_TIMEOUT] =
+        CANNED("HTTP/1.1 504 Gateway Timeout\r\n", "", ""),
+};
+
+static const char *const connection_headers[CONNECTION_MODES] = {
+    [CONNECTION_DEFAULT] = "",
+    [CONNECTION_CLOSE] = "Connection: close\r\n",
+    [CONNECTION_KEEP_ALIVE] = "Connection: keep-alive\r\n",
+};
+
+const char *connectionHeader(ConnectionMode mode) {
+  return connection_headers[mode];
+}
+
+int responseStatus(const char *status_line) {
+  // "HTTP/1.x " is followed by exactly three digits
+  const char *code = status_line + 9;
+  if (strncmp(status_line, "HTTP/1.", 7) != 0 || status_line[7] == '\0' ||
+      status_line[8] != ' ' || code[0] < '1' || code[0] > '9' ||
+      code[1] < '0' || code[1] > '9' || code[2] < '0' || code[2] > '9')
+    return 0;
+  return (code[0] - '0') * 100 + (code[1] - '0') * 10 + (code[2] - '0');
+}
+
+// Append 'len' bytes at 'pos' if they fit in 'size'
+static size_t append(char *dst, size_t pos, size_t size, const char *src,
+                     size_t len) {
+  if (pos + len > size)
+    return size + 1; // Stays past the end, reported by the caller
+  memcpy(dst + pos, src, len);
+  return pos + len;
 }
 
-// A function to free the server responses
-void freeServerResponses(char *serverResponse[], size_t count) {
-  for (size_t i = 0; i < count; ++i) {
-    if (serverResponse[i]) {
-      free(serverResponse[i]);
-      serverResponse[i] = NULL;
+static void renderCannedResponses(CannedResponses *R, time_t now) {
+  char date[HTTP_DATE_SIZE];
+  size_t date_len = formatHttpDate(now, date, sizeof(date));
+  R->date_second = now;
+  R->date_line_len = (size_t)snprintf(R->date_line, sizeof(R->date_line),
+                                      "Date: %.*s\r\n", (int)date_len, date);
+
+  for (int id = 0; id < CANNED_RESPONSE_COUNT; ++id) {
+    const CannedTemplate *T = &canned_templates[id];
+    char length_line[48];
+    size_t length_len =
+        (size_t)snprintf(length_line, sizeof(length_line),
+                         "Content-Length: %zu\r\n", T->body_len);
+    for (int mode = 0; mode < CONNECTION_MODES; ++mode) {
+      char *out = R->rendered[id][mode];
+      const char *connection = connection_headers[mode];
+      size_t pos = 0;
+      pos = append(out, pos, CANNED_RESPONSE_MAX, T->status_line,
+                   T->status_len);
+      pos = append(out, pos, CANNED_RESPONSE_MAX, T->headers, T->headers_len);
+      pos = append(out, pos, CANNED_RESPONSE_MAX, length_line, length_len);
+      pos = append(out, pos, CANNED_RESPONSE_MAX, R->date_line,
+                   R->date_line_len);
+      pos = append(out, pos, CANNED_RESPONSE_MAX, connection,
+                   strlen(connection));
+      pos = append(out, pos, CANNED_RESPONSE_MAX, "\r\n", 2);
+      size_t head_len = pos;
+      pos = append(out, pos, CANNED_RESPONSE_MAX, T->body, T->body_len);
+      if (pos > CANNED_RESPONSE_MAX) {
+        // Only possible if a template outgrows CANNED_RESPONSE_MAX
+        fprintf(stderr, "Canned response %d does not fit.\n", id);
+        head_len = pos = 0;
+      }
+      R->head_len[id][mode] = head_len;
+      R->total_len[id][mode] = pos;
     }
   }
 }
 
-// A function to generate server responses to the client requests at the echo/
-// endpoint
-ServerResponse echoResponse(ClientRequest C, char **serverResponse) {
-  ServerResponse S = {NULL, NULL, NULL}; // Initialize all to NULL
-
-  // contentLen is temporary and its content is copied by snprintf
-  char contentLen_str[12]; // Stack buffer for string representation of length
-  contentLen_str[0] = '\0';
-
-  if (C.args == NULL) { // Should not happen if parseRequest initialized C.args
-                        // correctly for /echo/
-    fprintf(stderr,
-            "Error: C.args is NULL in echoResponse for /echo/ route.\n");
-    return S; // Return empty ServerResponse
-  }
+void initializeCannedResponses(CannedResponses *R, time_t now) {
+  renderCannedResponses(R, now);
+}
+
+void refreshCannedResponses(CannedResponses *R, time_t now) {
+  if (now != R->date_second)
+    renderCannedResponses(R, now);
+}
 
-  snprintf(contentLen_str, sizeof(contentLen_str), "%d", (int)strlen(C.args));
+StringView cannedResponse(const CannedResponses *R, CannedResponseId id,
+                          ConnectionMode mode, int head_only) {
+  StringView v = {R->rendered[id][mode],
+                  head_only ? R->head_len[id][mode] : R->total_len[id][mode]};
+  return v;
+}
+
+StringView dateHeader(const CannedResponses *R) {
+  StringView v = {R->date_line, R->date_line_len};
+  return v;
+}
 
-  // Allocate memory for response parts
-  S.status_line = malloc(BUFFER_SIZE);
-  S.headers = malloc(BUFFER_SIZE);
-  S.response_body = malloc(strlen(C.args) + 1); // Allocate exact size for body
+// A function to generate server responses to the client requests at the echo/
+// endpoint. Every part is allocated from the request's arena.
+ServerResponse echoResponse(StringView message, Arena *arena) {
+  ServerResponse S = {NULL, NULL, NULL, 0}; // Initialize all to NULL
+
+  // Allocate memory for response parts. The status line never changes, so
+  // it is not copied.
+  S.status_line = "HTTP/1.1 200 OK\r\n";
+  S.headers = arena_alloc(arena, BUFFER_SIZE);
+  // The message is a view into the request, copy it out as the body
+  S.response_body = arena_strndup(arena, message.ptr, message.len);
 
-  if (!S.status_line || !S.headers || !S.response_body) {
-    perror("malloc failed in echoResponse");
-    freeServerResponse(&S); // free whatever was allocated
-    return S;               // Return partially or fully NULLed ServerResponse
+  if (!S.headers || !S.response_body) {
+    fprintf(stderr, "Arena exhausted in echoResponse.\n");
+    return (ServerResponse){NULL, NULL, NULL, 0};
   }
 
-  snprintf(S.status_line, BUFFER_SIZE, "%s", serverResponse[200]);
+  // The blank line ending the head is added by the caller, after the Date
+  // and any connection management headers. A body long enough to be
+  // compressed for clients that accept it varies with Accept-Encoding.
   snprintf(S.headers, BUFFER_SIZE,
-           "Content-Type: text/plain\r\nContent-Length: %s\r\n\r\n",
-           contentLen_str);
-  snprintf(S.response_body, strlen(C.args) + 1, "%s", C.args); // Use exact size
-
+           "Content-Type: text/plain\r\n%sContent-Length: %zu\r\n",
+           message.len >= COMPRESS_MIN_SIZE ? "Vary: Accept-Encoding\r\n"
+                                            : "",
+           message.len);
+  // The same path always gets the same echo
+  S.cache_ttl_ms = ECHO_CACHE_TTL_MS;
   return S;
 }
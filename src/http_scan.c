@@ -0,0 +1,262 @@
+#include "../include/http_scan.h"
+
+#include <stddef.h> // For NULL
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HTTP_SCAN_X86 1
+#include <immintrin.h> // For the SSE4.2 and AVX2 intrinsics
+#endif
+
+// Token characters (RFC 9110 section 5.6.2) classified by nibble: a byte is
+// a token character iff token_lo[c & 15] & token_hi[c >> 4] is non-zero.
+// Every high nibble that contains token characters (0x2-0x7) owns one bit,
+// which lets PSHUFB classify 16 or 32 bytes with two table lookups.
+static const unsigned char token_lo[16] = {0x3a, 0x3f, 0x3e, 0x3f, 0x3f, 0x3f,
+                                           0x3f, 0x3f, 0x3e, 0x3e, 0x3d, 0x15,
+                                           0x34, 0x15, 0x3d, 0x1c};
+static const unsigned char token_hi[16] = {0x00, 0x00, 0x01, 0x02, 0x04, 0x08,
+                                           0x10, 0x20, 0x00, 0x00, 0x00, 0x00,
+                                           0x00, 0x00, 0x00, 0x00};
+
+// The same set as a plain table for the scalar loops
+static const unsigned char token_chars[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 1, 0, 1, 1, 1, 1, 1, 0, 0, 1, 1, 0, 1, 1, 0,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0,
+    0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 0, 1, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+static inline int isTokenChar(unsigned char c) { return token_chars[c]; }
+
+static inline int isTargetStop(unsigned char c) {
+  return c <= ' ' || c == 0x7f;
+}
+
+static inline int isFieldValueStop(unsigned char c) {
+  return (c < ' ' && c != '\t') || c == 0x7f;
+}
+
+// ---- Scalar kernel ----
+
+static const char *scanTokenScalar(const char *p, const char *end) {
+  while (p < end && isTokenChar((unsigned char)*p))
+    ++p;
+  return p;
+}
+
+static const char *scanTargetScalar(const char *p, const char *end) {
+  while (p < end && !isTargetStop((unsigned char)*p))
+    ++p;
+  return p;
+}
+
+static const char *scanFieldValueScalar(const char *p, const char *end) {
+  while (p < end && !isFieldValueStop((unsigned char)*p))
+    ++p;
+  return p;
+}
+
+#ifdef HTTP_SCAN_X86
+
+// ---- SSE4.2 kernel ----
+
+// PCMPESTRI range pairs of the bytes that stop each scan
+static const char target_ranges[16] = {'\x00', ' ', '\x7f', '\x7f'};
+static const char field_value_ranges[16] = {'\x00', '\x08', '\x0a',
+                                            '\x1f', '\x7f', '\x7f'};
+
+__attribute__((target("sse4.2"))) static const char *
+scanRangesSse42(const char *p, const char *end, const char *ranges,
+                int ranges_len) {
+  const __m128i r = _mm_loadu_si128((const __m128i *)ranges);
+  while (end - p >= 16) {
+    __m128i b = _mm_loadu_si128((const __m128i *)p);
+    int idx = _mm_cmpestri(r, ranges_len, b, 16,
+                           _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES |
+                               _SIDD_LEAST_SIGNIFICANT);
+    if (idx != 16)
+      return p + idx;
+    p += 16;
+  }
+  return p;
+}
+
+__attribute__((target("sse4.2"))) static const char *
+scanTokenSse42(const char *p, const char *end) {
+  const __m128i lo_lut = _mm_loadu_si128((const __m128i *)token_lo);
+  const __m128i hi_lut = _mm_loadu_si128((const __m128i *)token_hi);
+  const __m128i nibble = _mm_set1_epi8(0x0f);
+  while (end - p >= 16) {
+    __m128i b = _mm_loadu_si128((const __m128i *)p);
+    __m128i lo = _mm_shuffle_epi8(lo_lut, _mm_and_si128(b, nibble));
+    __m128i hi = _mm_shuffle_epi8(
+        hi_lut, _mm_and_si128(_mm_srli_epi16(b, 4), nibble));
+    __m128i bad = _mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128());
+    int mask = _mm_movemask_epi8(bad);
+    if (mask)
+      return p + __builtin_ctz(mask);
+    p += 16;
+  }
+  return scanTokenScalar(p, end);
+}
+
+__attribute__((target("sse4.2"))) static const char *
+scanTargetSse42(const char *p, const char *end) {
+  return scanTargetScalar(scanRangesSse42(p, end, target_ranges, 4), end);
+}
+
+__attribute__((target("sse4.2"))) static const char *
+scanFieldValueSse42(const char *p, const char *end) {
+  return scanFieldValueScalar(
+      scanRangesSse42(p, end, field_value_ranges, 6), end);
+}
+
+// ---- AVX2 kernel ----
+// Only CPUs with SSE4.2 have AVX2, so the SSE4.2 kernel finishes the tail.
+
+// Unsigned "c <= limit" for every byte
+__attribute__((target("avx2"))) static inline __m256i
+bytesAtMost(__m256i b, unsigned char limit) {
+  return _mm256_cmpeq_epi8(_mm256_min_epu8(b, _mm256_set1_epi8((char)limit)),
+                           b);
+}
+
+__attribute__((target("avx2"))) static const char *
+scanTokenAvx2(const char *p, const char *end) {
+  const __m256i lo_lut = _mm256_broadcastsi128_si256(
+      _mm_loadu_si128((const __m128i *)token_lo));
+  const __m256i hi_lut = _mm256_broadcastsi128_si256(
+      _mm_loadu_si128((const __m128i *)token_hi));
+  const __m256i nibble = _mm256_set1_epi8(0x0f);
+  while (end - p >= 32) {
+    __m256i b = _mm256_loadu_si256((const __m256i *)p);
+    __m256i lo = _mm256_shuffle_epi8(lo_lut, _mm256_and_si256(b, nibble));
+    __m256i hi = _mm256_shuffle_epi8(
+        hi_lut, _mm256_and_si256(_mm256_srli_epi16(b, 4), nibble));
+    __m256i bad =
+        _mm256_cmpeq_epi8(_mm256_and_si256(lo, hi), _mm256_setzero_si256());
+    unsigned mask = (unsigned)_mm256_movemask_epi8(bad);
+    if (mask)
+      return p + __builtin_ctz(mask);
+    p += 32;
+  }
+  return scanTokenSse42(p, end); // 16-byte steps for the tail
+}
+
+__attribute__((target("avx2"))) static const char *
+scanTargetAvx2(const char *p, const char *end) {
+  const __m256i del = _mm256_set1_epi8(0x7f);
+  while (end - p >= 32) {
+    __m256i b = _mm256_loadu_si256((const __m256i *)p);
+    __m256i stop =
+        _mm256_or_si256(bytesAtMost(b, ' '), _mm256_cmpeq_epi8(b, del));
+    unsigned mask = (unsigned)_mm256_movemask_epi8(stop);
+    if (mask)
+      return p + __builtin_ctz(mask);
+    p += 32;
+  }
+  return scanTargetSse42(p, end); // 16-byte steps for the tail
+}
+
+__attribute__((target("avx2"))) static const char *
+scanFieldValueAvx2(const char *p, const char *end) {
+  const __m256i del = _mm256_set1_epi8(0x7f);
+  const __m256i tab = _mm256_set1_epi8('\t');
+  while (end - p >= 32) {
+    __m256i b = _mm256_loadu_si256((const __m256i *)p);
+    __m256i ctl =
+        _mm256_andnot_si256(_mm256_cmpeq_epi8(b, tab), bytesAtMost(b, 0x1f));
+    __m256i stop = _mm256_or_si256(ctl, _mm256_cmpeq_epi8(b, del));
+    unsigned mask = (unsigned)_mm256_movemask_epi8(stop);
+    if (mask)
+      return p + __builtin_ctz(mask);
+    p += 32;
+  }
+  return scanFieldValueSse42(p, end); // 16-byte steps for the tail
+}
+
+#endif // HTTP_SCAN_X86
+
+const char *(*scanToken)(const char *p, const char *end) = scanTokenScalar;
+const char *(*scanTarget)(const char *p, const char *end) = scanTargetScalar;
+const char *(*scanFieldValue)(const char *p,
+                              const char *end) = scanFieldValueScalar;
+
+static HttpScanKernel active_kernel = HTTP_SCAN_SCALAR;
+
+static int kernelSupported(HttpScanKernel kernel) {
+  switch (kernel) {
+  case HTTP_SCAN_SCALAR:
+    return 1;
+#ifdef HTTP_SCAN_X86
+  case HTTP_SCAN_SSE42:
+    return __builtin_cpu_supports("sse4.2");
+  case HTTP_SCAN_AVX2:
+    return __builtin_cpu_supports("avx2");
+#endif
+  default:
+    return 0;
+  }
+}
+
+int httpScanUseKernel(HttpScanKernel kernel) {
+#ifdef HTTP_SCAN_X86
+  __builtin_cpu_init();
+#endif
+  if (!kernelSupported(kernel))
+    return -1;
+  switch (kernel) {
+#ifdef HTTP_SCAN_X86
+  case HTTP_SCAN_SSE42:
+    scanToken = scanTokenSse42;
+    scanTarget = scanTargetSse42;
+    scanFieldValue = scanFieldValueSse42;
+    break;
+  case HTTP_SCAN_AVX2:
+    scanToken = scanTokenAvx2;
+    scanTarget = scanTargetAvx2;
+    scanFieldValue = scanFieldValueAvx2;
+    break;
+#endif
+  default:
+    scanToken = scanTokenScalar;
+    scanTarget = scanTargetScalar;
+    scanFieldValue = scanFieldValueScalar;
+    break;
+  }
+  active_kernel = kernel;
+  return 0;
+}
+
+void httpScanInit(void) {
+  if (httpScanUseKernel(HTTP_SCAN_AVX2) == 0)
+    return;
+  if (httpScanUseKernel(HTTP_SCAN_SSE42) == 0)
+    return;
+  httpScanUseKernel(HTTP_SCAN_SCALAR);
+}
+
+HttpScanKernel httpScanActiveKernel(void) { return active_kernel; }
+
+const char *httpScanKernelName(HttpScanKernel kernel) {
+  switch (kernel) {
+  case HTTP_SCAN_SSE42:
+    return "sse4.2";
+  case HTTP_SCAN_AVX2:
+    return "avx2";
+  default:
+    return "scalar";
+  }
+}
@@ -1,26 +1,137 @@
 #include "../include/http_types.h"
-#include <stdlib.h>
-
-// Helper function to free ClientRequest
-void freeClientRequest(ClientRequest *C) {
-  if (C->http_method)
-    free(C->http_method);
-  if (C->route)
-    free(C->route);
-  if (C->http_version)
-    free(C->http_version);
-  if (C->args)
-    free(C->args);
-  C->http_method = C->route = C->http_version = C->args = NULL;
-}
-
-// Helper function to free ServerResponse
-void freeServerResponse(ServerResponse *S) {
-  if (S->status_line)
-    free(S->status_line);
-  if (S->headers)
-    free(S->headers);
-  if (S->response_body)
-    free(S->response_body);
-  S->status_line = S->headers = S->response_body = NULL;
+#include <stdio.h>   // For snprintf
+#include <string.h>  // For strlen, memcmp
+#include <strings.h> // For strncasecmp
+
+static const char *const day_names[] = {"Sun", "Mon", "Tue", "Wed",
+                                        "Thu", "Fri", "Sat"};
+static const char *const month_names[] = {"Jan", "Feb", "Mar", "Apr",
+                                          "May", "Jun", "Jul", "Aug",
+                                          "Sep", "Oct", "Nov", "Dec"};
+
+int viewEquals(StringView v, const char *s) {
+  size_t len = strlen(s);
+  return v.len == len && memcmp(v.ptr, s, len) == 0;
+}
+
+int viewEqualsIgnoreCase(StringView v, const char *s) {
+  size_t len = strlen(s);
+  return v.len == len && strncasecmp(v.ptr, s, len) == 0;
+}
+
+int viewStartsWith(StringView v, const char *prefix) {
+  size_t len = strlen(prefix);
+  return v.len >= len && memcmp(v.ptr, prefix, len) == 0;
+}
+
+const HttpHeader *findHeader(const ClientRequest *C, const char *name) {
+  for (size_t i = 0; i < C->header_count; ++i) {
+    if (viewEqualsIgnoreCase(C->headers[i].name, name))
+      return &C->headers[i];
+  }
+  return NULL;
+}
+
+int headerHasToken(StringView value, const char *token) {
+  size_t token_len = strlen(token);
+  const char *p = value.ptr;
+  const char *end = value.ptr + value.len;
+  while (p < end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+      ++p;
+    const char *start = p;
+    while (p < end && *p != ',')
+      ++p;
+    const char *stop = p;
+    while (stop > start && (stop[-1] == ' ' || stop[-1] == '\t'))
+      --stop;
+    if ((size_t)(stop - start) == token_len &&
+        strncasecmp(start, token, token_len) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+const char *httpMethodName(HttpMethod method) {
+  switch (method) {
+  case HTTP_METHOD_GET:
+    return "GET";
+  case HTTP_METHOD_HEAD:
+    return "HEAD";
+  case HTTP_METHOD_POST:
+    return "POST";
+  case HTTP_METHOD_PUT:
+    return "PUT";
+  case HTTP_METHOD_DELETE:
+    return "DELETE";
+  case HTTP_METHOD_CONNECT:
+    return "CONNECT";
+  case HTTP_METHOD_OPTIONS:
+    return "OPTIONS";
+  case HTTP_METHOD_TRACE:
+    return "TRACE";
+  case HTTP_METHOD_PATCH:
+    return "PATCH";
+  default:
+    return "UNKNOWN";
+  }
+}
+
+size_t formatHttpDate(time_t t, char *buf, size_t size) {
+  struct tm tm;
+  if (size < HTTP_DATE_SIZE || !gmtime_r(&t, &tm))
+    return 0;
+  // Names are spelled out instead of using strftime(), whose %a and %b
+  // follow the locale
+  int n = snprintf(buf, size, "%s, %02d %s %04d %02d:%02d:%02d GMT",
+                   day_names[tm.tm_wday], tm.tm_mday, month_names[tm.tm_mon],
+                   tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+  return n > 0 ? (size_t)n : 0;
+}
+
+// Parse 'len' decimal digits
+static int parseDigits(const char *p, size_t len, int *out) {
+  int value = 0;
+  for (size_t i = 0; i < len; ++i) {
+    if (p[i] < '0' || p[i] > '9')
+      return -1;
+    value = value * 10 + (p[i] - '0');
+  }
+  *out = value;
+  return 0;
+}
+
+// Days between 1970-01-01 and the given civil date (proleptic Gregorian)
+static long daysFromCivil(int year, int month, int day) {
+  year -= month <= 2;
+  long era = (year >= 0 ? year : year - 399) / 400;
+  long yoe = year - era * 400;
+  long doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+  long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + doe - 719468;
+}
+
+int parseHttpDate(StringView v, time_t *out) {
+  // Only the IMF-fixdate form is accepted: "Sun, 06 Nov 1994 08:49:37 GMT".
+  // Every current client sends it; the obsolete forms are ignored.
+  const char *p = v.ptr;
+  if (v.len != 29 || p[3] != ',' || p[4] != ' ' || p[7] != ' ' ||
+      p[11] != ' ' || p[16] != ' ' || p[19] != ':' || p[22] != ':' ||
+      memcmp(p + 25, " GMT", 4) != 0)
+    return -1;
+  int month = -1;
+  for (int i = 0; i < 12; ++i) {
+    if (memcmp(p + 8, month_names[i], 3) == 0)
+      month = i + 1;
+  }
+  int day, year, hour, minute, second;
+  if (month < 0 || parseDigits(p + 5, 2, &day) < 0 ||
+      parseDigits(p + 12, 4, &year) < 0 || parseDigits(p + 17, 2, &hour) < 0 ||
+      parseDigits(p + 20, 2, &minute) < 0 ||
+      parseDigits(p + 23, 2, &second) < 0 || day < 1 || day > 31 ||
+      hour > 23 || minute > 59 || second > 60)
+    return -1;
+  *out = (time_t)daysFromCivil(year, month, day) * 86400 + hour * 3600 +
+         minute * 60 + second;
+  return 0;
 }
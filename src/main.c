@@ -1,66 +1,108 @@
 #include <stdio.h>  // For printf, fprintf, setvbuf, NULL, _IONBF
-#include <stdlib.h> // For EXIT_FAILURE, EXIT_SUCCESS
-#include <string.h> // For strlen
-#include <unistd.h> // For close()
+#include <stdlib.h> // For EXIT_FAILURE, EXIT_SUCCESS, calloc, free
 // Include your custom headers
-#include "../include/config.h"
-#include "../include/http_response.h"
+#include "../include/access_log.h"
+#include "../include/admission.h"
+#include "../include/http_scan.h"
+#include "../include/metrics.h"
+#include "../include/options.h"
 #include "../include/server.h"
 #include "../include/signal_handler.h"
+#include "../include/upgrade.h"
+#include "../include/worker.h"
 
-int main() {
+int main(int argc, char *argv[]) {
   // Disable output buffering so that the values sent to buffer are immediately
   // sent to respective streams
   setvbuf(stdout, NULL, _IONBF, 0);
   setvbuf(stderr, NULL, _IONBF, 0);
 
+  ServerOptions opts;
+  int parsed = parse_options(argc, argv, &opts);
+  if (parsed != 0) {
+    return parsed > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+  int worker_count =
+      opts.worker_count > 0 ? opts.worker_count : default_worker_count();
+
+  // Pick the fastest parser scanning kernel before any worker parses
+  httpScanInit();
+
   // Setup signal handler for graceful shutdown
   if (setup_signal_handler() == -1) {
     return EXIT_FAILURE;
   }
-  char *serverResponse[RESPONSE_CODES] = {0};
-  if (initializeServerResponses(serverResponse, 200, "HTTP/1.1 200 OK\r\n",
-                                strlen("HTTP/1.1 200 OK\r\n")) < 0 ||
-      initializeServerResponses(serverResponse, 404,
-                                "HTTP/1.1 404 Not Found\r\n",
-                                strlen("HTTP/1.1 404 Not Found\r\n")) < 0) {
-    fprintf(stderr, "Failed to initialize server responses.\n");
-    freeServerResponses(serverResponse, RESPONSE_CODES);
+  // Listening sockets handed down by a binary being replaced are taken
+  // over before any worker binds its own
+  if (upgrade_init(argv) < 0) {
+    return EXIT_FAILURE;
+  }
+  // Every worker shares the route table, so it is complete before they start
+  if (setup_routes(&opts) < 0) {
+    return EXIT_FAILURE;
+  }
+  // ... and so are the admission limits
+  admission_init(&opts);
+  Worker *workers = calloc(worker_count, sizeof(*workers));
+  if (!workers) {
+    perror("calloc failed for workers");
+    free_routes();
+    return EXIT_FAILURE;
+  }
+  // The log thread drains one ring per worker, so it runs before the first
+  // worker and stops after the last. The counters outlive the workers too.
+  if (metrics_init(worker_count) < 0) {
+    fprintf(stderr, "Failed to allocate the metrics.\n");
+    free(workers);
+    free_routes();
+    return EXIT_FAILURE;
+  }
+  if (access_log_start(opts.log_level, opts.log_format, worker_count) < 0) {
+    metrics_destroy();
+    free(workers);
+    free_routes();
     return EXIT_FAILURE;
   }
 
-  int server_fd = setup_server_socket(PORT);
-  if (server_fd < 0) {
-    freeServerResponses(serverResponse, RESPONSE_CODES);
+  // Block the shutdown signals before the workers exist so that they are
+  // only ever delivered to this thread, which then fans the shutdown out to
+  // every worker.
+  sigset_t old_mask;
+  if (block_shutdown_signals(&old_mask) < 0 ||
+      start_workers(workers, worker_count, &opts) < 0) {
+    access_log_stop();
+    metrics_destroy();
+    free(workers);
+    free_routes();
     return EXIT_FAILURE;
   }
 
   printf("Logs from the program will appear here.\n");
-  printf("Waiting for a client to connect on port %d...\n", PORT);
-  printf("Press Ctrl+C to stop the server.\n");
+  printf("Waiting for a client to connect on port %d with %d worker%s...\n",
+         opts.port, worker_count, worker_count == 1 ? "" : "s");
+  printf("Press Ctrl+C to stop the server, send SIGTERM to drain it or "
+         "SIGHUP to upgrade it.\n");
+  // Every listener is up, so the process this one replaces can drain
+  upgrade_ready();
 
-  while (keep_running) {
-    int client_fd = handle_accept(server_fd);
-    if (!keep_running) {
-      // fprintf(stderr, "Server is shutting down. Exiting accept loop.\n");
-      break; // Exit the loop if a signal was received
-    }
-
-    if (client_fd == -2) { // Custom code for EINTR, continue loop
-      continue;
-    }
-    if (client_fd < 0) { // Other fatal accept errors
-      // Error message already printed by handle_accept
-      continue;
+  for (;;) {
+    ServerSignal signal = wait_for_signal(&old_mask);
+    if (signal == SIGNAL_UPGRADE) {
+      if (upgrade_binary(workers, worker_count) < 0)
+        continue; // Keep serving with this binary
+      signal = SIGNAL_DRAIN;
     }
-    printf("Client Connected.\n");
-    handle_client(client_fd, serverResponse);
-    printf("Client Disconnected.\n");
-    close(client_fd);
+    if (signal == SIGNAL_DRAIN)
+      drain_workers(workers, worker_count);
+    break;
   }
+  keep_running = 0;
+  stop_workers(workers, worker_count);
+  access_log_stop();
+  metrics_destroy();
 
-  close(server_fd);
-  freeServerResponses(serverResponse, RESPONSE_CODES);
+  free(workers);
+  free_routes();
   printf("Server shut down successfully.\n");
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,38 @@
+#include "../include/memory_budget.h"
+#include "../include/config.h" // For ADMISSION_SHED_PERCENT, CACHE_LINE_SIZE
+
+static size_t budget;     // 0 if unlimited
+static size_t shed_level; // Bytes in use from which connections get 503
+
+// Updated by every worker with atomic operations, on a cache line of its
+// own. Pools only get here when their free lists can not serve them, so
+// it is not written per request.
+static struct {
+  _Alignas(CACHE_LINE_SIZE) size_t used;
+} memory;
+
+void memory_budget_init(size_t bytes) {
+  budget = bytes;
+  shed_level = bytes / 100 * ADMISSION_SHED_PERCENT;
+}
+
+int memory_budget_reserve(size_t bytes) {
+  size_t used = __atomic_add_fetch(&memory.used, bytes, __ATOMIC_RELAXED);
+  if (budget && used > budget) {
+    __atomic_sub_fetch(&memory.used, bytes, __ATOMIC_RELAXED);
+    return 0;
+  }
+  return 1;
+}
+
+void memory_budget_release(size_t bytes) {
+  __atomic_sub_fetch(&memory.used, bytes, __ATOMIC_RELAXED);
+}
+
+size_t memory_budget_used(void) {
+  return __atomic_load_n(&memory.used, __ATOMIC_RELAXED);
+}
+
+int memory_budget_shedding(void) {
+  return budget && memory_budget_used() >= shed_level;
+}
@@ -0,0 +1,257 @@
+#include "../include/metrics.h"
+#include "../include/memory_budget.h" // For memory_budget_used
+
+#include <stdarg.h> // For va_list, va_start, va_end
+#include <stdio.h>  // For vsnprintf
+#include <stdlib.h> // For aligned_alloc, free
+#include <string.h> // For memset
+
+// Powers of two of nanoseconds exported as the Prometheus 'le' bounds:
+// 2^10 ns (about 1 us) to 2^34 ns (about 17 s)
+#define EXPORT_MIN_BITS 10
+#define EXPORT_MAX_BITS 34
+
+static WorkerMetrics *workers;
+static int worker_total;
+
+int metrics_init(int worker_count) {
+  size_t size = (size_t)worker_count * sizeof(WorkerMetrics);
+  workers = aligned_alloc(CACHE_LINE_SIZE, size);
+  if (!workers)
+    return -1;
+  memset(workers, 0, size);
+  worker_total = worker_count;
+  return 0;
+}
+
+void metrics_destroy(void) {
+  free(workers);
+  workers = NULL;
+  worker_total = 0;
+}
+
+WorkerMetrics *metrics_worker(int index) {
+  return workers ? &workers[index] : NULL;
+}
+
+static uint64_t load(const uint64_t *value) {
+  return __atomic_load_n(value, __ATOMIC_RELAXED);
+}
+
+// Sum a counter over every worker. 'offset' locates it in WorkerMetrics.
+static uint64_t sum_counter(size_t offset) {
+  uint64_t total = 0;
+  for (int i = 0; i < worker_total; ++i)
+    total += load((const uint64_t *)((const char *)&workers[i] + offset));
+  return total;
+}
+
+static void sum_histogram(size_t offset, Histogram *total) {
+  memset(total, 0, sizeof(*total));
+  for (int i = 0; i < worker_total; ++i) {
+    const Histogram *h =
+        (const Histogram *)((const char *)&workers[i] + offset);
+    for (size_t b = 0; b < METRICS_HISTOGRAM_BUCKETS; ++b)
+      total->buckets[b] += load(&h->buckets[b]);
+    total->sum += load(&h->sum);
+  }
+  // The count is taken from the buckets, so it always matches them even
+  // though the workers keep recording while they are summed
+  for (size_t b = 0; b < METRICS_HISTOGRAM_BUCKETS; ++b)
+    total->count += total->buckets[b];
+}
+
+// Largest value that falls into bucket 'index'
+static uint64_t bucket_upper(size_t index) {
+  if (index < 2 * METRICS_HISTOGRAM_SUB)
+    return index;
+  unsigned shift = (unsigned)(index / METRICS_HISTOGRAM_SUB) - 1;
+  uint64_t lower = (uint64_t)(METRICS_HISTOGRAM_SUB +
+                              index % METRICS_HISTOGRAM_SUB)
+                   << shift;
+  return lower + (1ull << shift) - 1;
+}
+
+uint64_t histogram_quantile(const Histogram *h, double q) {
+  if (h->count == 0)
+    return 0;
+  uint64_t rank = (uint64_t)(q * (double)h->count + 0.5);
+  if (rank == 0)
+    rank = 1;
+  uint64_t seen = 0;
+  for (size_t b = 0; b < METRICS_HISTOGRAM_BUCKETS; ++b) {
+    seen += h->buckets[b];
+    if (seen >= rank)
+      return bucket_upper(b);
+  }
+  return bucket_upper(METRICS_HISTOGRAM_BUCKETS - 1);
+}
+
+// Output buffer that remembers whether anything did not fit
+typedef struct {
+  char *out;
+  size_t size, len;
+  int overflow;
+} Page;
+
+static void emit(Page *page, const char *format, ...) {
+  if (page->overflow)
+    return;
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(page->out + page->len, page->size - page->len, format,
+                    args);
+  va_end(args);
+  if (n < 0 || (size_t)n >= page->size - page->len)
+    page->overflow = 1;
+  else
+    page->len += (size_t)n;
+}
+
+static void emit_counter(Page *page, const char *name, const char *help,
+                         const char *type, uint64_t value) {
+  emit(page, "# HELP %s %s\n# TYPE %s %s\n%s %llu\n", name, help, name, type,
+       name, (unsigned long long)value);
+}
+
+static void emit_histogram(Page *page, const char *name, const char *help,
+                           size_t offset) {
+  Histogram h;
+  sum_histogram(offset, &h);
+  emit(page, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+  // Bucket boundaries are powers of two, so every fine bucket falls
+  // entirely below or above each exported bound
+  uint64_t cumulative = 0;
+  size_t b = 0;
+  for (unsigned bits = EXPORT_MIN_BITS; bits <= EXPORT_MAX_BITS; ++bits) {
+    uint64_t bound = 1ull << bits;
+    for (; b < METRICS_HISTOGRAM_BUCKETS && bucket_upper(b) < bound; ++b)
+      cumulative += h.buckets[b];
+    emit(page, "%s_bucket{le=\"%.12g\"} %llu\n", name, (double)bound / 1e9,
+         (unsigned long long)cumulative);
+  }
+  emit(page, "%s_bucket{le=\"+Inf\"} %llu\n", name,
+       (unsigned long long)h.count);
+  emit(page, "%s_sum %.9f\n%s_count %llu\n", name, (double)h.sum / 1e9, name,
+       (unsigned long long)h.count);
+  // The fine buckets resolve the tail far better than the exported bounds,
+  // so the usual quantiles are worked out here as well
+  static const char *const labels[] = {"0.5", "0.9", "0.99", "0.999"};
+  static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+  emit(page, "# HELP %s_quantile %s, quantiles\n# TYPE %s_quantile gauge\n",
+       name, help, name);
+  for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); ++i) {
+    emit(page, "%s_quantile{quantile=\"%s\"} %.9f\n", name, labels[i],
+         (double)histogram_quantile(&h, quantiles[i]) / 1e9);
+  }
+}
+
+size_t metrics_render(char *out, size_t size, const char *const *route_names,
+                      size_t route_count) {
+  static const char *const classes[METRICS_STATUS_CLASSES] = {
+      "none", "1xx", "2xx", "3xx", "4xx", "5xx"};
+  Page page = {out, size, 0, 0};
+  if (!workers || route_count > METRICS_MAX_ROUTES)
+    return 0;
+
+  emit_counter(&page, "httpc_connections_accepted_total",
+               "Connections accepted.", "counter",
+               sum_counter(offsetof(WorkerMetrics, accepts)));
+  emit_counter(&page, "httpc_connections_open", "Connections open now.",
+               "gauge", sum_counter(offsetof(WorkerMetrics, connections)));
+  emit_counter(&page, "httpc_connections_rate_limited_total",
+               "Connections turned away with 429 by the per-client rate.",
+               "counter", sum_counter(offsetof(WorkerMetrics, rate_limited)));
+  emit_counter(&page, "httpc_connections_overloaded_total",
+               "Connections turned away with 503 by the connection limit.",
+               "counter", sum_counter(offsetof(WorkerMetrics, overloaded)));
+  emit_counter(&page, "httpc_connections_shed_total",
+               "Connections turned away with 503 by the memory budget.",
+               "counter", sum_counter(offsetof(WorkerMetrics, shed)));
+  emit_counter(&page, "httpc_pooled_memory_bytes",
+               "Bytes of buffers and connections the workers hold.", "gauge",
+               memory_budget_used());
+  emit_counter(&page, "httpc_connections_untracked_total",
+               "Connections admitted without a rate bucket, the table being "
+               "full or the client not having an IPv4 address.",
+               "counter", sum_counter(offsetof(WorkerMetrics, untracked)));
+  emit_counter(&page, "httpc_parse_errors_total",
+               "Requests rejected by the parser.", "counter",
+               sum_counter(offsetof(WorkerMetrics, parse_errors)));
+  emit_counter(&page, "httpc_received_bytes_total",
+               "Bytes read from clients.", "counter",
+               sum_counter(offsetof(WorkerMetrics, bytes_in)));
+  emit_counter(&page, "httpc_sent_bytes_total", "Bytes written to clients.",
+               "counter", sum_counter(offsetof(WorkerMetrics, bytes_out)));
+  emit_counter(&page, "httpc_upstream_connects_total",
+               "Connections opened to proxy upstreams.", "counter",
+               sum_counter(offsetof(WorkerMetrics, upstream_connects)));
+  emit_counter(&page, "httpc_upstream_reuses_total",
+               "Proxied requests sent on a pooled upstream connection.",
+               "counter",
+               sum_counter(offsetof(WorkerMetrics, upstream_reuses)));
+  emit_counter(&page, "httpc_upstream_failures_total",
+               "Upstream connections that failed before a response head.",
+               "counter",
+               sum_counter(offsetof(WorkerMetrics, upstream_failures)));
+  emit_counter(&page, "httpc_upstream_ejections_total",
+               "Upstreams taken out of balancing after repeated failures.",
+               "counter",
+               sum_counter(offsetof(WorkerMetrics, upstream_ejections)));
+  emit_counter(&page, "httpc_http2_connections_total",
+               "Client connections that switched to HTTP/2.", "counter",
+               sum_counter(offsetof(WorkerMetrics, http2_connections)));
+  emit_counter(&page, "httpc_http2_streams_total",
+               "Requests received on HTTP/2 streams.", "counter",
+               sum_counter(offsetof(WorkerMetrics, http2_streams)));
+  emit_counter(&page, "httpc_http2_resets_total",
+               "HTTP/2 streams reset with RST_STREAM.", "counter",
+               sum_counter(offsetof(WorkerMetrics, http2_resets)));
+  emit_counter(&page, "httpc_response_cache_hits_total",
+               "Requests answered from the response cache.", "counter",
+               sum_counter(offsetof(WorkerMetrics, cache_hits)));
+  emit_counter(&page, "httpc_response_cache_fills_total",
+               "Handler responses stored in the response cache.", "counter",
+               sum_counter(offsetof(WorkerMetrics, cache_fills)));
+
+  static const char *const timeout_kinds[METRICS_TIMEOUT_KINDS] = {
+      "head", "body", "write", "idle", "linger", "connect", "upstream"};
+  emit(&page, "# HELP httpc_timeouts_total Connections closed by a timeout, "
+              "by what they were waiting for.\n"
+              "# TYPE httpc_timeouts_total counter\n");
+  for (size_t k = 0; k < METRICS_TIMEOUT_KINDS; ++k) {
+    emit(&page, "httpc_timeouts_total{kind=\"%s\"} %llu\n", timeout_kinds[k],
+         (unsigned long long)sum_counter(offsetof(WorkerMetrics, timeouts) +
+                                         k * sizeof(uint64_t)));
+  }
+
+  // Only series that have counted something are listed
+  emit(&page, "# HELP httpc_requests_total Requests by route and status "
+              "class.\n# TYPE httpc_requests_total counter\n");
+  for (size_t r = 0; r <= route_count; ++r) {
+    // The last row counts the requests that matched no route
+    size_t slot = r < route_count ? r : METRICS_MAX_ROUTES;
+    const char *route = r < route_count ? route_names[r] : "unmatched";
+    for (size_t c = 0; c < METRICS_STATUS_CLASSES; ++c) {
+      uint64_t n = sum_counter(offsetof(WorkerMetrics, requests) +
+                               (slot * METRICS_STATUS_CLASSES + c) *
+                                   sizeof(uint64_t));
+      if (n > 0) {
+        emit(&page, "httpc_requests_total{route=\"%s\",code=\"%s\"} %llu\n",
+             route, classes[c], (unsigned long long)n);
+      }
+    }
+  }
+
+  emit_histogram(&page, "httpc_parse_duration_seconds",
+                 "Time spent parsing request heads",
+                 offsetof(WorkerMetrics, parse_time));
+  emit_histogram(&page, "httpc_handler_duration_seconds",
+                 "Time spent routing requests and queueing responses",
+                 offsetof(WorkerMetrics, handler_time));
+  emit_histogram(&page, "httpc_request_duration_seconds",
+                 "Time from receiving a request head to queueing its "
+                 "response",
+                 offsetof(WorkerMetrics, request_time));
+  return page.overflow ? 0 : page.len;
+}
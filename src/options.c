@@ -0,0 +1,181 @@
+#include "../include/options.h"
+#include "../include/config.h" // For PORT, PROXY_MAX_ROUTES, ADMISSION_*
+
+#include <stdio.h>  // For fprintf
+#include <stdlib.h> // For strtol
+#include <string.h> // For strchr, strcmp
+#include <unistd.h> // For getopt, optarg, optind
+
+static void print_usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [-p port] [-w workers] [-a] [-d dir] [-b backend]"
+          " [-q] [-l level] [-F format]\n"
+          "          [-r rate[/burst]] [-C max] [-M mb]"
+          " [-P prefix=upstream[,upstream...]]...\n"
+          "  -p port     TCP port to listen on (default %d)\n"
+          "  -w workers  Worker threads, 0 = one per online CPU (default 0)\n"
+          "  -a          Pin each worker thread to its own CPU\n"
+          "  -d dir      Serve the files below dir (default: none)\n"
+          "  -b backend  I/O backend: epoll or uring (default epoll)\n"
+          "  -q          With -b uring, poll submissions from a kernel thread\n"
+          "  -l level    Access log: off, error, info or debug (default info)\n"
+          "  -F format   Access log lines: common or json (default common)\n"
+          "  -r rate     New connections per second from one client address,\n"
+          "              with bursts of up to burst (default rate); more get\n"
+          "              429 (default: unlimited)\n"
+          "  -C max      Connections open at once; more get 503 (default:\n"
+          "              unlimited)\n"
+          "  -M mb       Memory for buffers and connections over every\n"
+          "              worker; new connections get 503 once %d%% of it\n"
+          "              is in use (default: unlimited)\n"
+          "  -P route    Proxy prefix and everything below it to the\n"
+          "              upstreams, host:port or unix:/path, balanced by\n"
+          "              fewest requests in flight (up to %d times)\n"
+          "  -h          Show this help\n",
+          prog, PORT, ADMISSION_SHED_PERCENT, PROXY_MAX_ROUTES);
+}
+
+// Parse a decimal integer option within [min, max]
+static int parse_int(const char *text, int min, int max, int *out) {
+  char *end = NULL;
+  long value = strtol(text, &end, 10);
+  if (end == text || *end != '\0' || value < min || value > max)
+    return -1;
+  *out = (int)value;
+  return 0;
+}
+
+int parse_options(int argc, char *argv[], ServerOptions *opts) {
+  opts->port = PORT;
+  opts->worker_count = 0;
+  opts->pin_workers = 0;
+  opts->doc_root = NULL;
+  opts->backend = BACKEND_EPOLL;
+  opts->sqpoll = 0;
+  opts->log_level = LOG_LEVEL_INFO;
+  opts->log_format = LOG_FORMAT_COMMON;
+  opts->proxy_route_count = 0;
+  opts->client_rate = 0;
+  opts->client_burst = 0;
+  opts->max_connections = 0;
+  opts->memory_budget_mb = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "p:w:ad:b:ql:F:r:C:M:P:h")) != -1) {
+    switch (opt) {
+    case 'p':
+      if (parse_int(optarg, 1, 65535, &opts->port) < 0) {
+        fprintf(stderr, "Invalid port: %s\n", optarg);
+        return -1;
+      }
+      break;
+    case 'w':
+      if (parse_int(optarg, 0, MAX_WORKERS, &opts->worker_count) < 0) {
+        fprintf(stderr, "Invalid worker count: %s (0-%d)\n", optarg,
+                MAX_WORKERS);
+        return -1;
+      }
+      break;
+    case 'a':
+      opts->pin_workers = 1;
+      break;
+    case 'd':
+      opts->doc_root = optarg;
+      break;
+    case 'b':
+      if (strcmp(optarg, "epoll") == 0) {
+        opts->backend = BACKEND_EPOLL;
+      } else if (strcmp(optarg, "uring") == 0) {
+        opts->backend = BACKEND_URING;
+      } else {
+        fprintf(stderr, "Invalid backend: %s (epoll or uring)\n", optarg);
+        return -1;
+      }
+      break;
+    case 'q':
+      opts->sqpoll = 1;
+      break;
+    case 'l':
+      if (strcmp(optarg, "off") == 0) {
+        opts->log_level = LOG_LEVEL_OFF;
+      } else if (strcmp(optarg, "error") == 0) {
+        opts->log_level = LOG_LEVEL_ERROR;
+      } else if (strcmp(optarg, "info") == 0) {
+        opts->log_level = LOG_LEVEL_INFO;
+      } else if (strcmp(optarg, "debug") == 0) {
+        opts->log_level = LOG_LEVEL_DEBUG;
+      } else {
+        fprintf(stderr, "Invalid log level: %s (off, error, info, debug)\n",
+                optarg);
+        return -1;
+      }
+      break;
+    case 'F':
+      if (strcmp(optarg, "common") == 0) {
+        opts->log_format = LOG_FORMAT_COMMON;
+      } else if (strcmp(optarg, "json") == 0) {
+        opts->log_format = LOG_FORMAT_JSON;
+      } else {
+        fprintf(stderr, "Invalid log format: %s (common or json)\n", optarg);
+        return -1;
+      }
+      break;
+    case 'r': {
+      // rate[/burst], the burst defaulting to one second's worth
+      char *slash = strchr(optarg, '/');
+      if (slash)
+        *slash = '\0';
+      int invalid =
+          parse_int(optarg, 1, ADMISSION_MAX_RATE, &opts->client_rate) < 0 ||
+          (slash && parse_int(slash + 1, 1, ADMISSION_MAX_RATE,
+                              &opts->client_burst) < 0);
+      if (slash)
+        *slash = '/';
+      if (invalid) {
+        fprintf(stderr, "Invalid rate: %s (1-%d[/1-%d])\n", optarg,
+                ADMISSION_MAX_RATE, ADMISSION_MAX_RATE);
+        return -1;
+      }
+      if (!slash)
+        opts->client_burst = opts->client_rate;
+      break;
+    }
+    case 'C':
+      if (parse_int(optarg, 1, ADMISSION_MAX_CONNECTIONS,
+                    &opts->max_connections) < 0) {
+        fprintf(stderr, "Invalid connection limit: %s (1-%d)\n", optarg,
+                ADMISSION_MAX_CONNECTIONS);
+        return -1;
+      }
+      break;
+    case 'M':
+      if (parse_int(optarg, 1, ADMISSION_MAX_MEMORY_MB,
+                    &opts->memory_budget_mb) < 0) {
+        fprintf(stderr, "Invalid memory budget: %s (1-%d megabytes)\n",
+                optarg, ADMISSION_MAX_MEMORY_MB);
+        return -1;
+      }
+      break;
+    case 'P':
+      // Checked and resolved when the routes are set up
+      if (opts->proxy_route_count == PROXY_MAX_ROUTES) {
+        fprintf(stderr, "At most %d proxy routes.\n", PROXY_MAX_ROUTES);
+        return -1;
+      }
+      opts->proxy_routes[opts->proxy_route_count++] = optarg;
+      break;
+    case 'h':
+      print_usage(argv[0]);
+      return 1;
+    default:
+      print_usage(argv[0]);
+      return -1;
+    }
+  }
+  if (optind < argc) {
+    fprintf(stderr, "Unexpected argument: %s\n", argv[optind]);
+    print_usage(argv[0]);
+    return -1;
+  }
+  return 0;
+}
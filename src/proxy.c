@@ -0,0 +1,1266 @@
+// splice(), pipe2() and memmem() are Linux extensions
+#define _GNU_SOURCE
+#include "../include/proxy.h"
+#include "../include/event_loop.h" // For EventLoop, loop_watch_upstream
+#include "../include/http2.h"      // For http2_reset_stream
+#include "../include/server.h"     // For finish_deferred_request
+
+#include <arpa/inet.h>   // For inet_ntop, INET6_ADDRSTRLEN
+#include <errno.h>       // For errno, EAGAIN, EINPROGRESS, EINTR, EINVAL
+#include <fcntl.h>       // For splice, SPLICE_F_MOVE, O_NONBLOCK, O_CLOEXEC
+#include <netdb.h>       // For getaddrinfo, freeaddrinfo, gai_strerror
+#include <netinet/in.h>  // For sockaddr_in, sockaddr_in6, IPPROTO_TCP
+#include <netinet/tcp.h> // For TCP_NODELAY
+#include <stdio.h>       // For fprintf, snprintf, perror
+#include <stdlib.h>      // For malloc, free
+#include <string.h>      // For memcpy, memmove, memmem, strchr, strerror
+#include <strings.h>     // For strncasecmp
+#include <sys/socket.h>  // For socket, connect, send, recv, getpeername
+#include <sys/un.h>      // For sockaddr_un
+#include <unistd.h>      // For close, pipe2
+
+// Every method a proxied resource may have. CONNECT would need a tunnel,
+// and TRACE would echo headers the client never sent.
+#define PROXY_METHODS                                                         \
+  (ROUTE_GET | ROUTE_HEAD | ROUTE_POST | ROUTE_METHOD(HTTP_METHOD_PUT) |      \
+   ROUTE_METHOD(HTTP_METHOD_DELETE) | ROUTE_METHOD(HTTP_METHOD_OPTIONS) |    \
+   ROUTE_METHOD(HTTP_METHOD_PATCH))
+
+// Where an upstream server listens, resolved once at startup
+typedef struct {
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  char name[PROXY_NAME_MAX]; // As given on the command line
+} UpstreamAddress;
+
+// A -P route and the servers its requests are balanced over
+typedef struct {
+  size_t routes[2]; // Router indexes of "prefix" and "prefix/*"
+  int servers[PROXY_MAX_UPSTREAMS];
+  int server_count;
+} ProxyRoute;
+
+// Set up before the workers start and only read afterwards. A server
+// named by several routes is one server, with one pool per worker.
+static UpstreamAddress addresses[PROXY_MAX_UPSTREAMS];
+static int address_count;
+static ProxyRoute routes[PROXY_MAX_ROUTES];
+static int route_count;
+static const Router *proxy_router;
+
+// Fields that only concern the connection they arrive on, and those
+// rewritten for the next hop
+static const char *const request_dropped[] = {
+    "Connection",        "Keep-Alive", "Proxy-Connection", "TE",
+    "Trailer",           "Upgrade",    "Transfer-Encoding", "Content-Length",
+    "Expect",            "X-Forwarded-For",
+};
+static const char *const response_dropped[] = {
+    "Connection", "Keep-Alive", "Proxy-Connection", "TE",
+    "Trailer",    "Upgrade",    "Transfer-Encoding",
+};
+
+static int is_listed(StringView name, const char *const *fields,
+                     size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    if (viewEqualsIgnoreCase(name, fields[i]))
+      return 1;
+  }
+  return 0;
+}
+
+#define IS_LISTED(name, fields)                                               \
+  is_listed(name, fields, sizeof(fields) / sizeof(fields[0]))
+
+// Whether a comma separated list contains 'token', ignoring case, as
+// headerHasToken() for a token that is not NUL terminated
+static int has_token(StringView list, StringView token) {
+  const char *p = list.ptr, *end = list.ptr + list.len;
+  while (p < end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+      ++p;
+    const char *start = p;
+    while (p < end && *p != ',')
+      ++p;
+    const char *stop = p;
+    while (stop > start && (stop[-1] == ' ' || stop[-1] == '\t'))
+      --stop;
+    if ((size_t)(stop - start) == token.len &&
+        strncasecmp(start, token.ptr, token.len) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+// Whether a field is named by one of the 'count' Connection header values,
+// which makes it hop-by-hop as well (RFC 9110, section 7.6.1)
+static int is_connection_option(StringView name, const StringView *lists,
+                                size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    if (has_token(lists[i], name))
+      return 1;
+  }
+  return 0;
+}
+
+// Resolve one upstream: "unix:/path", "host:port" or "[v6 address]:port".
+// Returns its index in 'addresses', or -1 with a message printed.
+static int add_address(const char *text, size_t len) {
+  for (int i = 0; i < address_count; ++i) {
+    if (strlen(addresses[i].name) == len &&
+        memcmp(addresses[i].name, text, len) == 0)
+      return i;
+  }
+  if (len == 0 || len >= PROXY_NAME_MAX) {
+    fprintf(stderr, "Invalid upstream: %.*s\n", (int)len, text);
+    return -1;
+  }
+  if (address_count == PROXY_MAX_UPSTREAMS) {
+    fprintf(stderr, "At most %d upstreams.\n", PROXY_MAX_UPSTREAMS);
+    return -1;
+  }
+  UpstreamAddress *A = &addresses[address_count];
+  memset(A, 0, sizeof(*A));
+  memcpy(A->name, text, len);
+  A->name[len] = '\0';
+
+  if (strncmp(A->name, "unix:", 5) == 0) {
+    struct sockaddr_un *sun = (struct sockaddr_un *)&A->addr;
+    const char *path = A->name + 5;
+    size_t path_len = strlen(path);
+    if (path_len == 0 || path_len >= sizeof(sun->sun_path)) {
+      fprintf(stderr, "Invalid socket path: %s\n", A->name);
+      return -1;
+    }
+    sun->sun_family = AF_UNIX;
+    memcpy(sun->sun_path, path, path_len + 1);
+    A->addr_len =
+        (socklen_t)(offsetof(struct sockaddr_un, sun_path) + path_len + 1);
+    return address_count++;
+  }
+
+  char host[PROXY_NAME_MAX];
+  memcpy(host, A->name, len + 1);
+  char *colon = strrchr(host, ':');
+  if (!colon || colon == host || colon[1] == '\0') {
+    fprintf(stderr, "Invalid upstream: %s (host:port or unix:/path)\n",
+            A->name);
+    return -1;
+  }
+  *colon = '\0';
+  char *name = host;
+  size_t name_len = (size_t)(colon - host);
+  if (name[0] == '[' && name_len > 2 && name[name_len - 1] == ']') {
+    name[name_len - 1] = '\0';
+    name++;
+  }
+  struct addrinfo hints = {.ai_family = AF_UNSPEC,
+                           .ai_socktype = SOCK_STREAM,
+                           .ai_flags = AI_NUMERICSERV};
+  struct addrinfo *found;
+  int err = getaddrinfo(name, colon + 1, &hints, &found);
+  if (err != 0) {
+    fprintf(stderr, "Failed to resolve %s: %s\n", A->name,
+            gai_strerror(err));
+    return -1;
+  }
+  memcpy(&A->addr, found->ai_addr, found->ai_addrlen);
+  A->addr_len = found->ai_addrlen;
+  freeaddrinfo(found);
+  return address_count++;
+}
+
+static int proxy_request(Connection *conn, const ClientRequest *C,
+                         const RouteMatch *match, ConnectionMode mode);
+
+// Index of the route registered for 'pattern'
+static size_t route_index(const Router *router, const char *pattern) {
+  for (size_t i = 0; i < router->route_count; ++i) {
+    if (strcmp(router->routes[i].pattern, pattern) == 0)
+      return i;
+  }
+  return router->route_count;
+}
+
+int proxy_add_route(Router *router, const char *spec) {
+  const char *eq = strchr(spec, '=');
+  if (!eq || spec[0] != '/' || eq[1] == '\0') {
+    fprintf(stderr, "Invalid proxy route: %s (prefix=upstream[,...])\n",
+            spec);
+    return -1;
+  }
+  if (route_count == PROXY_MAX_ROUTES) {
+    fprintf(stderr, "At most %d proxy routes.\n", PROXY_MAX_ROUTES);
+    return -1;
+  }
+  ProxyRoute *R = &routes[route_count];
+  R->server_count = 0;
+  for (const char *p = eq + 1; *p;) {
+    const char *end = strchr(p, ',');
+    if (!end)
+      end = p + strlen(p);
+    int server = add_address(p, (size_t)(end - p));
+    if (server < 0)
+      return -1;
+    if (R->server_count == PROXY_MAX_UPSTREAMS) {
+      fprintf(stderr, "At most %d upstreams per route.\n",
+              PROXY_MAX_UPSTREAMS);
+      return -1;
+    }
+    R->servers[R->server_count++] = server;
+    p = *end ? end + 1 : end;
+  }
+
+  // "/api" and "/api/" both mean /api itself and every path below it
+  size_t prefix_len = (size_t)(eq - spec);
+  while (prefix_len > 1 && spec[prefix_len - 1] == '/')
+    prefix_len--;
+  if (prefix_len >= PROXY_NAME_MAX) {
+    fprintf(stderr, "Proxy prefix too long: %.*s\n", (int)prefix_len, spec);
+    return -1;
+  }
+  char exact[PROXY_NAME_MAX], below[PROXY_NAME_MAX + 2];
+  snprintf(exact, sizeof(exact), "%.*s", (int)prefix_len, spec);
+  snprintf(below, sizeof(below), "%s/*", prefix_len > 1 ? exact : "");
+  if (router_add(router, PROXY_METHODS, exact, proxy_request, ROUTE_BODY) <
+          0 ||
+      router_add(router, PROXY_METHODS, below, proxy_request, ROUTE_BODY) <
+          0) {
+    fprintf(stderr, "Failed to add the proxy route %s.\n", exact);
+    return -1;
+  }
+  R->routes[0] = route_index(router, exact);
+  R->routes[1] = route_index(router, below);
+  proxy_router = router;
+  route_count++;
+  return 0;
+}
+
+// The -P route a match belongs to, or -1
+static int find_route(const RouteMatch *match) {
+  if (!match->route || !proxy_router)
+    return -1;
+  size_t index = (size_t)(match->route - proxy_router->routes);
+  for (int r = 0; r < route_count; ++r) {
+    if (routes[r].routes[0] == index || routes[r].routes[1] == index)
+      return r;
+  }
+  return -1;
+}
+
+void proxy_init(Proxy *proxy, EventLoop *loop) {
+  memset(proxy, 0, sizeof(*proxy));
+  proxy->loop = loop;
+}
+
+static MemoryPools *pools(Proxy *P) { return &P->loop->pools; }
+
+static Upstream *new_upstream(Proxy *P) {
+  Upstream *up = P->free;
+  if (up) {
+    P->free = up->next;
+    P->free_count--;
+  } else {
+    up = malloc(sizeof(*up));
+    if (!up) {
+      perror("malloc failed for Upstream");
+      return NULL;
+    }
+  }
+  memset(up, 0, sizeof(*up));
+  up->fd = -1;
+  up->server = -1;
+  up->pipe_fds[0] = up->pipe_fds[1] = -1;
+  up->proxy = P;
+  return up;
+}
+
+// Put away a struct whose sockets are closed. While the io_uring backend
+// still has a poll on it, it waits on the retired list. Nothing is freed
+// here: epoll may still report the closed socket later in the same batch.
+static void recycle_upstream(Proxy *P, Upstream *up) {
+  up->state = UPSTREAM_FREE;
+  up->client = NULL;
+  up->prev = NULL;
+  if (up->polling) {
+    up->retired = 1;
+    up->next = P->retired;
+    if (P->retired)
+      P->retired->prev = up;
+    P->retired = up;
+    return;
+  }
+  up->next = P->free;
+  P->free = up;
+  P->free_count++;
+}
+
+void proxy_release_retired(Upstream *up) {
+  Proxy *P = up->proxy;
+  if (up->prev)
+    up->prev->next = up->next;
+  else
+    P->retired = up->next;
+  if (up->next)
+    up->next->prev = up->prev;
+  up->retired = 0;
+  recycle_upstream(P, up);
+}
+
+// Close the sockets of 'up' and give its receive buffer back
+static void close_sockets(Proxy *P, Upstream *up) {
+  if (up->fd >= 0) {
+    loop_forget_upstream(P->loop, up);
+    close(up->fd);
+    up->fd = -1;
+  }
+  for (int i = 0; i < 2; ++i) {
+    if (up->pipe_fds[i] >= 0)
+      close(up->pipe_fds[i]);
+    up->pipe_fds[i] = -1;
+  }
+  up->piped = 0;
+  buffer_pool_release(&pools(P)->recv_buffers, up->recv_buffer);
+  up->recv_buffer = NULL;
+  up->recv_len = up->recv_queued = 0;
+}
+
+static void pool_unlink(Proxy *P, Upstream *up) {
+  UpstreamServer *S = &P->servers[up->server];
+  if (up->prev)
+    up->prev->next = up->next;
+  else
+    S->idle = up->next;
+  if (up->next)
+    up->next->prev = up->prev;
+  else
+    S->idle_tail = up->prev;
+  up->prev = up->next = NULL;
+  S->idle_count--;
+}
+
+static void discard_idle(Proxy *P, Upstream *up) {
+  pool_unlink(P, up);
+  close_sockets(P, up);
+  recycle_upstream(P, up);
+}
+
+// Keep a connection that finished its response for the next request to
+// the same server. It holds no buffer while it waits, only its pipe.
+static void pool_push(Proxy *P, Upstream *up) {
+  UpstreamServer *S = &P->servers[up->server];
+  buffer_pool_release(&pools(P)->recv_buffers, up->recv_buffer);
+  up->recv_buffer = NULL;
+  up->recv_len = up->recv_queued = 0;
+  if (S->idle_count >= PROXY_IDLE_MAX) {
+    close_sockets(P, up);
+    recycle_upstream(P, up);
+    return;
+  }
+  memset(&up->request, 0, sizeof(up->request));
+  up->state = UPSTREAM_IDLE;
+  up->client = NULL;
+  up->reused = 1;
+  up->idle_since_ms = P->loop->now_ms;
+  up->prev = NULL;
+  up->next = S->idle;
+  if (S->idle)
+    S->idle->prev = up;
+  else
+    S->idle_tail = up;
+  S->idle = up;
+  S->idle_count++;
+}
+
+void proxy_expire_idle(Proxy *proxy) {
+  for (int s = 0; s < address_count; ++s) {
+    UpstreamServer *S = &proxy->servers[s];
+    while (S->idle_tail && proxy->loop->now_ms - S->idle_tail->idle_since_ms >=
+                               PROXY_IDLE_TIMEOUT_MS)
+      discard_idle(proxy, S->idle_tail);
+  }
+  // Between batches of events nothing refers to unused structs any more
+  while (proxy->free_count > POOL_MAX_FREE) {
+    Upstream *up = proxy->free;
+    proxy->free = up->next;
+    proxy->free_count--;
+    free(up);
+  }
+}
+
+void proxy_destroy(Proxy *proxy) {
+  for (int s = 0; s < address_count; ++s) {
+    while (proxy->servers[s].idle)
+      discard_idle(proxy, proxy->servers[s].idle);
+  }
+  // Nothing refers to retired structs once the backend has stopped
+  Upstream *lists[2] = {proxy->free, proxy->retired};
+  for (int i = 0; i < 2; ++i) {
+    while (lists[i]) {
+      Upstream *next = lists[i]->next;
+      free(lists[i]);
+      lists[i] = next;
+    }
+  }
+  proxy->free = proxy->retired = NULL;
+  proxy->free_count = 0;
+}
+
+// Count a failure against server 's'. After PROXY_MAX_FAILS in a row it is
+// left out of balancing for PROXY_EJECT_MS, then gets requests again; one
+// more failure then ejects it again at once.
+static void server_failed(Proxy *P, int s) {
+  UpstreamServer *S = &P->servers[s];
+  S->failures++;
+  if (S->failures < PROXY_MAX_FAILS || S->ejected_until_ms > P->loop->now_ms)
+    return;
+  S->ejected_until_ms = P->loop->now_ms + PROXY_EJECT_MS;
+  S->failures = PROXY_MAX_FAILS - 1;
+  metrics_add(&P->loop->metrics->upstream_ejections, 1);
+  fprintf(stderr, "Upstream %s keeps failing, ejected for %d ms.\n",
+          addresses[s].name, PROXY_EJECT_MS);
+  // Its pooled connections are not worth trying either
+  while (S->idle)
+    discard_idle(P, S->idle);
+}
+
+// The healthy server of route 'r' with the fewest requests in flight,
+// ties broken round robin. 'avoid', a server that just failed, is only
+// picked if no other is healthy. Returns -1 if every server is ejected.
+static int pick_server(Proxy *P, int r, int avoid) {
+  const ProxyRoute *R = &routes[r];
+  unsigned start = P->cursors[r]++;
+  int best = -1, fallback = -1;
+  for (int i = 0; i < R->server_count; ++i) {
+    int s = R->servers[(start + (unsigned)i) % (unsigned)R->server_count];
+    const UpstreamServer *S = &P->servers[s];
+    if (S->ejected_until_ms > P->loop->now_ms)
+      continue;
+    if (s == avoid) {
+      fallback = s;
+      continue;
+    }
+    if (best < 0 || S->outstanding < P->servers[best].outstanding)
+      best = s;
+  }
+  return best >= 0 ? best : fallback;
+}
+
+// A connection to server 's': the most recently used pooled one, which is
+// the least likely to have been closed by the server, else a new one with
+// connect() under way. Returns NULL if there is no socket to be had.
+static Upstream *open_connection(Proxy *P, int s) {
+  UpstreamServer *S = &P->servers[s];
+  WorkerMetrics *M = P->loop->metrics;
+  if (S->idle) {
+    Upstream *up = S->idle;
+    pool_unlink(P, up);
+    up->state = UPSTREAM_HEAD;
+    metrics_add(&M->upstream_reuses, 1);
+    return up;
+  }
+  const UpstreamAddress *A = &addresses[s];
+  int fd = socket(A->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK |
+                  SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    fprintf(stderr, "Upstream socket creation failed: %s\n",
+            strerror(errno));
+    return NULL;
+  }
+  if (A->addr.ss_family != AF_UNIX) {
+    int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+  }
+  if (connect(fd, (const struct sockaddr *)&A->addr, A->addr_len) < 0 &&
+      errno != EINPROGRESS) {
+    fprintf(stderr, "Failed to connect to %s: %s\n", A->name,
+            strerror(errno));
+    close(fd);
+    metrics_add(&M->upstream_failures, 1);
+    server_failed(P, s);
+    return NULL;
+  }
+  Upstream *up = new_upstream(P);
+  if (!up) {
+    close(fd);
+    return NULL;
+  }
+  up->fd = fd;
+  up->server = s;
+  up->state = UPSTREAM_CONNECTING;
+  if (loop_watch_upstream(P->loop, up) < 0) {
+    close_sockets(P, up);
+    recycle_upstream(P, up);
+    return NULL;
+  }
+  metrics_add(&M->upstream_connects, 1);
+  return up;
+}
+
+// Hand 'rq' to a connection to the best server of its route, trying the
+// others while connecting fails outright. Returns 0 once the request
+// belongs to conn->upstream, or -1 if no server could take it.
+static int dispatch(Connection *conn, RelayRequest *rq, int avoid) {
+  Proxy *P = conn->proxy;
+  while (rq->tries < PROXY_MAX_TRIES) {
+    int s = pick_server(P, rq->route, avoid);
+    if (s < 0)
+      return -1;
+    rq->tries++;
+    Upstream *up = open_connection(P, s);
+    if (!up) {
+      avoid = s;
+      continue;
+    }
+    up->request = *rq;
+    up->client = conn;
+    up->wrote = 0;
+    P->servers[s].outstanding++;
+    conn->upstream = up;
+    conn->relay_wait = up->state == UPSTREAM_CONNECTING ? TIMEOUT_CONNECT
+                                                        : TIMEOUT_UPSTREAM;
+    return 0;
+  }
+  return -1;
+}
+
+// Let go of the client's upstream: the request is counted and logged, and
+// the connection goes back to its pool if 'reusable', else it is closed
+static void detach_upstream(Connection *conn, int reusable) {
+  Upstream *up = conn->upstream;
+  Proxy *P = up->proxy;
+  RelayRequest *rq = &up->request;
+  finish_deferred_request(conn, &rq->deferred, rq->relayed);
+  buffer_pool_release(&pools(P)->send_buffers, rq->send_buffer);
+  rq->send_buffer = NULL;
+  conn->upstream = NULL;
+  // Only a struct left behind by a failure has no socket
+  if (up->fd >= 0)
+    P->servers[up->server].outstanding--;
+  if (reusable && up->fd >= 0) {
+    pool_push(P, up);
+    return;
+  }
+  close_sockets(P, up);
+  recycle_upstream(P, up);
+}
+
+void proxy_detach(Connection *conn) {
+  if (conn->upstream)
+    detach_upstream(conn, 0);
+}
+
+// The connection carrying the client's request failed before a response
+// head arrived, or did not answer in time. A pooled connection the server
+// closed while it idled is not held against the server. The request goes
+// to another connection if nothing of it was written yet, or if the server
+// can not have seen it (the pooled connection was dead) and it may be
+// repeated; otherwise the upstream struct stays behind, without a socket,
+// so proxy_relay() answers 502 or 504.
+static void relay_failed(Connection *conn, int timed_out) {
+  Upstream *up = conn->upstream;
+  Proxy *P = up->proxy;
+  RelayRequest *rq = &up->request;
+  int server = up->server;
+  int stale = !timed_out && up->reused && up->recv_len == 0;
+  metrics_add(&P->loop->metrics->upstream_failures, 1);
+  if (!stale) {
+    fprintf(stderr, "Upstream %s %s.\n", addresses[server].name,
+            timed_out ? "did not answer in time" : "failed");
+    server_failed(P, server);
+  }
+  P->servers[server].outstanding--;
+  close_sockets(P, up);
+  if (!up->wrote || (stale && rq->idempotent && !rq->has_body)) {
+    rq->send_sent = 0;
+    conn->upstream = NULL;
+    if (dispatch(conn, rq, stale ? -1 : server) == 0) {
+      recycle_upstream(P, up);
+      return;
+    }
+    conn->upstream = up;
+  }
+  rq->status = timed_out ? 504 : 502;
+}
+
+int proxy_expire(Connection *conn) {
+  Upstream *up = conn->upstream;
+  // Once the response head has gone out, all that is left is to close
+  if ((conn->timeout_kind != TIMEOUT_CONNECT &&
+       conn->timeout_kind != TIMEOUT_UPSTREAM) ||
+      up->state == UPSTREAM_BODY || up->fd < 0)
+    return 0;
+  relay_failed(conn, 1);
+  return 1;
+}
+
+// Write what is held of the request. Returns 1 once all of it is written,
+// 0 if the socket is full or still connecting, or -1 if the connection
+// failed.
+static int send_request(Upstream *up) {
+  RelayRequest *rq = &up->request;
+  while (rq->send_sent < rq->send_len) {
+    ssize_t n = send(up->fd, rq->send_buffer + rq->send_sent,
+                     rq->send_len - rq->send_sent, MSG_NOSIGNAL);
+    if (n > 0) {
+      rq->send_sent += (size_t)n;
+      up->wrote = 1;
+      if (up->state == UPSTREAM_CONNECTING)
+        up->state = UPSTREAM_HEAD;
+      continue;
+    }
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return 0;
+    return -1;
+  }
+  // A body streams through the buffer. A request without one keeps its
+  // head, to be sent again if the connection turns out to be dead.
+  if (rq->has_body)
+    rq->send_len = rq->send_sent = 0;
+  return 1;
+}
+
+// Write what the body sink has buffered. A failure is dealt with at once,
+// so the sink goes on with the request's next connection, or discards.
+static void push_body(Connection *conn) {
+  if (send_request(conn->upstream) < 0)
+    relay_failed(conn, 0);
+}
+
+// Body sink of proxied requests: the body goes out as it arrives, through
+// the request's send buffer, re-framed as chunks if the client chunked it
+static ssize_t proxy_body(void *ctx, const char *data, size_t len) {
+  Connection *conn = ctx;
+  Upstream *up = conn->upstream;
+  if (!up || up->request.status)
+    return (ssize_t)len; // Answered already, the rest is of no use
+  RelayRequest *rq = &up->request;
+  if (data == NULL) {
+    if (rq->chunked) {
+      memcpy(rq->send_buffer + rq->send_len, "0\r\n\r\n", 5);
+      rq->send_len += 5;
+    }
+    rq->done = 1;
+    push_body(conn);
+    return 0;
+  }
+
+  // Leave room for the chunk framing and the final "0\r\n\r\n"
+  size_t overhead = rq->chunked ? 32 : 0;
+  if (SEND_BUFFER_SIZE - rq->send_len <= overhead) {
+    push_body(conn);
+    up = conn->upstream;
+    if (up->request.status)
+      return (ssize_t)len;
+    rq = &up->request;
+    if (SEND_BUFFER_SIZE - rq->send_len <= overhead)
+      return 0; // Resumed once the upstream takes more
+  }
+  size_t room = SEND_BUFFER_SIZE - rq->send_len - overhead;
+  size_t n = len < room ? len : room;
+  char *dst = rq->send_buffer + rq->send_len;
+  if (rq->chunked)
+    dst += snprintf(dst, 20, "%zx\r\n", n);
+  memcpy(dst, data, n);
+  dst += n;
+  if (rq->chunked) {
+    memcpy(dst, "\r\n", 2);
+    dst += 2;
+  }
+  rq->send_len = (size_t)(dst - rq->send_buffer);
+  push_body(conn);
+  return (ssize_t)n;
+}
+
+// Append to the upstream request head. Returns -1 once it does not fit.
+static int append(RelayRequest *rq, const char *data, size_t len) {
+  if (len > SEND_BUFFER_SIZE - rq->send_len)
+    return -1;
+  memcpy(rq->send_buffer + rq->send_len, data, len);
+  rq->send_len += len;
+  return 0;
+}
+
+// The client's address as text, for X-Forwarded-For
+static void client_address(const Connection *conn, char *out, size_t size) {
+  out[0] = '\0';
+  if (conn->peer_addr) {
+    inet_ntop(AF_INET, &conn->peer_addr, out, (socklen_t)size);
+    return;
+  }
+  struct sockaddr_storage addr;
+  socklen_t addr_len = sizeof(addr);
+  if (getpeername(conn->fd, (struct sockaddr *)&addr, &addr_len) < 0)
+    return;
+  if (addr.ss_family == AF_INET)
+    inet_ntop(AF_INET, &((struct sockaddr_in *)&addr)->sin_addr, out,
+              (socklen_t)size);
+  else if (addr.ss_family == AF_INET6)
+    inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&addr)->sin6_addr, out,
+              (socklen_t)size);
+}
+
+// Write the upstream request head: the client's request line and fields
+// over HTTP/1.1, without the hop-by-hop ones and those the client's
+// Connection header names, plus X-Forwarded-For, a Host for HTTP/1.0
+// clients that sent none, and the body framing. Returns -1 if it does not
+// fit the send buffer.
+static int build_request(const Connection *conn, const ClientRequest *C,
+                         RelayRequest *rq) {
+  StringView forwarded = {NULL, 0};
+  int has_host = 0;
+  StringView options[MAX_HEADERS];
+  size_t option_count = 0;
+  for (size_t h = 0; h < C->header_count; ++h) {
+    if (viewEqualsIgnoreCase(C->headers[h].name, "Connection"))
+      options[option_count++] = C->headers[h].value;
+  }
+  if (append(rq, C->method_name.ptr, C->method_name.len) < 0 ||
+      append(rq, " ", 1) < 0 ||
+      append(rq, C->target.ptr, C->target.len) < 0 ||
+      append(rq, " HTTP/1.1\r\n", 11) < 0)
+    return -1;
+  for (size_t h = 0; h < C->header_count; ++h) {
+    const HttpHeader *H = &C->headers[h];
+    if (is_connection_option(H->name, options, option_count))
+      continue;
+    if (viewEqualsIgnoreCase(H->name, "X-Forwarded-For"))
+      forwarded = H->value;
+    if (IS_LISTED(H->name, request_dropped))
+      continue;
+    if (viewEqualsIgnoreCase(H->name, "Host"))
+      has_host = 1;
+    if (append(rq, H->name.ptr, H->name.len) < 0 ||
+        append(rq, ": ", 2) < 0 ||
+        append(rq, H->value.ptr, H->value.len) < 0 ||
+        append(rq, "\r\n", 2) < 0)
+      return -1;
+  }
+  char line[PROXY_NAME_MAX + 64];
+  int len;
+  if (!has_host) {
+    const char *name = addresses[routes[rq->route].servers[0]].name;
+    len = snprintf(line, sizeof(line), "Host: %s\r\n",
+                   strncmp(name, "unix:", 5) == 0 ? "localhost" : name);
+    if (append(rq, line, (size_t)len) < 0)
+      return -1;
+  }
+  char addr[INET6_ADDRSTRLEN];
+  client_address(conn, addr, sizeof(addr));
+  if (append(rq, "X-Forwarded-For: ", 17) < 0 ||
+      (forwarded.len > 0 &&
+       (append(rq, forwarded.ptr, forwarded.len) < 0 ||
+        append(rq, ", ", 2) < 0)) ||
+      append(rq, addr, strlen(addr)) < 0 || append(rq, "\r\n", 2) < 0)
+    return -1;
+  if (rq->chunked) {
+    if (append(rq, "Transfer-Encoding: chunked\r\n", 28) < 0)
+      return -1;
+  } else if (rq->has_body) {
+    len = snprintf(line, sizeof(line), "Content-Length: %llu\r\n",
+                   (unsigned long long)C->content_length);
+    if (append(rq, line, (size_t)len) < 0)
+      return -1;
+  }
+  return append(rq, "\r\n", 2);
+}
+
+// Queue a canned response for a request that was not forwarded
+static int answer_now(Connection *conn, CannedResponseId id,
+                      ConnectionMode mode, int head_only) {
+  StringView response = cannedResponse(conn->responses, id, mode, head_only);
+  conn->status = (uint16_t)responseStatus(response.ptr);
+  return queue_response(conn, response.ptr, response.len);
+}
+
+// Handler of the proxied routes: forward the request to one of the route's
+// upstreams. The response is relayed from flush_connection() through
+// proxy_relay(), once everything queued before it has been written.
+static int proxy_request(Connection *conn, const ClientRequest *C,
+                         const RouteMatch *match, ConnectionMode mode) {
+  int head_only = C->http_method == HTTP_METHOD_HEAD;
+  int r = find_route(match);
+  // Relaying is done on the client's socket, which a stream does not have
+  if (conn->stream)
+    return http2_reset_stream(conn, HTTP2_HTTP_1_1_REQUIRED);
+  if (r < 0 || !conn->proxy)
+    return answer_now(conn, RESPONSE_BAD_GATEWAY, mode, head_only);
+  RelayRequest rq;
+  memset(&rq, 0, sizeof(rq));
+  rq.send_buffer = buffer_pool_acquire(&pools(conn->proxy)->send_buffers);
+  if (!rq.send_buffer)
+    return -1;
+  rq.has_body = httpParserInBody(&conn->parser);
+  rq.chunked = rq.has_body && C->chunked;
+  rq.done = !rq.has_body;
+  rq.head_only = head_only;
+  rq.idempotent = C->http_method != HTTP_METHOD_POST &&
+                  C->http_method != HTTP_METHOD_PATCH &&
+                  C->http_method != HTTP_METHOD_UNKNOWN;
+  rq.client_minor = C->version_minor;
+  rq.mode = mode;
+  rq.route = r;
+  CannedResponseId failure = RESPONSE_HEADERS_TOO_LARGE;
+  if (build_request(conn, C, &rq) == 0) {
+    failure = RESPONSE_BAD_GATEWAY;
+    if (dispatch(conn, &rq, -1) == 0) {
+      if (rq.has_body)
+        conn->on_body = proxy_body;
+      return 0;
+    }
+  }
+  buffer_pool_release(&pools(conn->proxy)->send_buffers, rq.send_buffer);
+  return answer_now(conn, failure, mode, head_only);
+}
+
+// Answer the client ourselves once no upstream could: 502, or 504 after a
+// timeout
+static int answer_error(Connection *conn) {
+  Upstream *up = conn->upstream;
+  RelayRequest *rq = &up->request;
+  ConnectionMode mode = rq->mode;
+  if (httpParserInBody(&conn->parser)) {
+    // The rest of the request body is not worth reading
+    conn->close_after_send = 1;
+    httpParserReset(&conn->parser);
+    mode = CONNECTION_CLOSE;
+  }
+  CannedResponseId id = rq->status == 504 ? RESPONSE_GATEWAY_TIMEOUT
+                                          : RESPONSE_BAD_GATEWAY;
+  StringView response = cannedResponse(conn->responses, id, mode,
+                                       rq->head_only);
+  conn->status = (uint16_t)responseStatus(response.ptr);
+  if (queue_response(conn, response.ptr, response.len) < 0)
+    return -1;
+  rq->relayed += response.len;
+  detach_upstream(conn, 0);
+  return RELAY_QUEUED;
+}
+
+// Find the next header line between 'p' and 'end'. Returns its length
+// without the CRLF, or -1 at the end.
+static long next_line(const char **p, const char *end, const char **line) {
+  if (*p >= end)
+    return -1;
+  const char *eol = memmem(*p, (size_t)(end - *p), "\r\n", 2);
+  if (!eol)
+    eol = end;
+  *line = *p;
+  *p = eol + 2;
+  return (long)(eol - *line);
+}
+
+// Split a header line into its name and trimmed value. Returns -1 if it is
+// not a valid field.
+static int split_field(const char *line, long len, StringView *name,
+                       StringView *value) {
+  const char *colon = memchr(line, ':', (size_t)len);
+  // A line starting with whitespace continues the previous one (obsolete
+  // line folding), which nothing should send any more
+  if (!colon || colon == line || line[0] == ' ' || line[0] == '\t')
+    return -1;
+  *name = (StringView){line, (size_t)(colon - line)};
+  const char *v = colon + 1, *end = line + len;
+  while (v < end && (*v == ' ' || *v == '\t'))
+    v++;
+  while (end > v && (end[-1] == ' ' || end[-1] == '\t'))
+    end--;
+  *value = (StringView){v, (size_t)(end - v)};
+  return 0;
+}
+
+// Turn the upstream's response head (the first 'head_len' bytes of
+// recv_buffer) into the client's: HTTP/1.1 with the same status and
+// fields minus the hop-by-hop ones and those its Connection header names,
+// body framing the client can read, and our own connection header.
+// Decides how the body is relayed. Returns -1 if the head is malformed.
+static int queue_head(Connection *conn, Upstream *up, size_t head_len,
+                      int status) {
+  RelayRequest *rq = &up->request;
+  const char *head = up->recv_buffer;
+  const char *end = head + head_len - 2; // Up to the blank line
+  const char *p = head, *line;
+  long status_len = next_line(&p, end, &line);
+  const char *fields = p;
+
+  // What the fields say about the framing and the connection
+  up->keep_alive = head[7] != '0';
+  int chunked = 0, has_length = 0;
+  uint64_t length = 0;
+  StringView name, value;
+  StringView options[MAX_HEADERS];
+  size_t option_count = 0;
+  long len;
+  while ((len = next_line(&p, end, &line)) >= 0) {
+    if (split_field(line, len, &name, &value) < 0)
+      return -1;
+    if (viewEqualsIgnoreCase(name, "Connection")) {
+      if (option_count == MAX_HEADERS)
+        return -1;
+      options[option_count++] = value;
+      if (headerHasToken(value, "close"))
+        up->keep_alive = 0;
+      else if (headerHasToken(value, "keep-alive"))
+        up->keep_alive = 1;
+    } else if (viewEqualsIgnoreCase(name, "Transfer-Encoding")) {
+      if (!viewEqualsIgnoreCase(value, "chunked"))
+        return -1; // Nothing else can be relayed as it is
+      chunked = 1;
+    } else if (viewEqualsIgnoreCase(name, "Content-Length")) {
+      uint64_t n = 0;
+      if (value.len == 0 || value.len > 19)
+        return -1;
+      for (size_t i = 0; i < value.len; ++i) {
+        if (value.ptr[i] < '0' || value.ptr[i] > '9')
+          return -1;
+        n = n * 10 + (uint64_t)(value.ptr[i] - '0');
+      }
+      if (has_length && n != length)
+        return -1;
+      has_length = 1;
+      length = n;
+    }
+  }
+  if (rq->head_only || status == 204 || status == 304) {
+    up->framing = BODY_NONE;
+  } else if (chunked) {
+    up->framing = BODY_CHUNKED;
+  } else if (has_length) {
+    up->framing = length > 0 ? BODY_LENGTH : BODY_NONE;
+    up->remaining = length;
+  } else {
+    up->framing = BODY_CLOSE;
+    up->keep_alive = 0;
+  }
+
+  // Without chunked coding on the client's side the end of the body can
+  // only be told by closing the connection
+  ConnectionMode mode = rq->mode;
+  up->decode_chunks = up->framing == BODY_CHUNKED && rq->client_minor == 0;
+  if (up->framing == BODY_CLOSE || up->decode_chunks) {
+    conn->close_after_send = 1;
+    mode = CONNECTION_CLOSE;
+  }
+  if (head_len + 64 > SEND_BUFFER_SIZE - conn->send_len) {
+    fprintf(stderr, "Upstream response head does not fit the send "
+                    "buffer.\n");
+    return -1;
+  }
+  size_t queued_before = conn->out_bytes;
+  if (queue_response(conn, "HTTP/1.1", 8) < 0 ||
+      queue_response(conn, head + 8, (size_t)(status_len + 2 - 8)) < 0)
+    return -1;
+  p = fields;
+  while ((len = next_line(&p, end, &line)) >= 0) {
+    split_field(line, len, &name, &value);
+    int is_length = viewEqualsIgnoreCase(name, "Content-Length");
+    // A Content-Length the body is relayed by stays, whatever the
+    // Connection header says: the client needs it to find the end
+    if (IS_LISTED(name, response_dropped) || (chunked && is_length) ||
+        (!is_length && is_connection_option(name, options, option_count)))
+      continue;
+    if (queue_response(conn, line, (size_t)len + 2) < 0)
+      return -1;
+  }
+  const char *connection_header = connectionHeader(mode);
+  if ((up->framing == BODY_CHUNKED && !up->decode_chunks &&
+       queue_response(conn, "Transfer-Encoding: chunked\r\n", 28) < 0) ||
+      queue_response(conn, connection_header, strlen(connection_header)) <
+          0 ||
+      queue_response(conn, "\r\n", 2) < 0)
+    return -1;
+  conn->status = (uint16_t)status;
+  rq->relayed += conn->out_bytes - queued_before;
+
+  up->state = UPSTREAM_BODY;
+  up->body_complete = up->framing == BODY_NONE;
+  if (up->framing == BODY_CHUNKED) {
+    httpParserReset(&up->chunks);
+    up->chunks.state = HTTP_PARSER_CHUNK_SIZE;
+  }
+  // The server answered, so it is healthy
+  up->proxy->servers[up->server].failures = 0;
+  return 0;
+}
+
+// Drop the first 'len' bytes of the upstream's receive buffer
+static void consume_upstream(Upstream *up, size_t len) {
+  memmove(up->recv_buffer, up->recv_buffer + len, up->recv_len - len);
+  up->recv_len -= len;
+}
+
+// Read the response head. Interim 1xx responses are skipped: a 100
+// Continue has been sent to the client already, if it asked. Returns 1
+// once the head has been queued for the client, 0 if more has to arrive,
+// or -1 if the upstream failed.
+static int read_head(Connection *conn, Upstream *up) {
+  if (!up->recv_buffer) {
+    up->recv_buffer = buffer_pool_acquire(&pools(up->proxy)->recv_buffers);
+    if (!up->recv_buffer)
+      return -1;
+  }
+  for (;;) {
+    const char *blank = memmem(up->recv_buffer, up->recv_len, "\r\n\r\n", 4);
+    if (blank) {
+      size_t head_len = (size_t)(blank - up->recv_buffer) + 4;
+      int status = head_len >= 14 ? responseStatus(up->recv_buffer) : 0;
+      if (status == 0 || status == 101)
+        return -1; // Not HTTP, or a protocol switch nobody asked for
+      if (status >= 200) {
+        if (queue_head(conn, up, head_len, status) < 0)
+          return -1;
+        consume_upstream(up, head_len); // What is left is body
+        return 1;
+      }
+      consume_upstream(up, head_len);
+      continue;
+    }
+    if (up->recv_len == RECV_BUFFER_SIZE)
+      return -1; // Head too large
+    ssize_t n = recv(up->fd, up->recv_buffer + up->recv_len,
+                     RECV_BUFFER_SIZE - up->recv_len, 0);
+    if (n > 0) {
+      up->recv_len += (size_t)n;
+      continue;
+    }
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return 0;
+    return -1; // Closed or reset before a head
+  }
+}
+
+// The whole response has been relayed. The upstream goes back to its pool
+// if it can carry another request: the server keeps it open, and neither
+// side has bytes left over.
+static int finish_response(Connection *conn) {
+  Upstream *up = conn->upstream;
+  RelayRequest *rq = &up->request;
+  int reusable = up->keep_alive && rq->done && rq->send_sent == rq->send_len &&
+                 up->recv_len == 0 && up->piped == 0;
+  if (httpParserInBody(&conn->parser)) {
+    // The upstream answered before the request body was complete. The
+    // rest is not worth reading, so the client connection ends here.
+    conn->close_after_send = 1;
+    httpParserReset(&conn->parser);
+  }
+  detach_upstream(conn, reusable);
+  return RELAY_DONE;
+}
+
+// Body sink for chunked responses to HTTP/1.0 clients: the chunk data is
+// queued in place, without its framing
+static ssize_t queue_chunk_data(void *ctx, const char *data, size_t len) {
+  Connection *conn = ctx;
+  if (conn->out_count == OUTPUT_MAX_SEGMENTS)
+    return 0; // Resumed once the queued pieces are written
+  if (queue_reference(conn, data, len) < 0)
+    return -1;
+  conn->upstream->request.relayed += len;
+  return (ssize_t)len;
+}
+
+// Body sink that only lets the parser find the end of a chunked body,
+// which is relayed with its framing
+static ssize_t skip_chunk_data(void *ctx, const char *data, size_t len) {
+  (void)ctx;
+  (void)data;
+  return (ssize_t)len;
+}
+
+// Relay body bytes through recv_buffer: those that arrived with the head,
+// chunked bodies, and every body when splice() can not be used
+static int copy_body(Connection *conn, Upstream *up) {
+  while (up->recv_len == 0) {
+    size_t want = RECV_BUFFER_SIZE;
+    if (up->framing == BODY_LENGTH && up->remaining < want)
+      want = (size_t)up->remaining;
+    ssize_t n = recv(up->fd, up->recv_buffer, want, 0);
+    if (n > 0) {
+      up->recv_len = (size_t)n;
+    } else if (n == 0) {
+      if (up->framing != BODY_CLOSE) {
+        fprintf(stderr, "Upstream %s closed in the middle of a body.\n",
+                addresses[up->server].name);
+        return -1;
+      }
+      up->body_complete = 1;
+      return finish_response(conn);
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      conn->relay_wait = TIMEOUT_UPSTREAM;
+      return RELAY_WAITING;
+    } else if (errno != EINTR) {
+      fprintf(stderr, "Failed to read from upstream: %s\n", strerror(errno));
+      return -1;
+    }
+  }
+
+  size_t take = up->recv_len;
+  if (up->framing == BODY_CHUNKED) {
+    int status = httpParserBody(&up->chunks, up->recv_buffer, up->recv_len,
+                                &take,
+                                up->decode_chunks ? queue_chunk_data
+                                                  : skip_chunk_data,
+                                conn);
+    up->chunks.body_bytes = 0; // MAX_BODY_SIZE is for requests
+    if (status < 0) {
+      fprintf(stderr, "Invalid chunked body from upstream %s.\n",
+              addresses[up->server].name);
+      return -1;
+    }
+    up->body_complete = status == PARSE_OK;
+    if (!up->decode_chunks) {
+      if (queue_reference(conn, up->recv_buffer, take) < 0)
+        return -1;
+      up->request.relayed += take;
+    }
+  } else {
+    if (up->framing == BODY_LENGTH) {
+      if (take > up->remaining)
+        take = (size_t)up->remaining;
+      up->remaining -= take;
+      up->body_complete = up->remaining == 0;
+    }
+    if (queue_reference(conn, up->recv_buffer, take) < 0)
+      return -1;
+    up->request.relayed += take;
+  }
+  // Bytes past the end of the body: the connection is out of step
+  if (up->body_complete && take < up->recv_len)
+    up->keep_alive = 0;
+  up->recv_queued = take;
+  return RELAY_QUEUED;
+}
+
+// Relay body bytes from the upstream socket through a pipe to the client
+// socket, so the kernel moves them without a copy through user space
+static int splice_body(Connection *conn, Upstream *up) {
+  if (up->pipe_fds[0] < 0 && pipe2(up->pipe_fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+    up->copy_only = 1;
+    return copy_body(conn, up);
+  }
+  for (;;) {
+    if (up->piped > 0) {
+      ssize_t n = splice(up->pipe_fds[0], NULL, conn->fd, NULL, up->piped,
+                         SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n > 0) {
+        up->piped -= (size_t)n;
+        up->request.relayed += (uint64_t)n;
+        if (conn->metrics)
+          metrics_add(&conn->metrics->bytes_out, (uint64_t)n);
+        continue;
+      }
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        conn->relay_wait = TIMEOUT_WRITE;
+        return RELAY_BLOCKED;
+      }
+      fprintf(stderr, "Failed Sending Response: %s\n",
+              n < 0 ? strerror(errno) : "pipe is empty");
+      return -1;
+    }
+    if (up->body_complete)
+      return finish_response(conn);
+
+    size_t want = PROXY_SPLICE_SIZE;
+    if (up->framing == BODY_LENGTH && up->remaining < want)
+      want = (size_t)up->remaining;
+    ssize_t n = splice(up->fd, NULL, up->pipe_fds[1], NULL, want,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n > 0) {
+      up->piped = (size_t)n;
+      if (up->framing == BODY_LENGTH) {
+        up->remaining -= (uint64_t)n;
+        up->body_complete = up->remaining == 0;
+      }
+      continue;
+    }
+    if (n == 0) {
+      if (up->framing != BODY_CLOSE) {
+        fprintf(stderr, "Upstream %s closed in the middle of a body.\n",
+                addresses[up->server].name);
+        return -1;
+      }
+      up->body_complete = 1;
+      continue;
+    }
+    if (errno == EINTR)
+      continue;
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      conn->relay_wait = TIMEOUT_UPSTREAM;
+      return RELAY_WAITING;
+    }
+    if (errno == EINVAL) {
+      // A socket type splice() does not support: copy from now on
+      up->copy_only = 1;
+      return copy_body(conn, up);
+    }
+    fprintf(stderr, "Failed to read from upstream: %s\n", strerror(errno));
+    return -1;
+  }
+}
+
+static int relay_body(Connection *conn, Upstream *up) {
+  // The bytes queued last time have been written by now
+  if (up->recv_queued > 0) {
+    consume_upstream(up, up->recv_queued);
+    up->recv_queued = 0;
+  }
+  if (up->body_complete && up->piped == 0)
+    return finish_response(conn);
+  if (up->framing == BODY_CHUNKED || up->recv_len > 0 || up->copy_only)
+    return copy_body(conn, up);
+  return splice_body(conn, up);
+}
+
+int proxy_relay(Connection *conn) {
+  for (;;) {
+    Upstream *up = conn->upstream;
+    if (!up)
+      return RELAY_DONE;
+    if (up->request.status)
+      return answer_error(conn);
+    if (up->state == UPSTREAM_BODY)
+      return relay_body(conn, up);
+    // Until the head arrives, request bytes may still be waiting to go
+    if (send_request(up) < 0) {
+      relay_failed(conn, 0);
+      continue;
+    }
+    if (up->state == UPSTREAM_CONNECTING) {
+      conn->relay_wait = TIMEOUT_CONNECT;
+      return RELAY_WAITING;
+    }
+    int head = read_head(conn, up);
+    if (head < 0) {
+      relay_failed(conn, 0);
+      continue;
+    }
+    if (head == 0) {
+      conn->relay_wait = TIMEOUT_UPSTREAM;
+      return RELAY_WAITING;
+    }
+    return RELAY_QUEUED;
+  }
+}
+
+Connection *proxy_upstream_ready(Upstream *up) {
+  if (up->state == UPSTREAM_FREE)
+    return NULL; // Closed earlier in the same batch of events
+  if (up->client)
+    return up->client;
+  if (up->state == UPSTREAM_IDLE) {
+    // A pooled connection has nothing to say between requests: whatever
+    // arrives, data, the end of the stream or an error, retires it
+    char byte;
+    ssize_t n = recv(up->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+      return NULL;
+    discard_idle(up->proxy, up);
+  }
+  return NULL;
+}
@@ -0,0 +1,137 @@
+#include "../include/response_cache.h"
+
+#include <stdio.h>  // For perror
+#include <stdlib.h> // For malloc, free
+#include <string.h> // For memcmp, memcpy, memset
+
+// FNV-1a over the key
+static uint32_t hash_key(const ResponseKey *key) {
+  uint32_t h = 2166136261u;
+  h = (h ^ key->method) * 16777619u;
+  h = (h ^ key->coding) * 16777619u;
+  for (size_t i = 0; i < key->target.len; ++i) {
+    h ^= (unsigned char)key->target.ptr[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static int key_matches(const CachedResponse *entry, const ResponseKey *key,
+                       uint32_t hash) {
+  return entry->hash == hash && entry->key_len == key->target.len + 2 &&
+         (uint8_t)entry->data[0] == key->method &&
+         (uint8_t)entry->data[1] == key->coding &&
+         memcmp(entry->data + 2, key->target.ptr, key->target.len) == 0;
+}
+
+static CachedResponse *find_entry(const ResponseCache *cache,
+                                  const ResponseKey *key, uint32_t hash) {
+  CachedResponse *entry =
+      cache->buckets[hash & (RESPONSE_CACHE_BUCKETS - 1)];
+  while (entry && !key_matches(entry, key, hash))
+    entry = entry->hash_next;
+  return entry;
+}
+
+void response_cache_init(ResponseCache *cache) {
+  memset(cache, 0, sizeof(*cache));
+  for (size_t i = 0; i < RESPONSE_CACHE_ENTRIES; ++i)
+    cache->free_slots[i] = RESPONSE_CACHE_ENTRIES - 1 - i;
+  cache->free_count = RESPONSE_CACHE_ENTRIES;
+}
+
+static void remove_entry(ResponseCache *cache, CachedResponse *entry) {
+  CachedResponse **link =
+      &cache->buckets[entry->hash & (RESPONSE_CACHE_BUCKETS - 1)];
+  while (*link != entry)
+    link = &(*link)->hash_next;
+  *link = entry->hash_next;
+  cache->clock[entry->slot] = NULL;
+  cache->free_slots[cache->free_count++] = entry->slot;
+  cache->count--;
+  cache->bytes -= sizeof(*entry) + entry->capacity;
+  free(entry);
+}
+
+void response_cache_destroy(ResponseCache *cache) {
+  for (size_t i = 0; i < RESPONSE_CACHE_ENTRIES; ++i) {
+    if (cache->clock[i])
+      remove_entry(cache, cache->clock[i]);
+  }
+}
+
+CachedResponse *response_cache_lookup(ResponseCache *cache,
+                                      const ResponseKey *key) {
+  if (cache->count == 0)
+    return NULL;
+  CachedResponse *entry = find_entry(cache, key, hash_key(key));
+  if (!entry || entry->expires_ms <= cache->now_ms)
+    return NULL;
+  entry->referenced = 1;
+  return entry;
+}
+
+// Advance the clock hand to the next entry worth dropping: one that has
+// expired, or was not served since the hand last passed it. Entries that
+// were get a second chance, so this ends within two turns.
+static void evict_one(ResponseCache *cache) {
+  for (;;) {
+    CachedResponse *entry = cache->clock[cache->hand];
+    cache->hand = (cache->hand + 1) % RESPONSE_CACHE_ENTRIES;
+    if (!entry)
+      continue;
+    if (entry->referenced && entry->expires_ms > cache->now_ms) {
+      entry->referenced = 0;
+      continue;
+    }
+    remove_entry(cache, entry);
+    return;
+  }
+}
+
+CachedResponse *response_cache_insert(ResponseCache *cache,
+                                      const ResponseKey *key, size_t len,
+                                      uint16_t status, unsigned ttl_ms) {
+  size_t key_len = key->target.len + 2;
+  if (len > RESPONSE_CACHE_MAX_SIZE || key_len > RESPONSE_CACHE_KEY_MAX)
+    return NULL;
+  uint32_t hash = hash_key(key);
+  CachedResponse *entry = find_entry(cache, key, hash);
+  if (entry && entry->capacity < key_len + len) {
+    remove_entry(cache, entry);
+    entry = NULL;
+  }
+  if (!entry) {
+    size_t capacity = key_len + len;
+    while (cache->count > 0 &&
+           (cache->free_count == 0 ||
+            cache->bytes + sizeof(*entry) + capacity > RESPONSE_CACHE_BYTES))
+      evict_one(cache);
+    entry = malloc(sizeof(*entry) + capacity);
+    if (!entry) {
+      perror("malloc failed for CachedResponse");
+      return NULL;
+    }
+    entry->hash = hash;
+    entry->capacity = capacity;
+    entry->key_len = key_len;
+    entry->data[0] = (char)key->method;
+    entry->data[1] = (char)key->coding;
+    memcpy(entry->data + 2, key->target.ptr, key->target.len);
+    entry->slot = cache->free_slots[--cache->free_count];
+    cache->clock[entry->slot] = entry;
+    CachedResponse **bucket =
+        &cache->buckets[hash & (RESPONSE_CACHE_BUCKETS - 1)];
+    entry->hash_next = *bucket;
+    *bucket = entry;
+    cache->count++;
+    cache->bytes += sizeof(*entry) + capacity;
+  }
+  entry->expires_ms = cache->now_ms + ttl_ms;
+  entry->status = status;
+  entry->referenced = 0;
+  entry->response = entry->data + key_len;
+  entry->len = len;
+  entry->date_offset = len;
+  return entry;
+}
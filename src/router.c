@@ -0,0 +1,439 @@
+#include "../include/router.h"
+
+#include <stdio.h>  // For fprintf
+#include <stdlib.h> // For calloc, malloc, realloc, free
+#include <string.h> // For memcmp, memchr, strchr, strcspn, strdup, strlen
+
+// Seeds tried per table size before the perfect hash table is doubled
+#define EXACT_SEED_TRIES 256
+
+// A trie node while the routes are inserted, before it is flattened into
+// Router.nodes
+typedef struct BuildNodeStruct BuildNode;
+struct BuildNodeStruct {
+  const char *label;
+  size_t label_len;
+  BuildNode **children;
+  size_t child_count;
+  BuildNode *param;
+  int32_t route, wildcard;
+};
+
+void router_init(Router *router) { memset(router, 0, sizeof(*router)); }
+
+static void free_tables(Router *router) {
+  free(router->exact_slots);
+  free(router->nodes);
+  free(router->labels);
+  router->exact_slots = NULL;
+  router->nodes = NULL;
+  router->labels = NULL;
+  router->node_count = 0;
+}
+
+void router_destroy(Router *router) {
+  for (size_t i = 0; i < router->route_count; ++i) {
+    free(router->routes[i].pattern);
+    free(router->routes[i].allow_headers);
+  }
+  free(router->routes);
+  free_tables(router);
+  memset(router, 0, sizeof(*router));
+}
+
+static int is_exact(const char *pattern) {
+  return !strchr(pattern, '{') && !strchr(pattern, '*');
+}
+
+// Check that {param} segments are whole segments and '*' only ends a
+// pattern
+static int valid_pattern(const char *pattern) {
+  if (pattern[0] != '/')
+    return 0;
+  size_t params = 0;
+  for (const char *p = pattern; *p; ++p) {
+    if (*p == '*') {
+      if (p[1] != '\0')
+        return 0;
+      params++;
+    } else if (*p == '{') {
+      const char *close = strchr(p, '}');
+      if (p[-1] != '/' || !close || close == p + 1 ||
+          (close[1] != '/' && close[1] != '\0') ||
+          memchr(p + 1, '/', (size_t)(close - p)))
+        return 0;
+      params++;
+      p = close;
+    } else if (*p == '}') {
+      return 0;
+    }
+  }
+  return params <= ROUTER_MAX_PARAMS;
+}
+
+static Route *find_route(Router *router, const char *pattern) {
+  for (size_t i = 0; i < router->route_count; ++i) {
+    if (strcmp(router->routes[i].pattern, pattern) == 0)
+      return &router->routes[i];
+  }
+  return NULL;
+}
+
+int router_add(Router *router, uint32_t methods, const char *pattern,
+               RouteHandler handler, unsigned flags) {
+  if (!valid_pattern(pattern) || methods == 0 ||
+      methods >= ROUTE_METHOD(HTTP_METHOD_COUNT)) {
+    fprintf(stderr, "Invalid route: %s\n", pattern);
+    return -1;
+  }
+  Route *route = find_route(router, pattern);
+  if (!route) {
+    if (router->route_count == router->route_capacity) {
+      size_t capacity =
+          router->route_capacity ? router->route_capacity * 2 : 16;
+      Route *routes = realloc(router->routes, capacity * sizeof(*routes));
+      if (!routes)
+        return -1;
+      router->routes = routes;
+      router->route_capacity = capacity;
+    }
+    route = &router->routes[router->route_count];
+    memset(route, 0, sizeof(*route));
+    route->pattern = strdup(pattern);
+    if (!route->pattern)
+      return -1;
+    router->route_count++;
+  }
+  if (route->methods & methods) {
+    fprintf(stderr, "Route registered twice: %s\n", pattern);
+    return -1;
+  }
+  route->methods |= methods;
+  for (int m = 0; m < HTTP_METHOD_COUNT; ++m) {
+    if (methods & ROUTE_METHOD(m)) {
+      route->handlers[m] = handler;
+      route->flags[m] = flags;
+    }
+  }
+  return 0;
+}
+
+// FNV-1a, with the seed folded into the offset basis
+static uint32_t hash_path(uint32_t seed, const char *p, size_t len) {
+  uint32_t h = 2166136261u ^ (seed * 0x9e3779b9u);
+  for (size_t i = 0; i < len; ++i) {
+    h ^= (unsigned char)p[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+// Find a table size and seed under which no two exact paths share a slot.
+// The table starts at twice the number of paths and doubles until a seed
+// works, so a lookup is always one probe and one comparison.
+static int build_exact(Router *router) {
+  size_t exact = 0;
+  for (size_t i = 0; i < router->route_count; ++i)
+    exact += is_exact(router->routes[i].pattern);
+  size_t size = 4;
+  while (size < exact * 2)
+    size *= 2;
+  for (;; size *= 2) {
+    uint32_t *slots = calloc(size, sizeof(*slots));
+    if (!slots)
+      return -1;
+    for (uint32_t seed = 0; seed < EXACT_SEED_TRIES; ++seed) {
+      int collided = 0;
+      for (size_t i = 0; i < router->route_count && !collided; ++i) {
+        const char *pattern = router->routes[i].pattern;
+        if (!is_exact(pattern))
+          continue;
+        uint32_t slot =
+            hash_path(seed, pattern, strlen(pattern)) & (uint32_t)(size - 1);
+        collided = slots[slot] != 0;
+        slots[slot] = (uint32_t)i + 1;
+      }
+      if (!collided) {
+        router->exact_slots = slots;
+        router->exact_mask = (uint32_t)(size - 1);
+        router->exact_seed = seed;
+        return 0;
+      }
+      memset(slots, 0, size * sizeof(*slots));
+    }
+    free(slots);
+  }
+}
+
+static BuildNode *new_node(const char *label, size_t label_len) {
+  BuildNode *node = calloc(1, sizeof(*node));
+  if (!node)
+    return NULL;
+  node->label = label;
+  node->label_len = label_len;
+  node->route = node->wildcard = -1;
+  return node;
+}
+
+static void free_build(BuildNode *node) {
+  if (!node)
+    return;
+  for (size_t i = 0; i < node->child_count; ++i)
+    free_build(node->children[i]);
+  free_build(node->param);
+  free(node->children);
+  free(node);
+}
+
+static int add_child(BuildNode *node, BuildNode *child) {
+  BuildNode **children =
+      realloc(node->children, (node->child_count + 1) * sizeof(*children));
+  if (!children)
+    return -1;
+  // Kept sorted by the first byte of the label
+  size_t i = node->child_count;
+  while (i > 0 && (unsigned char)children[i - 1]->label[0] >
+                      (unsigned char)child->label[0]) {
+    children[i] = children[i - 1];
+    --i;
+  }
+  children[i] = child;
+  node->children = children;
+  node->child_count++;
+  return 0;
+}
+
+// Insert a pattern, splitting edges where it leaves an existing label.
+// Labels point into the route's pattern, which outlives the build tree.
+static int insert_pattern(BuildNode *node, const char *p, int32_t route) {
+  for (;;) {
+    if (*p == '\0') {
+      node->route = route;
+      return 0;
+    }
+    if (*p == '*') {
+      node->wildcard = route;
+      return 0;
+    }
+    if (*p == '{') {
+      if (!node->param && !(node->param = new_node("", 0)))
+        return -1;
+      node = node->param;
+      p = strchr(p, '}') + 1;
+      continue;
+    }
+    size_t len = strcspn(p, "{*");
+    BuildNode *child = NULL;
+    for (size_t i = 0; i < node->child_count; ++i) {
+      if (node->children[i]->label[0] == *p)
+        child = node->children[i];
+    }
+    if (!child) {
+      child = new_node(p, len);
+      if (!child || add_child(node, child) < 0) {
+        free(child);
+        return -1;
+      }
+      node = child;
+      p += len;
+      continue;
+    }
+    size_t common = 0;
+    while (common < len && common < child->label_len &&
+           child->label[common] == p[common])
+      common++;
+    if (common < child->label_len) {
+      // Split the edge: the shared prefix becomes a node of its own
+      BuildNode *tail = new_node(child->label + common,
+                                 child->label_len - common);
+      if (!tail)
+        return -1;
+      tail->children = child->children;
+      tail->child_count = child->child_count;
+      tail->param = child->param;
+      tail->route = child->route;
+      tail->wildcard = child->wildcard;
+      child->children = NULL;
+      child->child_count = 0;
+      child->param = NULL;
+      child->route = child->wildcard = -1;
+      child->label_len = common;
+      if (add_child(child, tail) < 0) {
+        free(tail);
+        return -1;
+      }
+    }
+    node = child;
+    p += common;
+  }
+}
+
+static void count_nodes(const BuildNode *node, size_t *nodes, size_t *chars) {
+  (*nodes)++;
+  *chars += node->label_len;
+  for (size_t i = 0; i < node->child_count; ++i)
+    count_nodes(node->children[i], nodes, chars);
+  if (node->param)
+    count_nodes(node->param, nodes, chars);
+}
+
+// Lay the tree out breadth first, so the children of every node occupy
+// consecutive slots
+static void flatten(Router *router, BuildNode *root, BuildNode **queue) {
+  size_t head = 0, tail = 0, chars = 0;
+  queue[tail++] = root;
+  while (head < tail) {
+    size_t index = head;
+    BuildNode *node = queue[head++];
+    RouteNode *out = &router->nodes[index];
+    memcpy(router->labels + chars, node->label, node->label_len);
+    out->label = (uint32_t)chars;
+    out->label_len = (uint32_t)node->label_len;
+    chars += node->label_len;
+    out->route = node->route;
+    out->wildcard = node->wildcard;
+    out->first_child = (uint32_t)tail;
+    out->child_count = (uint32_t)node->child_count;
+    for (size_t i = 0; i < node->child_count; ++i)
+      queue[tail++] = node->children[i];
+    out->param_child = -1;
+    if (node->param) {
+      out->param_child = (int32_t)tail;
+      queue[tail++] = node->param;
+    }
+  }
+}
+
+static int build_trie(Router *router) {
+  BuildNode *root = new_node("", 0);
+  if (!root)
+    return -1;
+  for (size_t i = 0; i < router->route_count; ++i) {
+    const char *pattern = router->routes[i].pattern;
+    if (!is_exact(pattern) && insert_pattern(root, pattern, (int32_t)i) < 0) {
+      free_build(root);
+      return -1;
+    }
+  }
+  size_t nodes = 0, chars = 0;
+  count_nodes(root, &nodes, &chars);
+  router->nodes = calloc(nodes, sizeof(*router->nodes));
+  router->labels = malloc(chars + 1);
+  BuildNode **queue = malloc(nodes * sizeof(*queue));
+  int rc = -1;
+  if (router->nodes && router->labels && queue) {
+    flatten(router, root, queue);
+    router->node_count = nodes;
+    rc = 0;
+  }
+  free(queue);
+  free_build(root);
+  return rc;
+}
+
+// Fill in the implied HEAD handlers and the Allow header of every route
+static int finish_routes(Router *router) {
+  for (size_t i = 0; i < router->route_count; ++i) {
+    Route *route = &router->routes[i];
+    if ((route->methods & ROUTE_GET) && !(route->methods & ROUTE_HEAD)) {
+      route->methods |= ROUTE_HEAD;
+      route->handlers[HTTP_METHOD_HEAD] = route->handlers[HTTP_METHOD_GET];
+      route->flags[HTTP_METHOD_HEAD] = route->flags[HTTP_METHOD_GET];
+    }
+    char allow[128] = "Allow: ";
+    size_t len = strlen(allow);
+    for (int m = 0; m < HTTP_METHOD_COUNT; ++m) {
+      if (!(route->methods & ROUTE_METHOD(m)))
+        continue;
+      len += (size_t)snprintf(allow + len, sizeof(allow) - len, "%s%s",
+                              len > strlen("Allow: ") ? ", " : "",
+                              httpMethodName((HttpMethod)m));
+    }
+    free(route->allow_headers);
+    route->allow_headers = malloc(len + 32);
+    if (!route->allow_headers)
+      return -1;
+    snprintf(route->allow_headers, len + 32, "%s\r\nContent-Length: 0\r\n",
+             allow);
+  }
+  return 0;
+}
+
+int router_compile(Router *router) {
+  free_tables(router);
+  if (finish_routes(router) < 0 || build_exact(router) < 0 ||
+      build_trie(router) < 0) {
+    free_tables(router);
+    return -1;
+  }
+  return 0;
+}
+
+// Walk the trie from 'index' over [p, end). Literal edges are tried first,
+// then a {param} segment, then a trailing '*'; a dead end backs up to the
+// next alternative.
+static int match_node(const Router *router, uint32_t index, const char *p,
+                      const char *end, RouteMatch *match) {
+  const RouteNode *node = &router->nodes[index];
+  if (p == end && node->route >= 0) {
+    match->route = &router->routes[node->route];
+    return 1;
+  }
+  if (p < end) {
+    for (uint32_t i = 0; i < node->child_count; ++i) {
+      const RouteNode *child = &router->nodes[node->first_child + i];
+      const char *label = router->labels + child->label;
+      if (label[0] != *p)
+        continue;
+      if ((size_t)(end - p) >= child->label_len &&
+          memcmp(p, label, child->label_len) == 0 &&
+          match_node(router, node->first_child + i, p + child->label_len, end,
+                     match))
+        return 1;
+      break; // Siblings never share a first byte
+    }
+  }
+  if (node->param_child >= 0 && p < end && *p != '/') {
+    const char *segment_end = memchr(p, '/', (size_t)(end - p));
+    if (!segment_end)
+      segment_end = end;
+    size_t slot = match->param_count++;
+    match->params[slot] = (StringView){p, (size_t)(segment_end - p)};
+    if (match_node(router, (uint32_t)node->param_child, segment_end, end,
+                   match))
+      return 1;
+    match->param_count = slot;
+  }
+  if (node->wildcard >= 0) {
+    match->params[match->param_count++] = (StringView){p, (size_t)(end - p)};
+    match->route = &router->routes[node->wildcard];
+    return 1;
+  }
+  return 0;
+}
+
+int router_match(const Router *router, StringView path, HttpMethod method,
+                 RouteMatch *match) {
+  match->route = NULL;
+  match->handler = NULL;
+  match->flags = 0;
+  match->param_count = 0;
+  if (router->exact_slots) {
+    uint32_t slot = hash_path(router->exact_seed, path.ptr, path.len) &
+                    router->exact_mask;
+    uint32_t entry = router->exact_slots[slot];
+    if (entry) {
+      const Route *route = &router->routes[entry - 1];
+      if (strlen(route->pattern) == path.len &&
+          memcmp(route->pattern, path.ptr, path.len) == 0)
+        match->route = route;
+    }
+  }
+  if (!match->route && router->node_count)
+    match_node(router, 0, path.ptr, path.ptr + path.len, match);
+  if (!match->route || method >= HTTP_METHOD_COUNT)
+    return 0;
+  match->handler = match->route->handlers[method];
+  match->flags = match->route->flags[method];
+  return match->handler != NULL;
+}
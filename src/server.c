@@ -1,23 +1,35 @@
+// accept4() and SOCK_NONBLOCK are Linux extensions
+#define _GNU_SOURCE
 #include "../include/server.h"
+#include "../include/access_log.h"    // For AccessRecord, access_log_*
+#include "../include/compress.h"      // For compress_buffer, compress_negotiate
 #include "../include/config.h"        // For PORT, BACKLOG, BUFFER_SIZE
-#include "../include/http_parser.h"   // For parseRequest
-#include "../include/http_response.h" // For echoResponse
-#include "../include/http_types.h" // For freeClientRequest, freeServerResponse
-#include "../include/signal_handler.h" // For keep_running
+#include "../include/http2.h"         // For http2_handle, http2_upgrade
+#include "../include/http_parser.h"   // For httpParserHead, httpParserBody
+#include "../include/http_response.h" // For echoResponse, cannedResponse
+#include "../include/http_types.h"    // For ClientRequest, StringView
+#include "../include/metrics.h"       // For metrics_render, histogram_record
+#include "../include/proxy.h"         // For proxy_add_route, DeferredRequest
+#include "../include/router.h"        // For Router, router_match
+#include "../include/signal_handler.h" // For keep_running, draining
+#include "../include/static_files.h"   // For serve_static_file
 
 #include <errno.h>      // For errno
 #include <netinet/in.h> // For sockaddr_in, INADDR_ANY, htons, htonl
-#include <netinet/ip.h> // For IPPROTO_TCP (though not directly used here)
-#include <stdio.h>      // For fprintf, printf, perror
+#include <netinet/ip.h> // For IPPROTO_TCP
+#include <netinet/tcp.h> // For TCP_NODELAY
+#include <stdio.h>      // For fprintf, snprintf
 #include <stdlib.h>     // For EXIT_FAILURE, EXIT_SUCCESS, malloc
 #include <string.h>     // For strerror, strlen, strcmp, memcmp
-#include <sys/socket.h> // For socket, setsockopt, bind, listen, accept, send
+#include <sys/socket.h> // For socket, setsockopt, bind, listen, accept4
 #include <sys/types.h>  // For ssize_t
-#include <unistd.h>     // For read, close
+#include <unistd.h>     // For close
 
-int setup_server_socket(int port) {
+int setup_server_socket(int port, int reuse_port) {
   // stores struct file descriptor
-  int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+  // Close-on-exec, so a new binary only inherits the listeners it is
+  // handed on purpose
+  int server_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
   // server_fd is -1 in case of an error, otherwise store the descriptor of the
   // socket
   if (server_fd == -1) {
@@ -35,6 +47,15 @@ int setup_server_socket(int port) {
     close(server_fd);
     return -1;
   }
+  // SO_REUSEPORT lets every worker bind its own socket to the same port. The
+  // kernel then hashes incoming connections across those sockets, so workers
+  // never contend on a shared accept queue.
+  if (reuse_port && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &reuse,
+                               sizeof(reuse)) < 0) {
+    fprintf(stderr, "SO_REUSEPORT failed: %s\n", strerror(errno));
+    close(server_fd);
+    return -1;
+  }
   // a struct to store values of parameters for the server
   struct sockaddr_in serv_addr = {
       // sockaddr_in is IPv4 specifically
@@ -69,143 +90,722 @@ int setup_server_socket(int port) {
   return server_fd;
 }
 
-int handle_accept(int server_fd) {
-  // structs to store the client address data
-  struct sockaddr_in client_addr;
-  socklen_t client_addr_len = sizeof(client_addr);
-  // The accept(/*...*/) syscall extracts the first connection request in the
-  // queue of pending connections, it creates a new connected socket and
-  // returns the file descriptor for the connected socket. accept(/*...*/)
-  // will pause the execution here until a client attempts to connect (unless
-  // the server is in non blocking mode which is not the case here)
+void configure_client_socket(int client_fd) {
+  // Responses are written in one go, so there is nothing to gain from Nagle
+  // delaying the last segment of a reply.
+  int nodelay = 1;
+  if (setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay,
+                 sizeof(nodelay)) < 0) {
+    fprintf(stderr, "TCP_NODELAY failed: %s\n", strerror(errno));
+  }
+}
 
-  int client_fd =
-      accept(server_fd, (struct sockaddr *)&client_addr, &client_addr_len);
+int handle_accept(int server_fd, struct sockaddr_in *client_addr) {
+  socklen_t client_addr_len = sizeof(*client_addr);
+  // The accept4(/*...*/) syscall extracts the first connection request in the
+  // queue of pending connections, it creates a new connected socket and
+  // returns the file descriptor for the connected socket. The server socket is
+  // non-blocking, so accept4(/*...*/) returns straight away with EAGAIN once
+  // the queue is empty. SOCK_NONBLOCK makes the client socket non-blocking in
+  // the same syscall, so the event loop never blocks on a single client.
+  int client_fd = accept4(server_fd, (struct sockaddr *)client_addr,
+                          &client_addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
 
   if (!keep_running) {
-    fprintf(stderr, "Server is shutting down. Exiting accept loop.\n");
-    // Important: if accept is interrupted, it might return -1 and errno=EINTR.
-    // We return a special value or let the caller check keep_running.
-    // For now, -1 is fine, main.c will check keep_running after.
-    return -1; // Or some specific error code for shutdown
+    if (client_fd >= 0)
+      close(client_fd);
+    return ACCEPT_SHUTDOWN;
   }
 
   if (client_fd < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return ACCEPT_WOULD_BLOCK; // Queue drained, wait for the next event
+    }
     // If accept was interrupted by a signal, errno might be EINTR.
     // EINTR should not be treated as a fatal error, but continue the loop to
     // check keep_running.
     if (errno == EINTR) {
-      fprintf(stderr,
-              "Accept interrupted by signal. Checking shutdown flag.\n");
-      return -2; // Custom code for EINTR, indicating non-fatal continue
+      return ACCEPT_INTERRUPTED;
     }
     fprintf(stderr, "Connection failed: %s\n", strerror(errno));
-    return -3; // Generic error
+    return ACCEPT_FAILED;
   }
+
+  configure_client_socket(client_fd);
   return client_fd;
 }
 
-void handle_client(int client_fd, char *serverResponse[]) {
-  char client_req_buffer[BUFFER_SIZE] = {0};
-  ssize_t bytes_read = read(client_fd, client_req_buffer, BUFFER_SIZE - 1);
+// Queue a complete response: status line, header lines, the Date and
+// connection headers and the blank line ending the head, then 'body_len'
+// bytes of body. Every response carries a Content-Length (in 'headers') so
+// the client can find the end of it on a persistent connection. Apart from
+// the Date line the parts are queued as separate segments without being
+// copied, so they have to be string literals or memory from the
+// connection's arena.
+static int queue_full_response(Connection *conn, const char *status_line,
+                               const char *headers, ConnectionMode mode,
+                               const char *body, size_t body_len) {
+  StringView date = dateHeader(conn->responses);
+  const char *connection_header = connectionHeader(mode);
+  conn->status = (uint16_t)responseStatus(status_line);
+  if (queue_reference(conn, status_line, strlen(status_line)) < 0 ||
+      queue_reference(conn, headers, strlen(headers)) < 0 ||
+      queue_response(conn, date.ptr, date.len) < 0 ||
+      queue_reference(conn, connection_header, strlen(connection_header)) <
+          0 ||
+      queue_reference(conn, "\r\n", 2) < 0 ||
+      queue_reference(conn, body, body_len) < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+// Queue a 200 whose 'len' byte body is compressed on the way, read in
+// place and deflated straight into the arena, so the plain body is never
+// copied. Returns 1 if it was queued, 0 if the client takes no coding we
+// have, the body is too short or does not shrink, or -1 on failure.
+static int queue_compressed(Connection *conn, const ClientRequest *C,
+                            ConnectionMode mode, const char *content_type,
+                            const char *body, size_t len) {
+  if (!conn->compressor || len < COMPRESS_MIN_SIZE)
+    return 0;
+  ContentCoding coding = compress_negotiate(C);
+  if (coding == CODING_IDENTITY)
+    return 0;
+  char *out = arena_alloc(&conn->arena, len - 1);
+  if (!out)
+    return 0;
+  ssize_t out_len = compress_buffer(conn->compressor, coding,
+                                    COMPRESS_LEVEL_DYNAMIC, body, len, out,
+                                    len - 1);
+  if (out_len < 0)
+    return 0;
+  char *headers = arena_alloc(&conn->arena, BUFFER_SIZE);
+  if (!headers)
+    return -1;
+  snprintf(headers, BUFFER_SIZE,
+           "Content-Type: %s\r\nContent-Encoding: %s\r\n"
+           "Vary: Accept-Encoding\r\nContent-Length: %zd\r\n",
+           content_type, content_coding_name(coding), out_len);
+  int head_only = C->http_method == HTTP_METHOD_HEAD;
+  if (queue_full_response(conn, "HTTP/1.1 200 OK\r\n", headers, mode, out,
+                          head_only ? 0 : (size_t)out_len) < 0)
+    return -1;
+  return 1;
+}
+
+// Queue one of the canned responses. It is already rendered in full, so
+// this is a single copy.
+static int queue_canned_response(Connection *conn, CannedResponseId id,
+                                 ConnectionMode mode, int head_only) {
+  StringView response = cannedResponse(conn->responses, id, mode, head_only);
+  conn->status = (uint16_t)responseStatus(response.ptr);
+  return queue_response(conn, response.ptr, response.len);
+}
+
+// Answer a request the parser rejected. The stream can not be trusted any
+// more, so the connection is closed afterwards.
+static int reject_request(Connection *conn, int parse_status) {
+  conn->close_after_send = 1;
+  CannedResponseId id;
+  switch (parse_status) {
+  case PARSE_TOO_MANY_HEADERS:
+  case PARSE_HEAD_TOO_LARGE:
+    id = RESPONSE_HEADERS_TOO_LARGE;
+    break;
+  case PARSE_BODY_TOO_LARGE:
+    id = RESPONSE_CONTENT_TOO_LARGE;
+    break;
+  case PARSE_UNSUPPORTED_ENCODING:
+    id = RESPONSE_NOT_IMPLEMENTED;
+    break;
+  default:
+    id = RESPONSE_BAD_REQUEST;
+    break;
+  }
+  return queue_canned_response(conn, id, CONNECTION_CLOSE, 0);
+}
+
+// Body sink for requests whose handler has no use for the body. Reading it
+// keeps the connection usable for the next request.
+static ssize_t discard_body(void *ctx, const char *data, size_t len) {
+  (void)ctx;
+  (void)data;
+  return (ssize_t)len;
+}
+
+// Body sink of POST /echo: streams every received piece straight back as
+// part of the response body, so the body is never held in full.
+static ssize_t echo_body(void *ctx, const char *data, size_t len) {
+  Connection *conn = ctx;
+  if (data == NULL) {
+    if (conn->stream_chunked && queue_response(conn, "0\r\n\r\n", 5) < 0)
+      return -1;
+    return 0;
+  }
+
+  // Leave room for the chunk framing and the final "0\r\n\r\n"
+  size_t overhead = conn->stream_chunked ? 32 : 0;
+  size_t room = SEND_BUFFER_SIZE - conn->send_len;
+  if (room <= overhead)
+    return 0; // Send buffer is full, resume once it has drained
+  size_t n = len < room - overhead ? len : room - overhead;
+
+  if (conn->stream_chunked) {
+    char size_line[20];
+    int size_len = snprintf(size_line, sizeof(size_line), "%zx\r\n", n);
+    if (queue_response(conn, size_line, (size_t)size_len) < 0 ||
+        queue_response(conn, data, n) < 0 ||
+        queue_response(conn, "\r\n", 2) < 0)
+      return -1;
+  } else if (queue_response(conn, data, n) < 0) {
+    return -1;
+  }
+  return (ssize_t)n;
+}
+
+// Start the streamed response of POST /echo. The body follows through
+// echo_body(); its framing mirrors the request's.
+static int start_echo_body(Connection *conn, const ClientRequest *C,
+                           const RouteMatch *match, ConnectionMode mode) {
+  (void)match;
+  char *headers = arena_alloc(&conn->arena, BUFFER_SIZE);
+  if (!headers)
+    return -1;
+  conn->stream_chunked = 0;
+  if (C->chunked && C->version_minor >= 1) {
+    conn->stream_chunked = 1;
+    snprintf(headers, BUFFER_SIZE,
+             "Content-Type: application/octet-stream\r\n"
+             "Transfer-Encoding: chunked\r\n");
+  } else if (C->chunked) {
+    // An HTTP/1.0 client can not take a chunked response: the end of the
+    // body is marked by closing the connection instead.
+    conn->close_after_send = 1;
+    snprintf(headers, BUFFER_SIZE,
+             "Content-Type: application/octet-stream\r\n");
+    mode = CONNECTION_CLOSE;
+  } else {
+    snprintf(headers, BUFFER_SIZE,
+             "Content-Type: application/octet-stream\r\n"
+             "Content-Length: %llu\r\n",
+             (unsigned long long)C->content_length);
+  }
+  conn->on_body = echo_body;
+  return queue_full_response(conn, "HTTP/1.1 200 OK\r\n", headers, mode, "",
+                             0);
+}
+
+// GET /echo/*: answer with the rest of the path as a plain text body
+static int echo_path(Connection *conn, const ClientRequest *C,
+                     const RouteMatch *match, ConnectionMode mode) {
+  StringView message = match->params[match->param_count - 1];
+  int compressed = queue_compressed(conn, C, mode, "text/plain",
+                                    message.ptr, message.len);
+  if (compressed != 0) {
+    if (compressed > 0)
+      conn->cache_ttl_ms = ECHO_CACHE_TTL_MS;
+    return compressed < 0 ? -1 : 0;
+  }
+
+  ServerResponse S = echoResponse(message, &conn->arena);
+  if (!S.status_line || !S.headers || !S.response_body) {
+    fprintf(stderr, "Failed to create echo response.\n");
+    conn->close_after_send = 1;
+    return queue_canned_response(conn, RESPONSE_INTERNAL_ERROR,
+                                 CONNECTION_CLOSE, 0);
+  }
+
+  // The parts stay where they are and leave in one sendmsg() as separate
+  // segments, so no intermediate response string is needed.
+  int head_only = C->http_method == HTTP_METHOD_HEAD;
+  if (queue_full_response(conn, S.status_line, S.headers, mode,
+                          S.response_body,
+                          head_only ? 0 : strlen(S.response_body)) < 0)
+    return -1;
+  conn->cache_ttl_ms = S.cache_ttl_ms;
+  return 0;
+}
+
+// GET /: a file from the document root if there is one, else the built-in
+// page
+static int root_page(Connection *conn, const ClientRequest *C,
+                     const RouteMatch *match, ConnectionMode mode) {
+  (void)match;
+  int served = serve_static_file(conn, C, mode);
+  if (served != STATIC_NOT_FOUND)
+    return served < 0 ? -1 : 0;
+  return queue_canned_response(conn, RESPONSE_ROOT_OK, mode,
+                               C->http_method == HTTP_METHOD_HEAD);
+}
+
+// GET /*: files below the document root
+static int static_file(Connection *conn, const ClientRequest *C,
+                       const RouteMatch *match, ConnectionMode mode) {
+  (void)match;
+  int served = serve_static_file(conn, C, mode);
+  if (served != STATIC_NOT_FOUND)
+    return served < 0 ? -1 : 0;
+  return queue_canned_response(conn, RESPONSE_NOT_FOUND, mode, 0);
+}
+
+// The route table, compiled once before the workers start and only read
+// afterwards
+static Router router;
+// Route patterns by route index, the labels of the per-route counters
+static const char *route_names[METRICS_MAX_ROUTES];
+
+// GET /metrics: every worker's counters in the Prometheus text format. The
+// page is rendered into the arena, which is freed once it has been sent.
+static int metrics_page(Connection *conn, const ClientRequest *C,
+                        const RouteMatch *match, ConnectionMode mode) {
+  (void)match;
+  char *body = arena_alloc(&conn->arena, METRICS_PAGE_SIZE);
+  char *headers = arena_alloc(&conn->arena, BUFFER_SIZE);
+  if (!body || !headers)
+    return -1;
+  size_t len = metrics_render(body, METRICS_PAGE_SIZE, route_names,
+                              router.route_count);
+  if (len == 0) {
+    fprintf(stderr, "The metrics page does not fit in %d bytes.\n",
+            METRICS_PAGE_SIZE);
+    return queue_canned_response(conn, RESPONSE_INTERNAL_ERROR, mode, 0);
+  }
+  int compressed = queue_compressed(
+      conn, C, mode, "text/plain; version=0.0.4", body, len);
+  if (compressed != 0)
+    return compressed < 0 ? -1 : 0;
+  snprintf(headers, BUFFER_SIZE,
+           "Content-Type: text/plain; version=0.0.4\r\n"
+           "Vary: Accept-Encoding\r\nContent-Length: %zu\r\n",
+           len);
+  int head_only = C->http_method == HTTP_METHOD_HEAD;
+  return queue_full_response(conn, "HTTP/1.1 200 OK\r\n", headers, mode,
+                             body, head_only ? 0 : len);
+}
+
+// Register a built-in route unless a proxied prefix took its path
+static int add_builtin(uint32_t methods, const char *pattern,
+                       RouteHandler handler, unsigned flags) {
+  for (size_t i = 0; i < router.route_count; ++i) {
+    if (strcmp(router.routes[i].pattern, pattern) == 0)
+      return 0;
+  }
+  return router_add(&router, methods, pattern, handler, flags);
+}
+
+int setup_routes(const ServerOptions *opts) {
+  router_init(&router);
+  // Proxied prefixes first: they take precedence over the built-in routes
+  // of the same paths
+  for (int i = 0; i < opts->proxy_route_count; ++i) {
+    if (proxy_add_route(&router, opts->proxy_routes[i]) < 0) {
+      router_destroy(&router);
+      return -1;
+    }
+  }
+  if (add_builtin(ROUTE_POST, "/echo", start_echo_body, ROUTE_BODY) < 0 ||
+      add_builtin(ROUTE_GET, "/echo/*", echo_path, 0) < 0 ||
+      add_builtin(ROUTE_GET, "/", root_page, 0) < 0 ||
+      add_builtin(ROUTE_GET, "/metrics", metrics_page, 0) < 0 ||
+      add_builtin(ROUTE_GET, "/*", static_file, 0) < 0 ||
+      router_compile(&router) < 0) {
+    fprintf(stderr, "Failed to set up the routes.\n");
+    router_destroy(&router);
+    return -1;
+  }
+  if (router.route_count > METRICS_MAX_ROUTES) {
+    fprintf(stderr, "More than %d routes can not be counted.\n",
+            METRICS_MAX_ROUTES);
+    router_destroy(&router);
+    return -1;
+  }
+  for (size_t i = 0; i < router.route_count; ++i)
+    route_names[i] = router.routes[i].pattern;
+  return 0;
+}
+
+void free_routes(void) { router_destroy(&router); }
+
+// Produce the response for a parsed request
+static int route_request(Connection *conn, const ClientRequest *C,
+                         const RouteMatch *match, ConnectionMode mode) {
+  if (match->handler) {
+    return match->handler(conn, C, match, mode);
+  }
+  if (match->route) {
+    // The path exists but not for this method. The Allow header comes from
+    // the route table, so it always lists what is registered.
+    return queue_full_response(conn, "HTTP/1.1 405 Method Not Allowed\r\n",
+                               match->route->allow_headers, mode, "", 0);
+  }
+  return queue_canned_response(conn, RESPONSE_NOT_FOUND, mode, 0);
+}
+
+// Bytes queued on the connection but not written yet, file ranges included
+static uint64_t pending_output(const Connection *conn) {
+  return (uint64_t)conn->out_bytes + conn->file_remaining;
+}
+
+// Fill in the access log record of a request. 'C' is NULL for a request
+// the parser rejected; time, status and bytes are left to the caller.
+static void fill_record(const Connection *conn, const ClientRequest *C,
+                        AccessRecord *r) {
+  r->peer_addr = conn->peer_addr;
+  r->peer_port = conn->peer_port;
+  r->kind = ACCESS_RECORD_REQUEST;
+  r->method = HTTP_METHOD_UNKNOWN;
+  r->version = 255;
+  r->target_len = 0;
+  if (C) {
+    r->method = (uint8_t)C->http_method;
+    // A stream's request was rewritten as HTTP/1.1 for the parser
+    r->version = (uint8_t)(conn->stream ? 20 : 10 + C->version_minor);
+    size_t len = C->route.len < ACCESS_LOG_TARGET_MAX ? C->route.len
+                                                      : ACCESS_LOG_TARGET_MAX;
+    memcpy(r->target, C->route.ptr, len);
+    if (C->query.len > 0 && len < ACCESS_LOG_TARGET_MAX) {
+      r->target[len++] = '?';
+      size_t room = ACCESS_LOG_TARGET_MAX - len;
+      size_t query_len = C->query.len < room ? C->query.len : room;
+      memcpy(r->target + len, C->query.ptr, query_len);
+      len += query_len;
+    }
+    r->target_len = (uint8_t)len;
+  }
+}
+
+// Whether the handler reset the stream 'conn' stands in for rather than
+// answering it
+static int stream_reset(const Connection *conn) {
+  return conn->stream && conn->stream->reset;
+}
 
-  if (bytes_read < 0) {
-    fprintf(stderr, "Failed to read from client: %s\n", strerror(errno));
+// Leave an access log record for the request just answered, or for the
+// stream reset in its place. Filling in the record is all the worker does;
+// the log thread formats and writes it.
+static void log_request(Connection *conn, const ClientRequest *C,
+                        uint64_t bytes) {
+  int reset = stream_reset(conn);
+  LogLevel level = reset || conn->status >= 400 ? LOG_LEVEL_ERROR
+                                                : LOG_LEVEL_INFO;
+  if (!conn->log || !access_log_wants(level))
+    return;
+  AccessRecord *r = access_log_reserve(conn->log);
+  if (!r)
     return;
+  fill_record(conn, C, r);
+  r->time_ns = access_log_now();
+  r->bytes = bytes;
+  r->status = conn->status;
+  if (reset) {
+    r->kind = ACCESS_RECORD_RESET;
+    r->status = (uint16_t)conn->stream->reset_code;
+  }
+  access_log_commit(conn->log);
+}
+
+// Feed buffered body bytes of the current request to its sink
+static int handle_body(Connection *conn) {
+  if (conn->recv_len == 0) {
+    return 0;
+  }
+  size_t consumed = 0;
+  int status = httpParserBody(&conn->parser, conn->recv_buffer,
+                              conn->recv_len, &consumed, conn->on_body, conn);
+  consume_connection(conn, consumed);
+
+  if (status == PARSE_OK) {
+    int rc = conn->on_body(conn, NULL, 0) < 0 ? -1 : 1;
+    conn->on_body = NULL;
+    return rc;
+  }
+  if (status == PARSE_NEED_MORE || status == PARSE_PAUSED) {
+    return consumed > 0 ? 1 : 0;
   }
-  if (bytes_read == 0) {
-    printf("Client closed connection before sending data.\n");
+  // The response is already under way, so all that is left is to drop the
+  // connection.
+  fprintf(stderr, "Invalid request body (parser status %d).\n", status);
+  return -1;
+}
+
+// When the bytes of a request started to arrive. A request that was
+// pipelined behind others has waited since its bytes arrived; one read
+// without the rest of its head has no better start than 'parse_start'.
+static uint64_t request_arrival(const Connection *conn,
+                                uint64_t parse_start) {
+  return conn->received_ns && conn->received_ns < parse_start
+             ? conn->received_ns
+             : parse_start;
+}
+
+// Count the response to a request: 'route' is the index of the route it
+// matched, or METRICS_MAX_ROUTES if it matched none. Times are from
+// metrics_now(): when the request arrived and when it was answered.
+static void count_response(Connection *conn, size_t route, uint64_t received,
+                           uint64_t answered) {
+  WorkerMetrics *M = conn->metrics;
+  unsigned status_class = conn->status / 100;
+  if (status_class >= METRICS_STATUS_CLASSES)
+    status_class = 0;
+  metrics_add(&M->requests[route][status_class], 1);
+  histogram_record(&M->request_time, answered - received);
+}
+
+// Count a request just answered. Times are from metrics_now(): when
+// parsing started, ended, and the response was queued.
+static void count_request(Connection *conn, size_t route, uint64_t parse_start,
+                          uint64_t parsed, uint64_t handled) {
+  WorkerMetrics *M = conn->metrics;
+  if (!M)
     return;
+  histogram_record(&M->parse_time, parsed - parse_start);
+  histogram_record(&M->handler_time, handled - parsed);
+  // A reset stream got no response; http2_resets counts it instead
+  if (!stream_reset(conn))
+    count_response(conn, route, request_arrival(conn, parse_start),
+                   handled);
+}
+
+// A proxied request is only counted and logged once its response has been
+// relayed. Keep what is known now, when the request is at hand.
+static void defer_request(Connection *conn, const ClientRequest *C,
+                          size_t route, uint64_t parse_start,
+                          uint64_t parsed) {
+  DeferredRequest *d = &conn->upstream->request.deferred;
+  d->pending = 1;
+  d->route = route;
+  if (conn->metrics) {
+    uint64_t handled = metrics_now();
+    histogram_record(&conn->metrics->parse_time, parsed - parse_start);
+    histogram_record(&conn->metrics->handler_time, handled - parsed);
+    d->received = request_arrival(conn, parse_start);
   }
-  client_req_buffer[bytes_read] = '\0';
-  // Null terminate exactly after read bytes
+  // An error answer is the least that will be logged
+  d->logged = conn->log && access_log_wants(LOG_LEVEL_ERROR);
+  if (d->logged)
+    fill_record(conn, C, &d->record);
+}
 
-  ClientRequest C = parseRequest(client_req_buffer, bytes_read);
+void finish_deferred_request(Connection *conn, DeferredRequest *d,
+                             uint64_t bytes) {
+  if (!d->pending)
+    return;
+  d->pending = 0;
+  if (conn->metrics)
+    count_response(conn, d->route, d->received, metrics_now());
+  LogLevel level = conn->status >= 400 ? LOG_LEVEL_ERROR : LOG_LEVEL_INFO;
+  if (!d->logged || !access_log_wants(level))
+    return;
+  AccessRecord *r = access_log_reserve(conn->log);
+  if (!r)
+    return;
+  *r = d->record;
+  r->time_ns = access_log_now();
+  r->bytes = bytes;
+  r->status = conn->status;
+  access_log_commit(conn->log);
+}
 
-  if (!C.http_method || !C.route || !C.http_version) {
-    fprintf(stderr, "Failed to parse request or malformed request.\n");
-    // Send a 400 Bad Request
-    if (send(client_fd, "HTTP/1.1 400 Bad Request\r\n\r\n",
-             strlen("HTTP/1.1 400 Bad Request\r\n\r\n"), 0) < 0) {
-      fprintf(stderr, "Failed Sending 400 Response: %s\n", strerror(errno));
-    }
-    freeClientRequest(&C);
+// Answer a request the parser rejected, and count and log it
+static int answer_rejected(Connection *conn, int parse_status,
+                           uint64_t parse_start, uint64_t parsed) {
+  uint64_t output_before = pending_output(conn);
+  int rc = reject_request(conn, parse_status);
+  if (conn->metrics)
+    metrics_add(&conn->metrics->parse_errors, 1);
+  count_request(conn, METRICS_MAX_ROUTES, parse_start, parsed,
+                metrics_now());
+  log_request(conn, NULL, pending_output(conn) - output_before);
+  return rc;
+}
+
+// Find what a request's response would be cached under. Only GET and HEAD
+// requests without a body on connections kept open by default qualify, as
+// the cached bytes carry no Connection header. Returns 0 if it can not be.
+static int response_key(const Connection *conn, const ClientRequest *C,
+                        ConnectionMode mode, int has_body, ResponseKey *key) {
+  if (!conn->cache || has_body || mode != CONNECTION_DEFAULT ||
+      (C->http_method != HTTP_METHOD_GET &&
+       C->http_method != HTTP_METHOD_HEAD))
+    return 0;
+  key->method = (uint8_t)C->http_method;
+  key->coding = (uint8_t)(conn->compressor ? compress_negotiate(C)
+                                           : CODING_IDENTITY);
+  key->target = C->target;
+  return 1;
+}
+
+// Queue a cached response as one segment: copied next to what is queued
+// if it fits, else to the arena
+static int queue_cached_response(Connection *conn, CachedResponse *entry) {
+  StringView date = dateHeader(conn->responses);
+  if (entry->date_offset + date.len <= entry->len)
+    memcpy(entry->response + entry->date_offset, date.ptr, date.len);
+  conn->status = entry->status;
+  if (entry->len <= SEND_BUFFER_SIZE - conn->send_len)
+    return queue_response(conn, entry->response, entry->len);
+  char *copy = arena_alloc(&conn->arena, entry->len);
+  if (!copy)
+    return -1;
+  memcpy(copy, entry->response, entry->len);
+  return queue_reference(conn, copy, entry->len);
+}
+
+// Keep the response a handler just queued, if it allowed that with
+// cache_ttl_ms and all of it is in memory
+static void store_response(Connection *conn, const ResponseKey *key,
+                           uint64_t output_before) {
+  uint64_t len = pending_output(conn) - output_before;
+  if (conn->file || conn->upstream || len == 0)
+    return;
+  CachedResponse *entry = response_cache_insert(
+      conn->cache, key, (size_t)len, conn->status, conn->cache_ttl_ms);
+  if (!entry)
     return;
+  peek_output_tail(conn, entry->response, entry->len);
+  const char *date = memmem(entry->response, entry->len, "\r\nDate: ", 8);
+  if (date)
+    entry->date_offset = (size_t)(date + 2 - entry->response);
+  if (conn->metrics)
+    metrics_add(&conn->metrics->cache_fills, 1);
+}
+
+// Answer a routed request from the response cache, or with its handler,
+// then count and log it, or leave that until a proxied response has been
+// relayed. Each worker has its own cache and runs handlers to completion,
+// so of a burst of identical requests only the first reaches the handler.
+static int serve_request(Connection *conn, const ClientRequest *C,
+                         const RouteMatch *match, ConnectionMode mode,
+                         int has_body, uint64_t parse_start,
+                         uint64_t parsed) {
+  uint64_t output_before = pending_output(conn);
+  int accepts_body = match->handler && (match->flags & ROUTE_BODY);
+  int rc = 0;
+  if (has_body && C->expect_continue && accepts_body) {
+    rc = queue_reference(conn, "HTTP/1.1 100 Continue\r\n\r\n", 25);
+  }
+  conn->on_body = discard_body;
+  conn->cache_ttl_ms = 0;
+  ResponseKey key;
+  int cacheable = response_key(conn, C, mode, has_body, &key);
+  CachedResponse *hit = cacheable ? response_cache_lookup(conn->cache, &key)
+                                  : NULL;
+  if (hit) {
+    rc = queue_cached_response(conn, hit);
+    if (conn->metrics)
+      metrics_add(&conn->metrics->cache_hits, 1);
+  } else if (rc == 0) {
+    rc = route_request(conn, C, match, mode);
+    if (rc == 0 && cacheable && conn->cache_ttl_ms > 0)
+      store_response(conn, &key, output_before);
+  }
+  size_t route = match->route ? (size_t)(match->route - router.routes)
+                              : METRICS_MAX_ROUTES;
+  if (conn->upstream) {
+    defer_request(conn, C, route, parse_start, parsed);
+  } else {
+    count_request(conn, route, parse_start, parsed, metrics_now());
+    log_request(conn, C, pending_output(conn) - output_before);
   }
+  return rc;
+}
 
-  if (strcmp(C.http_method, "GET") == 0) {
-    if (C.args != NULL && memcmp(C.route, "/echo/", strlen("/echo/")) == 0) {
-      ServerResponse S = echoResponse(C, serverResponse);
-      if (!S.status_line || !S.headers || !S.response_body) {
-        fprintf(stderr, "Failed to create echo response.\n");
-        if (send(client_fd, "HTTP/1.1 500 Internal Server Error\r\n\r\n",
-                 strlen("HTTP/1.1 500 Internal Server Error\r\n\r\n"), 0) < 0) {
-          fprintf(stderr, "Failed Sending 500 Response: %s\n", strerror(errno));
-        }
-        freeServerResponse(&S);
-        freeClientRequest(&C);
-        return;
-      }
-
-      // Allocate buffer for the full response string
-      // Estimate size: status + headers + body + some slack
-      size_t estimated_size = strlen(S.status_line) + strlen(S.headers) +
-                              strlen(S.response_body) + 10;
-      char *responseString =
-          (char *)malloc(estimated_size); // Dynamic size estimation
-      if (!responseString) {
-        fprintf(stderr, "Failed to allocate memory for responseString.\n");
-        // Send a 500 Internal Server Error
-        if (send(client_fd, "HTTP/1.1 500 Internal Server Error\r\n\r\n",
-                 strlen("HTTP/1.1 500 Internal Server Error\r\n\r\n"), 0) < 0) {
-          fprintf(stderr, "Failed Sending 500 Response: %s\n", strerror(errno));
-        }
-        freeServerResponse(&S);
-        freeClientRequest(&C);
-        return;
-      }
-
-      int written = snprintf(responseString, estimated_size, "%s%s%s",
-                             S.status_line, S.headers, S.response_body);
-
-      if (written < 0 ||
-          (size_t)written >= estimated_size) { // cast written to size_t
-        fprintf(stderr, "Response string truncated or error occurred while "
-                        "parsing Response string.\n");
-      }
-
-      if (send(client_fd, responseString, strlen(responseString), 0) < 0) {
-        fprintf(stderr, "Failed Sending Response: %s\n", strerror(errno));
-      } else {
-        printf("Echo Response Sent.\n");
-      }
-      free(responseString);
-      freeServerResponse(&S);
-
-    } else if (strcmp(C.route, "/") == 0) {
-      if (send(client_fd, serverResponse[200], strlen(serverResponse[200]), 0) <
-          0) {
-        fprintf(stderr, "Failed Sending 200 Response: %s\n", strerror(errno));
-      } else {
-        printf("200 OK Response Sent (root).\n");
-      }
-    } else {
-      if (send(client_fd, serverResponse[404], strlen(serverResponse[404]), 0) <
-          0) {
-        fprintf(stderr, "Failed Sending 404 Response: %s\n", strerror(errno));
-      } else {
-        printf("404 Not Found Response Sent.\n");
-      }
-    }
-  } else { // Handle non-GET methods (e.g., send 405 Method Not Allowed)
-    const char *method_not_allowed =
-        "HTTP/1.1 405 Method Not Allowed\r\nAllow: GET\r\n\r\n";
-    if (send(client_fd, method_not_allowed, strlen(method_not_allowed), 0) <
-        0) {
-      fprintf(stderr, "Failed Sending 405 Response: %s\n", strerror(errno));
-    } else {
-      printf("405 Method Not Allowed sent.\n");
+int handle_client(Connection *conn) {
+  if (conn->h2) {
+    return http2_handle(conn);
+  }
+  if (httpParserInBody(&conn->parser)) {
+    return handle_body(conn);
+  }
+  if (conn->recv_len == 0) {
+    return 0;
+  }
+  if (conn->requests_served == 0) {
+    // A client that knows we speak HTTP/2 starts with its preface
+    int preface = http2_preface(conn);
+    if (preface == 0)
+      return 0;
+    if (preface > 0)
+      return http2_start(conn) < 0 ? -1 : 1;
+  }
+
+  ClientRequest C;
+  size_t head_len = 0;
+  uint64_t parse_start = conn->metrics ? metrics_now() : 0;
+  int status = httpParserHead(&conn->parser, conn->recv_buffer,
+                              conn->recv_len, &C, &head_len);
+  if (status == PARSE_NEED_MORE) {
+    return 0; // Wait for the rest of the head
+  }
+  conn->requests_served++;
+  conn->status = 0;
+  uint64_t parsed = conn->metrics ? metrics_now() : 0;
+
+  if (status != PARSE_OK) {
+    int rc = answer_rejected(conn, status, parse_start, parsed);
+    consume_connection(conn, conn->recv_len);
+    httpParserReset(&conn->parser);
+    return rc < 0 ? -1 : 1;
+  }
+  int has_body = httpParserInBody(&conn->parser);
+  if (!has_body && !draining) {
+    int upgraded = http2_upgrade(conn, &C, parse_start);
+    if (upgraded != 0) {
+      consume_connection(conn, head_len);
+      return upgraded < 0 ? -1 : 1;
     }
   }
-  freeClientRequest(&C);
+
+  // Keep the connection unless the client asked to close it, it can not
+  // send more requests, or it has used up its request budget.
+  RouteMatch match;
+  router_match(&router, C.route, C.http_method, &match);
+  int accepts_body = match.handler && (match.flags & ROUTE_BODY);
+  int keep_alive = C.keep_alive && !conn->peer_closed && !draining &&
+                   conn->requests_served < MAX_KEEPALIVE_REQUESTS;
+  if (has_body && C.expect_continue && !accepts_body) {
+    // The client holds the body back until it sees "100 Continue", which
+    // this route never sends, so the connection can not be reused.
+    keep_alive = 0;
+  }
+  ConnectionMode mode = CONNECTION_DEFAULT;
+  if (!keep_alive) {
+    conn->close_after_send = 1;
+    mode = CONNECTION_CLOSE;
+  } else if (C.version_minor == 0) {
+    mode = CONNECTION_KEEP_ALIVE; // HTTP/1.0 opt-in
+  }
+
+  int rc = serve_request(conn, &C, &match, mode, has_body, parse_start,
+                         parsed);
+  if (has_body && conn->close_after_send && conn->on_body == discard_body) {
+    // Nobody needs the body and the connection closes after the response,
+    // so the body is not read at all.
+    httpParserReset(&conn->parser);
+    has_body = 0;
+  }
+
+  // The request only holds views into the receive buffer, so the head is
+  // consumed once the response has been queued. The response itself lives
+  // in the arena until it has been written.
+  consume_connection(conn, head_len);
+  if (!has_body) {
+    conn->on_body = NULL;
+  }
+  return rc < 0 ? -1 : 1;
+}
+
+int handle_stream_request(Connection *conn, const ClientRequest *C,
+                          int parse_status, int has_body,
+                          uint64_t parse_start) {
+  conn->requests_served++;
+  conn->status = 0;
+  uint64_t parsed = conn->metrics ? metrics_now() : 0;
+  if (parse_status != PARSE_OK)
+    return answer_rejected(conn, parse_status, parse_start, parsed);
+  RouteMatch match;
+  router_match(&router, C->route, C->http_method, &match);
+  return serve_request(conn, C, &match, CONNECTION_DEFAULT, has_body,
+                       parse_start, parsed);
 }
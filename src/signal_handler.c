@@ -1,15 +1,47 @@
 #include "../include/signal_handler.h"
-#include <stdio.h>  // For fprintf
-#include <string.h> // For memset
+#include <pthread.h> // For pthread_sigmask
+#include <stdio.h>   // For fprintf
+#include <string.h>  // For memset, strerror
+#include <time.h>    // For struct timespec
 
 // Global atomic flag to control server loop
 volatile sig_atomic_t keep_running = 1;
+volatile sig_atomic_t draining = 0;
+
+// Requests the main thread has not acted on yet
+static volatile sig_atomic_t drain_requested = 0;
+static volatile sig_atomic_t upgrade_requested = 0;
+
+static const int shutdown_signals[] = {SIGINT, SIGTERM, SIGQUIT, SIGHUP,
+                                       SIGUSR2};
+#define SHUTDOWN_SIGNAL_COUNT                                                 \
+  (sizeof(shutdown_signals) / sizeof(shutdown_signals[0]))
+
+static void shutdown_signal_set(sigset_t *set) {
+  sigemptyset(set);
+  for (size_t i = 0; i < SHUTDOWN_SIGNAL_COUNT; ++i)
+    sigaddset(set, shutdown_signals[i]);
+}
 
 // Signal handler function
 void signal_handler(int signum) {
-  if (signum == SIGINT) {
+  switch (signum) {
+  case SIGINT:
     fprintf(stderr, "\nSIGINT received. Shutting down server...\n");
     keep_running = 0; // Set the flag to stop the main loop
+    break;
+  case SIGTERM:
+  case SIGQUIT:
+    fprintf(stderr, "\nSignal %d received. Draining connections...\n",
+            signum);
+    drain_requested = 1;
+    break;
+  case SIGHUP:
+  case SIGUSR2:
+    fprintf(stderr, "\nSignal %d received. Starting the new binary...\n",
+            signum);
+    upgrade_requested = 1;
+    break;
   }
 }
 
@@ -20,10 +52,54 @@ int setup_signal_handler() {
   sa.sa_handler = signal_handler; // Set our custom handler
   sigemptyset(&sa.sa_mask);       // Clear mask of blocked signals
   sa.sa_flags = 0;                // No special flags
-  if (sigaction(SIGINT, &sa, NULL) ==
-      -1) { // Register handler for SIGINT (Ctrl+C)
-    perror("sigaction failed");
+  for (size_t i = 0; i < SHUTDOWN_SIGNAL_COUNT; ++i) {
+    if (sigaction(shutdown_signals[i], &sa, NULL) == -1) {
+      perror("sigaction failed");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Function to block the shutdown signals in the calling thread
+int block_shutdown_signals(sigset_t *old_mask) {
+  sigset_t mask;
+  shutdown_signal_set(&mask);
+  int rc = pthread_sigmask(SIG_BLOCK, &mask, old_mask);
+  if (rc != 0) {
+    fprintf(stderr, "pthread_sigmask failed: %s\n", strerror(rc));
     return -1;
   }
   return 0;
 }
+
+// Function to wait for the next signal
+ServerSignal wait_for_signal(const sigset_t *old_mask) {
+  // sigsuspend() unblocks the signals and sleeps in one atomic step, so a
+  // signal arriving between the check and the sleep cannot be missed.
+  for (;;) {
+    if (!keep_running)
+      return SIGNAL_STOP;
+    if (drain_requested)
+      return SIGNAL_DRAIN;
+    if (upgrade_requested) {
+      upgrade_requested = 0; // Another one may follow if this one fails
+      return SIGNAL_UPGRADE;
+    }
+    sigsuspend(old_mask);
+  }
+}
+
+// Function to wait for a SIGINT while draining
+void wait_for_stop(int timeout_ms) {
+  // The signals stay blocked, so sigtimedwait() takes them without the
+  // handler running
+  sigset_t mask;
+  shutdown_signal_set(&mask);
+  struct timespec timeout = {timeout_ms / 1000,
+                             (long)(timeout_ms % 1000) * 1000000L};
+  if (sigtimedwait(&mask, NULL, &timeout) == SIGINT) {
+    fprintf(stderr, "\nSIGINT received. Cutting the drain short...\n");
+    keep_running = 0;
+  }
+}
@@ -0,0 +1,311 @@
+#include "../include/static_files.h"
+#include "../include/compress.h" // For compress_negotiate
+#include "../include/config.h"   // For FILE_PATH_MAX
+
+#include <errno.h>   // For errno, EISDIR
+#include <stdio.h>   // For snprintf
+#include <string.h>  // For memcpy, memcmp, strlen
+#include <strings.h> // For strncasecmp
+
+typedef struct {
+  int partial;     // A satisfiable Range was asked for
+  int unsatisfied; // The Range lies outside the file
+  off_t first;     // First byte of the range
+  off_t length;    // Bytes in the range
+} ByteRange;
+
+static int hex_value(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+// Map the route onto a path relative to the document root: percent escapes
+// are decoded, repeated slashes collapsed and a trailing slash names the
+// directory's index.html. Routes with "." or ".." segments or a NUL byte are
+// refused. Returns the path length or -1.
+static int map_route(StringView route, char *path, size_t size) {
+  size_t len = 0;
+  size_t segment = 0; // Start of the current segment in 'path'
+  for (size_t i = 0; i < route.len; ++i) {
+    char c = route.ptr[i];
+    if (c == '%') {
+      int hi = i + 2 < route.len ? hex_value(route.ptr[i + 1]) : -1;
+      int lo = i + 2 < route.len ? hex_value(route.ptr[i + 2]) : -1;
+      if (hi < 0 || lo < 0 || (hi == 0 && lo == 0))
+        return -1;
+      c = (char)(hi * 16 + lo);
+      i += 2;
+    }
+    if (c == '/') {
+      // Close the segment before starting a new one
+      size_t seg_len = len - segment;
+      if ((seg_len == 1 && path[segment] == '.') ||
+          (seg_len == 2 && path[segment] == '.' && path[segment + 1] == '.'))
+        return -1;
+      if (len == 0 || path[len - 1] == '/')
+        continue;
+    }
+    if (len + 1 >= size)
+      return -1;
+    path[len++] = c;
+    if (c == '/')
+      segment = len;
+  }
+  size_t seg_len = len - segment;
+  if ((seg_len == 1 && path[segment] == '.') ||
+      (seg_len == 2 && path[segment] == '.' && path[segment + 1] == '.'))
+    return -1;
+  if (len == 0 || path[len - 1] == '/') {
+    if (len + sizeof("index.html") > size)
+      return -1;
+    memcpy(path + len, "index.html", sizeof("index.html"));
+    return (int)(len + strlen("index.html"));
+  }
+  path[len] = '\0';
+  return (int)len;
+}
+
+// Check an If-None-Match list against the entry's ETag. The comparison is
+// weak, as the header requires: a W/ prefix is ignored.
+static int etag_list_matches(StringView list, const FileEntry *entry) {
+  size_t i = 0;
+  while (i < list.len) {
+    while (i < list.len && (list.ptr[i] == ' ' || list.ptr[i] == '\t' ||
+                            list.ptr[i] == ','))
+      i++;
+    size_t start = i;
+    while (i < list.len && list.ptr[i] != ',')
+      i++;
+    size_t end = i;
+    while (end > start &&
+           (list.ptr[end - 1] == ' ' || list.ptr[end - 1] == '\t'))
+      end--;
+    StringView tag = {list.ptr + start, end - start};
+    if (tag.len == 1 && tag.ptr[0] == '*')
+      return 1;
+    if (tag.len > 2 && tag.ptr[0] == 'W' && tag.ptr[1] == '/') {
+      tag.ptr += 2;
+      tag.len -= 2;
+    }
+    if (tag.len == entry->etag_len &&
+        memcmp(tag.ptr, entry->etag, tag.len) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+// Decide whether the client's cached copy is still current
+static int not_modified(const ClientRequest *C, const FileEntry *entry) {
+  const HttpHeader *inm = findHeader(C, "If-None-Match");
+  if (inm)
+    return etag_list_matches(inm->value, entry);
+  // If-Modified-Since only counts when there is no If-None-Match
+  const HttpHeader *ims = findHeader(C, "If-Modified-Since");
+  time_t since;
+  if (ims && parseHttpDate(ims->value, &since) == 0)
+    return entry->mtime <= since;
+  return 0;
+}
+
+// Parse a decimal byte position. Returns -1 if there are no digits or the
+// value overflows.
+static int parse_position(const char **p, const char *end, off_t *out) {
+  const char *start = *p;
+  unsigned long long value = 0;
+  while (*p < end && **p >= '0' && **p <= '9') {
+    if (value > (1ull << 62) / 10)
+      return -1;
+    value = value * 10 + (unsigned long long)(**p - '0');
+    (*p)++;
+  }
+  if (*p == start)
+    return -1;
+  *out = (off_t)value;
+  return 0;
+}
+
+// Work out the byte range to send. Only a single range is supported: a
+// request for several (or a malformed one) gets the whole file, which the
+// specification allows.
+static ByteRange parse_range(const ClientRequest *C, const FileEntry *entry) {
+  ByteRange range = {0, 0, 0, entry->size};
+  const HttpHeader *header = findHeader(C, "Range");
+  if (!header || C->http_method != HTTP_METHOD_GET)
+    return range;
+
+  // A Range guarded by If-Range only applies while the file still has the
+  // validator the client saw
+  const HttpHeader *if_range = findHeader(C, "If-Range");
+  if (if_range) {
+    StringView v = if_range->value;
+    int same = v.len && v.ptr[0] == '"'
+                   ? v.len == entry->etag_len &&
+                         memcmp(v.ptr, entry->etag, v.len) == 0
+                   : v.len == entry->last_modified_len &&
+                         memcmp(v.ptr, entry->last_modified, v.len) == 0;
+    if (!same)
+      return range;
+  }
+
+  StringView v = header->value;
+  if (v.len < 6 || strncasecmp(v.ptr, "bytes=", 6) != 0 ||
+      memchr(v.ptr, ',', v.len))
+    return range;
+  const char *p = v.ptr + 6;
+  const char *end = v.ptr + v.len;
+  off_t first = 0, last = entry->size - 1;
+  if (p < end && *p == '-') {
+    // Suffix range: the last N bytes
+    p++;
+    off_t suffix;
+    if (parse_position(&p, end, &suffix) < 0 || p != end)
+      return range;
+    if (suffix == 0) {
+      range.unsatisfied = 1;
+      return range;
+    }
+    first = suffix < entry->size ? entry->size - suffix : 0;
+  } else {
+    if (parse_position(&p, end, &first) < 0 || p == end || *p != '-')
+      return range;
+    p++;
+    if (p < end) {
+      if (parse_position(&p, end, &last) < 0 || p != end || last < first)
+        return range;
+      if (last >= entry->size)
+        last = entry->size - 1;
+    }
+    if (first >= entry->size) {
+      range.unsatisfied = 1;
+      return range;
+    }
+  }
+  range.partial = 1;
+  range.first = first;
+  range.length = last - first + 1;
+  return range;
+}
+
+// Queue the head of a file response: the status line, header lines taken
+// from the cache entry, extra lines from the arena, the Date and connection
+// headers and the blank line. Every part but the Date line is referenced,
+// not copied.
+static int queue_file_head(Connection *conn, const char *status_line,
+                           const char *headers, size_t headers_len,
+                           const char *extra, ConnectionMode mode) {
+  StringView date = dateHeader(conn->responses);
+  const char *connection_header = connectionHeader(mode);
+  conn->status = (uint16_t)responseStatus(status_line);
+  if (queue_reference(conn, status_line, strlen(status_line)) < 0 ||
+      queue_reference(conn, headers, headers_len) < 0 ||
+      (extra && queue_reference(conn, extra, strlen(extra)) < 0) ||
+      queue_response(conn, date.ptr, date.len) < 0 ||
+      queue_reference(conn, connection_header, strlen(connection_header)) <
+          0 ||
+      queue_reference(conn, "\r\n", 2) < 0)
+    return -1;
+  return 0;
+}
+
+// Hand the entry over to the connection once the head is queued
+static int attach_entry(Connection *conn, FileEntry *entry, int rc,
+                        off_t offset, size_t len) {
+  if (rc < 0 || queue_file(conn, entry, offset, len) < 0) {
+    file_cache_release(entry);
+    return -1;
+  }
+  return STATIC_SERVED;
+}
+
+int serve_static_file(Connection *conn, const ClientRequest *C,
+                      ConnectionMode mode) {
+  if (!conn->files)
+    return STATIC_NOT_FOUND;
+  char path[FILE_PATH_MAX];
+  int path_len = map_route(C->route, path, sizeof(path));
+  if (path_len < 0)
+    return STATIC_NOT_FOUND;
+
+  FileEntry *entry = file_cache_open(conn->files, path);
+  if (!entry && errno == EISDIR &&
+      (size_t)path_len + sizeof("/index.html") <= sizeof(path)) {
+    memcpy(path + path_len, "/index.html", sizeof("/index.html"));
+    entry = file_cache_open(conn->files, path);
+  }
+  if (!entry)
+    return STATIC_NOT_FOUND;
+
+  // The response refers to the entry's headers (and maybe its mapping), so
+  // the connection holds the reference until it has been written
+  int head_only = C->http_method == HTTP_METHOD_HEAD;
+  int rc;
+  if (not_modified(C, entry)) {
+    rc = queue_file_head(conn, "HTTP/1.1 304 Not Modified\r\n",
+                         entry->headers, entry->validators_len, NULL,
+                         mode);
+    return attach_entry(conn, entry, rc, 0, 0);
+  }
+
+  ByteRange range = parse_range(C, entry);
+  if (range.unsatisfied) {
+    char *extra = arena_alloc(&conn->arena, 96);
+    if (!extra) {
+      file_cache_release(entry);
+      return -1;
+    }
+    snprintf(extra, 96, "Content-Range: bytes */%llu\r\nContent-Length: 0\r\n",
+             (unsigned long long)entry->size);
+    rc = queue_file_head(conn, "HTTP/1.1 416 Range Not Satisfiable\r\n",
+                         entry->headers, entry->validators_len, extra,
+                         mode);
+    return attach_entry(conn, entry, rc, 0, 0);
+  }
+
+  // A client that takes a compressed body gets the variant kept with the
+  // entry; ranges are only served from the file as it is
+  const FileVariant *variant = NULL;
+  if (!range.partial && entry->compressible && conn->compressor)
+    variant = file_cache_variant(conn->files, entry, compress_negotiate(C),
+                                 conn->compressor);
+  if (variant) {
+    rc = queue_file_head(conn, "HTTP/1.1 200 OK\r\n", variant->headers,
+                         variant->headers_len, NULL, mode);
+    if (rc == 0)
+      rc = queue_reference(conn, variant->body,
+                           head_only ? 0 : variant->body_len);
+    return attach_entry(conn, entry, rc, 0, 0);
+  }
+
+  if (range.partial) {
+    char *extra = arena_alloc(&conn->arena, 128);
+    if (!extra) {
+      file_cache_release(entry);
+      return -1;
+    }
+    snprintf(extra, 128,
+             "Content-Range: bytes %llu-%llu/%llu\r\nContent-Length: %llu\r\n",
+             (unsigned long long)range.first,
+             (unsigned long long)(range.first + range.length - 1),
+             (unsigned long long)entry->size,
+             (unsigned long long)range.length);
+    rc = queue_file_head(conn, "HTTP/1.1 206 Partial Content\r\n",
+                         entry->headers, entry->common_len, extra,
+                         mode);
+  } else {
+    rc = queue_file_head(conn, "HTTP/1.1 200 OK\r\n", entry->headers,
+                         entry->headers_len, NULL, mode);
+  }
+
+  size_t body_len = head_only ? 0 : (size_t)range.length;
+  if (rc == 0 && entry->map) {
+    // Hot file: the body joins the head in the same sendmsg()
+    rc = queue_reference(conn, entry->map + range.first, body_len);
+    body_len = 0;
+  }
+  return attach_entry(conn, entry, rc, range.first, body_len);
+}
@@ -0,0 +1,124 @@
+#include "../include/timer_wheel.h"
+
+#include <string.h> // For memset
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+
+_Static_assert((TIMER_WHEEL_SLOTS & SLOT_MASK) == 0 &&
+                   TIMER_WHEEL_SLOTS % 64 == 0,
+               "TIMER_WHEEL_SLOTS is a power of two of at least 64");
+
+void timer_wheel_init(TimerWheel *wheel, uint64_t now) {
+  memset(wheel, 0, sizeof(*wheel));
+  wheel->now = now;
+}
+
+// The tick whose slot a timer due at 'deadline' goes into: never one that
+// has been processed, never beyond the wheel's span
+static uint64_t slot_tick_for(const TimerWheel *wheel, uint64_t deadline) {
+  if (deadline <= wheel->now)
+    return wheel->now + 1;
+  if (deadline - wheel->now >= TIMER_WHEEL_SLOTS)
+    return wheel->now + TIMER_WHEEL_SLOTS - 1;
+  return deadline;
+}
+
+static void link_timer(TimerWheel *wheel, Timer *t, uint64_t slot_tick) {
+  size_t slot = (size_t)(slot_tick & SLOT_MASK);
+  t->slot_tick = slot_tick;
+  t->prev = NULL;
+  t->next = wheel->slots[slot];
+  if (t->next)
+    t->next->prev = t;
+  wheel->slots[slot] = t;
+  wheel->occupied[slot / 64] |= 1ull << (slot % 64);
+  wheel->count++;
+}
+
+static void unlink_timer(TimerWheel *wheel, Timer *t) {
+  size_t slot = (size_t)(t->slot_tick & SLOT_MASK);
+  if (t->prev)
+    t->prev->next = t->next;
+  else
+    wheel->slots[slot] = t->next;
+  if (t->next)
+    t->next->prev = t->prev;
+  if (!wheel->slots[slot])
+    wheel->occupied[slot / 64] &= ~(1ull << (slot % 64));
+  t->slot_tick = 0;
+  t->prev = t->next = NULL;
+  wheel->count--;
+}
+
+void timer_wheel_arm(TimerWheel *wheel, Timer *t, uint64_t deadline) {
+  t->deadline = deadline;
+  uint64_t slot_tick = slot_tick_for(wheel, deadline);
+  if (t->slot_tick != 0) {
+    // Still linked early enough: the slot moves the timer on when it comes
+    // up, so the common re-arm is this one store and compare
+    if (t->slot_tick <= slot_tick)
+      return;
+    unlink_timer(wheel, t);
+  }
+  link_timer(wheel, t, slot_tick);
+}
+
+void timer_wheel_cancel(TimerWheel *wheel, Timer *t) {
+  if (t->slot_tick != 0)
+    unlink_timer(wheel, t);
+}
+
+uint64_t timer_wheel_next(const TimerWheel *wheel) {
+  if (wheel->count == 0)
+    return 0;
+  // Slots are visited in tick order starting after 'now', so the first
+  // set bit from there on, wrapping around, is the earliest
+  size_t start = (size_t)((wheel->now + 1) & SLOT_MASK);
+  for (size_t i = 0; i <= TIMER_WHEEL_SLOTS / 64; ++i) {
+    size_t word = (start / 64 + i) % (TIMER_WHEEL_SLOTS / 64);
+    uint64_t bits = wheel->occupied[word];
+    if (i == 0)
+      bits &= ~0ull << (start % 64); // Slots before 'start' come last
+    else if (i == TIMER_WHEEL_SLOTS / 64)
+      bits &= (1ull << (start % 64)) - 1;
+    if (bits) {
+      size_t slot = word * 64 + (size_t)__builtin_ctzll(bits);
+      return wheel->now + 1 + ((slot - start) & SLOT_MASK);
+    }
+  }
+  return 0;
+}
+
+Timer *timer_wheel_advance(TimerWheel *wheel, uint64_t now) {
+  Timer *expired = NULL;
+  Timer **tail = &expired;
+  for (;;) {
+    // Jump straight to the next slot that holds anything
+    uint64_t tick = timer_wheel_next(wheel);
+    if (tick == 0 || tick > now)
+      break;
+    wheel->now = tick;
+    size_t slot = (size_t)(tick & SLOT_MASK);
+    Timer *t = wheel->slots[slot];
+    wheel->slots[slot] = NULL;
+    wheel->occupied[slot / 64] &= ~(1ull << (slot % 64));
+    while (t) {
+      Timer *next = t->next;
+      wheel->count--;
+      if (t->deadline <= tick) {
+        t->slot_tick = 0;
+        t->prev = NULL;
+        t->next = NULL;
+        *tail = t;
+        tail = &t->next;
+      } else {
+        // Re-armed since it was linked, or beyond the span: move it on
+        link_timer(wheel, t, slot_tick_for(wheel, t->deadline));
+      }
+      t = next;
+    }
+  }
+  if (now > wheel->now)
+    wheel->now = now;
+  return expired;
+}
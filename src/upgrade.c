@@ -0,0 +1,218 @@
+// pipe2() is a Linux extension
+#define _GNU_SOURCE
+#include "../include/upgrade.h"
+#include "../include/config.h" // For MAX_WORKERS, UPGRADE_TIMEOUT_MS
+
+#include <errno.h>      // For errno, EINTR
+#include <fcntl.h>      // For fcntl, F_SETFD, FD_CLOEXEC, O_CLOEXEC
+#include <limits.h>     // For PATH_MAX
+#include <poll.h>       // For poll, POLLIN
+#include <signal.h>     // For kill, sigprocmask, SIGKILL
+#include <stdio.h>      // For fprintf, snprintf
+#include <stdlib.h>     // For getenv, unsetenv, realpath, strtol, malloc
+#include <string.h>     // For strchr, strerror, strncmp
+#include <sys/socket.h> // For getsockopt, SO_ACCEPTCONN
+#include <sys/wait.h>   // For waitpid
+#include <unistd.h>     // For fork, execve, pipe2, readlink, close
+
+extern char **environ;
+
+// The binary and arguments this process was started with
+static char exe_path[PATH_MAX];
+static char **exe_argv;
+
+// Listening sockets handed down by the parent, by worker index; -1 where
+// the parent had none or it is not listening
+static int inherited[MAX_WORKERS];
+static int inherited_count;
+static int inherited_taken[MAX_WORKERS];
+static int ready_fd = -1;
+
+// A descriptor from the environment, or -1 if 'text' does not name one
+static int parse_fd(const char *text, char **end) {
+  long fd = strtol(text, end, 10);
+  if (*end == text || fd < 0 || fd > INT_MAX)
+    return -1;
+  return (int)fd;
+}
+
+// The list holds one entry per worker, so a worker's socket keeps its
+// index: "-1" marks a worker the parent had no socket for
+static void take_inherited(void) {
+  const char *list = getenv(UPGRADE_LISTEN_FDS_ENV);
+  while (list && *list && inherited_count < MAX_WORKERS) {
+    char *end;
+    int fd = -1;
+    if (strncmp(list, "-1", 2) == 0) {
+      end = (char *)list + 2;
+    } else if ((fd = parse_fd(list, &end)) < 0) {
+      break;
+    }
+    // Only sockets still listening are used; close-on-exec again, so they
+    // are not passed on by accident
+    if (fd >= 0) {
+      int listening = 0;
+      socklen_t len = sizeof(listening);
+      if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) == 0 &&
+          listening)
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+      else
+        fd = -1;
+    }
+    inherited[inherited_count++] = fd;
+    list = *end == ',' ? end + 1 : end;
+  }
+  const char *ready = getenv(UPGRADE_READY_FD_ENV);
+  if (ready) {
+    char *end;
+    ready_fd = parse_fd(ready, &end);
+    if (ready_fd >= 0)
+      fcntl(ready_fd, F_SETFD, FD_CLOEXEC);
+  }
+  // A later upgrade of this process sets them afresh
+  unsetenv(UPGRADE_LISTEN_FDS_ENV);
+  unsetenv(UPGRADE_READY_FD_ENV);
+}
+
+int upgrade_init(char *argv[]) {
+  exe_argv = argv;
+  // The path is resolved now: the working directory is the one the
+  // relative path was given for, and /proc/self/exe would keep naming the
+  // old file once it has been replaced
+  if (strchr(argv[0], '/')) {
+    if (!realpath(argv[0], exe_path)) {
+      fprintf(stderr, "Failed to resolve %s: %s\n", argv[0],
+              strerror(errno));
+      return -1;
+    }
+  } else {
+    ssize_t len = readlink("/proc/self/exe", exe_path, sizeof(exe_path) - 1);
+    if (len < 0) {
+      fprintf(stderr, "Failed to resolve /proc/self/exe: %s\n",
+              strerror(errno));
+      return -1;
+    }
+    exe_path[len] = '\0';
+  }
+  take_inherited();
+  return 0;
+}
+
+int upgrade_listener(int index) {
+  if (index >= inherited_count || inherited[index] < 0)
+    return -1;
+  inherited_taken[index] = 1;
+  return inherited[index];
+}
+
+void upgrade_ready(void) {
+  for (int i = 0; i < inherited_count; ++i) {
+    if (inherited[i] >= 0 && !inherited_taken[i])
+      close(inherited[i]);
+  }
+  if (ready_fd < 0)
+    return;
+  if (write(ready_fd, "1", 1) != 1)
+    fprintf(stderr, "Failed to notify the old process: %s\n",
+            strerror(errno));
+  close(ready_fd);
+  ready_fd = -1;
+}
+
+// The environment of the new process: ours without stale upgrade
+// variables, plus 'listen' and 'ready'. Returns a malloc'ed array.
+static char **upgrade_environment(char *listen, char *ready) {
+  size_t count = 0;
+  while (environ[count])
+    count++;
+  char **env = malloc((count + 3) * sizeof(*env));
+  if (!env)
+    return NULL;
+  size_t n = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (strncmp(environ[i], UPGRADE_LISTEN_FDS_ENV "=",
+                sizeof(UPGRADE_LISTEN_FDS_ENV)) != 0 &&
+        strncmp(environ[i], UPGRADE_READY_FD_ENV "=",
+                sizeof(UPGRADE_READY_FD_ENV)) != 0)
+      env[n++] = environ[i];
+  }
+  env[n++] = listen;
+  env[n++] = ready;
+  env[n] = NULL;
+  return env;
+}
+
+// Wait for the new process to report that it serves. Returns 0 if it did.
+static int wait_until_ready(int fd) {
+  struct pollfd pfd = {.fd = fd, .events = POLLIN};
+  int n;
+  do {
+    n = poll(&pfd, 1, UPGRADE_TIMEOUT_MS);
+  } while (n < 0 && errno == EINTR);
+  char byte;
+  return n == 1 && read(fd, &byte, 1) == 1 ? 0 : -1;
+}
+
+int upgrade_binary(const Worker *workers, int count) {
+  char listen[sizeof(UPGRADE_LISTEN_FDS_ENV) + MAX_WORKERS * 12];
+  size_t len = (size_t)snprintf(listen, sizeof(listen), "%s=",
+                                UPGRADE_LISTEN_FDS_ENV);
+  // Every worker gets an entry, -1 if it has no socket, so the new
+  // process hands each socket to the worker of the same index
+  for (int i = 0; i < count; ++i) {
+    len += (size_t)snprintf(listen + len, sizeof(listen) - len, "%s%d",
+                            i > 0 ? "," : "",
+                            workers[i].server_fd >= 0 ? workers[i].server_fd
+                                                      : -1);
+  }
+  int pipe_fds[2];
+  if (pipe2(pipe_fds, O_CLOEXEC) < 0) {
+    fprintf(stderr, "pipe2 failed: %s\n", strerror(errno));
+    return -1;
+  }
+  char ready[sizeof(UPGRADE_READY_FD_ENV) + 16];
+  snprintf(ready, sizeof(ready), "%s=%d", UPGRADE_READY_FD_ENV, pipe_fds[1]);
+  char **env = upgrade_environment(listen, ready);
+  if (!env) {
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    return -1;
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    // Only async-signal-safe calls from here on: other threads may have
+    // held locks at the fork. The new binary starts with no signal
+    // blocked and keeps exactly the descriptors it is told about.
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+    for (int i = 0; i < count; ++i) {
+      if (workers[i].server_fd >= 0)
+        fcntl(workers[i].server_fd, F_SETFD, 0);
+    }
+    fcntl(pipe_fds[1], F_SETFD, 0);
+    execve(exe_path, exe_argv, env);
+    _exit(127);
+  }
+  free(env);
+  close(pipe_fds[1]);
+  if (pid < 0) {
+    fprintf(stderr, "fork failed: %s\n", strerror(errno));
+    close(pipe_fds[0]);
+    return -1;
+  }
+
+  int rc = wait_until_ready(pipe_fds[0]);
+  close(pipe_fds[0]);
+  if (rc < 0) {
+    fprintf(stderr, "%s (pid %d) did not start serving, keeping on.\n",
+            exe_path, (int)pid);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return -1;
+  }
+  printf("%s (pid %d) is serving, draining this process.\n", exe_path,
+         (int)pid);
+  return 0;
+}
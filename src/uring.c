@@ -0,0 +1,283 @@
+// syscall(), MAP_ANONYMOUS and MAP_POPULATE are not part of POSIX
+#define _GNU_SOURCE
+#include "../include/uring.h"
+
+#include <errno.h>       // For errno, ENOMEM, ETIME, EINTR
+#include <stdlib.h>      // For calloc, free
+#include <string.h>      // For memset
+#include <sys/mman.h>    // For mmap, munmap
+#include <sys/syscall.h> // For SYS_io_uring_setup, SYS_io_uring_enter
+#include <unistd.h>      // For syscall, close
+
+// The kernel reads the SQ tail and writes the CQ tail concurrently, so the
+// indices shared with it are accessed with acquire/release semantics
+#define load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+  return (int)syscall(SYS_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete,
+                     unsigned flags, const void *arg, size_t size) {
+  return (int)syscall(SYS_io_uring_enter, fd, to_submit, min_complete, flags,
+                      arg, size);
+}
+
+static int sys_register(int fd, unsigned opcode, const void *arg,
+                        unsigned nr) {
+  return (int)syscall(SYS_io_uring_register, fd, opcode, arg, nr);
+}
+
+// Create the ring with the cheapest completion handling the kernel offers:
+// deferred task work runs completions only inside io_uring_enter(), on the
+// worker's own thread. Older kernels fall back step by step.
+static int setup_ring(unsigned entries, int sqpoll,
+                      struct io_uring_params *p) {
+  static const unsigned attempts[] = {
+      IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+      IORING_SETUP_COOP_TASKRUN,
+      0,
+  };
+  for (size_t i = 0; i < sizeof(attempts) / sizeof(attempts[0]); ++i) {
+    memset(p, 0, sizeof(*p));
+    // The submission queue thread runs on its own, so deferring work to
+    // the submitter does not apply
+    p->flags = sqpoll ? IORING_SETUP_SQPOLL : attempts[i];
+    if (sqpoll)
+      p->sq_thread_idle = 1000;
+    int fd = sys_setup(entries, p);
+    if (fd >= 0 || errno != EINVAL || sqpoll)
+      return fd < 0 ? -errno : fd;
+  }
+  return -EINVAL;
+}
+
+int uring_init(Uring *ring, unsigned entries, int sqpoll) {
+  memset(ring, 0, sizeof(*ring));
+  struct io_uring_params p;
+  ring->fd = setup_ring(entries, sqpoll, &p);
+  if (ring->fd < 0) {
+    int err = ring->fd;
+    ring->fd = -1;
+    return err;
+  }
+  ring->flags = p.flags;
+  ring->features = p.features;
+
+  ring->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cq_map_size =
+      p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  // Kernels with a single mapping for both rings size it for the larger one
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_map_size > ring->sq_map_size)
+      ring->sq_map_size = ring->cq_map_size;
+    ring->cq_map_size = ring->sq_map_size;
+  }
+  ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_map == MAP_FAILED) {
+    ring->sq_map = NULL;
+    goto fail;
+  }
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cq_map = ring->sq_map;
+  } else {
+    ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_CQ_RING);
+    if (ring->cq_map == MAP_FAILED) {
+      ring->cq_map = NULL;
+      goto fail;
+    }
+  }
+  ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    goto fail;
+  }
+
+  char *sq = ring->sq_map;
+  ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  ring->sq_flags = (unsigned *)(sq + p.sq_off.flags);
+  ring->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+  ring->sq_entries = p.sq_entries;
+  // SQEs are always used in ring order, so the indirection array is set up
+  // once as the identity
+  unsigned *array = (unsigned *)(sq + p.sq_off.array);
+  for (unsigned i = 0; i < p.sq_entries; ++i)
+    array[i] = i;
+  ring->sqe_tail = ring->sqe_published = *ring->sq_tail;
+
+  char *cq = ring->cq_map;
+  ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  ring->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return 0;
+
+fail:;
+  int err = -errno;
+  uring_destroy(ring);
+  return err;
+}
+
+void uring_destroy(Uring *ring) {
+  if (ring->sqes)
+    munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_map && ring->cq_map != ring->sq_map)
+    munmap(ring->cq_map, ring->cq_map_size);
+  if (ring->sq_map)
+    munmap(ring->sq_map, ring->sq_map_size);
+  if (ring->fd >= 0)
+    close(ring->fd);
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = -1;
+}
+
+int uring_supports(const Uring *ring, const uint8_t *ops, size_t count) {
+  size_t size = sizeof(struct io_uring_probe) +
+                256 * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = calloc(1, size);
+  if (!probe)
+    return 0;
+  int supported =
+      sys_register(ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+  for (size_t i = 0; supported && i < count; ++i) {
+    supported = ops[i] <= probe->last_op &&
+                (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+  }
+  free(probe);
+  return supported;
+}
+
+// Make the SQEs filled so far visible to the kernel
+static unsigned publish(Uring *ring) {
+  unsigned pending = ring->sqe_tail - ring->sqe_published;
+  if (pending)
+    store_release(ring->sq_tail, ring->sqe_tail);
+  ring->sqe_published = ring->sqe_tail;
+  return pending;
+}
+
+// Enter the kernel to submit and, with 'wait_nr', to collect completions
+static int enter(Uring *ring, unsigned wait_nr, int timeout_ms) {
+  unsigned to_submit = publish(ring);
+  unsigned flags = 0;
+  if (ring->flags & IORING_SETUP_SQPOLL) {
+    // The polling thread picks the entries up itself unless it went to
+    // sleep. The fence orders the tail store before reading its flags.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (load_acquire(ring->sq_flags) & IORING_SQ_NEED_WAKEUP)
+      flags |= IORING_ENTER_SQ_WAKEUP;
+    else if (wait_nr == 0)
+      return 0;
+  }
+  if (wait_nr)
+    flags |= IORING_ENTER_GETEVENTS;
+  struct __kernel_timespec ts = {.tv_sec = timeout_ms / 1000,
+                                 .tv_nsec = (timeout_ms % 1000) * 1000000L};
+  struct io_uring_getevents_arg arg = {.ts = (uint64_t)(uintptr_t)&ts};
+  const void *argp = NULL;
+  size_t argsz = 0;
+  if (wait_nr && timeout_ms >= 0) {
+    flags |= IORING_ENTER_EXT_ARG;
+    argp = &arg;
+    argsz = sizeof(arg);
+  }
+  int rc = sys_enter(ring->fd, to_submit, wait_nr, flags, argp, argsz);
+  if (rc >= 0 || errno == ETIME || errno == EINTR)
+    return 0;
+  return -errno;
+}
+
+struct io_uring_sqe *uring_get_sqe(Uring *ring) {
+  if (ring->sqe_tail - load_acquire(ring->sq_head) >= ring->sq_entries) {
+    if (enter(ring, 0, -1) < 0 ||
+        ring->sqe_tail - load_acquire(ring->sq_head) >= ring->sq_entries)
+      return NULL;
+  }
+  struct io_uring_sqe *sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+  ring->sqe_tail++;
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+int uring_submit_and_wait(Uring *ring, unsigned wait_nr, int timeout_ms) {
+  return enter(ring, wait_nr, timeout_ms);
+}
+
+struct io_uring_cqe *uring_peek_cqe(Uring *ring) {
+  unsigned head = *ring->cq_head;
+  if (head == load_acquire(ring->cq_tail))
+    return NULL;
+  return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(Uring *ring) {
+  store_release(ring->cq_head, *ring->cq_head + 1);
+}
+
+int uring_buffers_init(Uring *ring, UringBuffers *buffers, uint16_t group,
+                       unsigned count, unsigned size) {
+  memset(buffers, 0, sizeof(*buffers));
+  buffers->ring_size = count * sizeof(struct io_uring_buf);
+  buffers->ring = mmap(NULL, buffers->ring_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buffers->ring == MAP_FAILED) {
+    buffers->ring = NULL;
+    return -errno;
+  }
+  buffers->memory = malloc((size_t)count * size);
+  if (!buffers->memory) {
+    munmap(buffers->ring, buffers->ring_size);
+    buffers->ring = NULL;
+    return -ENOMEM;
+  }
+  buffers->count = count;
+  buffers->size = size;
+  buffers->group = group;
+
+  struct io_uring_buf_reg reg = {
+      .ring_addr = (uint64_t)(uintptr_t)buffers->ring,
+      .ring_entries = count,
+      .bgid = group,
+  };
+  if (sys_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    int err = -errno;
+    free(buffers->memory);
+    munmap(buffers->ring, buffers->ring_size);
+    memset(buffers, 0, sizeof(*buffers));
+    return err;
+  }
+  for (unsigned id = 0; id < count; ++id)
+    uring_buffers_recycle(buffers, (uint16_t)id);
+  uring_buffers_commit(buffers);
+  return 0;
+}
+
+void uring_buffers_destroy(Uring *ring, UringBuffers *buffers) {
+  if (!buffers->ring)
+    return;
+  struct io_uring_buf_reg reg = {.bgid = buffers->group};
+  sys_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+  free(buffers->memory);
+  munmap(buffers->ring, buffers->ring_size);
+  memset(buffers, 0, sizeof(*buffers));
+}
+
+void uring_buffers_recycle(UringBuffers *buffers, uint16_t id) {
+  struct io_uring_buf *buf =
+      &buffers->ring->bufs[buffers->tail & (buffers->count - 1)];
+  buf->addr = (uint64_t)(uintptr_t)uring_buffer(buffers, id);
+  buf->len = buffers->size;
+  buf->bid = id;
+  buffers->tail++;
+}
+
+void uring_buffers_commit(UringBuffers *buffers) {
+  store_release(&buffers->ring->tail, buffers->tail);
+}
@@ -0,0 +1,604 @@
+#include "../include/uring_loop.h"
+#include "../include/config.h"         // For URING_*
+#include "../include/proxy.h"          // For Upstream, proxy_upstream_ready
+#include "../include/server.h"         // For handle_client
+#include "../include/signal_handler.h" // For keep_running, draining
+#include "../include/uring.h"          // For Uring, UringBuffers
+
+#include <errno.h>      // For errno, EAGAIN, ECANCELED, ENOBUFS
+#include <poll.h>       // For POLLIN, POLLOUT
+#include <stdint.h>     // For uint16_t, uint64_t, uintptr_t
+#include <stdio.h>      // For fprintf
+#include <stdlib.h>     // For calloc, free
+#include <string.h>     // For memcpy, strerror
+#include <sys/socket.h> // For shutdown, SOCK_NONBLOCK, MSG_NOSIGNAL
+#include <unistd.h>     // For close, read
+
+// user_data of the operations that are not tied to a connection. Those
+// that are carry the Connection's address, with the kind of operation in
+// the low bits; the poll of a proxy upstream carries the Upstream's.
+#define TAG_ACCEPT 1
+#define TAG_WAKE 2
+#define TAG_INOTIFY 3
+#define TAG_CANCEL_ACCEPT 4
+#define TAG_CANCEL_UPSTREAM 5
+#define OP_RECV 0
+#define OP_SEND 1
+#define OP_POLL 2
+#define OP_CANCEL 3
+#define OP_UPSTREAM 4
+#define OP_MASK 7
+
+struct UringLoopStruct {
+  Uring ring;
+  UringBuffers buffers;
+  // Received buffers wait on their connection in arrival order
+  uint16_t held_next[URING_BUFFER_COUNT]; // Next buffer of the same chain
+  uint32_t held_len[URING_BUFFER_COUNT];  // Bytes received into the buffer
+  unsigned held;       // Buffers held by connections
+  int starved;         // A receive stopped for lack of buffers
+  int accept_armed;    // The multishot accept is active
+  Connection *closing; // Closed connections with operations in flight
+};
+
+static uint64_t conn_data(const Connection *conn, unsigned op) {
+  return (uint64_t)(uintptr_t)conn | op;
+}
+
+static struct io_uring_sqe *next_sqe(UringLoop *U) {
+  struct io_uring_sqe *sqe = uring_get_sqe(&U->ring);
+  if (!sqe)
+    fprintf(stderr, "io_uring submission queue is full.\n");
+  return sqe;
+}
+
+// One accept keeps producing a completion per client until it fails
+static int arm_accept(UringLoop *U, int server_fd) {
+  struct io_uring_sqe *sqe = next_sqe(U);
+  if (!sqe)
+    return -1;
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = server_fd;
+  sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->user_data = TAG_ACCEPT;
+  U->accept_armed = 1;
+  return 0;
+}
+
+// Stop the multishot accept, for a drain
+static int cancel_accept(UringLoop *U) {
+  struct io_uring_sqe *sqe = next_sqe(U);
+  if (!sqe)
+    return -1;
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = TAG_ACCEPT;
+  sqe->user_data = TAG_CANCEL_ACCEPT;
+  return 0;
+}
+
+static int arm_poll(UringLoop *U, int fd, unsigned multishot, uint64_t tag) {
+  struct io_uring_sqe *sqe = next_sqe(U);
+  if (!sqe)
+    return -1;
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = POLLIN;
+  sqe->len = multishot ? IORING_POLL_ADD_MULTI : 0;
+  sqe->user_data = tag;
+  return 0;
+}
+
+// The kernel picks a provided buffer for every chunk it receives, so no
+// memory is tied up while the connection is idle
+static int arm_recv(UringLoop *U, Connection *conn) {
+  struct io_uring_sqe *sqe = next_sqe(U);
+  if (!sqe)
+    return -1;
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = conn->fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = U->buffers.group;
+  sqe->user_data = conn_data(conn, OP_RECV);
+  conn->recv_armed = 1;
+  conn->uring_ops++;
+  return 0;
+}
+
+static int cancel_recv(UringLoop *U, Connection *conn) {
+  struct io_uring_sqe *sqe = next_sqe(U);
+  if (!sqe)
+    return -1;
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = conn_data(conn, OP_RECV);
+  sqe->user_data = conn_data(conn, OP_CANCEL);
+  conn->recv_cancelling = 1;
+  conn->uring_ops++;
+  return 0;
+}
+
+// Send every queued segment with one sendmsg. The segments stay locked
+// until it completes, so pipelined responses queued meanwhile start new
+// ones instead of growing these.
+static int submit_send(UringLoop *U, Connection *conn) {
+  struct io_uring_sqe *sqe = next_sqe(U);
+  if (!sqe)
+    return -1;
+  conn->send_msg = (struct msghdr){
+      .msg_iov = conn->out + conn->out_next,
+      .msg_iovlen = conn->out_count - conn->out_next,
+  };
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = conn->fd;
+  sqe->addr = (uint64_t)(uintptr_t)&conn->send_msg;
+  sqe->len = 1;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = conn_data(conn, OP_SEND);
+  conn->out_locked = conn->out_count;
+  conn->send_busy = 1;
+  conn->uring_ops++;
+  return 0;
+}
+
+// Wait for room in the socket, for file bodies sent with sendfile()
+static int submit_pollout(UringLoop *U, Connection *conn) {
+  struct io_uring_sqe *sqe = next_sqe(U);
+  if (!sqe)
+    return -1;
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = conn->fd;
+  sqe->poll32_events = POLLOUT;
+  sqe->user_data = conn_data(conn, OP_POLL);
+  conn->send_busy = 1;
+  conn->uring_ops++;
+  return 0;
+}
+
+static void hold_buffer(UringLoop *U, Connection *conn, uint16_t id,
+                        uint32_t len) {
+  U->held_len[id] = len;
+  if (conn->held_count > 0) {
+    U->held_next[conn->held_tail] = id;
+  } else {
+    conn->held_head = id;
+    conn->held_offset = 0;
+  }
+  conn->held_tail = id;
+  conn->held_count++;
+  U->held++;
+}
+
+// Give the oldest held buffer back to the kernel
+static void drop_held(UringLoop *U, Connection *conn) {
+  uint16_t id = conn->held_head;
+  conn->held_head = U->held_next[id];
+  conn->held_count--;
+  conn->held_offset = 0;
+  U->held--;
+  uring_buffers_recycle(&U->buffers, id);
+}
+
+static void release_held(UringLoop *U, Connection *conn) {
+  while (conn->held_count > 0)
+    drop_held(U, conn);
+}
+
+// Copy held data into the receive buffer as far as it has room. What does
+// not fit stays held and is reported through recv_pending, like unread
+// socket data is under epoll. Returns -1 if there was data but no buffer
+// to copy it to, 0 otherwise.
+static int copy_held(UringLoop *U, Connection *conn) {
+  if (conn->held_count == 0) {
+    conn->recv_pending = 0;
+    return 0;
+  }
+  if (make_input_room(conn) < 0)
+    return -1;
+  size_t copied = 0;
+  while (conn->held_count > 0 && conn->recv_len < conn->recv_size - 1) {
+    uint16_t id = conn->held_head;
+    size_t avail = U->held_len[id] - conn->held_offset;
+    size_t room = conn->recv_size - 1 - conn->recv_len;
+    size_t n = avail < room ? avail : room;
+    memcpy(conn->recv_buffer + conn->recv_len,
+           uring_buffer(&U->buffers, id) + conn->held_offset, n);
+    conn->recv_len += n;
+    conn->held_offset += n;
+    copied += n;
+    if (conn->held_offset == U->held_len[id])
+      drop_held(U, conn);
+  }
+  conn->recv_buffer[conn->recv_len] = '\0';
+  conn->recv_pending = conn->held_count > 0;
+  if (copied > 0)
+    connection_received(conn, copied);
+  return 0;
+}
+
+// Drive one connection forward after one of its operations completed, the
+// way service_connection() does under epoll.
+// Returns -1 when the connection should be closed, 0 otherwise.
+static int drive_connection(UringLoop *U, Connection *conn) {
+  if (conn->lingering) {
+    release_held(U, conn);
+    return conn->peer_closed ? -1 : 0;
+  }
+  for (;;) {
+    if (copy_held(U, conn) < 0)
+      return -1;
+    int handled_any = 0;
+    while ((!conn->close_after_send || httpParserInBody(&conn->parser)) &&
+           connection_has_room(conn)) {
+      int handled = handle_client(conn);
+      if (handled < 0)
+        return -1;
+      if (handled == 0)
+        break;
+      handled_any = 1;
+    }
+    if (conn->send_busy)
+      return 0; // The completion of the send comes back here
+    if (conn->out_bytes > 0)
+      return submit_send(U, conn);
+    // Segments written: send any file body and recycle the output memory
+    int drained = conn->out_count > 0 || conn->file != NULL;
+    int relaying = conn->upstream != NULL;
+    int flushed = flush_connection(conn);
+    if (flushed < 0)
+      return -1;
+    if (flushed == 0)
+      return submit_pollout(U, conn);
+    if (flushed == FLUSH_WAITING) {
+      // The upstream's poll resumes the relay. Only more of a request body
+      // may still be fed to it.
+      if (!handled_any)
+        return 0;
+      continue;
+    }
+    if (conn->close_after_send && !httpParserInBody(&conn->parser)) {
+      if (conn->peer_closed)
+        return -1;
+      linger_connection(conn);
+      release_held(U, conn);
+      return 0;
+    }
+    // Go round again while anything moved: new requests may have become
+    // complete, or a paused body can continue now that the output drained
+    if (!handled_any && !conn->recv_pending && !drained && !relaying)
+      break;
+  }
+  if (conn->peer_closed && conn->held_count == 0)
+    return -1; // Client went away and every complete request was answered
+  return 0;
+}
+
+// Keep a receive armed while the connection can take more data, and stop
+// it while the connection holds too many buffers unread
+static int adjust_recv(UringLoop *U, Connection *conn) {
+  if (conn->recv_armed) {
+    if (conn->held_count >= URING_MAX_HELD && !conn->recv_cancelling)
+      return cancel_recv(U, conn);
+    return 0;
+  }
+  if (conn->peer_closed || conn->recv_starved ||
+      conn->held_count >= URING_MAX_HELD)
+    return 0;
+  return arm_recv(U, conn);
+}
+
+static void finish_closing(UringLoop *U, Connection *conn) {
+  if (conn->prev)
+    conn->prev->next = conn->next;
+  else
+    U->closing = conn->next;
+  if (conn->next)
+    conn->next->prev = conn->prev;
+  free_connection(conn);
+}
+
+void uring_close_connection(UringLoop *U, Connection *conn) {
+  release_held(U, conn);
+  if (conn->uring_ops == 0) {
+    free_connection(conn);
+    return;
+  }
+  // Shutting the socket down makes pending sends fail and ends the
+  // receive, so the remaining completions arrive promptly
+  conn->closing = 1;
+  shutdown(conn->fd, SHUT_RDWR);
+  if (conn->recv_armed && !conn->recv_cancelling)
+    cancel_recv(U, conn);
+  conn->prev = NULL;
+  conn->next = U->closing;
+  if (U->closing)
+    U->closing->prev = conn;
+  U->closing = conn;
+}
+
+static void complete_connection(EventLoop *loop, UringLoop *U,
+                                 const struct io_uring_cqe *cqe) {
+  Connection *conn = (Connection *)(uintptr_t)(cqe->user_data & ~OP_MASK);
+  unsigned op = (unsigned)(cqe->user_data & OP_MASK);
+  int res = cqe->res;
+  int more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+  if (!more)
+    conn->uring_ops--;
+
+  if (op == OP_RECV) {
+    if (!more)
+      conn->recv_armed = conn->recv_cancelling = 0;
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+      uint16_t id = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+      if (res > 0 && !conn->closing)
+        hold_buffer(U, conn, id, (uint32_t)res);
+      else
+        uring_buffers_recycle(&U->buffers, id);
+    }
+  }
+  if (conn->closing) {
+    if (conn->uring_ops == 0)
+      finish_closing(U, conn);
+    return;
+  }
+
+  int rc = 0;
+  switch (op) {
+  case OP_RECV:
+    if (res == 0) {
+      conn->peer_closed = 1;
+    } else if (res == -ENOBUFS) {
+      // Restarted once connections give buffers back
+      conn->recv_starved = 1;
+      U->starved = 1;
+    } else if (res < 0 && res != -ECANCELED) {
+      fprintf(stderr, "Failed to read from client: %s\n", strerror(-res));
+      rc = -1;
+    }
+    break;
+  case OP_SEND:
+    conn->send_busy = 0;
+    conn->out_locked = 0;
+    if (res < 0) {
+      fprintf(stderr, "Failed Sending Response: %s\n", strerror(-res));
+      rc = -1;
+    } else {
+      connection_sent(conn, (size_t)res);
+    }
+    break;
+  case OP_POLL:
+    conn->send_busy = 0;
+    break;
+  case OP_CANCEL:
+    return; // The receive reports its own end
+  }
+  if (rc == 0)
+    rc = drive_connection(U, conn);
+  if (rc == 0)
+    rc = adjust_recv(U, conn);
+  if (rc < 0)
+    close_connection(loop, conn);
+  else
+    touch_connection(loop, conn);
+}
+
+int uring_resume_connection(UringLoop *U, Connection *conn) {
+  int rc = drive_connection(U, conn);
+  return rc < 0 ? rc : adjust_recv(U, conn);
+}
+
+static int arm_upstream(UringLoop *U, Upstream *up) {
+  struct io_uring_sqe *sqe = next_sqe(U);
+  if (!sqe)
+    return -1;
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = up->fd;
+  sqe->poll32_events = POLLIN | POLLOUT;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->user_data = (uint64_t)(uintptr_t)up | OP_UPSTREAM;
+  up->polling = 1;
+  return 0;
+}
+
+int uring_watch_upstream(UringLoop *U, Upstream *up) {
+  return arm_upstream(U, up);
+}
+
+void uring_forget_upstream(UringLoop *U, Upstream *up) {
+  if (!up->polling)
+    return;
+  struct io_uring_sqe *sqe = next_sqe(U);
+  if (!sqe)
+    return; // Ends with the close, or when the ring is torn down
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = (uint64_t)(uintptr_t)up | OP_UPSTREAM;
+  sqe->user_data = TAG_CANCEL_UPSTREAM;
+}
+
+// Readiness of an upstream socket is handed to the client it serves. A
+// closed upstream waits for the last completion of its poll to be freed.
+static void complete_upstream(EventLoop *loop, UringLoop *U,
+                              const struct io_uring_cqe *cqe) {
+  Upstream *up = (Upstream *)(uintptr_t)(cqe->user_data & ~(uint64_t)OP_MASK);
+  if (!(cqe->flags & IORING_CQE_F_MORE)) {
+    up->polling = 0;
+    if (up->retired) {
+      proxy_release_retired(up);
+      return;
+    }
+    if (up->fd >= 0 && cqe->res != -ECANCELED && arm_upstream(U, up) < 0)
+      return;
+  } else if (up->retired) {
+    return;
+  }
+  if (cqe->res == -ECANCELED)
+    return;
+  Connection *client = proxy_upstream_ready(up);
+  if (client)
+    resume_connection(loop, client);
+}
+
+static void complete(EventLoop *loop, UringLoop *U,
+                     const struct io_uring_cqe *cqe) {
+  switch (cqe->user_data) {
+  case TAG_ACCEPT:
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+      U->accept_armed = 0; // Armed again after this batch
+    if (cqe->res < 0) {
+      if (cqe->res != -ECANCELED)
+        fprintf(stderr, "Connection failed: %s\n", strerror(-cqe->res));
+      return;
+    }
+    if (!keep_running) {
+      close(cqe->res);
+      return;
+    }
+    configure_client_socket(cqe->res);
+    Connection *conn = adopt_connection(loop, cqe->res, NULL);
+    if (conn && arm_recv(U, conn) < 0)
+      close_connection(loop, conn);
+    return;
+  case TAG_WAKE: {
+    // keep_running and draining are checked after the batch. Reading the
+    // eventfd lets the poll wait for the next wake-up.
+    uint64_t count;
+    if (read(loop->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+      fprintf(stderr, "Failed to read the wake fd: %s\n", strerror(errno));
+    if (keep_running)
+      arm_poll(U, loop->wake_fd, 0, TAG_WAKE);
+    return;
+  }
+  case TAG_CANCEL_ACCEPT:
+  case TAG_CANCEL_UPSTREAM:
+    return; // The operation reports its own end
+  case TAG_INOTIFY:
+    file_cache_process_events(&loop->files);
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+      arm_poll(U, loop->files.inotify_fd, 1, TAG_INOTIFY);
+    return;
+  default:
+    if ((cqe->user_data & OP_MASK) == OP_UPSTREAM)
+      complete_upstream(loop, U, cqe);
+    else
+      complete_connection(loop, U, cqe);
+  }
+}
+
+// Read every completion that is ready
+static void reap_completions(EventLoop *loop, UringLoop *U) {
+  struct io_uring_cqe *cqe;
+  while ((cqe = uring_peek_cqe(&U->ring))) {
+    struct io_uring_cqe copy = *cqe;
+    uring_cqe_seen(&U->ring);
+    complete(loop, U, &copy);
+  }
+}
+
+// Arm the receives that ran out of buffers again once some are free
+static void restart_starved(EventLoop *loop, UringLoop *U) {
+  if (!U->starved || U->held >= URING_BUFFER_COUNT)
+    return;
+  U->starved = 0;
+  Connection *conn = loop->connections;
+  while (conn) {
+    Connection *next = conn->next;
+    if (conn->recv_starved) {
+      conn->recv_starved = 0;
+      if (adjust_recv(U, conn) < 0)
+        close_connection(loop, conn);
+    }
+    conn = next;
+  }
+}
+
+// Set up the ring and the buffers. Returns URING_UNSUPPORTED if the kernel
+// lacks any feature the loop relies on.
+static int setup_uring(UringLoop *U, int sqpoll) {
+  int err = uring_init(&U->ring, URING_ENTRIES, sqpoll);
+  if (err < 0) {
+    fprintf(stderr, "io_uring_setup failed: %s\n", strerror(-err));
+    return URING_UNSUPPORTED;
+  }
+  // The probe can not report multishot receive; IORING_OP_SEND_ZC arrived
+  // with the same kernel release (6.0), so it stands in for it
+  static const uint8_t ops[] = {IORING_OP_ACCEPT,     IORING_OP_RECV,
+                                IORING_OP_SENDMSG,    IORING_OP_POLL_ADD,
+                                IORING_OP_ASYNC_CANCEL, IORING_OP_SEND_ZC};
+  unsigned features = IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+  if ((U->ring.features & features) != features ||
+      !uring_supports(&U->ring, ops, sizeof(ops))) {
+    fprintf(stderr, "io_uring lacks multishot receive support.\n");
+    uring_destroy(&U->ring);
+    return URING_UNSUPPORTED;
+  }
+  err = uring_buffers_init(&U->ring, &U->buffers, 0, URING_BUFFER_COUNT,
+                           URING_BUFFER_SIZE);
+  if (err < 0) {
+    fprintf(stderr, "Failed to register io_uring buffers: %s\n",
+            strerror(-err));
+    uring_destroy(&U->ring);
+    return URING_UNSUPPORTED;
+  }
+  return 0;
+}
+
+int run_uring_loop(EventLoop *loop, int sqpoll) {
+  UringLoop *U = calloc(1, sizeof(*U));
+  if (!U) {
+    perror("calloc failed for UringLoop");
+    return -1;
+  }
+  if (setup_uring(U, sqpoll) != 0) {
+    free(U);
+    return URING_UNSUPPORTED;
+  }
+  loop->uring = U;
+
+  int status = 0;
+  if (arm_accept(U, loop->server_fd) < 0 ||
+      (loop->wake_fd >= 0 && arm_poll(U, loop->wake_fd, 0, TAG_WAKE) < 0) ||
+      (loop->serve_files &&
+       arm_poll(U, loop->files.inotify_fd, 1, TAG_INOTIFY) < 0))
+    status = -1;
+
+  while (loop_running(loop) && status == 0) {
+    // Everything queued while handling the last batch (sends, receives,
+    // recycled buffers) reaches the kernel with this one system call
+    uring_buffers_commit(&U->buffers);
+    int err = uring_submit_and_wait(&U->ring, 1, loop_wait_ms(loop));
+    if (err < 0) {
+      fprintf(stderr, "io_uring_enter failed: %s\n", strerror(-err));
+      status = -1;
+      break;
+    }
+    update_loop_time(loop);
+    reap_completions(loop, U);
+    restart_starved(loop, U);
+    if (loop_start_drain(loop) && U->accept_armed)
+      cancel_accept(U);
+    if (!U->accept_armed && keep_running && !loop->draining)
+      arm_accept(U, loop->server_fd);
+    close_expired_connections(loop);
+  }
+
+  while (loop->connections)
+    close_connection(loop, loop->connections);
+  // Closed connections are freed as their operations complete
+  for (int i = 0; U->closing && i < 10; ++i) {
+    uring_buffers_commit(&U->buffers);
+    if (uring_submit_and_wait(&U->ring, 1, 100) < 0)
+      break;
+    reap_completions(loop, U);
+  }
+  uring_buffers_destroy(&U->ring, &U->buffers);
+  uring_destroy(&U->ring);
+  // Tearing the ring down ended whatever was still in flight
+  while (U->closing)
+    finish_closing(U, U->closing);
+  loop->uring = NULL;
+  free(U);
+  return status;
+}
@@ -0,0 +1,151 @@
+// pthread_attr_setaffinity_np() and CPU_SET() are GNU extensions
+#define _GNU_SOURCE
+#include "../include/worker.h"
+#include "../include/config.h"         // For TIMER_TICK_MS
+#include "../include/event_loop.h"     // For run_event_loop
+#include "../include/server.h"         // For setup_server_socket
+#include "../include/signal_handler.h" // For keep_running, draining
+#include "../include/upgrade.h"        // For upgrade_listener
+
+#include <errno.h>       // For errno
+#include <sched.h>       // For sched_getaffinity, cpu_set_t, CPU_* macros
+#include <signal.h>      // For kill, SIGINT
+#include <stdint.h>      // For uint64_t
+#include <stdio.h>       // For fprintf, printf
+#include <string.h>      // For strerror
+#include <sys/eventfd.h> // For eventfd
+#include <unistd.h>      // For close, write, sysconf, getpid
+
+int default_worker_count(void) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  return cpus > 0 ? (int)cpus : 1;
+}
+
+static void *worker_main(void *arg) {
+  Worker *worker = arg;
+  if (run_event_loop(worker->server_fd, worker->wake_fd, worker->id,
+                     worker->opts) < 0) {
+    fprintf(stderr, "Worker %d failed, shutting the server down.\n",
+            worker->id);
+    // Only the main thread accepts SIGINT, so this wakes it up to stop the
+    // remaining workers.
+    keep_running = 0;
+    kill(getpid(), SIGINT);
+  }
+  __atomic_store_n(&worker->finished, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+// Pick the CPU for worker 'index' from the CPUs this process may run on, so
+// pinning also behaves under taskset or cgroup cpusets.
+static int pick_cpu(int index) {
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+    return -1;
+  int usable = CPU_COUNT(&allowed);
+  if (usable <= 0)
+    return -1;
+  int wanted = index % usable;
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &allowed) && wanted-- == 0)
+      return cpu;
+  }
+  return -1;
+}
+
+static int start_worker(Worker *worker, const ServerOptions *opts) {
+  // A listener handed over by the binary this one replaces keeps its
+  // queue of pending connections
+  worker->server_fd = upgrade_listener(worker->id);
+  if (worker->server_fd < 0)
+    worker->server_fd = setup_server_socket(opts->port, 1);
+  if (worker->server_fd < 0)
+    return -1;
+  worker->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (worker->wake_fd < 0) {
+    fprintf(stderr, "eventfd failed: %s\n", strerror(errno));
+    return -1;
+  }
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  worker->cpu = -1;
+  if (opts->pin_workers) {
+    int cpu = pick_cpu(worker->id);
+    if (cpu >= 0) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpu, &set);
+      if (pthread_attr_setaffinity_np(&attr, sizeof(set), &set) == 0)
+        worker->cpu = cpu;
+    }
+    if (worker->cpu < 0)
+      fprintf(stderr, "Could not pin worker %d, running unpinned.\n",
+              worker->id);
+  }
+
+  int rc = pthread_create(&worker->thread, &attr, worker_main, worker);
+  pthread_attr_destroy(&attr);
+  if (rc != 0) {
+    fprintf(stderr, "pthread_create failed: %s\n", strerror(rc));
+    return -1;
+  }
+  worker->started = 1;
+  return 0;
+}
+
+int start_workers(Worker *workers, int count, const ServerOptions *opts) {
+  for (int i = 0; i < count; ++i) {
+    workers[i] = (Worker){.id = i,
+                          .cpu = -1,
+                          .server_fd = -1,
+                          .wake_fd = -1,
+                          .opts = opts};
+  }
+  for (int i = 0; i < count; ++i) {
+    if (start_worker(&workers[i], opts) < 0) {
+      keep_running = 0;
+      stop_workers(workers, count);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static void wake_workers(Worker *workers, int count) {
+  for (int i = 0; i < count; ++i) {
+    uint64_t one = 1;
+    if (workers[i].started && write(workers[i].wake_fd, &one, sizeof(one)) < 0)
+      fprintf(stderr, "Failed to wake worker %d: %s\n", i, strerror(errno));
+  }
+}
+
+void drain_workers(Worker *workers, int count) {
+  draining = 1;
+  wake_workers(workers, count);
+  // Every worker ends its own drain by DRAIN_TIMEOUT_MS, so this only
+  // watches for them to finish and for a SIGINT
+  for (int i = 0; i < count && keep_running; ++i) {
+    while (workers[i].started &&
+           !__atomic_load_n(&workers[i].finished, __ATOMIC_ACQUIRE) &&
+           keep_running)
+      wait_for_stop(TIMER_TICK_MS);
+  }
+}
+
+void stop_workers(Worker *workers, int count) {
+  // Wake every loop first so the workers wind down in parallel
+  wake_workers(workers, count);
+  for (int i = 0; i < count; ++i) {
+    if (workers[i].started) {
+      pthread_join(workers[i].thread, NULL);
+      workers[i].started = 0;
+    }
+    if (workers[i].wake_fd >= 0)
+      close(workers[i].wake_fd);
+    if (workers[i].server_fd >= 0)
+      close(workers[i].server_fd);
+    workers[i].wake_fd = workers[i].server_fd = -1;
+  }
+}
@@ -0,0 +1,41 @@
+// Helpers shared by the tests. Each test program checks one module through
+// its functions, prints every check that fails with its file and line, and
+// ends with a summary line and a failing exit status if anything failed.
+
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>  // For printf, fprintf
+#include <stdlib.h> // For EXIT_FAILURE, EXIT_SUCCESS
+
+static int test_checks, test_failures;
+
+static inline void test_check(int ok, const char *what, const char *file,
+                              int line) {
+  test_checks++;
+  if (!ok) {
+    test_failures++;
+    fprintf(stderr, "%s:%d: check failed: %s\n", file, line, what);
+  }
+}
+
+static inline void test_check_equal(long long got, long long want,
+                                    const char *what, const char *file,
+                                    int line) {
+  test_check(got == want, what, file, line);
+  if (got != want)
+    fprintf(stderr, "    got %lld, want %lld\n", got, want);
+}
+
+#define CHECK(cond) test_check((cond) != 0, #cond, __FILE__, __LINE__)
+#define CHECK_EQ(got, want)                                                   \
+  test_check_equal((long long)(got), (long long)(want), #got " == " #want,   \
+                   __FILE__, __LINE__)
+
+// Print how the checks went. Returns the exit status for main().
+static inline int test_report(const char *name) {
+  printf("%s: %d checks, %d failed\n", name, test_checks, test_failures);
+  return test_failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+#endif // TEST_H
@@ -0,0 +1,137 @@
+// Tests of admission control: a client's token bucket refilling at the
+// configured rate, capped at its burst and turning connections away once
+// empty, clients kept apart, peers without an IPv4 address admitted
+// untracked instead of sharing a bucket, the cap on open connections, and
+// the compare-and-swap bucket taken from several threads at once.
+
+#include "test.h"
+#include "../include/admission.h"
+
+#include <pthread.h> // For pthread_create, pthread_join
+#include <stdint.h>  // For uint32_t, uint64_t
+
+// Addresses are only hashed, so any distinct values will do
+#define CLIENT_A 0x0a000001u
+#define CLIENT_B 0x0a000002u
+#define CLIENT_C 0x0a000003u
+
+static void configure(int rate, int burst, int max_connections) {
+  ServerOptions opts = {0};
+  opts.client_rate = rate;
+  opts.client_burst = burst;
+  opts.max_connections = max_connections;
+  admission_init(&opts);
+}
+
+// How many of 'tries' connections from 'addr' at 'now_ms' are admitted;
+// every admitted one is released again right away
+static int admitted(uint32_t addr, uint64_t now_ms, int tries) {
+  int n = 0;
+  for (int i = 0; i < tries; ++i) {
+    AdmissionResult result = admission_check(addr, now_ms);
+    if (result == ADMIT_OK) {
+      n++;
+      admission_release();
+    }
+  }
+  return n;
+}
+
+static void test_bucket(void) {
+  configure(10, 3, 0); // 10 per second, 3 in a burst
+  CHECK(admission_by_address());
+
+  // A new client starts with a full bucket, and is turned away once it is
+  // empty
+  CHECK_EQ(admission_check(CLIENT_A, 1000), ADMIT_OK);
+  CHECK_EQ(admission_check(CLIENT_A, 1000), ADMIT_OK);
+  CHECK_EQ(admission_check(CLIENT_A, 1000), ADMIT_OK);
+  CHECK_EQ(admission_check(CLIENT_A, 1000), ADMIT_RATE_LIMITED);
+  CHECK_EQ(admission_check(CLIENT_A, 1050), ADMIT_RATE_LIMITED);
+
+  // 10 per second is one token every 100 ms; half a token is not enough
+  CHECK_EQ(admitted(CLIENT_A, 1100, 5), 1);
+  CHECK_EQ(admitted(CLIENT_A, 1150, 5), 0);
+  CHECK_EQ(admitted(CLIENT_A, 1300, 5), 2);
+
+  // However long the client waits, the bucket holds no more than the burst
+  CHECK_EQ(admitted(CLIENT_A, 1000000, 10), 3);
+
+  // Another client has a bucket of its own
+  CHECK_EQ(admitted(CLIENT_B, 1000000, 10), 3);
+  CHECK_EQ(admitted(CLIENT_A, 1000000, 10), 0);
+
+  // A clock read by another worker may lag behind the bucket's stamp
+  CHECK_EQ(admitted(CLIENT_A, 999000, 10), 0);
+  CHECK_EQ(admitted(CLIENT_A, 1000100, 10), 1);
+}
+
+// Peers without an IPv4 address are reported as address 0. They can not
+// be told apart, so none of them is held to a bucket that all would share.
+static void test_no_address(void) {
+  configure(1, 1, 0);
+  int untracked = 0;
+  for (int i = 0; i < 100; ++i)
+    untracked += admission_check(0, 5000) == ADMIT_UNTRACKED;
+  CHECK_EQ(untracked, 100);
+
+  // ... while a client with an address is still limited
+  CHECK_EQ(admission_check(CLIENT_C, 5000), ADMIT_OK);
+  CHECK_EQ(admission_check(CLIENT_C, 5000), ADMIT_RATE_LIMITED);
+}
+
+static void test_max_connections(void) {
+  configure(0, 0, 2);
+  CHECK(!admission_by_address());
+  CHECK_EQ(admission_check(CLIENT_A, 0), ADMIT_OK);
+  CHECK_EQ(admission_check(CLIENT_B, 0), ADMIT_OK);
+  CHECK_EQ(admission_check(CLIENT_C, 0), ADMIT_OVERLOADED);
+  admission_release();
+  CHECK_EQ(admission_check(CLIENT_C, 0), ADMIT_OK);
+  admission_release();
+  admission_release();
+
+  // A connection turned away for its rate does not stay counted, and an
+  // untracked one is counted like any other
+  configure(10, 1, 1);
+  CHECK_EQ(admission_check(CLIENT_A, 2000000), ADMIT_OK);
+  admission_release();
+  CHECK_EQ(admission_check(CLIENT_A, 2000000), ADMIT_RATE_LIMITED);
+  CHECK_EQ(admission_check(0, 2000000), ADMIT_UNTRACKED);
+  CHECK_EQ(admission_check(CLIENT_B, 2000000), ADMIT_OVERLOADED);
+  admission_release();
+  CHECK_EQ(admission_check(CLIENT_B, 2000000), ADMIT_OK);
+  admission_release();
+}
+
+enum { THREADS = 8, TRIES = 10000, BURST = 5000 };
+
+static void *take_tokens(void *arg) {
+  int *count = arg;
+  for (int i = 0; i < TRIES; ++i)
+    *count += admission_check(CLIENT_C + 1, 3000000) == ADMIT_OK;
+  return NULL;
+}
+
+// Workers race on one bucket: exactly the burst gets through
+static void test_concurrent(void) {
+  configure(1, BURST, 0);
+  pthread_t threads[THREADS];
+  int counts[THREADS] = {0};
+  for (int i = 0; i < THREADS; ++i)
+    CHECK_EQ(pthread_create(&threads[i], NULL, take_tokens, &counts[i]), 0);
+  int total = 0;
+  for (int i = 0; i < THREADS; ++i) {
+    pthread_join(threads[i], NULL);
+    total += counts[i];
+  }
+  CHECK_EQ(total, BURST);
+}
+
+int main(void) {
+  test_bucket();
+  test_no_address();
+  test_max_connections();
+  test_concurrent();
+  return test_report("test_admission");
+}
@@ -0,0 +1,134 @@
+// Tests of response compression: the coding picked from Accept-Encoding,
+// with q-values, refusals with q=0, "*" and several headers, and bodies
+// compressed in one pass that inflate back to the input.
+
+#include "test.h"
+#include "../include/compress.h"
+#include "../include/http_parser.h"
+
+#include <stdint.h> // For uintptr_t
+#include <stdio.h>  // For fprintf, snprintf
+#include <string.h> // For memcmp, memset, strcmp, strlen
+#include <zlib.h>   // For inflateInit2, inflate, inflateEnd
+
+// The coding picked for a request carrying 'headers', e.g.
+// "Accept-Encoding: gzip\r\n"
+static int negotiate(const char *headers) {
+  static char head[1024];
+  snprintf(head, sizeof(head), "GET / HTTP/1.1\r\nHost: x\r\n%s\r\n",
+           headers);
+  ClientRequest C;
+  if (parseRequest(head, strlen(head), &C) != PARSE_OK)
+    return -1;
+  return (int)compress_negotiate(&C);
+}
+
+static void test_negotiate(void) {
+  static const struct {
+    const char *header;
+    ContentCoding coding;
+  } cases[] = {
+      {"", CODING_IDENTITY},
+      {"Accept-Encoding: gzip\r\n", CODING_GZIP},
+      {"Accept-Encoding: deflate\r\n", CODING_DEFLATE},
+      {"Accept-Encoding: gzip, deflate, br\r\n", CODING_GZIP},
+      {"Accept-Encoding: deflate, gzip\r\n", CODING_GZIP},
+      {"Accept-Encoding: br, identity\r\n", CODING_IDENTITY},
+      {"Accept-Encoding:\r\n", CODING_IDENTITY},
+      {"Accept-Encoding: GZIP\r\n", CODING_GZIP},
+      {"accept-encoding: x-gzip\r\n", CODING_GZIP},
+      // q-values: the higher wins, gzip on a tie
+      {"Accept-Encoding: gzip;q=0.5, deflate\r\n", CODING_DEFLATE},
+      {"Accept-Encoding: gzip;q=0.4, deflate;q=0.45\r\n", CODING_DEFLATE},
+      {"Accept-Encoding: gzip;q=0.5, deflate;q=0.5\r\n", CODING_GZIP},
+      {"Accept-Encoding: gzip;q=1.0, deflate;q=1\r\n", CODING_GZIP},
+      {"Accept-Encoding: gzip;q=0.001\r\n", CODING_GZIP},
+      {"Accept-Encoding: gzip ; q=0.8, deflate;Q=0.9\r\n", CODING_DEFLATE},
+      {"Accept-Encoding: gzip;level=1;q=0.2, deflate;q=0.3\r\n",
+       CODING_DEFLATE},
+      // q=0 refuses a coding, however many zeros follow
+      {"Accept-Encoding: gzip;q=0\r\n", CODING_IDENTITY},
+      {"Accept-Encoding: gzip;q=0.000\r\n", CODING_IDENTITY},
+      {"Accept-Encoding: gzip; q=0, deflate\r\n", CODING_DEFLATE},
+      {"Accept-Encoding: gzip;q=0, deflate;q=0\r\n", CODING_IDENTITY},
+      // A parameter merely ending in q is not the q-value
+      {"Accept-Encoding: gzip;xq=0\r\n", CODING_GZIP},
+      // "*" stands for every coding not listed
+      {"Accept-Encoding: *\r\n", CODING_GZIP},
+      {"Accept-Encoding: *;q=0\r\n", CODING_IDENTITY},
+      {"Accept-Encoding: *;q=0, deflate\r\n", CODING_DEFLATE},
+      {"Accept-Encoding: gzip;q=0, *\r\n", CODING_DEFLATE},
+      {"Accept-Encoding: deflate;q=0.5, *;q=0.6\r\n", CODING_GZIP},
+      // Several headers make up one list
+      {"Accept-Encoding: gzip;q=0\r\nAccept-Encoding: deflate\r\n",
+       CODING_DEFLATE},
+      {"Accept-Encoding: br\r\nAccept-Encoding: gzip\r\n", CODING_GZIP},
+  };
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+    int got = negotiate(cases[i].header);
+    CHECK_EQ(got, cases[i].coding);
+    if (got != (int)cases[i].coding)
+      fprintf(stderr, "    for %s", cases[i].header);
+  }
+  CHECK(strcmp(content_coding_name(CODING_GZIP), "gzip") == 0);
+  CHECK(strcmp(content_coding_name(CODING_DEFLATE), "deflate") == 0);
+}
+
+// Inflate 'len' bytes in the wrapper of 'coding'. Returns the length, or
+// -1 if the data is not a complete stream.
+static long inflate_body(ContentCoding coding, const char *src, size_t len,
+                         char *dst, size_t cap) {
+  z_stream s;
+  memset(&s, 0, sizeof(s));
+  if (inflateInit2(&s, coding == CODING_GZIP ? 16 + MAX_WBITS : MAX_WBITS) !=
+      Z_OK)
+    return -1;
+  s.next_in = (Bytef *)(uintptr_t)src;
+  s.avail_in = (uInt)len;
+  s.next_out = (Bytef *)dst;
+  s.avail_out = (uInt)cap;
+  int rc = inflate(&s, Z_FINISH);
+  long out = (long)(cap - s.avail_out);
+  inflateEnd(&s);
+  return rc == Z_STREAM_END && s.avail_in == 0 ? out : -1;
+}
+
+static void test_compress(void) {
+  static char text[16384], packed[16384], unpacked[16384];
+  for (size_t i = 0; i < sizeof(text); ++i)
+    text[i] = "lorem ipsum dolor sit amet "[i % 27];
+  Compressor z;
+  compressor_init(&z);
+  static const ContentCoding codings[] = {CODING_GZIP, CODING_DEFLATE};
+  for (size_t c = 0; c < 2; ++c) {
+    // Twice per level, so the stream is reset and its level changed
+    for (int level = 1; level <= 9; level += 4) {
+      for (int round = 0; round < 2; ++round) {
+        ssize_t n = compress_buffer(&z, codings[c], level, text,
+                                    sizeof(text), packed, sizeof(packed));
+        CHECK(n > 0 && (size_t)n < sizeof(text) / 10);
+        long m = n > 0 ? inflate_body(codings[c], packed, (size_t)n,
+                                      unpacked, sizeof(unpacked))
+                       : -1;
+        CHECK_EQ(m, sizeof(text));
+        CHECK(m == sizeof(text) && memcmp(unpacked, text, sizeof(text)) == 0);
+      }
+    }
+    // Output that does not fit in the room given is refused
+    CHECK_EQ(compress_buffer(&z, codings[c], 6, text, sizeof(text), packed,
+                             16),
+             -1);
+    CHECK(compress_buffer(&z, codings[c], 6, text, sizeof(text), packed,
+                          sizeof(packed)) > 0);
+  }
+  CHECK_EQ(compress_buffer(&z, CODING_IDENTITY, 6, text, sizeof(text),
+                           packed, sizeof(packed)),
+           -1);
+  compressor_destroy(&z);
+}
+
+int main(void) {
+  test_negotiate();
+  test_compress();
+  return test_report("test_compress");
+}
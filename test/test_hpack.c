@@ -0,0 +1,319 @@
+// Tests of the HPACK decoder and encoder: the examples of RFC 7541
+// Appendix C, dynamic table eviction and size updates, malformed Huffman
+// strings and integers, and fields encoded by us decoding back to what
+// they were.
+
+#include "test.h"
+#include "../include/hpack.h"
+
+#include <string.h> // For strlen, memcmp, strcmp
+
+// The fields of a decoded block as "name: value\n" lines
+typedef struct {
+  char text[4096];
+  size_t len;
+} Fields;
+
+static void collect(void *ctx, StringView name, StringView value) {
+  Fields *F = ctx;
+  int n = snprintf(F->text + F->len, sizeof(F->text) - F->len, "%.*s: %.*s\n",
+                   (int)name.len, name.ptr, (int)value.len, value.ptr);
+  if (n > 0 && (size_t)n < sizeof(F->text) - F->len)
+    F->len += (size_t)n;
+}
+
+static size_t from_hex(const char *hex, uint8_t *out) {
+  size_t n = 0;
+  for (; hex[0] && hex[1]; hex += 2) {
+    unsigned byte;
+    sscanf(hex, "%2x", &byte);
+    out[n++] = (uint8_t)byte;
+  }
+  return n;
+}
+
+static char scratch[RECV_BUFFER_SIZE];
+
+// Decode the block written as 'hex'. Returns what hpack_decode() did and
+// leaves the fields in 'F'.
+static int decode_hex(HpackDecoder *D, const char *hex, Fields *F) {
+  uint8_t block[1024];
+  size_t len = from_hex(hex, block);
+  F->len = 0;
+  F->text[0] = '\0';
+  return hpack_decode(D, block, len, scratch, sizeof(scratch), collect, F);
+}
+
+// Decode a block that has to succeed into the fields 'want', leaving a
+// dynamic table of 'table_size' bytes
+static void expect_block(HpackDecoder *D, const char *hex, const char *want,
+                         size_t table_size) {
+  Fields F;
+  CHECK_EQ(decode_hex(D, hex, &F), 0);
+  CHECK(strcmp(F.text, want) == 0);
+  if (strcmp(F.text, want) != 0)
+    fprintf(stderr, "    got:\n%s    want:\n%s", F.text, want);
+  CHECK_EQ(D->size, table_size);
+}
+
+static int fails(HpackDecoder *D, const char *hex) {
+  Fields F;
+  return decode_hex(D, hex, &F) < 0;
+}
+
+// C.2: one field of each representation
+static void test_field_examples(void) {
+  HpackDecoder D;
+  hpack_decoder_init(&D);
+  expect_block(&D, "400a637573746f6d2d6b65790d637573746f6d2d686561646572",
+               "custom-key: custom-header\n", 55);
+  hpack_decoder_init(&D);
+  expect_block(&D, "040c2f73616d706c652f70617468", ":path: /sample/path\n", 0);
+  expect_block(&D, "100870617373776f726406736563726574",
+               "password: secret\n", 0);
+  expect_block(&D, "82", ":method: GET\n", 0);
+}
+
+static const char *const request_fields[] = {
+    ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\n",
+    ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\n"
+    "cache-control: no-cache\n",
+    ":method: GET\n:scheme: https\n:path: /index.html\n"
+    ":authority: www.example.com\ncustom-key: custom-value\n",
+};
+static const size_t request_sizes[] = {57, 110, 164};
+
+// C.3 and C.4: three requests on one connection, plain and Huffman coded
+static void test_request_examples(void) {
+  static const char *const plain[] = {
+      "828684410f7777772e6578616d706c652e636f6d",
+      "828684be58086e6f2d6361636865",
+      "828785bf400a637573746f6d2d6b65790c637573746f6d2d76616c7565",
+  };
+  static const char *const huffman[] = {
+      "828684418cf1e3c2e5f23a6ba0ab90f4ff",
+      "828684be5886a8eb10649cbf",
+      "828785bf408825a849e95ba97d7f8925a849e95bb8e8b4bf",
+  };
+  HpackDecoder D;
+  hpack_decoder_init(&D);
+  for (int i = 0; i < 3; ++i)
+    expect_block(&D, plain[i], request_fields[i], request_sizes[i]);
+  hpack_decoder_init(&D);
+  for (int i = 0; i < 3; ++i)
+    expect_block(&D, huffman[i], request_fields[i], request_sizes[i]);
+}
+
+static const char *const response_fields[] = {
+    ":status: 302\ncache-control: private\n"
+    "date: Mon, 21 Oct 2013 20:13:21 GMT\n"
+    "location: https://www.example.com\n",
+    ":status: 307\ncache-control: private\n"
+    "date: Mon, 21 Oct 2013 20:13:21 GMT\n"
+    "location: https://www.example.com\n",
+    ":status: 200\ncache-control: private\n"
+    "date: Mon, 21 Oct 2013 20:13:22 GMT\n"
+    "location: https://www.example.com\ncontent-encoding: gzip\n"
+    "set-cookie: foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1\n",
+};
+static const size_t response_sizes[] = {222, 222, 215};
+
+// C.5 and C.6: three responses through a 256 byte table, which evicts.
+// The size is lowered by an update at the start of the first block.
+static void test_response_examples(void) {
+  static const char *const plain[] = {
+      "3fe101"
+      "4803333032580770726976617465611d4d6f6e2c203231204f637420323031332032"
+      "303a31333a323120474d546e1768747470733a2f2f7777772e6578616d706c652e63"
+      "6f6d",
+      "4803333037c1c0bf",
+      "88c1611d4d6f6e2c203231204f637420323031332032303a31333a323220474d54c0"
+      "5a04677a69707738666f6f3d4153444a4b48514b425a584f5157454f50495541585157"
+      "454f49553b206d61782d6167653d333630303b2076657273696f6e3d31",
+  };
+  static const char *const huffman[] = {
+      "3fe101"
+      "488264025885aec3771a4b6196d07abe941054d444a8200595040b8166e082a62d1b"
+      "ff6e919d29ad171863c78f0b97c8e9ae82ae43d3",
+      "4883640effc1c0bf",
+      "88c16196d07abe941054d444a8200595040b8166e084a62d1bffc05a839bd9ab77ad"
+      "94e7821dd7f2e6c7b335dfdfcd5b3960d5af27087f3672c1ab270fb5291f9587316065"
+      "c003ed4ee5b1063d5007",
+  };
+  HpackDecoder D;
+  hpack_decoder_init(&D);
+  for (int i = 0; i < 3; ++i)
+    expect_block(&D, plain[i], response_fields[i], response_sizes[i]);
+  CHECK_EQ(D.count, 3);
+  hpack_decoder_init(&D);
+  for (int i = 0; i < 3; ++i)
+    expect_block(&D, huffman[i], response_fields[i], response_sizes[i]);
+  CHECK_EQ(D.count, 3);
+}
+
+// Literal with incremental indexing and a new name: "x-a: <value>", 45
+// bytes in the table with a 10 byte value
+static void insert_hex(char *hex, const char *value) {
+  static const char digits[] = "0123456789abcdef";
+  size_t len = strlen(value), n = 0;
+  n += (size_t)sprintf(hex, "4003782d61%02x", (unsigned)len);
+  for (size_t i = 0; i < len; ++i) {
+    hex[n++] = digits[(unsigned char)value[i] >> 4];
+    hex[n++] = digits[(unsigned char)value[i] & 15];
+  }
+  hex[n] = '\0';
+}
+
+static void test_eviction(void) {
+  HpackDecoder D;
+  Fields F;
+  char hex[256];
+  hpack_decoder_init(&D);
+  // A 100 byte table holds two 45 byte entries
+  CHECK_EQ(decode_hex(&D, "3f45", &F), 0);
+  CHECK_EQ(D.max_size, 100);
+  insert_hex(hex, "0000000001");
+  CHECK_EQ(decode_hex(&D, hex, &F), 0);
+  insert_hex(hex, "0000000002");
+  CHECK_EQ(decode_hex(&D, hex, &F), 0);
+  CHECK_EQ(D.count, 2);
+  insert_hex(hex, "0000000003");
+  CHECK_EQ(decode_hex(&D, hex, &F), 0);
+  CHECK_EQ(D.count, 2);
+  CHECK_EQ(D.size, 90);
+  // Index 62 is the newest entry, 63 the one before, and the first is gone
+  expect_block(&D, "be", "x-a: 0000000003\n", 90);
+  expect_block(&D, "bf", "x-a: 0000000002\n", 90);
+  CHECK(fails(&D, "c0"));
+
+  // An entry larger than the table empties it and is not added
+  char value[71];
+  memset(value, '0', 70);
+  value[70] = '\0';
+  insert_hex(hex, value);
+  CHECK_EQ(decode_hex(&D, hex, &F), 0);
+  CHECK_EQ(D.count, 0);
+  CHECK_EQ(D.size, 0);
+  CHECK(fails(&D, "be"));
+}
+
+static void test_size_updates(void) {
+  HpackDecoder D;
+  char hex[256];
+  hpack_decoder_init(&D);
+  insert_hex(hex, "0000000001");
+  expect_block(&D, hex, "x-a: 0000000001\n", 45);
+  // Shrinking the table evicts what no longer fits, raising it again
+  // brings nothing back
+  expect_block(&D, "20", "", 0);
+  expect_block(&D, "3fe11f", "", 0);
+  CHECK_EQ(D.max_size, HPACK_TABLE_SIZE);
+  CHECK(fails(&D, "be"));
+  // Not above what we announced, and only at the start of a block
+  CHECK(fails(&D, "3fe21f"));
+  CHECK(fails(&D, "8220"));
+  // Two updates in a row are allowed
+  expect_block(&D, "203f4582", ":method: GET\n", 0);
+  CHECK_EQ(D.max_size, 100);
+}
+
+// Many entries through the ring, so that names and values wrap around its
+// end, each read back right after it went in
+static void test_ring_wrap(void) {
+  HpackDecoder D;
+  char hex[256], value[32], want[64];
+  hpack_decoder_init(&D);
+  for (int i = 0; i < 300; ++i) {
+    snprintf(value, sizeof(value), "%029d", i * 7919);
+    insert_hex(hex, value);
+    Fields F;
+    CHECK_EQ(decode_hex(&D, hex, &F), 0);
+    snprintf(want, sizeof(want), "x-a: %s\n", value);
+    expect_block(&D, "be", want, D.size);
+  }
+  CHECK(D.size <= HPACK_TABLE_SIZE);
+  CHECK_EQ(D.count, HPACK_TABLE_SIZE / (3 + 29 + 32));
+}
+
+static void test_malformed(void) {
+  HpackDecoder D;
+  hpack_decoder_init(&D);
+  // "a" is 00011 and is padded with ones
+  expect_block(&D, "0001" "61" "81" "1f", "a: a\n", 0);
+  CHECK(fails(&D, "0001" "61" "81" "18")); // Padded with zeros
+  CHECK(fails(&D, "0001" "61" "82" "1fff")); // Over 7 bits of padding
+  CHECK(fails(&D, "0001" "61" "84" "ffffffff")); // EOS
+  CHECK(fails(&D, "80"));                  // Index 0
+  CHECK(fails(&D, "ff00"));                // Past the tables
+  CHECK(fails(&D, "0085" "6161"));         // String past the block
+  CHECK(fails(&D, "00"));                  // Name missing
+  CHECK(fails(&D, "ffffffffff0f"));        // Integer too large
+  CHECK(fails(&D, "ff"));                  // Integer cut short
+
+  // Huffman strings that decode to more than the scratch buffer holds
+  uint8_t block[6 + 2000];
+  size_t len = 0;
+  block[len++] = 0x00;
+  block[len++] = 0x01;
+  block[len++] = 'a';
+  block[len++] = 0xff; // Huffman, length 127 + 0x51 + (0x0e << 7) = 2000
+  block[len++] = 0xd1;
+  block[len++] = 0x0e;
+  memset(block + len, 0x00, 2000); // '0' is 00000: 3200 of them
+  len += 2000;
+  char small[1024];
+  Fields F = {.len = 0};
+  CHECK_EQ(hpack_decode(&D, block, len, small, sizeof(small), collect, &F),
+           -1);
+}
+
+static void test_encode(void) {
+  static const struct {
+    const char *name, *value;
+  } fields[] = {
+      {"Content-Type", "text/plain"},
+      {"X-Custom", "some value, with \"quotes\""},
+      {"Date", "Mon, 21 Oct 2013 20:13:22 GMT"},
+      {"Empty", ""},
+  };
+  uint8_t block[1024];
+  size_t len = hpack_encode_status(block, 200);
+  CHECK_EQ(len, 1);
+  CHECK_EQ(block[0], 0x88);
+  len += hpack_encode_status(block + len, 431);
+  for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i) {
+    StringView name = {fields[i].name, strlen(fields[i].name)};
+    StringView value = {fields[i].value, strlen(fields[i].value)};
+    ssize_t n = hpack_encode_field(block + len, sizeof(block) - len, name,
+                                   value);
+    CHECK(n > 0);
+    len += (size_t)n;
+  }
+  StringView name = {"x", 1}, value = {"long enough", 11};
+  CHECK_EQ(hpack_encode_field(block, 4, name, value), -1);
+
+  HpackDecoder D;
+  Fields F = {.len = 0};
+  hpack_decoder_init(&D);
+  CHECK_EQ(hpack_decode(&D, block, len, scratch, sizeof(scratch), collect,
+                        &F),
+           0);
+  F.text[F.len] = '\0';
+  const char *want = ":status: 200\n:status: 431\ncontent-type: text/plain\n"
+                     "x-custom: some value, with \"quotes\"\n"
+                     "date: Mon, 21 Oct 2013 20:13:22 GMT\nempty: \n";
+  CHECK(strcmp(F.text, want) == 0);
+  CHECK_EQ(D.size, 0);
+}
+
+int main(void) {
+  test_field_examples();
+  test_request_examples();
+  test_response_examples();
+  test_eviction();
+  test_size_updates();
+  test_ring_wrap();
+  test_malformed();
+  test_encode();
+  return test_report("test_hpack");
+}
@@ -0,0 +1,441 @@
+// Tests of the HTTP/2 frame reader through handle_client() on a connection
+// without a socket: a request answered over a stream, the timeout it
+// waits under, and the errors the reader has to catch, flow-control window
+// overflows on the connection and on a stream, oversized frames and header
+// blocks, HEADERS on closed streams and undecodable HPACK.
+
+// memmem() is a Linux extension
+#define _GNU_SOURCE
+#include "test.h"
+#include "../include/connection.h"
+#include "../include/http2.h"
+#include "../include/http_response.h"
+#include "../include/server.h"
+
+#include <stdlib.h> // For malloc, free
+#include <string.h> // For memcpy, memset, memmem
+#include <time.h>   // For time
+
+#define FRAME_DATA 0x0
+#define FRAME_HEADERS 0x1
+#define FRAME_RST_STREAM 0x3
+#define FRAME_SETTINGS 0x4
+#define FRAME_GOAWAY 0x7
+#define FRAME_WINDOW_UPDATE 0x8
+#define FRAME_CONTINUATION 0x9
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+
+static MemoryPools pools;
+static CannedResponses responses;
+
+// A client connection and everything the server wrote to it
+typedef struct {
+  Connection *conn;
+  uint8_t out[256 * 1024];
+  size_t out_len;
+  int dropped; // handle_client() gave up on the connection
+} Client;
+
+// Frames to send, built up before they are fed
+typedef struct {
+  uint8_t data[64 * 1024];
+  size_t len;
+} Frames;
+
+static void add_frame(Frames *F, uint8_t type, uint8_t flags,
+                      uint32_t stream, const void *payload, size_t len) {
+  uint8_t *p = F->data + F->len;
+  p[0] = (uint8_t)(len >> 16);
+  p[1] = (uint8_t)(len >> 8);
+  p[2] = (uint8_t)len;
+  p[3] = type;
+  p[4] = flags;
+  p[5] = (uint8_t)(stream >> 24);
+  p[6] = (uint8_t)(stream >> 16);
+  p[7] = (uint8_t)(stream >> 8);
+  p[8] = (uint8_t)stream;
+  if (len > 0)
+    memcpy(p + 9, payload, len);
+  F->len += 9 + len;
+}
+
+static void add_window_update(Frames *F, uint32_t stream,
+                              uint32_t increment) {
+  uint8_t p[4] = {(uint8_t)(increment >> 24), (uint8_t)(increment >> 16),
+                  (uint8_t)(increment >> 8), (uint8_t)increment};
+  add_frame(F, FRAME_WINDOW_UPDATE, 0, stream, p, 4);
+}
+
+// A header block of :method, :scheme, :path and :authority with literals
+// that are not indexed
+static size_t request_block(uint8_t *block, const char *method,
+                            const char *path) {
+  size_t len = 0, path_len = strlen(path), method_len = strlen(method);
+  block[len++] = 0x02; // :method, a literal value
+  block[len++] = (uint8_t)method_len;
+  memcpy(block + len, method, method_len);
+  len += method_len;
+  block[len++] = 0x86; // :scheme: http
+  block[len++] = 0x04; // :path, a literal value
+  block[len++] = (uint8_t)path_len;
+  memcpy(block + len, path, path_len);
+  len += path_len;
+  block[len++] = 0x01; // :authority, a literal value
+  block[len++] = 1;
+  block[len++] = 'x';
+  return len;
+}
+
+// What flush_connection() does once everything queued has been written,
+// keeping the bytes
+static void capture_output(Client *c) {
+  Connection *conn = c->conn;
+  for (size_t i = conn->out_next; i < conn->out_count; ++i) {
+    size_t len = conn->out[i].iov_len;
+    if (len > sizeof(c->out) - c->out_len)
+      len = sizeof(c->out) - c->out_len;
+    memcpy(c->out + c->out_len, conn->out[i].iov_base, len);
+    c->out_len += len;
+  }
+  conn->out_count = conn->out_next = 0;
+  conn->out_bytes = 0;
+  conn->send_len = 0;
+  arena_reset(&conn->arena);
+}
+
+// Hand the bytes to the server as far as its receive buffer takes them,
+// the way reads would
+static void feed(Client *c, const uint8_t *data, size_t len) {
+  Connection *conn = c->conn;
+  while (!c->dropped) {
+    size_t n = RECV_BUFFER_SIZE - 1 - conn->recv_len;
+    if (n > len)
+      n = len;
+    memcpy(conn->recv_buffer + conn->recv_len, data, n);
+    conn->recv_len += n;
+    conn->recv_buffer[conn->recv_len] = '\0';
+    data += n;
+    len -= n;
+    // The event loop stops reading once the connection is to be closed
+    int rc = 0;
+    while (!conn->close_after_send && (rc = handle_client(conn)) > 0)
+      capture_output(c);
+    capture_output(c);
+    if (rc < 0 || (len > 0 && conn->recv_len == RECV_BUFFER_SIZE - 1))
+      c->dropped = 1;
+    if (len == 0 || conn->close_after_send)
+      break;
+  }
+}
+
+// Open a connection with the preface and SETTINGS, acknowledging ours
+static void open_client(Client *c) {
+  memset(c, 0, sizeof(*c));
+  c->conn = create_connection(-1, &pools);
+  CHECK(c->conn && reserve_input(c->conn, RECV_BUFFER_SIZE) == 0);
+  c->conn->responses = &responses;
+  Frames F = {.len = 0};
+  memcpy(F.data, "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n", 24);
+  F.len = 24;
+  add_frame(&F, FRAME_SETTINGS, 0, 0, NULL, 0);
+  add_frame(&F, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+  feed(c, F.data, F.len);
+  CHECK(c->conn->h2 != NULL);
+}
+
+static void close_client(Client *c) {
+  http2_close(c->conn);
+  free_connection(c->conn);
+}
+
+// Find the first frame of 'type' on 'stream' the server sent. Returns its
+// payload, or NULL.
+static const uint8_t *find_frame(const Client *c, uint8_t type,
+                                 uint32_t stream, size_t *len,
+                                 uint8_t *flags) {
+  size_t i = 0;
+  while (i + 9 <= c->out_len) {
+    const uint8_t *p = c->out + i;
+    size_t n = (size_t)p[0] << 16 | (size_t)p[1] << 8 | p[2];
+    uint32_t id = (uint32_t)(p[5] & 0x7f) << 24 | (uint32_t)p[6] << 16 |
+                  (uint32_t)p[7] << 8 | p[8];
+    if (p[3] == type && id == stream) {
+      *len = n;
+      if (flags)
+        *flags = p[4];
+      return p + 9;
+    }
+    i += 9 + n;
+  }
+  return NULL;
+}
+
+static uint32_t read32(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+         p[3];
+}
+
+// The error code of the GOAWAY the server sent, or -1
+static long goaway_code(const Client *c) {
+  size_t len;
+  const uint8_t *p = find_frame(c, FRAME_GOAWAY, 0, &len, NULL);
+  return p && len >= 8 ? (long)read32(p + 4) : -1;
+}
+
+// The error code of the RST_STREAM the server sent for 'stream', or -1
+static long reset_code(const Client *c, uint32_t stream) {
+  size_t len;
+  const uint8_t *p = find_frame(c, FRAME_RST_STREAM, stream, &len, NULL);
+  return p && len == 4 ? (long)read32(p) : -1;
+}
+
+static void test_request(void) {
+  Client *c = malloc(sizeof(*c));
+  open_client(c);
+  size_t len;
+  CHECK(find_frame(c, FRAME_SETTINGS, 0, &len, NULL) != NULL);
+  CHECK(find_frame(c, FRAME_WINDOW_UPDATE, 0, &len, NULL) != NULL);
+
+  Frames F = {.len = 0};
+  uint8_t block[128];
+  add_frame(&F, FRAME_HEADERS, FLAG_END_STREAM | FLAG_END_HEADERS, 1, block,
+            request_block(block, "GET", "/echo/h2-test"));
+  feed(c, F.data, F.len);
+  uint8_t flags = 0;
+  const uint8_t *p = find_frame(c, FRAME_HEADERS, 1, &len, &flags);
+  CHECK(p && len > 0 && p[0] == 0x88); // :status: 200
+  CHECK(flags & FLAG_END_HEADERS);
+  p = find_frame(c, FRAME_DATA, 1, &len, &flags);
+  CHECK(p && memmem(p, len, "h2-test", 7) != NULL);
+  CHECK_EQ(goaway_code(c), -1);
+  CHECK(!c->dropped);
+  close_client(c);
+  free(c);
+}
+
+static void test_connection_window(void) {
+  Client *c = malloc(sizeof(*c));
+  open_client(c);
+  Frames F = {.len = 0};
+  add_window_update(&F, 0, 0x7fffffff);
+  feed(c, F.data, F.len);
+  CHECK_EQ(goaway_code(c), 0x3); // FLOW_CONTROL_ERROR
+  CHECK(c->conn->close_after_send);
+  close_client(c);
+
+  // An increment of 0 is a protocol error
+  open_client(c);
+  F.len = 0;
+  add_window_update(&F, 0, 0);
+  feed(c, F.data, F.len);
+  CHECK_EQ(goaway_code(c), 0x1);
+  close_client(c);
+  free(c);
+}
+
+static void test_stream_windows(void) {
+  Client *c = malloc(sizeof(*c));
+  open_client(c);
+  Frames F = {.len = 0};
+  uint8_t block[128];
+  // A request body beyond the stream's window resets that stream only
+  add_frame(&F, FRAME_HEADERS, FLAG_END_HEADERS, 1, block,
+            request_block(block, "POST", "/echo"));
+  feed(c, F.data, F.len);
+  static uint8_t body[HTTP2_STREAM_WINDOW + 1];
+  memset(body, 'b', sizeof(body));
+  F.len = 0;
+  add_frame(&F, FRAME_DATA, FLAG_END_STREAM, 1, body, sizeof(body));
+  feed(c, F.data, F.len);
+  CHECK_EQ(reset_code(c, 1), 0x3);
+
+  // So does a WINDOW_UPDATE taking a stream's send window past 2^31 - 1
+  F.len = 0;
+  add_frame(&F, FRAME_HEADERS, FLAG_END_HEADERS, 3, block,
+            request_block(block, "POST", "/echo"));
+  add_window_update(&F, 3, 0x7fffffff);
+  feed(c, F.data, F.len);
+  CHECK_EQ(reset_code(c, 3), 0x3);
+  CHECK_EQ(goaway_code(c), -1);
+  CHECK(!c->conn->close_after_send);
+  close_client(c);
+  free(c);
+}
+
+// A DATA frame read in pieces keeps the body timeout, which every read
+// renews; only a header block in pieces runs against the head deadline
+static void test_timeouts(void) {
+  Client *c = malloc(sizeof(*c));
+  open_client(c);
+  CHECK_EQ(http2_waiting_for(c->conn), TIMEOUT_IDLE);
+  Frames F = {.len = 0};
+  uint8_t block[128];
+  add_frame(&F, FRAME_HEADERS, FLAG_END_HEADERS, 1, block,
+            request_block(block, "POST", "/echo"));
+  feed(c, F.data, F.len);
+  CHECK_EQ(http2_waiting_for(c->conn), TIMEOUT_BODY);
+
+  static uint8_t body[4096];
+  memset(body, 'b', sizeof(body));
+  F.len = 0;
+  add_frame(&F, FRAME_DATA, 0, 1, body, sizeof(body));
+  feed(c, F.data, 9 + 100);
+  CHECK_EQ(http2_waiting_for(c->conn), TIMEOUT_BODY);
+  feed(c, F.data + 9 + 100, 5);
+  CHECK_EQ(http2_waiting_for(c->conn), TIMEOUT_BODY);
+  feed(c, F.data + 9 + 105, F.len - 9 - 105);
+  CHECK_EQ(http2_waiting_for(c->conn), TIMEOUT_BODY);
+
+  // Part of the next frame header, then part of a header block
+  F.len = 0;
+  add_frame(&F, FRAME_HEADERS, FLAG_END_HEADERS, 3, block,
+            request_block(block, "POST", "/echo"));
+  feed(c, F.data, 4);
+  CHECK_EQ(http2_waiting_for(c->conn), TIMEOUT_BODY);
+  feed(c, F.data + 4, 7);
+  CHECK_EQ(http2_waiting_for(c->conn), TIMEOUT_HEAD);
+  feed(c, F.data + 11, F.len - 11);
+  CHECK_EQ(http2_waiting_for(c->conn), TIMEOUT_BODY);
+  CHECK_EQ(goaway_code(c), -1);
+  close_client(c);
+
+  // With no stream open, the rest of a frame header waits like a head
+  open_client(c);
+  F.len = 0;
+  add_window_update(&F, 0, 100);
+  feed(c, F.data, 5);
+  CHECK_EQ(http2_waiting_for(c->conn), TIMEOUT_HEAD);
+  feed(c, F.data + 5, F.len - 5);
+  CHECK_EQ(http2_waiting_for(c->conn), TIMEOUT_IDLE);
+  close_client(c);
+  free(c);
+}
+
+static void test_oversized(void) {
+  Client *c = malloc(sizeof(*c));
+  static uint8_t filler[HTTP2_MAX_FRAME + 1];
+  memset(filler, 0x82, sizeof(filler)); // Indexed :method: GET, repeated
+
+  // A frame beyond the largest we allow
+  open_client(c);
+  Frames F = {.len = 0};
+  add_frame(&F, FRAME_DATA, 0, 1, filler, HTTP2_MAX_FRAME + 1);
+  feed(c, F.data, F.len);
+  CHECK_EQ(goaway_code(c), 0x6); // FRAME_SIZE_ERROR
+  close_client(c);
+
+  // A header block spread over frames that do not fit together
+  open_client(c);
+  F.len = 0;
+  add_frame(&F, FRAME_HEADERS, 0, 1, filler, 10000);
+  add_frame(&F, FRAME_CONTINUATION, FLAG_END_HEADERS, 1, filler, 10000);
+  feed(c, F.data, F.len);
+  CHECK_EQ(goaway_code(c), 0xb); // ENHANCE_YOUR_CALM
+  close_client(c);
+
+  // Another frame in the middle of a header block
+  open_client(c);
+  F.len = 0;
+  add_frame(&F, FRAME_HEADERS, 0, 1, filler, 10);
+  add_window_update(&F, 0, 100);
+  feed(c, F.data, F.len);
+  CHECK_EQ(goaway_code(c), 0x1); // PROTOCOL_ERROR
+  close_client(c);
+  free(c);
+}
+
+// HEADERS on a stream id at or below one already used: a request there is
+// a connection error, trailers for a stream that is gone a stream error
+static void test_closed_streams(void) {
+  Client *c = malloc(sizeof(*c));
+  uint8_t block[128];
+  static const uint8_t trailer[] = {0x00, 3, 'x', '-', 't', 1, '1'};
+
+  // A second request on a finished stream
+  open_client(c);
+  Frames F = {.len = 0};
+  add_frame(&F, FRAME_HEADERS, FLAG_END_STREAM | FLAG_END_HEADERS, 1, block,
+            request_block(block, "GET", "/echo/one"));
+  feed(c, F.data, F.len);
+  size_t len;
+  CHECK(find_frame(c, FRAME_DATA, 1, &len, NULL) != NULL);
+  F.len = 0;
+  add_frame(&F, FRAME_HEADERS, FLAG_END_STREAM | FLAG_END_HEADERS, 1, block,
+            request_block(block, "GET", "/echo/two"));
+  feed(c, F.data, F.len);
+  CHECK_EQ(goaway_code(c), 0x1); // PROTOCOL_ERROR
+  close_client(c);
+
+  // A request on a lower id that was never used
+  open_client(c);
+  F.len = 0;
+  add_frame(&F, FRAME_HEADERS, FLAG_END_STREAM | FLAG_END_HEADERS, 5, block,
+            request_block(block, "GET", "/echo/five"));
+  add_frame(&F, FRAME_HEADERS, FLAG_END_STREAM | FLAG_END_HEADERS, 3, block,
+            request_block(block, "GET", "/echo/three"));
+  feed(c, F.data, F.len);
+  CHECK_EQ(goaway_code(c), 0x1);
+  close_client(c);
+
+  // Trailers for a stream that has closed reset it, and the connection
+  // goes on
+  open_client(c);
+  F.len = 0;
+  add_frame(&F, FRAME_HEADERS, FLAG_END_STREAM | FLAG_END_HEADERS, 1, block,
+            request_block(block, "GET", "/echo/one"));
+  feed(c, F.data, F.len);
+  F.len = 0;
+  add_frame(&F, FRAME_HEADERS, FLAG_END_STREAM | FLAG_END_HEADERS, 1,
+            trailer, sizeof(trailer));
+  add_frame(&F, FRAME_HEADERS, FLAG_END_STREAM | FLAG_END_HEADERS, 3, block,
+            request_block(block, "GET", "/echo/three"));
+  feed(c, F.data, F.len);
+  CHECK_EQ(reset_code(c, 1), 0x5); // STREAM_CLOSED
+  CHECK_EQ(goaway_code(c), -1);
+  CHECK(find_frame(c, FRAME_DATA, 3, &len, NULL) != NULL);
+  close_client(c);
+  free(c);
+}
+
+static void test_bad_hpack(void) {
+  static const uint8_t blocks[][5] = {
+      {0xff, 0x00},                  // Index past both tables
+      {0x00, 0x01, 'a', 0x81},       // Value cut off
+      {0x3f, 0xe2, 0x1f},            // Table size above what we announced
+      {0x00, 0x01, 'a', 0x81, 0x18}, // Huffman padding of zeros
+  };
+  static const size_t lengths[] = {2, 4, 3, 5};
+  Client *c = malloc(sizeof(*c));
+  for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); ++i) {
+    open_client(c);
+    Frames F = {.len = 0};
+    add_frame(&F, FRAME_HEADERS, FLAG_END_STREAM | FLAG_END_HEADERS, 1,
+              blocks[i], lengths[i]);
+    feed(c, F.data, F.len);
+    CHECK_EQ(goaway_code(c), 0x9); // COMPRESSION_ERROR
+    close_client(c);
+  }
+  free(c);
+}
+
+int main(void) {
+  ServerOptions opts = {0}; // The built-in routes only, no -P
+  if (setup_routes(&opts) < 0)
+    return EXIT_FAILURE;
+  memory_pools_init(&pools);
+  initializeCannedResponses(&responses, time(NULL));
+
+  test_request();
+  test_connection_window();
+  test_stream_windows();
+  test_timeouts();
+  test_oversized();
+  test_closed_streams();
+  test_bad_hpack();
+
+  memory_pools_destroy(&pools);
+  free_routes();
+  return test_report("test_http2");
+}
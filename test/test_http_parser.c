@@ -0,0 +1,328 @@
+// Tests of the request parser: heads parsed whole and fed a byte at a
+// time, the errors it reports, and Content-Length and chunked bodies
+// decoded from input split at every point, with a sink that pauses or
+// aborts.
+
+#include "test.h"
+#include "../include/config.h"
+#include "../include/http_parser.h"
+
+#include <string.h> // For memcmp, memset, strlen
+
+static int view_is(StringView v, const char *s) {
+  return v.len == strlen(s) && memcmp(v.ptr, s, v.len) == 0;
+}
+
+static void test_parse_request(void) {
+  static const char head[] = "POST /items/7?view=full&x=1 HTTP/1.1\r\n"
+                             "Host: example.com\r\n"
+                             "X-Padded:  \t value with spaces \t \r\n"
+                             "Empty:\r\n"
+                             "Content-Length: 12\r\n"
+                             "Expect: 100-continue\r\n\r\n";
+  ClientRequest C;
+  CHECK_EQ(parseRequest(head, strlen(head), &C), PARSE_OK);
+  CHECK_EQ(C.http_method, HTTP_METHOD_POST);
+  CHECK(view_is(C.method_name, "POST"));
+  CHECK(view_is(C.target, "/items/7?view=full&x=1"));
+  CHECK(view_is(C.route, "/items/7"));
+  CHECK(view_is(C.query, "view=full&x=1"));
+  CHECK(view_is(C.http_version, "HTTP/1.1"));
+  CHECK_EQ(C.version_minor, 1);
+  CHECK_EQ(C.header_count, 5);
+  CHECK(view_is(C.headers[0].name, "Host"));
+  CHECK(view_is(C.headers[1].value, "value with spaces"));
+  CHECK(view_is(C.headers[2].value, ""));
+  CHECK_EQ(C.content_length, 12);
+  CHECK(!C.chunked);
+  CHECK(C.expect_continue);
+  CHECK(C.keep_alive);
+
+  // Bare LFs, an unknown method and HTTP/1.0 defaults
+  static const char old[] = "PURGE /cache HTTP/1.0\nHost: a\n\n";
+  CHECK_EQ(parseRequest(old, strlen(old), &C), PARSE_OK);
+  CHECK_EQ(C.http_method, HTTP_METHOD_UNKNOWN);
+  CHECK(view_is(C.method_name, "PURGE"));
+  CHECK(view_is(C.query, ""));
+  CHECK_EQ(C.version_minor, 0);
+  CHECK(!C.keep_alive);
+
+  static const char keep[] = "GET / HTTP/1.0\r\n"
+                             "Connection: Keep-Alive\r\n\r\n";
+  CHECK_EQ(parseRequest(keep, strlen(keep), &C), PARSE_OK);
+  CHECK(C.keep_alive);
+  static const char closing[] = "GET / HTTP/1.1\r\n"
+                                 "Connection: upgrade, close\r\n\r\n";
+  CHECK_EQ(parseRequest(closing, strlen(closing), &C), PARSE_OK);
+  CHECK(!C.keep_alive);
+  static const char chunked[] = "PUT /f HTTP/1.1\r\n"
+                                "Transfer-Encoding: chunked\r\n\r\n";
+  CHECK_EQ(parseRequest(chunked, strlen(chunked), &C), PARSE_OK);
+  CHECK(C.chunked);
+}
+
+static void test_bad_requests(void) {
+  static const struct {
+    const char *head;
+    int status;
+  } cases[] = {
+      {"GET / HTTP/1.1\r\nHost: a\r\n", PARSE_MALFORMED}, // No blank line
+      {"GET  / HTTP/1.1\r\n\r\n", PARSE_MALFORMED},
+      {"GET / HTTP/2.0\r\n\r\n", PARSE_MALFORMED},
+      {"GET / HTTP/1.1 \r\n\r\n", PARSE_MALFORMED},
+      {"GET /a b HTTP/1.1\r\n\r\n", PARSE_MALFORMED},
+      {"G(T / HTTP/1.1\r\n\r\n", PARSE_MALFORMED},
+      {"GET / HTTP/1.1\r\nNo Colon\r\n\r\n", PARSE_MALFORMED},
+      {"GET / HTTP/1.1\r\nName : v\r\n\r\n", PARSE_MALFORMED},
+      {"GET / HTTP/1.1\r\n folded: v\r\n\r\n", PARSE_MALFORMED},
+      {"GET / HTTP/1.1\r\nA: b\x01\x63\r\n\r\n", PARSE_MALFORMED},
+      {"GET / HTTP/1.1\r\nA: b\rc\r\n\r\n", PARSE_MALFORMED},
+      {"POST / HTTP/1.1\r\nContent-Length: 1\r\n"
+       "Transfer-Encoding: chunked\r\n\r\n",
+       PARSE_MALFORMED},
+      {"POST / HTTP/1.1\r\nContent-Length: 1\r\nContent-Length: 1\r\n\r\n",
+       PARSE_MALFORMED},
+      {"POST / HTTP/1.1\r\nContent-Length: 1x\r\n\r\n", PARSE_MALFORMED},
+      {"POST / HTTP/1.1\r\nContent-Length: -1\r\n\r\n", PARSE_MALFORMED},
+      {"POST / HTTP/1.1\r\nContent-Length:\r\n\r\n", PARSE_MALFORMED},
+      {"POST / HTTP/1.1\r\nContent-Length: 99999999999999999999\r\n\r\n",
+       PARSE_BODY_TOO_LARGE},
+      {"POST / HTTP/1.1\r\nTransfer-Encoding: gzip, chunked\r\n\r\n",
+       PARSE_UNSUPPORTED_ENCODING},
+  };
+  ClientRequest C;
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+    int status = parseRequest(cases[i].head, strlen(cases[i].head), &C);
+    CHECK_EQ(status, cases[i].status);
+    if (status != cases[i].status)
+      fprintf(stderr, "    for: %s\n", cases[i].head);
+  }
+
+  static char many[MAX_HEADERS * 8 + 64];
+  size_t len = (size_t)sprintf(many, "GET / HTTP/1.1\r\n");
+  for (int i = 0; i <= MAX_HEADERS; ++i)
+    len += (size_t)sprintf(many + len, "H%d: v\r\n", i);
+  len += (size_t)sprintf(many + len, "\r\n");
+  CHECK_EQ(parseRequest(many, len, &C), PARSE_TOO_MANY_HEADERS);
+}
+
+static void test_incremental_head(void) {
+  static const char input[] = "GET /echo/split HTTP/1.1\r\n"
+                              "Host: localhost\r\n"
+                              "Accept: */*\r\n\r\n"
+                              "GET /next HTTP/1.1\r\n";
+  size_t head = strlen(input) - strlen("GET /next HTTP/1.1\r\n");
+  HttpParser P;
+  ClientRequest C;
+  size_t head_len = 0;
+  httpParserReset(&P);
+  // Fed as it would arrive, one more byte each time
+  for (size_t len = 1; len < head; ++len)
+    CHECK_EQ(httpParserHead(&P, input, len, &C, &head_len), PARSE_NEED_MORE);
+  CHECK_EQ(httpParserHead(&P, input, strlen(input), &C, &head_len), PARSE_OK);
+  CHECK_EQ(head_len, head);
+  CHECK(view_is(C.route, "/echo/split"));
+  CHECK(!httpParserInBody(&P));
+
+  // The search resumes where it stopped, even inside the blank line
+  httpParserReset(&P);
+  CHECK_EQ(httpParserHead(&P, input, head - 1, &C, &head_len),
+           PARSE_NEED_MORE);
+  CHECK_EQ(httpParserHead(&P, input, head, &C, &head_len), PARSE_OK);
+  CHECK_EQ(head_len, head);
+
+  // A head that does not end within MAX_HEAD_SIZE
+  static char big[MAX_HEAD_SIZE + 64];
+  memset(big, 'a', sizeof(big));
+  memcpy(big, "GET / HTTP/1.1\r\nX: ", 19);
+  httpParserReset(&P);
+  CHECK_EQ(httpParserHead(&P, big, MAX_HEAD_SIZE - 1, &C, &head_len),
+           PARSE_NEED_MORE);
+  CHECK_EQ(httpParserHead(&P, big, MAX_HEAD_SIZE, &C, &head_len),
+           PARSE_HEAD_TOO_LARGE);
+  memcpy(big + MAX_HEAD_SIZE + 10, "\r\n\r\n", 4);
+  httpParserReset(&P);
+  CHECK_EQ(httpParserHead(&P, big, sizeof(big), &C, &head_len),
+           PARSE_HEAD_TOO_LARGE);
+}
+
+// Collects the decoded body. Takes at most 'limit' bytes per call if that
+// is not 0, and aborts once 'abort_at' bytes were taken if that is not 0.
+typedef struct {
+  char data[4096];
+  size_t len;
+  size_t limit;
+  size_t abort_at;
+} Body;
+
+static ssize_t collect(void *ctx, const char *data, size_t len) {
+  Body *B = ctx;
+  if (B->abort_at && B->len >= B->abort_at)
+    return -1;
+  if (B->limit && len > B->limit)
+    len = B->limit;
+  if (len > sizeof(B->data) - B->len)
+    len = sizeof(B->data) - B->len;
+  memcpy(B->data + B->len, data, len);
+  B->len += len;
+  return (ssize_t)len;
+}
+
+// Parse 'head', then feed 'body' in pieces of 'piece' bytes, resuming
+// after every pause the way the event loop does. Returns the final status
+// and the input used in 'used'.
+static int feed_body(const char *head, const char *body, size_t body_len,
+                     size_t piece, Body *B, size_t *used) {
+  HttpParser P;
+  ClientRequest C;
+  size_t head_len;
+  httpParserReset(&P);
+  if (httpParserHead(&P, head, strlen(head), &C, &head_len) != PARSE_OK)
+    return -100;
+  *used = 0;
+  int status = PARSE_NEED_MORE;
+  size_t available = 0;
+  while (httpParserInBody(&P)) {
+    if (available < body_len)
+      available = available + piece < body_len ? available + piece
+                                               : body_len;
+    size_t consumed = 0;
+    status = httpParserBody(&P, body + *used, available - *used, &consumed,
+                            collect, B);
+    *used += consumed;
+    if (status < 0 || status == PARSE_OK)
+      break;
+    if (status == PARSE_NEED_MORE && available == body_len)
+      break;
+  }
+  return status;
+}
+
+static const char chunked_head[] = "POST /echo HTTP/1.1\r\n"
+                                   "Transfer-Encoding: chunked\r\n\r\n";
+
+static void test_length_body(void) {
+  static const char head[] = "POST /echo HTTP/1.1\r\n"
+                             "Content-Length: 11\r\n\r\n";
+  static const char body[] = "hello worldGET / HTTP/1.1\r\n\r\n";
+  for (size_t piece = 1; piece <= 12; ++piece) {
+    Body B = {.len = 0};
+    size_t used;
+    CHECK_EQ(feed_body(head, body, strlen(body), piece, &B, &used),
+             PARSE_OK);
+    CHECK_EQ(used, 11);
+    CHECK(B.len == 11 && memcmp(B.data, "hello world", 11) == 0);
+  }
+  // A sink taking 2 bytes at a time pauses the parser
+  Body B = {.limit = 2};
+  size_t used;
+  CHECK_EQ(feed_body(head, body, strlen(body), 64, &B, &used), PARSE_OK);
+  CHECK(B.len == 11 && memcmp(B.data, "hello world", 11) == 0);
+  // And one that aborts fails it
+  Body aborting = {.limit = 2, .abort_at = 4};
+  CHECK_EQ(feed_body(head, body, strlen(body), 64, &aborting, &used),
+           PARSE_MALFORMED);
+}
+
+static void test_chunked_body(void) {
+  static const char body[] = "4\r\nWiki\r\n"
+                             "5;name=value; other\r\n"
+                             "pedia\r\n"
+                             "E\r\n in\r\n\r\nchunks.\r\n"
+                             "0a \r\n0123456789\n"
+                             "0\r\n"
+                             "Trailer-One: x\r\n"
+                             "Trailer-Two: y\r\n"
+                             "\r\n"
+                             "GET / HTTP/1.1\r\n\r\n";
+  static const char decoded[] = "Wikipedia in\r\n\r\nchunks.0123456789";
+  size_t end = strlen(body) - strlen("GET / HTTP/1.1\r\n\r\n");
+  for (size_t piece = 1; piece <= strlen(body); ++piece) {
+    Body B = {.len = 0};
+    size_t used;
+    int status = feed_body(chunked_head, body, strlen(body), piece, &B,
+                           &used);
+    CHECK_EQ(status, PARSE_OK);
+    CHECK_EQ(used, end);
+    CHECK(B.len == strlen(decoded) && memcmp(B.data, decoded, B.len) == 0);
+  }
+  Body B = {.limit = 3};
+  size_t used;
+  CHECK_EQ(feed_body(chunked_head, body, strlen(body), 1000, &B, &used),
+           PARSE_OK);
+  CHECK(B.len == strlen(decoded) && memcmp(B.data, decoded, B.len) == 0);
+
+  // The last chunk without trailers, ended by a bare LF
+  static const char bare[] = "3\r\nabc\n0\n\n";
+  Body C = {.len = 0};
+  CHECK_EQ(feed_body(chunked_head, bare, strlen(bare), 1, &C, &used),
+           PARSE_OK);
+  CHECK_EQ(used, strlen(bare));
+  CHECK(C.len == 3 && memcmp(C.data, "abc", 3) == 0);
+}
+
+static void test_bad_chunks(void) {
+  static const struct {
+    const char *body;
+    int status;
+  } cases[] = {
+      {"\r\n", PARSE_MALFORMED},               // No size
+      {"x\r\n", PARSE_MALFORMED},              // Not hex
+      {";ext\r\n", PARSE_MALFORMED},           // Extension without a size
+      {"4\rX", PARSE_MALFORMED},               // CR without LF
+      {"4\r\nWikiX\r\n", PARSE_MALFORMED},     // Data longer than its size
+      {"4\r\nWiki\r\r", PARSE_MALFORMED},      // CR CR after the data
+      {"0\r\n\rX", PARSE_MALFORMED},           // Bad final CRLF
+      {"fffffffffffffffff\r\n", PARSE_BODY_TOO_LARGE},
+      {"800001\r\n", PARSE_BODY_TOO_LARGE},    // Over MAX_BODY_SIZE at once
+  };
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+    for (size_t piece = 1; piece <= 3; piece += 2) {
+      Body B = {.len = 0};
+      size_t used;
+      int status = feed_body(chunked_head, cases[i].body,
+                             strlen(cases[i].body), piece, &B, &used);
+      CHECK_EQ(status, cases[i].status);
+      if (status != cases[i].status)
+        fprintf(stderr, "    for: %s\n", cases[i].body);
+    }
+  }
+
+  // Chunk-size lines and trailers are not buffered, but still limited
+  static char line[MAX_CHUNK_LINE + 16];
+  memset(line, 'e', sizeof(line) - 1);
+  line[sizeof(line) - 1] = '\0';
+  memcpy(line, "1;", 2);
+  Body B = {.len = 0};
+  size_t used;
+  CHECK_EQ(feed_body(chunked_head, line, strlen(line), 100, &B, &used),
+           PARSE_MALFORMED);
+  static char trailer[MAX_CHUNK_LINE + 16];
+  memset(trailer, 't', sizeof(trailer) - 1);
+  trailer[sizeof(trailer) - 1] = '\0';
+  memcpy(trailer, "0\r\nT: ", 6);
+  CHECK_EQ(feed_body(chunked_head, trailer, strlen(trailer), 100, &B, &used),
+           PARSE_MALFORMED);
+
+  // Chunks that add up to more than MAX_BODY_SIZE
+  HttpParser P;
+  ClientRequest C;
+  size_t head_len, consumed;
+  httpParserReset(&P);
+  CHECK_EQ(httpParserHead(&P, chunked_head, strlen(chunked_head), &C,
+                          &head_len),
+           PARSE_OK);
+  P.body_bytes = MAX_BODY_SIZE - 2; // As if that much had been delivered
+  CHECK_EQ(httpParserBody(&P, "3\r\n", 3, &consumed, collect, &B),
+           PARSE_BODY_TOO_LARGE);
+}
+
+int main(void) {
+  test_parse_request();
+  test_bad_requests();
+  test_incremental_head();
+  test_length_body();
+  test_chunked_body();
+  test_bad_chunks();
+  return test_report("test_http_parser");
+}
@@ -0,0 +1,215 @@
+// Tests of the response cache: keys matched on method, coding and the
+// whole target, entries expiring after their time to live, expired
+// entries replaced in place, the size limits, and CLOCK eviction once the
+// entry or byte bound is reached, which spares entries served since the
+// hand last passed them.
+
+#include "test.h"
+#include "../include/response_cache.h"
+
+#include <stdio.h>  // For snprintf
+#include <string.h> // For memcpy, memcmp, memset, strlen
+
+static ResponseCache cache;
+
+static ResponseKey key_of(uint8_t method, uint8_t coding,
+                          const char *target) {
+  ResponseKey key = {method, coding, {target, strlen(target)}};
+  return key;
+}
+
+// Cache 'body' as the response to 'target' with GET and no coding
+static CachedResponse *put(const char *target, const char *body,
+                           unsigned ttl_ms) {
+  ResponseKey key = key_of(1, 0, target);
+  CachedResponse *entry =
+      response_cache_insert(&cache, &key, strlen(body), 200, ttl_ms);
+  if (entry)
+    memcpy(entry->response, body, strlen(body));
+  return entry;
+}
+
+static CachedResponse *get(const char *target) {
+  ResponseKey key = key_of(1, 0, target);
+  return response_cache_lookup(&cache, &key);
+}
+
+static int holds(const CachedResponse *entry, const char *body) {
+  return entry && entry->len == strlen(body) &&
+         memcmp(entry->response, body, entry->len) == 0;
+}
+
+static void test_keys(void) {
+  response_cache_init(&cache);
+  cache.now_ms = 1000;
+  CHECK(get("/a") == NULL);
+  CachedResponse *entry = put("/a", "response a", 1000);
+  CHECK(entry != NULL);
+  CHECK_EQ(entry->status, 200);
+  CHECK_EQ(entry->date_offset, entry->len);
+  CHECK(holds(get("/a"), "response a"));
+
+  // Method, coding and target all have to match, the target in full
+  ResponseKey key = key_of(2, 0, "/a");
+  CHECK(response_cache_lookup(&cache, &key) == NULL);
+  key = key_of(1, 1, "/a");
+  CHECK(response_cache_lookup(&cache, &key) == NULL);
+  CHECK(get("/a?") == NULL);
+  CHECK(get("/") == NULL);
+  CHECK(get("/A") == NULL);
+
+  // The same target under another coding is an entry of its own
+  key = key_of(1, 1, "/a");
+  entry = response_cache_insert(&cache, &key, 4, 200, 1000);
+  CHECK(entry != NULL);
+  memcpy(entry->response, "gzip", 4);
+  CHECK(holds(response_cache_lookup(&cache, &key), "gzip"));
+  CHECK(holds(get("/a"), "response a"));
+  CHECK_EQ(cache.count, 2);
+
+  // Targets too long for a key and responses too large are not cached
+  static char target[RESPONSE_CACHE_KEY_MAX];
+  memset(target, 'x', sizeof(target) - 1);
+  target[0] = '/';
+  target[sizeof(target) - 1] = '\0';
+  CHECK(put(target, "long", 1000) == NULL);
+  target[sizeof(target) - 2] = '\0';
+  CHECK(put(target, "long", 1000) != NULL);
+  key = key_of(1, 0, "/big");
+  CHECK(response_cache_insert(&cache, &key, RESPONSE_CACHE_MAX_SIZE + 1,
+                              200, 1000) == NULL);
+  CHECK(response_cache_insert(&cache, &key, RESPONSE_CACHE_MAX_SIZE, 200,
+                              1000) != NULL);
+
+  response_cache_destroy(&cache);
+  CHECK_EQ(cache.count, 0);
+  CHECK_EQ(cache.bytes, 0);
+}
+
+static void test_ttl(void) {
+  response_cache_init(&cache);
+  cache.now_ms = 5000;
+  CachedResponse *entry = put("/t", "first", 100);
+  cache.now_ms = 5099;
+  CHECK(get("/t") == entry);
+  cache.now_ms = 5100;
+  CHECK(get("/t") == NULL);
+
+  // An expired entry with room for the new response keeps its memory,
+  // a larger response replaces it
+  size_t bytes = cache.bytes;
+  CHECK(put("/t", "again", 100) == entry);
+  CHECK_EQ(cache.count, 1);
+  CHECK_EQ(cache.bytes, bytes);
+  CHECK(holds(get("/t"), "again"));
+  CachedResponse *larger = put("/t", "a larger response", 100);
+  CHECK(larger != NULL);
+  CHECK_EQ(cache.count, 1);
+  CHECK(cache.bytes > bytes);
+  CHECK(holds(get("/t"), "a larger response"));
+
+  // A time to live of 0 is never served
+  put("/zero", "zero", 0);
+  CHECK(get("/zero") == NULL);
+  response_cache_destroy(&cache);
+}
+
+// Fill every place on the clock; entries 0 to 'served' - 1 are served
+// once. Entry i goes to clock slot i, the first place handed out.
+static void fill(size_t served) {
+  char target[32];
+  for (size_t i = 0; i < RESPONSE_CACHE_ENTRIES; ++i) {
+    snprintf(target, sizeof(target), "/entry/%zu", i);
+    put(target, "x", 60000);
+  }
+  for (size_t i = 0; i < served; ++i) {
+    snprintf(target, sizeof(target), "/entry/%zu", i);
+    get(target);
+  }
+}
+
+static int cached(size_t i) {
+  char target[32];
+  snprintf(target, sizeof(target), "/entry/%zu", i);
+  ResponseKey key = key_of(1, 0, target);
+  // Looked up without marking it served
+  CachedResponse *entry = response_cache_lookup(&cache, &key);
+  if (entry)
+    entry->referenced = 0;
+  return entry != NULL;
+}
+
+static void test_clock(void) {
+  response_cache_init(&cache);
+  cache.now_ms = 1;
+  fill(RESPONSE_CACHE_ENTRIES / 2);
+  CHECK_EQ(cache.count, RESPONSE_CACHE_ENTRIES);
+
+  // The hand passes the served entries, taking their mark, and drops the
+  // first one that was not served
+  put("/new/0", "x", 60000);
+  CHECK_EQ(cache.count, RESPONSE_CACHE_ENTRIES);
+  CHECK(!cached(RESPONSE_CACHE_ENTRIES / 2));
+  CHECK(cached(RESPONSE_CACHE_ENTRIES / 2 + 1));
+  CHECK(cached(0));
+  CHECK(cached(RESPONSE_CACHE_ENTRIES / 2 - 1));
+  CHECK(holds(get("/new/0"), "x"));
+  put("/new/1", "x", 60000);
+  CHECK(!cached(RESPONSE_CACHE_ENTRIES / 2 + 1));
+  response_cache_destroy(&cache);
+
+  // With every entry served, each gets a second chance and the hand comes
+  // round to the first one again
+  response_cache_init(&cache);
+  fill(RESPONSE_CACHE_ENTRIES);
+  put("/new/0", "x", 60000);
+  CHECK(!cached(0));
+  CHECK(cached(1));
+  CHECK(cached(RESPONSE_CACHE_ENTRIES - 1));
+  response_cache_destroy(&cache);
+
+  // An expired entry goes first, served or not
+  response_cache_init(&cache);
+  fill(RESPONSE_CACHE_ENTRIES);
+  CachedResponse *entry = put("/entry/7", "x", 10);
+  CHECK(entry != NULL);
+  entry->referenced = 1;
+  cache.now_ms += 10;
+  put("/new/0", "x", 60000);
+  CHECK(!cached(7));
+  CHECK(cached(0));
+  CHECK(cached(6));
+  CHECK(cached(8));
+  response_cache_destroy(&cache);
+}
+
+// Large responses reach the byte bound before the entry bound
+static void test_bytes(void) {
+  response_cache_init(&cache);
+  static char body[RESPONSE_CACHE_MAX_SIZE + 1];
+  memset(body, 'b', sizeof(body) - 1);
+  char target[32];
+  size_t inserted = 0;
+  int within = 1;
+  for (size_t i = 0; i < 2 * RESPONSE_CACHE_BYTES / sizeof(body); ++i) {
+    snprintf(target, sizeof(target), "/large/%zu", i);
+    inserted += put(target, body, 60000) != NULL;
+    within &= cache.bytes <= RESPONSE_CACHE_BYTES;
+  }
+  CHECK(within);
+  CHECK(cache.count < inserted);
+  CHECK(cache.count >= RESPONSE_CACHE_BYTES / sizeof(body) - 1);
+  // The newest is kept, the oldest gone
+  CHECK(holds(get(target), body));
+  CHECK(get("/large/0") == NULL);
+  response_cache_destroy(&cache);
+  CHECK_EQ(cache.bytes, 0);
+}
+
+int main(void) {
+  test_keys();
+  test_ttl();
+  test_clock();
+  test_bytes();
+  return test_report("test_response_cache");
+}
@@ -0,0 +1,287 @@
+// Tests of the router: exact paths through the perfect hash, the priority
+// of literal segments over {param} segments over a trailing '*', backing
+// up out of a dead end, 405 against 404, and rejected patterns. A table of
+// generated routes is checked against the pattern it was registered with.
+
+#include "test.h"
+#include "../include/router.h"
+
+#include <fcntl.h>  // For open, O_WRONLY
+#include <stdio.h>  // For fflush, snprintf
+#include <string.h> // For memcmp, strcmp, strlen
+#include <unistd.h> // For close, dup, dup2
+
+// Handlers are only compared, never called
+static int handler_a(Connection *conn, const ClientRequest *C,
+                     const RouteMatch *match, ConnectionMode mode) {
+  (void)conn, (void)C, (void)match, (void)mode;
+  return 0;
+}
+
+static int handler_b(Connection *conn, const ClientRequest *C,
+                     const RouteMatch *match, ConnectionMode mode) {
+  (void)conn, (void)C, (void)match, (void)mode;
+  return 0;
+}
+
+static StringView view(const char *s) { return (StringView){s, strlen(s)}; }
+
+static int view_is(StringView v, const char *s) {
+  return v.len == strlen(s) && memcmp(v.ptr, s, v.len) == 0;
+}
+
+// Match 'path' with GET and return the pattern of the route, or NULL
+static const char *matched(const Router *router, const char *path,
+                           RouteMatch *match) {
+  router_match(router, view(path), HTTP_METHOD_GET, match);
+  return match->route ? match->route->pattern : NULL;
+}
+
+static int pattern_is(const char *got, const char *want) {
+  return got && strcmp(got, want) == 0;
+}
+
+static void test_priority(void) {
+  Router router;
+  router_init(&router);
+  static const char *patterns[] = {
+      "/",           "/echo",        "/echo/*",   "/users/{id}",
+      "/users/me",   "/users/{id}/posts",         "/users/{id}/*",
+      "/a/{x}/c",    "/a/b/d",       "/static*",
+  };
+  for (size_t i = 0; i < sizeof(patterns) / sizeof(*patterns); ++i)
+    CHECK_EQ(router_add(&router, ROUTE_GET, patterns[i], handler_a, 0), 0);
+  CHECK_EQ(router_compile(&router), 0);
+
+  RouteMatch m;
+  CHECK(pattern_is(matched(&router, "/", &m), "/"));
+  CHECK_EQ(m.param_count, 0);
+  CHECK(pattern_is(matched(&router, "/echo", &m), "/echo"));
+  CHECK_EQ(m.param_count, 0);
+
+  // A trailing '*' captures the rest of the path, even when it is empty
+  CHECK(pattern_is(matched(&router, "/echo/hello/world", &m), "/echo/*"));
+  CHECK_EQ(m.param_count, 1);
+  CHECK(view_is(m.params[0], "hello/world"));
+  CHECK(pattern_is(matched(&router, "/echo/", &m), "/echo/*"));
+  CHECK(view_is(m.params[0], ""));
+
+  // Literal segments win over {param}
+  CHECK(pattern_is(matched(&router, "/users/me", &m), "/users/me"));
+  CHECK_EQ(m.param_count, 0);
+  CHECK(pattern_is(matched(&router, "/users/42", &m), "/users/{id}"));
+  CHECK_EQ(m.param_count, 1);
+  CHECK(view_is(m.params[0], "42"));
+  CHECK(pattern_is(matched(&router, "/users/mex", &m), "/users/{id}"));
+  CHECK(view_is(m.params[0], "mex"));
+
+  // {param} wins over '*', which takes what the other patterns leave
+  CHECK(pattern_is(matched(&router, "/users/42/posts", &m),
+                   "/users/{id}/posts"));
+  CHECK(view_is(m.params[0], "42"));
+  CHECK(pattern_is(matched(&router, "/users/42/likes/9", &m),
+                   "/users/{id}/*"));
+  CHECK_EQ(m.param_count, 2);
+  CHECK(view_is(m.params[0], "42"));
+  CHECK(view_is(m.params[1], "likes/9"));
+  CHECK(pattern_is(matched(&router, "/users/me/posts", &m),
+                   "/users/{id}/posts"));
+  CHECK(view_is(m.params[0], "me"));
+
+  // A literal edge that leads nowhere backs up to the {param} edge, and
+  // the capture of a failed branch is dropped
+  CHECK(pattern_is(matched(&router, "/a/b/d", &m), "/a/b/d"));
+  CHECK(pattern_is(matched(&router, "/a/b/c", &m), "/a/{x}/c"));
+  CHECK_EQ(m.param_count, 1);
+  CHECK(view_is(m.params[0], "b"));
+  CHECK(matched(&router, "/a/b/e", &m) == NULL);
+  CHECK_EQ(m.param_count, 0);
+
+  // A '*' need not follow a slash; a {param} is a whole segment
+  CHECK(pattern_is(matched(&router, "/static", &m), "/static*"));
+  CHECK(view_is(m.params[0], ""));
+  CHECK(pattern_is(matched(&router, "/static/css/a.css", &m), "/static*"));
+  CHECK(view_is(m.params[0], "/css/a.css"));
+  CHECK(matched(&router, "/users/", &m) == NULL);
+  CHECK(matched(&router, "/users", &m) == NULL);
+  CHECK(pattern_is(matched(&router, "/users/42/", &m), "/users/{id}/*"));
+  CHECK(view_is(m.params[1], ""));
+  CHECK(matched(&router, "", &m) == NULL);
+  CHECK(matched(&router, "/nope", &m) == NULL);
+  CHECK(matched(&router, "/ech", &m) == NULL);
+  CHECK(matched(&router, "/echox", &m) == NULL);
+
+  router_destroy(&router);
+}
+
+static void test_methods(void) {
+  Router router;
+  router_init(&router);
+  CHECK_EQ(router_add(&router, ROUTE_GET, "/page", handler_a, 0), 0);
+  CHECK_EQ(router_add(&router, ROUTE_POST, "/page", handler_b, ROUTE_BODY),
+           0);
+  CHECK_EQ(router_add(&router, ROUTE_GET, "/own-head", handler_a, 0), 0);
+  CHECK_EQ(router_add(&router, ROUTE_HEAD, "/own-head", handler_b, 0), 0);
+  CHECK_EQ(router_add(&router, ROUTE_POST, "/items/{id}", handler_b, 0), 0);
+  CHECK_EQ(router_compile(&router), 0);
+
+  RouteMatch m;
+  CHECK_EQ(router_match(&router, view("/page"), HTTP_METHOD_GET, &m), 1);
+  CHECK(m.handler == handler_a);
+  CHECK_EQ(m.flags, 0);
+  CHECK_EQ(router_match(&router, view("/page"), HTTP_METHOD_POST, &m), 1);
+  CHECK(m.handler == handler_b);
+  CHECK_EQ(m.flags, ROUTE_BODY);
+
+  // GET answers HEAD unless HEAD has a handler of its own
+  CHECK_EQ(router_match(&router, view("/page"), HTTP_METHOD_HEAD, &m), 1);
+  CHECK(m.handler == handler_a);
+  CHECK_EQ(router_match(&router, view("/own-head"), HTTP_METHOD_HEAD, &m),
+           1);
+  CHECK(m.handler == handler_b);
+
+  // A known path without the method is a 405 with an Allow header, an
+  // unknown one a 404
+  CHECK_EQ(router_match(&router, view("/page"), HTTP_METHOD_PUT, &m), 0);
+  CHECK(pattern_is(m.route ? m.route->pattern : NULL, "/page"));
+  CHECK(m.handler == NULL);
+  CHECK(strcmp(m.route->allow_headers,
+               "Allow: GET, HEAD, POST\r\nContent-Length: 0\r\n") == 0);
+  CHECK_EQ(router_match(&router, view("/items/3"), HTTP_METHOD_GET, &m), 0);
+  CHECK(m.route != NULL);
+  CHECK_EQ(m.param_count, 1);
+  CHECK(strcmp(m.route->allow_headers,
+               "Allow: POST\r\nContent-Length: 0\r\n") == 0);
+  CHECK_EQ(router_match(&router, view("/page"), HTTP_METHOD_UNKNOWN, &m),
+           0);
+  CHECK(m.route != NULL);
+  CHECK_EQ(router_match(&router, view("/other"), HTTP_METHOD_GET, &m), 0);
+  CHECK(m.route == NULL);
+  CHECK(m.handler == NULL);
+
+  router_destroy(&router);
+}
+
+// Point stderr at /dev/null while routes are rejected on purpose, so the
+// router's complaints do not read like failed checks. Returns the saved
+// descriptor for unmute_stderr().
+static int mute_stderr(void) {
+  fflush(stderr);
+  int saved = dup(STDERR_FILENO);
+  int null = open("/dev/null", O_WRONLY);
+  if (null >= 0) {
+    dup2(null, STDERR_FILENO);
+    close(null);
+  }
+  return saved;
+}
+
+static void unmute_stderr(int saved) {
+  fflush(stderr);
+  if (saved >= 0) {
+    dup2(saved, STDERR_FILENO);
+    close(saved);
+  }
+}
+
+static void test_invalid(void) {
+  static const char *bad[] = {
+      "",          "echo",       "/a*/b",        "/a{b}",   "/{}",
+      "/{a",       "/a}",        "/{a}b",        "/{a/b}",  "/**",
+      "/{a}/{b}/{c}/{d}/{e}/{f}/{g}/{h}/*",
+  };
+  Router router;
+  router_init(&router);
+  int rejected = 0;
+  int saved = mute_stderr();
+  for (size_t i = 0; i < sizeof(bad) / sizeof(*bad); ++i)
+    rejected += router_add(&router, ROUTE_GET, bad[i], handler_a, 0) == -1;
+  rejected += router_add(&router, 0, "/a", handler_a, 0) == -1;
+  rejected += router_add(&router, ROUTE_METHOD(HTTP_METHOD_COUNT), "/a",
+                         handler_a, 0) == -1;
+  unmute_stderr(saved);
+  CHECK_EQ(rejected, sizeof(bad) / sizeof(*bad) + 2);
+  CHECK_EQ(router.route_count, 0);
+
+  // ROUTER_MAX_PARAMS captures are allowed, one more is not
+  CHECK_EQ(router_add(&router, ROUTE_GET, "/{a}/{b}/{c}/{d}/{e}/{f}/{g}/*",
+                      handler_a, 0),
+           0);
+  CHECK_EQ(router_add(&router, ROUTE_GET | ROUTE_POST, "/twice", handler_a,
+                      0),
+           0);
+  saved = mute_stderr();
+  rejected = router_add(&router, ROUTE_POST, "/twice", handler_b, 0) == -1;
+  unmute_stderr(saved);
+  CHECK(rejected);
+  CHECK_EQ(router_compile(&router), 0);
+
+  RouteMatch m;
+  CHECK_EQ(router_match(&router, view("/1/2/3/4/5/6/7/8/9"), HTTP_METHOD_GET,
+                        &m),
+           1);
+  CHECK_EQ(m.param_count, ROUTER_MAX_PARAMS);
+  CHECK(view_is(m.params[6], "7"));
+  CHECK(view_is(m.params[7], "8/9"));
+  CHECK_EQ(router_match(&router, view("/twice"), HTTP_METHOD_POST, &m), 1);
+  CHECK(m.handler == handler_a);
+  router_destroy(&router);
+
+  // An empty router matches nothing
+  router_init(&router);
+  CHECK_EQ(router_compile(&router), 0);
+  CHECK_EQ(router_match(&router, view("/"), HTTP_METHOD_GET, &m), 0);
+  CHECK(m.route == NULL);
+  router_destroy(&router);
+}
+
+// Register many exact paths and patterns that share prefixes, so the
+// perfect hash has to search for a seed and the trie splits its edges, and
+// check that every path finds its own route
+static void test_many_routes(void) {
+  enum { ROUTES = 500 };
+  Router router;
+  router_init(&router);
+  char pattern[64];
+  for (int i = 0; i < ROUTES; ++i) {
+    snprintf(pattern, sizeof(pattern), "/api/v%d/item%d", i % 7, i);
+    CHECK_EQ(router_add(&router, ROUTE_GET, pattern, handler_a, 0), 0);
+    snprintf(pattern, sizeof(pattern), "/api/v%d/item%d/{id}", i % 7, i);
+    CHECK_EQ(router_add(&router, ROUTE_GET, pattern, handler_b, 0), 0);
+  }
+  CHECK_EQ(router_compile(&router), 0);
+
+  char path[64], want[64];
+  RouteMatch m;
+  int exact_ok = 1, param_ok = 1;
+  for (int i = 0; i < ROUTES; ++i) {
+    snprintf(path, sizeof(path), "/api/v%d/item%d", i % 7, i);
+    exact_ok &= pattern_is(matched(&router, path, &m), path) &&
+                m.handler == handler_a;
+    snprintf(path, sizeof(path), "/api/v%d/item%d/x%d", i % 7, i, i);
+    snprintf(want, sizeof(want), "/api/v%d/item%d/{id}", i % 7, i);
+    param_ok &= pattern_is(matched(&router, path, &m), want) &&
+                m.handler == handler_b && m.param_count == 1 &&
+                m.params[0].len == strlen(path) - strlen(want) + 4;
+  }
+  CHECK(exact_ok);
+  CHECK(param_ok);
+  CHECK(matched(&router, "/api/v0/item7", &m) != NULL);
+  CHECK(matched(&router, "/api/v1/item7", &m) == NULL);
+  CHECK(matched(&router, "/api/v0/item", &m) == NULL);
+  CHECK(matched(&router, "/api/v0/item7/", &m) == NULL);
+
+  // Compiling again rebuilds the same tables
+  CHECK_EQ(router_compile(&router), 0);
+  CHECK(pattern_is(matched(&router, "/api/v3/item3/z", &m),
+                   "/api/v3/item3/{id}"));
+  router_destroy(&router);
+}
+
+int main(void) {
+  test_priority();
+  test_methods();
+  test_invalid();
+  test_many_routes();
+  return test_report("test_router");
+}
@@ -0,0 +1,328 @@
+// Tests of static file serving from a temporary document root: Range
+// requests (prefix, open-ended, suffix, past the end, several ranges and
+// malformed ones, If-Range), conditional requests with If-None-Match and
+// If-Modified-Since, route mapping, and a compressed variant only being
+// served for a whole body.
+
+// memmem() and mkdtemp() are Linux extensions
+#define _GNU_SOURCE
+#include "test.h"
+#include "../include/compress.h"
+#include "../include/connection.h"
+#include "../include/file_cache.h"
+#include "../include/http_parser.h"
+#include "../include/http_response.h"
+#include "../include/static_files.h"
+
+#include <fcntl.h>    // For open, O_*
+#include <stdio.h>    // For fprintf, snprintf
+#include <stdlib.h>   // For mkdtemp, atoi, EXIT_FAILURE
+#include <string.h>   // For memcmp, memcpy, memmem, memset, strcmp, strlen
+#include <sys/stat.h> // For mkdir
+#include <sys/time.h> // For utimes
+#include <time.h>     // For time
+#include <unistd.h>   // For write, close, unlink, rmdir
+
+#define FILE_SIZE 1000
+#define MTIME 1700000000 // Tue, 14 Nov 2023 22:13:20 GMT
+
+static MemoryPools pools;
+static CannedResponses responses;
+static FileCache files;
+static Compressor compressor;
+static char root[] = "/tmp/httpc-test-XXXXXX";
+static char data[FILE_SIZE];
+
+// A response as the client would receive it
+typedef struct {
+  int served; // serve_static_file() returned STATIC_SERVED
+  int status;
+  char text[16384];
+  size_t len;
+  const char *body;
+  size_t body_len;
+} Response;
+
+static void write_file(const char *name, const char *content, size_t len) {
+  char path[256];
+  snprintf(path, sizeof(path), "%s/%s", root, name);
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  CHECK(fd >= 0 && write(fd, content, len) == (ssize_t)len);
+  close(fd);
+  struct timeval times[2] = {{MTIME, 0}, {MTIME, 0}};
+  CHECK_EQ(utimes(path, times), 0);
+}
+
+static void remove_file(const char *name) {
+  char path[256];
+  snprintf(path, sizeof(path), "%s/%s", root, name);
+  unlink(path);
+}
+
+// Request 'target' with 'method' and the header lines 'headers', and take
+// everything the server queued
+static void fetch(Response *r, const char *method, const char *target,
+                  const char *headers) {
+  char head[1024];
+  snprintf(head, sizeof(head), "%s %s HTTP/1.1\r\nHost: x\r\n%s\r\n",
+           method, target, headers);
+  memset(r, 0, sizeof(*r));
+  ClientRequest C;
+  if (parseRequest(head, strlen(head), &C) != PARSE_OK) {
+    CHECK(!"request parses");
+    return;
+  }
+  Connection *conn = create_connection(-1, &pools);
+  conn->responses = &responses;
+  conn->files = &files;
+  conn->compressor = &compressor;
+  r->served = serve_static_file(conn, &C, CONNECTION_DEFAULT) ==
+              STATIC_SERVED;
+  ssize_t n = take_output(conn, r->text, sizeof(r->text) - 1);
+  free_connection(conn);
+  if (!r->served || n < 0)
+    return;
+  r->len = (size_t)n;
+  r->text[r->len] = '\0';
+  r->status = r->len > 12 ? atoi(r->text + 9) : 0;
+  const char *end = memmem(r->text, r->len, "\r\n\r\n", 4);
+  if (end) {
+    r->body = end + 4;
+    r->body_len = r->len - (size_t)(r->body - r->text);
+  }
+}
+
+// The value of header 'name' in the response, or "" if it has none
+static const char *header(const Response *r, const char *name) {
+  static char value[256];
+  char line[64];
+  snprintf(line, sizeof(line), "\r\n%s: ", name);
+  const char *p = memmem(r->text, r->len, line, strlen(line));
+  value[0] = '\0';
+  if (!p)
+    return value;
+  p += strlen(line);
+  const char *end = memmem(p, r->len - (size_t)(p - r->text), "\r\n", 2);
+  size_t len = end ? (size_t)(end - p) : 0;
+  if (len >= sizeof(value))
+    len = sizeof(value) - 1;
+  memcpy(value, p, len);
+  value[len] = '\0';
+  return value;
+}
+
+static int header_is(const Response *r, const char *name, const char *want) {
+  return strcmp(header(r, name), want) == 0;
+}
+
+// Request 'range' of data.bin and check the status, and for a 206 the
+// bytes and Content-Range. 'first' < 0 expects the whole file.
+static void check_range(const char *range, int status, long first,
+                        long last) {
+  char headers[256];
+  snprintf(headers, sizeof(headers), "Range: %s\r\n", range);
+  Response r;
+  fetch(&r, "GET", "/data.bin", headers);
+  CHECK_EQ(r.status, status);
+  if (r.status != status)
+    fprintf(stderr, "    for Range: %s\n", range);
+  if (status == 206) {
+    char want[64];
+    snprintf(want, sizeof(want), "bytes %ld-%ld/%d", first, last, FILE_SIZE);
+    CHECK(header_is(&r, "Content-Range", want));
+    CHECK_EQ(r.body_len, last - first + 1);
+    CHECK(r.body_len == (size_t)(last - first + 1) &&
+          memcmp(r.body, data + first, r.body_len) == 0);
+  } else if (status == 200) {
+    CHECK(header_is(&r, "Content-Range", ""));
+    CHECK_EQ(r.body_len, FILE_SIZE);
+  } else if (status == 416) {
+    CHECK(header_is(&r, "Content-Range", "bytes */1000"));
+    CHECK_EQ(r.body_len, 0);
+  }
+}
+
+static void test_ranges(void) {
+  check_range("bytes=0-99", 206, 0, 99);
+  check_range("bytes=0-0", 206, 0, 0);
+  check_range("bytes=100-", 206, 100, 999);
+  check_range("bytes=999-", 206, 999, 999);
+  check_range("BYTES=10-19", 206, 10, 19);
+  // The last position is cut to the end of the file
+  check_range("bytes=990-5000", 206, 990, 999);
+  // Suffix ranges: the last N bytes, all of them if N is larger
+  check_range("bytes=-100", 206, 900, 999);
+  check_range("bytes=-1", 206, 999, 999);
+  check_range("bytes=-2000", 206, 0, 999);
+  // Ranges starting past the end, or empty, can not be satisfied
+  check_range("bytes=1000-", 416, 0, 0);
+  check_range("bytes=5000-6000", 416, 0, 0);
+  check_range("bytes=-0", 416, 0, 0);
+  // Several ranges and malformed ones get the whole file
+  check_range("bytes=0-9,20-29", 200, -1, -1);
+  check_range("bytes=100-50", 200, -1, -1);
+  check_range("bytes=abc", 200, -1, -1);
+  check_range("bytes=0-1x", 200, -1, -1);
+  check_range("bytes=-", 200, -1, -1);
+  check_range("bytes=--5", 200, -1, -1);
+  check_range("items=0-9", 200, -1, -1);
+  check_range("bytes=99999999999999999999-", 200, -1, -1);
+
+  // Only GET is answered with part of the file
+  Response r;
+  fetch(&r, "HEAD", "/data.bin", "Range: bytes=0-9\r\n");
+  CHECK_EQ(r.status, 200);
+  CHECK(header_is(&r, "Content-Length", "1000"));
+  CHECK_EQ(r.body_len, 0);
+
+  // If-Range applies the Range only while the validator is current
+  Response plain;
+  fetch(&plain, "GET", "/data.bin", "");
+  char etag[128], modified[128], headers[512];
+  snprintf(etag, sizeof(etag), "%s", header(&plain, "ETag"));
+  snprintf(modified, sizeof(modified), "%s",
+           header(&plain, "Last-Modified"));
+  CHECK(etag[0] == '"');
+  CHECK(strcmp(modified, "Tue, 14 Nov 2023 22:13:20 GMT") == 0);
+  snprintf(headers, sizeof(headers), "Range: bytes=0-9\r\nIf-Range: %s\r\n",
+           etag);
+  fetch(&r, "GET", "/data.bin", headers);
+  CHECK_EQ(r.status, 206);
+  snprintf(headers, sizeof(headers), "Range: bytes=0-9\r\nIf-Range: %s\r\n",
+           modified);
+  fetch(&r, "GET", "/data.bin", headers);
+  CHECK_EQ(r.status, 206);
+  fetch(&r, "GET", "/data.bin",
+        "Range: bytes=0-9\r\nIf-Range: \"stale\"\r\n");
+  CHECK_EQ(r.status, 200);
+  fetch(&r, "GET", "/data.bin",
+        "Range: bytes=0-9\r\nIf-Range: Mon, 13 Nov 2023 00:00:00 GMT\r\n");
+  CHECK_EQ(r.status, 200);
+}
+
+static int conditional_status(const char *headers) {
+  Response r;
+  fetch(&r, "GET", "/data.bin", headers);
+  if (r.status == 304)
+    CHECK_EQ(r.body_len, 0);
+  return r.status;
+}
+
+static void test_conditional(void) {
+  Response plain;
+  fetch(&plain, "GET", "/data.bin", "");
+  char etag[128], headers[512];
+  snprintf(etag, sizeof(etag), "%s", header(&plain, "ETag"));
+
+  snprintf(headers, sizeof(headers), "If-None-Match: %s\r\n", etag);
+  CHECK_EQ(conditional_status(headers), 304);
+  // The comparison is weak, and the tag may be anywhere in a list
+  snprintf(headers, sizeof(headers), "If-None-Match: W/%s\r\n", etag);
+  CHECK_EQ(conditional_status(headers), 304);
+  snprintf(headers, sizeof(headers),
+           "If-None-Match: \"a\", W/\"b\" ,%s , \"c\"\r\n", etag);
+  CHECK_EQ(conditional_status(headers), 304);
+  CHECK_EQ(conditional_status("If-None-Match: *\r\n"), 304);
+  CHECK_EQ(conditional_status("If-None-Match: \"other\"\r\n"), 200);
+  CHECK_EQ(conditional_status("If-None-Match: \r\n"), 200);
+
+  // If-Modified-Since: not modified at or after the file's time
+  CHECK_EQ(conditional_status(
+               "If-Modified-Since: Tue, 14 Nov 2023 22:13:20 GMT\r\n"),
+           304);
+  CHECK_EQ(conditional_status(
+               "If-Modified-Since: Wed, 15 Nov 2023 00:00:00 GMT\r\n"),
+           304);
+  CHECK_EQ(conditional_status(
+               "If-Modified-Since: Tue, 14 Nov 2023 22:13:19 GMT\r\n"),
+           200);
+  CHECK_EQ(conditional_status("If-Modified-Since: yesterday\r\n"), 200);
+  // ... and it only counts without If-None-Match
+  CHECK_EQ(conditional_status(
+               "If-None-Match: \"other\"\r\n"
+               "If-Modified-Since: Wed, 15 Nov 2023 00:00:00 GMT\r\n"),
+           200);
+
+  // A 304 is checked before the Range
+  snprintf(headers, sizeof(headers),
+           "If-None-Match: %s\r\nRange: bytes=0-9\r\n", etag);
+  CHECK_EQ(conditional_status(headers), 304);
+}
+
+static void test_routes(void) {
+  Response r;
+  fetch(&r, "GET", "/da%74a.bin", "");
+  CHECK_EQ(r.status, 200);
+  fetch(&r, "GET", "//data.bin", "");
+  CHECK_EQ(r.status, 200);
+  fetch(&r, "GET", "/dir/", "");
+  CHECK(r.status == 200 && r.body_len == 5 && memcmp(r.body, "index", 5) == 0);
+  fetch(&r, "GET", "/dir", "");
+  CHECK_EQ(r.status, 200);
+  fetch(&r, "GET", "/data.bin?x=1", "");
+  CHECK_EQ(r.status, 200);
+
+  // Dot segments, NUL bytes and missing files are not found
+  static const char *missing[] = {
+      "/missing.bin", "/../data.bin",   "/dir/../data.bin", "/%2e%2e/x",
+      "/./data.bin",  "/data.bin%00",   "/data%2",          "/dir/..",
+  };
+  for (size_t i = 0; i < sizeof(missing) / sizeof(missing[0]); ++i) {
+    fetch(&r, "GET", missing[i], "");
+    CHECK(!r.served);
+  }
+}
+
+// A compressed variant is served for a whole body only
+static void test_variant(void) {
+  Response r;
+  fetch(&r, "GET", "/page.html", "Accept-Encoding: gzip\r\n");
+  CHECK_EQ(r.status, 200);
+  CHECK(header_is(&r, "Content-Encoding", "gzip"));
+  CHECK(r.body_len > 0 && r.body_len < FILE_SIZE * 2);
+  fetch(&r, "GET", "/page.html",
+        "Accept-Encoding: gzip\r\nRange: bytes=0-9\r\n");
+  CHECK_EQ(r.status, 206);
+  CHECK(header_is(&r, "Content-Encoding", ""));
+  CHECK_EQ(r.body_len, 10);
+  fetch(&r, "GET", "/page.html", "Accept-Encoding: gzip;q=0\r\n");
+  CHECK_EQ(r.status, 200);
+  CHECK(header_is(&r, "Content-Encoding", ""));
+}
+
+int main(void) {
+  if (!mkdtemp(root))
+    return EXIT_FAILURE;
+  for (size_t i = 0; i < sizeof(data); ++i)
+    data[i] = (char)(i * 7 + i / 256);
+  static char page[FILE_SIZE * 4];
+  for (size_t i = 0; i < sizeof(page); ++i)
+    page[i] = "<p>hello world</p>\n"[i % 19];
+  char dir[64];
+  snprintf(dir, sizeof(dir), "%s/dir", root);
+  mkdir(dir, 0755);
+  write_file("data.bin", data, sizeof(data));
+  write_file("page.html", page, sizeof(page));
+  write_file("dir/index.html", "index", 5);
+
+  memory_pools_init(&pools);
+  initializeCannedResponses(&responses, time(NULL));
+  compressor_init(&compressor);
+  if (file_cache_init(&files, root) < 0)
+    return EXIT_FAILURE;
+
+  test_ranges();
+  test_conditional();
+  test_routes();
+  test_variant();
+
+  file_cache_destroy(&files);
+  compressor_destroy(&compressor);
+  memory_pools_destroy(&pools);
+  remove_file("dir/index.html");
+  remove_file("page.html");
+  remove_file("data.bin");
+  rmdir(dir);
+  rmdir(root);
+  return test_report("test_static_files");
+}
@@ -0,0 +1,214 @@
+// Tests of the timer wheel: expiry at the deadline and not before, slots
+// reused once the clock wraps around the wheel, deadlines beyond its span,
+// re-arming to a later deadline from the slot a timer is still in,
+// re-arming earlier, cancelling, and a run of random operations checked
+// against the deadlines themselves.
+
+#include "test.h"
+#include "../include/timer_wheel.h"
+
+#include <stdint.h> // For uint64_t
+#include <string.h> // For memset
+
+static TimerWheel wheel;
+
+// How many timers of a chain returned by timer_wheel_advance() there are,
+// checking that each came back disarmed
+static int chain_length(Timer *t) {
+  int n = 0;
+  for (; t; t = t->next, ++n)
+    CHECK_EQ(t->slot_tick, 0);
+  return n;
+}
+
+static int in_chain(const Timer *chain, const Timer *t) {
+  for (; chain; chain = chain->next) {
+    if (chain == t)
+      return 1;
+  }
+  return 0;
+}
+
+static void test_expiry(void) {
+  Timer a, b, c;
+  memset(&a, 0, sizeof(a));
+  memset(&b, 0, sizeof(b));
+  memset(&c, 0, sizeof(c));
+  timer_wheel_init(&wheel, 100);
+  CHECK_EQ(timer_wheel_next(&wheel), 0);
+  CHECK(timer_wheel_advance(&wheel, 200) == NULL);
+  CHECK_EQ(wheel.now, 200);
+
+  timer_wheel_arm(&wheel, &a, 210);
+  timer_wheel_arm(&wheel, &b, 205);
+  timer_wheel_arm(&wheel, &c, 210);
+  CHECK_EQ(wheel.count, 3);
+  CHECK_EQ(timer_wheel_next(&wheel), 205);
+  CHECK(timer_wheel_advance(&wheel, 204) == NULL);
+  Timer *expired = timer_wheel_advance(&wheel, 205);
+  CHECK(expired == &b);
+  CHECK_EQ(chain_length(expired), 1);
+  CHECK_EQ(timer_wheel_next(&wheel), 210);
+  expired = timer_wheel_advance(&wheel, 1000);
+  CHECK_EQ(chain_length(expired), 2);
+  CHECK(in_chain(expired, &a) && in_chain(expired, &c));
+  CHECK_EQ(wheel.count, 0);
+  CHECK_EQ(wheel.now, 1000);
+
+  // A deadline already past expires on the next tick
+  timer_wheel_arm(&wheel, &a, 10);
+  CHECK_EQ(timer_wheel_next(&wheel), 1001);
+  CHECK(timer_wheel_advance(&wheel, 1000) == NULL);
+  CHECK(timer_wheel_advance(&wheel, 1001) == &a);
+}
+
+// Slots are indexed by tick modulo the wheel size, so after the clock has
+// gone around the wheel a few times the same slots serve again
+static void test_wrap(void) {
+  Timer t;
+  memset(&t, 0, sizeof(t));
+  timer_wheel_init(&wheel, TIMER_WHEEL_SLOTS - 3);
+  for (uint64_t round = 0; round < 4 * TIMER_WHEEL_SLOTS; round += 7) {
+    uint64_t deadline = wheel.now + 5;
+    timer_wheel_arm(&wheel, &t, deadline);
+    CHECK_EQ(timer_wheel_next(&wheel), deadline);
+    CHECK(timer_wheel_advance(&wheel, deadline - 1) == NULL);
+    CHECK(timer_wheel_advance(&wheel, deadline + 2) == &t);
+  }
+
+  // The slot just before 'now', which the next-slot search reaches last
+  timer_wheel_init(&wheel, 64 * 3 + 10);
+  timer_wheel_arm(&wheel, &t, wheel.now + TIMER_WHEEL_SLOTS - 1);
+  CHECK_EQ(timer_wheel_next(&wheel), wheel.now + TIMER_WHEEL_SLOTS - 1);
+  CHECK(timer_wheel_advance(&wheel, wheel.now + TIMER_WHEEL_SLOTS - 1) ==
+        &t);
+}
+
+// A deadline beyond the span waits in the farthest slot and is moved on
+// from there until it is due
+static void test_beyond_span(void) {
+  Timer t;
+  memset(&t, 0, sizeof(t));
+  timer_wheel_init(&wheel, 0);
+  uint64_t deadline = 5 * TIMER_WHEEL_SLOTS + 17;
+  timer_wheel_arm(&wheel, &t, deadline);
+  CHECK_EQ(timer_wheel_next(&wheel), TIMER_WHEEL_SLOTS - 1);
+  int early = 0;
+  for (uint64_t now = 0; now < deadline; now += TIMER_WHEEL_SLOTS / 3)
+    early += timer_wheel_advance(&wheel, now) != NULL;
+  CHECK_EQ(early, 0);
+  CHECK_EQ(wheel.count, 1);
+  CHECK(timer_wheel_advance(&wheel, deadline - 1) == NULL);
+  CHECK_EQ(timer_wheel_next(&wheel), deadline);
+  CHECK(timer_wheel_advance(&wheel, deadline) == &t);
+}
+
+static void test_rearm_and_cancel(void) {
+  Timer a, b;
+  memset(&a, 0, sizeof(a));
+  memset(&b, 0, sizeof(b));
+  timer_wheel_init(&wheel, 1000);
+
+  // Later: the timer stays in its slot with the new deadline stored, and
+  // is moved on from there instead of expiring
+  timer_wheel_arm(&wheel, &a, 1010);
+  timer_wheel_arm(&wheel, &a, 1050);
+  CHECK_EQ(a.slot_tick, 1010);
+  CHECK_EQ(a.deadline, 1050);
+  CHECK(timer_wheel_advance(&wheel, 1049) == NULL);
+  CHECK_EQ(a.slot_tick, 1050);
+  CHECK_EQ(wheel.count, 1);
+  CHECK(timer_wheel_advance(&wheel, 1050) == &a);
+
+  // Earlier: the timer moves to the earlier slot
+  timer_wheel_arm(&wheel, &a, 1100);
+  timer_wheel_arm(&wheel, &a, 1060);
+  CHECK_EQ(a.slot_tick, 1060);
+  CHECK_EQ(wheel.count, 1);
+  CHECK(timer_wheel_advance(&wheel, 1060) == &a);
+
+  // Cancelled timers never expire, and cancelling twice is harmless
+  timer_wheel_arm(&wheel, &a, 1070);
+  timer_wheel_arm(&wheel, &b, 1070);
+  timer_wheel_cancel(&wheel, &a);
+  timer_wheel_cancel(&wheel, &a);
+  CHECK_EQ(wheel.count, 1);
+  CHECK_EQ(a.slot_tick, 0);
+  Timer *expired = timer_wheel_advance(&wheel, 1100);
+  CHECK(expired == &b);
+  CHECK_EQ(chain_length(expired), 1);
+
+  // Cancelling the last timer of a slot clears it from the bitmap
+  timer_wheel_arm(&wheel, &a, 1110);
+  timer_wheel_arm(&wheel, &b, 1120);
+  timer_wheel_cancel(&wheel, &a);
+  CHECK_EQ(timer_wheel_next(&wheel), 1120);
+  timer_wheel_cancel(&wheel, &b);
+  CHECK_EQ(timer_wheel_next(&wheel), 0);
+  CHECK(timer_wheel_advance(&wheel, 2000) == NULL);
+}
+
+// A small deterministic generator, so a failure can be replayed
+static uint64_t next_random(uint64_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+// Random arms, re-arms, cancels and advances: every timer has to expire
+// exactly when the clock passes its last deadline, and only then
+static void test_random(void) {
+  enum { TIMERS = 256, STEPS = 20000 };
+  static Timer timers[TIMERS];
+  static int armed[TIMERS];
+  memset(timers, 0, sizeof(timers));
+  memset(armed, 0, sizeof(armed));
+  timer_wheel_init(&wheel, 1);
+  uint64_t state = 0x9e3779b97f4a7c15ull;
+  int early = 0, late = 0, stray = 0;
+  for (int step = 0; step < STEPS; ++step) {
+    uint64_t r = next_random(&state);
+    size_t i = (size_t)(r % TIMERS);
+    switch ((r >> 16) % 4) {
+    case 0:
+    case 1:
+      timer_wheel_arm(&wheel, &timers[i],
+                      wheel.now + (r >> 24) % (3 * TIMER_WHEEL_SLOTS));
+      armed[i] = 1;
+      break;
+    case 2:
+      timer_wheel_cancel(&wheel, &timers[i]);
+      armed[i] = 0;
+      break;
+    default: {
+      uint64_t now = wheel.now + (r >> 24) % 200;
+      Timer *expired = timer_wheel_advance(&wheel, now);
+      for (Timer *t = expired; t; t = t->next) {
+        size_t k = (size_t)(t - timers);
+        stray += !armed[k];
+        early += t->deadline > now;
+        armed[k] = 0;
+      }
+      for (size_t k = 0; k < TIMERS; ++k)
+        late += armed[k] && timers[k].deadline < now;
+    }
+    }
+  }
+  CHECK_EQ(early, 0);
+  CHECK_EQ(late, 0);
+  CHECK_EQ(stray, 0);
+  size_t count = 0;
+  for (size_t k = 0; k < TIMERS; ++k)
+    count += (size_t)armed[k];
+  CHECK_EQ(wheel.count, count);
+}
+
+int main(void) {
+  test_expiry();
+  test_wrap();
+  test_beyond_span();
+  test_rearm_and_cancel();
+  test_random();
+  return test_report("test_timer_wheel");
+}